@@ -0,0 +1,262 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+// Measures walking a large abstract syntax tree with the iterator, the
+// visitor, and a hand-rolled recursive walk for comparison. Once with nodes
+// laid out the way a parser allocates them, and once with leaves scattered.
+// Then measures hash-consing a tree made of many copies of a few subtrees,
+// like repeated macro expansions would produce.
+//
+// Usage: ast_bench [NODE_COUNT]
+
+#include "bench.h"
+#include "../common/astcons.h"
+#include "../common/astiter.h"
+#include "../common/astlst.h"
+
+// Deterministic pseudo-random numbers so runs are comparable.
+static uint64_t rng_state = 0x9E3779B97F4A7C15u;
+
+static uint32_t rng_next(void)
+{
+    rng_state = rng_state * 6364136223846793005u + 1442695040888963407u;
+    return (uint32_t)(rng_state >> 33);
+}
+
+// Leaves allocated up front in shuffled order, to stand in for trees whose
+// nodes aren't laid out in traversal order. NULL to allocate as we go.
+static astid_t *leaf_pool;
+static uint32_t leaf_pool_next;
+
+// Hash-consing to intern nodes with as they're made. NULL for none.
+static struct astcons *bench_astcons;
+
+// Intern node if hash-consing.
+static astid_t intern(struct astman *astman, astid_t node, uint32_t extra)
+{
+    return bench_astcons != NULL
+        ? astcons_intern(bench_astcons, astman, node, extra)
+        : node;
+}
+
+// Build a subtree of node_count nodes with up to max_arity children per node
+// the way a parser would: children before their parents.
+static astid_t build_tree(
+    struct tgroup *tgroup,
+    uint32_t node_count,
+    uint32_t max_arity)
+{
+    struct astman *astman = &tgroup->astman;
+    if (node_count == 1 && leaf_pool != NULL)
+    {
+        return leaf_pool[leaf_pool_next++];
+    }
+    else if (node_count == 1)
+    {
+        astid_t leaf = astman_alloc_node(astman, SYNCAT_IDENT, 0, 1);
+        astman->data[leaf] = rng_next();
+        return intern(astman, leaf, 1);
+    }
+
+    // Split the remaining nodes between the children.
+    uint32_t remaining = node_count - 1;
+    uint32_t arity = 1 + rng_next() % max_arity;
+    if (arity > remaining)
+    {
+        arity = remaining;
+    }
+
+    struct astlst astlst;
+    astlst_init(&astlst);
+    for (uint32_t i = arity; i > 0; i--)
+    {
+        uint32_t size = remaining / i;
+        if (i > 1 && size > 1)
+        {
+            size = size / 2 + rng_next() % size;
+        }
+
+        astlst_push(tgroup, &astlst, build_tree(tgroup, size, 8));
+        remaining -= size;
+    }
+
+    astid_t node = astlst_finish(tgroup, &astlst, SYNCAT_DEFINE_DIRECTIVE, 0);
+    return intern(astman, node, 0);
+}
+
+// Baseline: hand-rolled recursive walk.
+static uint64_t walk_recursive(struct astman *astman, astid_t node)
+{
+    uint64_t sum = astman_get_syncat(astman, node);
+    uint32_t end = node + astman_get_child_count(astman, node);
+    for (uint32_t i = node; i < end; i++)
+    {
+        sum += walk_recursive(astman, astman->data[i]);
+    }
+
+    return sum + 1;
+}
+
+// Visitor context.
+struct visit_ctx
+{
+    struct astman *astman;
+    uint64_t sum;
+};
+
+static bool visit_enter(void *ctx, astid_t node, uint32_t depth)
+{
+    (void)depth;
+
+    struct visit_ctx *visit_ctx = ctx;
+    visit_ctx->sum += astman_get_syncat(visit_ctx->astman, node);
+    return true;
+}
+
+static void visit_leave(void *ctx, astid_t node, uint32_t depth)
+{
+    (void)node;
+    (void)depth;
+
+    struct visit_ctx *visit_ctx = ctx;
+    visit_ctx->sum++;
+}
+
+// Print result row.
+static void report(const char *name, double seconds, uint64_t sum, uint32_t n)
+{
+    printf(
+        "%-12s %8.3f s %8.2f ns/node  (checksum %" PRIu64 ")\n",
+        name, seconds, seconds * 1e9 / n, sum);
+    bench_sink += sum;
+}
+
+// Build a tree and time walking it every which way.
+static void run(const char *name, uint32_t node_count, bool scatter)
+{
+    struct tgroup tgroup;
+    tgroup_init(&tgroup);
+    struct astman *astman = &tgroup.astman;
+
+    double start = bench_now();
+    if (scatter)
+    {
+        leaf_pool = ALLOC_ARRAY(astid_t, node_count, MEM_TAG_OTHER);
+        leaf_pool_next = 0;
+        for (uint32_t i = 0; i < node_count; i++)
+        {
+            leaf_pool[i] = astman_alloc_node(astman, SYNCAT_IDENT, 0, 1);
+            astman->data[leaf_pool[i]] = rng_next();
+        }
+
+        for (uint32_t i = node_count - 1; i > 0; i--)
+        {
+            uint32_t j = rng_next() % (i + 1);
+            astid_t tmp = leaf_pool[i];
+            leaf_pool[i] = leaf_pool[j];
+            leaf_pool[j] = tmp;
+        }
+    }
+
+    // Give the root enough children to make it wide.
+    astid_t root = build_tree(&tgroup, node_count, 1000000);
+    printf(
+        "%s: %" PRIu32 " nodes (%" PRIu32 " words) built in %.3f s\n",
+        name, node_count, astman->data_len, bench_now() - start);
+
+    jocc_free(leaf_pool);
+    leaf_pool = NULL;
+
+    // Recursive baseline. Fine here because the tree is shallow.
+    start = bench_now();
+    uint64_t sum = walk_recursive(astman, root);
+    report("recursive", bench_now() - start, sum, node_count);
+
+    // Iterator.
+    start = bench_now();
+    sum = 0;
+    struct astiter iter;
+    astiter_init(&iter, astman, root);
+    struct astiter_step step;
+    while (astiter_next(&iter, &step))
+    {
+        sum += step.leaving ? 1 : astman_get_syncat(astman, step.node);
+    }
+
+    astiter_destroy(&iter);
+    report("iterator", bench_now() - start, sum, node_count);
+
+    // Visitor.
+    start = bench_now();
+    struct visit_ctx ctx = {astman, 0};
+    struct astvisitor visitor = {visit_enter, visit_leave, &ctx};
+    astman_visit(astman, root, &visitor);
+    report("visitor", bench_now() - start, ctx.sum, node_count);
+
+    tgroup_destroy(&tgroup);
+}
+
+// Build a tree of expansion_count copies of a few different subtrees, with
+// and without hash-consing, and compare the astman memory used.
+static void run_cons(uint32_t expansion_count)
+{
+    for (int cons = 0; cons < 2; cons++)
+    {
+        struct tgroup tgroup;
+        tgroup_init(&tgroup);
+
+        struct astcons astcons;
+        astcons_init(&astcons);
+        bench_astcons = cons ? &astcons : NULL;
+
+        // Each "macro" is a subtree of 10-40 nodes
+        // grown from one of 100 fixed seeds.
+        double start = bench_now();
+        struct astlst astlst;
+        astlst_init(&astlst);
+        for (uint32_t i = 0; i < expansion_count; i++)
+        {
+            uint32_t macro = (uint32_t)(i * 2654435761u) % 100;
+            rng_state = 0x9E3779B97F4A7C15u + macro;
+            astid_t expansion =
+                build_tree(&tgroup, 10 + macro * 30 / 100, 4);
+            astlst_push(&tgroup, &astlst, expansion);
+        }
+
+        astlst_finish(&tgroup, &astlst, SYNCAT_DEFINE_DIRECTIVE, 0);
+        printf(
+            "%s: %" PRIu32 " expansions, %" PRIu32 " astman words,"
+            " built in %.3f s\n",
+            cons ? "hash-consed" : "unique", expansion_count,
+            tgroup.astman.data_len, bench_now() - start);
+
+        if (cons)
+        {
+            astcons_report(&astcons, stdout);
+        }
+
+        bench_astcons = NULL;
+        astcons_destroy(&astcons);
+        tgroup_destroy(&tgroup);
+    }
+}
+
+// Entry point.
+int main(int argc, char **argv)
+{
+    uint32_t node_count = 100000000;
+    if (argc > 1)
+    {
+        node_count = (uint32_t)strtoul(argv[1], NULL, 10);
+    }
+
+    if (node_count < 2)
+    {
+        node_count = 2;
+    }
+
+    run("parser order", node_count, false);
+    run("scattered leaves", node_count, true);
+    run_cons(node_count / 25);
+}
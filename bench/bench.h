@@ -0,0 +1,32 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "../common/prelude.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Results get folded into this so the compiler can't discard the work.
+static volatile uint64_t bench_sink;
+
+// Monotonic time in seconds.
+static double bench_now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
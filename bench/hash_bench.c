@@ -0,0 +1,136 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+// Hash micro-benchmark. Prints nanoseconds per hash for each hash function
+// and hash_impl across key sizes from 1 byte to 1 MiB, so the crossover points
+// between them are visible. Build with optimizations for meaningful numbers.
+
+#include "bench.h"
+#include "../common/alloc.h"
+#include "../common/hash.h"
+
+#define MAX_SIZE ((size_t)1 << 20)
+
+// Hash functions under test.
+enum fn
+{
+    FN_HASH,
+    FN_HASH128,
+    FN_HASH_SMALL,
+    FN_STR_HASH,
+};
+
+// Time one hash function on one key size. Each key depends on the previous
+// hash, so this measures latency, which is what hash table lookups see.
+static double time_ns(enum fn fn, unsigned char *buf, size_t size)
+{
+    size_t iters = ((size_t)1 << 24) / size;
+    if (iters < ((size_t)1 << 15))
+    {
+        iters = (size_t)1 << 15;
+    }
+
+    uint64_t h = 0;
+    double start = bench_now();
+    for (size_t i = 0; i < iters; i++)
+    {
+        buf[0] ^= (unsigned char)h;
+        switch (fn)
+        {
+        case FN_HASH:
+            h = jocc_hash(buf, size);
+            break;
+
+        case FN_HASH128:
+            h = jocc_hash128(buf, size).low64;
+            break;
+
+        case FN_HASH_SMALL:
+            h = jocc_hash_small(buf, size);
+            break;
+
+        case FN_STR_HASH:
+            h = jocc_str_hash(buf, size);
+            break;
+        }
+    }
+    double end = bench_now();
+
+    bench_sink += h;
+    return (end - start) * 1e9 / (double)iters;
+}
+
+// Print one table cell.
+static void print_cell(double ns)
+{
+    if (ns < 0)
+    {
+        printf(" %10s", "-");
+    }
+    else
+    {
+        printf(" %10.2f", ns);
+    }
+}
+
+// Entry point.
+int main(void)
+{
+    enum hash_impl best = hash_get_impl();
+    printf("selected hash_impl: %s\n\n", hash_impl_names[best]);
+
+    unsigned char *buf = ALLOC_ARRAY(unsigned char, MAX_SIZE, MEM_TAG_OTHER);
+    for (size_t i = 0; i < MAX_SIZE; i++)
+    {
+        buf[i] = (unsigned char)(i * 2654435761u >> 24);
+    }
+
+    // Header.
+    printf("%8s", "bytes");
+    for (int impl = 0; impl < HASH_IMPL_COUNT; impl++)
+    {
+        printf(" %10s", hash_impl_names[impl]);
+    }
+    printf(" %10s %10s %10s   (ns/hash)\n", "hash128", "small", "str_hash");
+
+    // Every size up to 16 bytes, then either side of
+    // XXH3's internal thresholds, then powers of two.
+    size_t sizes[64];
+    int size_count = 0;
+    for (size_t size = 1; size <= 17; size++)
+    {
+        sizes[size_count++] = size;
+    }
+    sizes[size_count++] = 32;
+    sizes[size_count++] = STR_HASH_ROLLING_MAX + 1;
+    sizes[size_count++] = 64;
+    sizes[size_count++] = 128;
+    sizes[size_count++] = 129;
+    sizes[size_count++] = 240;
+    sizes[size_count++] = 241;
+    for (size_t size = 256; size <= MAX_SIZE; size *= 2)
+    {
+        sizes[size_count++] = size;
+    }
+
+    for (int i = 0; i < size_count; i++)
+    {
+        size_t size = sizes[i];
+        printf("%8zu", size);
+
+        for (int impl = 0; impl < HASH_IMPL_COUNT; impl++)
+        {
+            bool ok = hash_set_impl((enum hash_impl)impl);
+            print_cell(ok ? time_ns(FN_HASH, buf, size) : -1);
+        }
+
+        hash_set_impl(best);
+        print_cell(time_ns(FN_HASH128, buf, size));
+        print_cell(size < 16 ? time_ns(FN_HASH_SMALL, buf, size) : -1);
+        print_cell(time_ns(FN_STR_HASH, buf, size));
+        printf("\n");
+    }
+
+    jocc_free(buf);
+}
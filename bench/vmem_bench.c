@@ -0,0 +1,200 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+// Measures random reads from a big vmem_arr, the way passes over a large
+// astman or strman touch memory, with and without huge pages. Prints time
+// per read, and on Linux, dTLB load misses per read and how much of the array
+// ended up on huge pages. Each read depends on the previous one, so this
+// measures latency, which is what pointer chasing through the tree sees.
+//
+// Usage: vmem_bench [ARRAY_MIB [READ_COUNT]]
+
+#include "bench.h"
+#include "../common/vmem.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Open a counter of dTLB load misses in this thread. Returns -1 if
+// the platform or the kernel's perf_event_paranoid setting won't allow it.
+static int open_dtlb_counter(void)
+{
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config =
+        PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+// Start counting from 0.
+static void start_counter(int fd)
+{
+#if defined(__linux__)
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+    (void)fd;
+#endif
+}
+
+// Stop counting and get the count. -1 if there's no counter.
+static int64_t stop_counter(int fd)
+{
+#if defined(__linux__)
+    uint64_t count;
+    if (fd >= 0 &&
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) == 0 &&
+        read(fd, &count, sizeof(count)) == sizeof(count))
+    {
+        return (int64_t)count;
+    }
+#else
+    (void)fd;
+#endif
+
+    return -1;
+}
+
+// Get how many KiB of this process's anonymous memory are on huge pages.
+// -1 if unknown.
+static int64_t anon_huge_kib(void)
+{
+    int64_t kib = -1;
+#if defined(__linux__)
+    FILE *file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        long long value;
+        if (sscanf(line, "AnonHugePages: %lld kB", &value) == 1)
+        {
+            kib = value;
+            break;
+        }
+    }
+
+    fclose(file);
+#endif
+
+    return kib;
+}
+
+// Fill an array the way a compiler pass would, growing it as it goes, then
+// time chasing read_count random indexes through it.
+static void run(bool huge_pages, size_t size, uint64_t read_count, int fd)
+{
+    vmem_set_huge_pages(huge_pages);
+    struct vmem_arr arr;
+    vmem_arr_init(&arr, size, MEM_TAG_OTHER);
+
+    uint32_t count = (uint32_t)(size / sizeof(uint32_t));
+    uint64_t rng = 0x9E3779B97F4A7C15u;
+    for (uint32_t i = 0; i < count; i += 4096)
+    {
+        uint32_t end = count - i < 4096 ? count : i + 4096;
+        vmem_arr_ensure(&arr, sizeof(uint32_t) * (size_t)end);
+        uint32_t *data = (uint32_t *)arr.data;
+        for (uint32_t j = i; j < end; j++)
+        {
+            rng = rng * 6364136223846793005u + 1442695040888963407u;
+            data[j] = (uint32_t)(rng >> 33) % count;
+        }
+    }
+
+    const uint32_t *data = (const uint32_t *)arr.data;
+    uint32_t index = 0;
+    start_counter(fd);
+    double start = bench_now();
+    for (uint64_t i = 0; i < read_count; i++)
+    {
+        index = data[index] ^ (uint32_t)(i & 1);
+    }
+
+    double seconds = bench_now() - start;
+    int64_t misses = stop_counter(fd);
+    bench_sink += index;
+
+    printf(
+        "%-14s %8.2f ns/read", huge_pages ? "huge pages" : "4 KiB pages",
+        seconds * 1e9 / (double)read_count);
+    if (misses >= 0)
+    {
+        printf("  %6.3f dTLB misses/read", (double)misses / (double)read_count);
+    }
+    else
+    {
+        printf("  %6s dTLB misses/read", "n/a");
+    }
+
+    int64_t huge_kib = anon_huge_kib();
+    if (huge_kib >= 0)
+    {
+        printf("  %6" PRId64 " MiB on huge pages", huge_kib / 1024);
+    }
+
+    printf("\n");
+    vmem_arr_destroy(&arr);
+}
+
+// Entry point.
+int main(int argc, char **argv)
+{
+    size_t size_mib = 1024;
+    uint64_t read_count = 20000000;
+    if (argc > 1)
+    {
+        size_mib = (size_t)strtoull(argv[1], NULL, 10);
+    }
+
+    if (argc > 2)
+    {
+        read_count = strtoull(argv[2], NULL, 10);
+    }
+
+    if (size_mib < 1)
+    {
+        size_mib = 1;
+    }
+
+    int fd = open_dtlb_counter();
+    if (fd < 0)
+    {
+        printf("dTLB miss counter unavailable; timing only\n");
+    }
+
+    printf(
+        "%zu MiB array, %" PRIu64 " dependent random reads\n",
+        size_mib, read_count);
+    run(false, size_mib << 20, read_count, fd);
+    run(true, size_mib << 20, read_count, fd);
+
+#if defined(__linux__)
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+#endif
+}
@@ -6,12 +6,1166 @@
 
 #include "prelude.h"
 
+// Alignment of every allocation. Enough for any standard type.
+#define ALLOC_ALIGNMENT ((size_t)16)
+
+// Round size up to a multiple of ALLOC_ALIGNMENT.
+#define _ALLOC_ROUND(size) \
+    (((size) + ALLOC_ALIGNMENT - 1) & ~(ALLOC_ALIGNMENT - 1))
+
+// Allocator backend.
+enum alloc_backend
+{
+    ALLOC_BACKEND_MALLOC, // libc.
+    ALLOC_BACKEND_ARENA,  // Bump arena. Freeing small blocks does nothing.
+    ALLOC_BACKEND_POOL,   // Free lists by size class.
+    ALLOC_BACKEND_COUNT,
+};
+
+// Human-readable alloc_backend names.
+static const char *const alloc_backend_names[ALLOC_BACKEND_COUNT] = {
+    "malloc",
+    "arena",
+    "pool",
+};
+
+// Backend used unless alloc_set_backend says otherwise.
+#ifndef ALLOC_DEFAULT_BACKEND
+#define ALLOC_DEFAULT_BACKEND ALLOC_BACKEND_MALLOC
+#endif
+
+// Allocator functions. They return NULL when out of memory and
+// re-allocating NULL allocates, like libc's.
+struct alloc_vtable
+{
+    void *(*alloc)(size_t size);
+    void *(*zalloc)(size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+
+    // Free everything that can be freed at once.
+    void (*release)(void);
+};
+
+// Subsystem an allocation belongs to, for memory accounting.
+enum mem_tag
+{
+    MEM_TAG_OTHER,
+    MEM_TAG_ASTMAN,
+    MEM_TAG_DIAG_ARR,
+    MEM_TAG_FILE_DATA,
+    MEM_TAG_MACRO_TABLE,
+    MEM_TAG_PREPROCESSOR,
+    MEM_TAG_SRCMAN,
+    MEM_TAG_STRMAN,
+    MEM_TAG_TMP_STACK,
+    MEM_TAG_TOKCACHE,
+    MEM_TAG_TOKMAN,
+    MEM_TAG_COUNT,
+};
+
+// Human-readable mem_tag names.
+static const char *const mem_tag_names[MEM_TAG_COUNT] = {
+    "other",
+    "astman",
+    "diag_arr",
+    "file_data",
+    "macro_table",
+    "preprocessor",
+    "srcman",
+    "strman",
+    "tmp_stack",
+    "tokcache",
+    "tokman",
+};
+
+// Memory used by a subsystem.
+struct mem_usage
+{
+    // Heap blocks. Only counted while tracking, which needs a header on each.
+    uint64_t alloc_count;
+    uint64_t realloc_count;
+    uint64_t free_count;
+    uint64_t heap_bytes;
+    uint64_t heap_peak_bytes;
+    uint64_t realloc_copy_bytes; // Moved by re-allocating.
+
+    // Committed virtual memory and mapped files. Always counted.
+    uint64_t mapped_bytes;
+    uint64_t mapped_peak_bytes;
+
+    // Dynamic arrays resized by dynarr.h. Always counted.
+    uint64_t array_resize_count;
+    uint64_t array_copy_bytes; // Moved by resizing.
+};
+
+// Memory used by each mem_tag, and overall. The overall peaks are
+// peaks of the sums, which can be less than the sums of the peaks.
+static struct mem_usage mem_usage[MEM_TAG_COUNT];
+static struct mem_usage mem_usage_total;
+
+// Header in front of arena and pool blocks.
+// 64-bit fields keep it a multiple of ALLOC_ALIGNMENT everywhere.
+struct _alloc_header
+{
+    uint64_t size;
+    uint64_t kind; // Backend-specific.
+};
+
+// libc alloc.
+static void *_alloc_malloc_alloc(size_t size)
+{
+    return malloc(size);
+}
+
+// libc zalloc.
+static void *_alloc_malloc_zalloc(size_t size)
+{
+    return calloc(1, size);
+}
+
+// libc realloc.
+static void *_alloc_malloc_realloc(void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+// libc free.
+static void _alloc_malloc_free(void *ptr)
+{
+    free(ptr);
+}
+
+// libc release. Nothing to do.
+static void _alloc_malloc_release(void)
+{
+}
+
+// Bump arena.
+//
+// Blocks are carved off the end of the current chunk one after another, with
+// their size in front so re-allocating knows how much to copy. The last block
+// in the chunk grows in place. Freeing does nothing; all the memory goes back
+// at once on release. Blocks too big to share a chunk, like whole-file
+// arrays, are malloc'ed by themselves and kept in a list for release. Those
+// are worth giving back early, so freeing them does, and re-allocating them
+// and zeroing them go to libc, which can avoid copying and touching pages.
+struct _alloc_arena
+{
+    unsigned char *chunk;
+    size_t chunk_used;
+    size_t chunk_size;
+
+    // Links of the first large block.
+    struct _alloc_arena_large *large;
+};
+
+// Chunk header.
+struct _alloc_arena_chunk
+{
+    struct _alloc_arena_chunk *prev;
+};
+
+// Links in front of a large block's header.
+struct _alloc_arena_large
+{
+    struct _alloc_arena_large *prev;
+    struct _alloc_arena_large *next;
+};
+
+// Arena chunk size, and the size above which blocks are large.
+#define ALLOC_ARENA_CHUNK_SIZE ((size_t)1024 * 1024)
+#define ALLOC_ARENA_LARGE_SIZE (ALLOC_ARENA_CHUNK_SIZE / 8)
+
+// Arena block kinds.
+#define _ALLOC_ARENA_SMALL 0
+#define _ALLOC_ARENA_LARGE 1
+
+// The arena.
+static struct _alloc_arena _alloc_arena = {NULL, 0, 0, NULL};
+
+// Allocate large arena block, zeroed if asked to.
+static void *_alloc_arena_alloc_large(size_t size, bool zero)
+{
+    size_t prefix =
+        _ALLOC_ROUND(sizeof(struct _alloc_arena_large)) +
+        sizeof(struct _alloc_header);
+    if (size > SIZE_MAX - prefix)
+    {
+        return NULL;
+    }
+
+    struct _alloc_arena_large *large =
+        zero ? calloc(1, prefix + size) : malloc(prefix + size);
+    if (large == NULL)
+    {
+        return NULL;
+    }
+
+    large->prev = NULL;
+    large->next = _alloc_arena.large;
+    if (large->next != NULL)
+    {
+        large->next->prev = large;
+    }
+
+    _alloc_arena.large = large;
+
+    unsigned char *ptr = (unsigned char *)large + prefix;
+    struct _alloc_header *header = (struct _alloc_header *)ptr - 1;
+    header->size = size;
+    header->kind = _ALLOC_ARENA_LARGE;
+    return ptr;
+}
+
+// Re-allocate large arena block in place if libc can.
+static void *_alloc_arena_realloc_large(void *ptr, size_t size)
+{
+    size_t prefix =
+        _ALLOC_ROUND(sizeof(struct _alloc_arena_large)) +
+        sizeof(struct _alloc_header);
+    if (size > SIZE_MAX - prefix)
+    {
+        return NULL;
+    }
+
+    struct _alloc_arena_large *large = (struct _alloc_arena_large *)
+        ((unsigned char *)ptr - prefix);
+    large = realloc(large, prefix + size);
+    if (large == NULL)
+    {
+        return NULL;
+    }
+
+    // Fix up links to the block in case it moved.
+    if (large->prev != NULL)
+    {
+        large->prev->next = large;
+    }
+    else
+    {
+        _alloc_arena.large = large;
+    }
+
+    if (large->next != NULL)
+    {
+        large->next->prev = large;
+    }
+
+    ptr = (unsigned char *)large + prefix;
+    ((struct _alloc_header *)ptr - 1)->size = size;
+    return ptr;
+}
+
+// Free large arena block.
+static void _alloc_arena_free_large(void *ptr)
+{
+    size_t prefix =
+        _ALLOC_ROUND(sizeof(struct _alloc_arena_large)) +
+        sizeof(struct _alloc_header);
+    struct _alloc_arena_large *large = (struct _alloc_arena_large *)
+        ((unsigned char *)ptr - prefix);
+
+    if (large->prev != NULL)
+    {
+        large->prev->next = large->next;
+    }
+    else
+    {
+        _alloc_arena.large = large->next;
+    }
+
+    if (large->next != NULL)
+    {
+        large->next->prev = large->prev;
+    }
+
+    free(large);
+}
+
+// Arena alloc.
+static void *_alloc_arena_alloc(size_t size)
+{
+    if (size > ALLOC_ARENA_LARGE_SIZE)
+    {
+        return _alloc_arena_alloc_large(size, false);
+    }
+
+    // Start a new chunk if this one is full. The rest of it goes to waste,
+    // but blocks are small compared to chunks, so that's never much.
+    size_t block_size = sizeof(struct _alloc_header) + _ALLOC_ROUND(size);
+    if (_alloc_arena.chunk_size - _alloc_arena.chunk_used < block_size)
+    {
+        struct _alloc_arena_chunk *chunk = malloc(ALLOC_ARENA_CHUNK_SIZE);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+
+        chunk->prev = (struct _alloc_arena_chunk *)_alloc_arena.chunk;
+        _alloc_arena.chunk = (unsigned char *)chunk;
+        _alloc_arena.chunk_used =
+            _ALLOC_ROUND(sizeof(struct _alloc_arena_chunk));
+        _alloc_arena.chunk_size = ALLOC_ARENA_CHUNK_SIZE;
+    }
+
+    struct _alloc_header *header = (struct _alloc_header *)
+        (_alloc_arena.chunk + _alloc_arena.chunk_used);
+    header->size = size;
+    header->kind = _ALLOC_ARENA_SMALL;
+    _alloc_arena.chunk_used += block_size;
+    return header + 1;
+}
+
+// Arena zalloc.
+static void *_alloc_arena_zalloc(size_t size)
+{
+    if (size > ALLOC_ARENA_LARGE_SIZE)
+    {
+        return _alloc_arena_alloc_large(size, true);
+    }
+
+    void *ptr = _alloc_arena_alloc(size);
+    if (ptr != NULL)
+    {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+// Arena realloc.
+static void *_alloc_arena_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return _alloc_arena_alloc(size);
+    }
+
+    struct _alloc_header *header = (struct _alloc_header *)ptr - 1;
+    size_t old_size = (size_t)header->size;
+    if (header->kind == _ALLOC_ARENA_LARGE && size > ALLOC_ARENA_LARGE_SIZE)
+    {
+        return _alloc_arena_realloc_large(ptr, size);
+    }
+
+    // Grow or shrink the chunk's last block in place.
+    unsigned char *end = (unsigned char *)ptr + _ALLOC_ROUND(old_size);
+    if (header->kind == _ALLOC_ARENA_SMALL &&
+        size <= ALLOC_ARENA_LARGE_SIZE &&
+        end == _alloc_arena.chunk + _alloc_arena.chunk_used)
+    {
+        size_t used = (size_t)((unsigned char *)ptr - _alloc_arena.chunk);
+        if (_alloc_arena.chunk_size - used >= _ALLOC_ROUND(size))
+        {
+            header->size = size;
+            _alloc_arena.chunk_used = used + _ALLOC_ROUND(size);
+            return ptr;
+        }
+    }
+
+    // Shrinking anything else isn't worth a copy.
+    if (size <= old_size && header->kind == _ALLOC_ARENA_SMALL)
+    {
+        return ptr;
+    }
+
+    void *new_ptr = _alloc_arena_alloc(size);
+    if (new_ptr != NULL)
+    {
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        if (header->kind == _ALLOC_ARENA_LARGE)
+        {
+            _alloc_arena_free_large(ptr);
+        }
+    }
+
+    return new_ptr;
+}
+
+// Arena free. Only large blocks go back before release.
+static void _alloc_arena_free(void *ptr)
+{
+    if (ptr != NULL &&
+        ((struct _alloc_header *)ptr - 1)->kind == _ALLOC_ARENA_LARGE)
+    {
+        _alloc_arena_free_large(ptr);
+    }
+}
+
+// Arena release.
+static void _alloc_arena_release(void)
+{
+    struct _alloc_arena_chunk *chunk =
+        (struct _alloc_arena_chunk *)_alloc_arena.chunk;
+    while (chunk != NULL)
+    {
+        struct _alloc_arena_chunk *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+
+    struct _alloc_arena_large *large = _alloc_arena.large;
+    while (large != NULL)
+    {
+        struct _alloc_arena_large *next = large->next;
+        free(large);
+        large = next;
+    }
+
+    _alloc_arena.chunk = NULL;
+    _alloc_arena.chunk_used = 0;
+    _alloc_arena.chunk_size = 0;
+    _alloc_arena.large = NULL;
+}
+
+// Size-class pool.
+//
+// Small blocks are rounded up to a power of two and carved out of slabs.
+// Freed ones go on a free list for their size class, so re-allocating and
+// freeing are a few instructions, with no coalescing. Blocks above the
+// largest size class go to libc.
+#define ALLOC_POOL_CLASS_COUNT 9 // 16 to 4096 bytes.
+#define ALLOC_POOL_SLAB_SIZE ((size_t)64 * 1024)
+
+// Pool block kind for blocks that went to libc.
+#define _ALLOC_POOL_LARGE ALLOC_POOL_CLASS_COUNT
+
+// Freed pool block.
+struct _alloc_pool_free
+{
+    struct _alloc_pool_free *next;
+};
+
+// Pool state.
+struct _alloc_pool
+{
+    struct _alloc_pool_free *free_lists[ALLOC_POOL_CLASS_COUNT];
+
+    // Current slab, and the slab list threaded through their first bytes.
+    unsigned char *slab_next;
+    unsigned char *slab_end;
+    void *slabs;
+};
+
+// The pool.
+static struct _alloc_pool _alloc_pool = {{NULL}, NULL, NULL, NULL};
+
+// Get block size of a pool size class.
+static size_t _alloc_pool_class_size(size_t size_class)
+{
+    return (size_t)16 << size_class;
+}
+
+// Allocate pool block too large for any size class, zeroed if asked to.
+static void *_alloc_pool_alloc_large(size_t size, bool zero)
+{
+    struct _alloc_header *header;
+    if (size > SIZE_MAX - sizeof(*header))
+    {
+        return NULL;
+    }
+
+    header = zero
+        ? calloc(1, sizeof(*header) + size)
+        : malloc(sizeof(*header) + size);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+
+    header->size = size;
+    header->kind = _ALLOC_POOL_LARGE;
+    return header + 1;
+}
+
+// Pool alloc.
+static void *_alloc_pool_alloc(size_t size)
+{
+    struct _alloc_header *header;
+    if (size > _alloc_pool_class_size(ALLOC_POOL_CLASS_COUNT - 1))
+    {
+        return _alloc_pool_alloc_large(size, false);
+    }
+
+    size_t size_class = 0;
+    while (_alloc_pool_class_size(size_class) < size)
+    {
+        size_class++;
+    }
+
+    // Reuse a freed block if there is one.
+    struct _alloc_pool_free *block = _alloc_pool.free_lists[size_class];
+    if (block != NULL)
+    {
+        _alloc_pool.free_lists[size_class] = block->next;
+        header = (struct _alloc_header *)block - 1;
+        header->size = size;
+        return block;
+    }
+
+    // Otherwise carve one out of the slab, starting a new one if necessary.
+    size_t block_size =
+        sizeof(*header) + _alloc_pool_class_size(size_class);
+    if ((size_t)(_alloc_pool.slab_end - _alloc_pool.slab_next) < block_size)
+    {
+        unsigned char *slab = malloc(ALLOC_POOL_SLAB_SIZE);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+
+        *(void **)slab = _alloc_pool.slabs;
+        _alloc_pool.slabs = slab;
+        _alloc_pool.slab_next = slab + ALLOC_ALIGNMENT;
+        _alloc_pool.slab_end = slab + ALLOC_POOL_SLAB_SIZE;
+    }
+
+    header = (struct _alloc_header *)_alloc_pool.slab_next;
+    header->size = size;
+    header->kind = size_class;
+    _alloc_pool.slab_next += block_size;
+    return header + 1;
+}
+
+// Pool zalloc.
+static void *_alloc_pool_zalloc(size_t size)
+{
+    if (size > _alloc_pool_class_size(ALLOC_POOL_CLASS_COUNT - 1))
+    {
+        return _alloc_pool_alloc_large(size, true);
+    }
+
+    void *ptr = _alloc_pool_alloc(size);
+    if (ptr != NULL)
+    {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+// Pool free.
+static void _alloc_pool_free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    struct _alloc_header *header = (struct _alloc_header *)ptr - 1;
+    if (header->kind == _ALLOC_POOL_LARGE)
+    {
+        free(header);
+        return;
+    }
+
+    struct _alloc_pool_free *block = ptr;
+    block->next = _alloc_pool.free_lists[(size_t)header->kind];
+    _alloc_pool.free_lists[(size_t)header->kind] = block;
+}
+
+// Pool realloc.
+static void *_alloc_pool_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return _alloc_pool_alloc(size);
+    }
+
+    // Stay put if the block is big enough already.
+    struct _alloc_header *header = (struct _alloc_header *)ptr - 1;
+    size_t old_size = (size_t)header->size;
+    bool large = size > _alloc_pool_class_size(ALLOC_POOL_CLASS_COUNT - 1);
+    if (header->kind == _ALLOC_POOL_LARGE && large)
+    {
+        if (size > SIZE_MAX - sizeof(*header))
+        {
+            return NULL;
+        }
+
+        header = realloc(header, sizeof(*header) + size);
+        if (header == NULL)
+        {
+            return NULL;
+        }
+
+        header->size = size;
+        return header + 1;
+    }
+    else if (
+        header->kind != _ALLOC_POOL_LARGE &&
+        size <= _alloc_pool_class_size((size_t)header->kind))
+    {
+        header->size = size;
+        return ptr;
+    }
+
+    void *new_ptr = _alloc_pool_alloc(size);
+    if (new_ptr != NULL)
+    {
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        _alloc_pool_free(ptr);
+    }
+
+    return new_ptr;
+}
+
+// Pool release. Large blocks belong to libc and stay until freed.
+static void _alloc_pool_release(void)
+{
+    void *slab = _alloc_pool.slabs;
+    while (slab != NULL)
+    {
+        void *prev = *(void **)slab;
+        free(slab);
+        slab = prev;
+    }
+
+    memset(&_alloc_pool, 0, sizeof(_alloc_pool));
+}
+
+// Backend vtables, indexed by alloc_backend.
+static const struct alloc_vtable _alloc_vtables[ALLOC_BACKEND_COUNT] = {
+    {
+        _alloc_malloc_alloc, _alloc_malloc_zalloc, _alloc_malloc_realloc,
+        _alloc_malloc_free, _alloc_malloc_release,
+    },
+    {
+        _alloc_arena_alloc, _alloc_arena_zalloc, _alloc_arena_realloc,
+        _alloc_arena_free, _alloc_arena_release,
+    },
+    {
+        _alloc_pool_alloc, _alloc_pool_zalloc, _alloc_pool_realloc,
+        _alloc_pool_free, _alloc_pool_release,
+    },
+};
+
+// Selected backend, and whether tracking heap usage.
+static const struct alloc_vtable *_alloc_vtable =
+    &_alloc_vtables[ALLOC_DEFAULT_BACKEND];
+#if defined(ALLOC_TRACE)
+static bool _alloc_tracking = true;
+#else
+static bool _alloc_tracking = false;
+#endif
+
+// Add to a mem_usage count, and bump its peak if that's a new high.
+static void _mem_add(uint64_t *bytes, uint64_t *peak_bytes, int64_t delta)
+{
+    *bytes += (uint64_t)delta;
+    if (*bytes > *peak_bytes)
+    {
+        *peak_bytes = *bytes;
+    }
+}
+
+// Count heap bytes of a mem_tag coming to life, or dying if negative.
+static void _mem_count_heap(enum mem_tag tag, int64_t delta)
+{
+    struct mem_usage *usage = &mem_usage[tag];
+    _mem_add(&usage->heap_bytes, &usage->heap_peak_bytes, delta);
+    _mem_add(
+        &mem_usage_total.heap_bytes, &mem_usage_total.heap_peak_bytes, delta);
+}
+
+// Count committed or mapped bytes of a mem_tag, or uncommitted or unmapped
+// bytes if negative. For memory that doesn't come from jocc_alloc.
+static void mem_count_mapped(enum mem_tag tag, int64_t delta)
+{
+    assert(tag < MEM_TAG_COUNT);
+
+    struct mem_usage *usage = &mem_usage[tag];
+    _mem_add(&usage->mapped_bytes, &usage->mapped_peak_bytes, delta);
+    _mem_add(
+        &mem_usage_total.mapped_bytes, &mem_usage_total.mapped_peak_bytes,
+        delta);
+}
+
+// Header in front of tracked blocks. When tracing, also where and when the
+// block was allocated. A multiple of ALLOC_ALIGNMENT either way.
+struct _alloc_track_header
+{
+    uint64_t size;
+    uint64_t tag;
+#if defined(ALLOC_TRACE)
+    uint64_t site;
+    uint64_t birth;
+#endif
+};
+
+#if defined(ALLOC_TRACE)
+
+// Allocation tracing, built in with -DJOCC_ALLOC_TRACE=ON.
+//
+// Every tracked allocation is attributed to the source line that asked for
+// it, through ALLOC_ARRAY, DYNARR_GROW and the like, and summed up per line
+// with a histogram of block sizes and how long blocks lived, counted in
+// allocator calls made in between. The latest events are kept in a ring buffer,
+// and the re-allocations that copied the most bytes in a top list. It's all
+// in static storage, so tracing never allocates. Tracing needs the tracking
+// headers, so tracking is always on.
+
+#define ALLOC_TRACE_SITE_CAPACITY 1024
+#define ALLOC_TRACE_RING_SIZE 4096
+#define ALLOC_TRACE_TOP_COUNT 10
+
+// Size histogram buckets: up to 16 bytes, up to 128, and so on, 8x apart.
+#define ALLOC_TRACE_BUCKET_COUNT 8
+
+// Source line that allocates. Site 0 is for allocations not made through
+// the traced entry points, e.g. by alloc.h itself.
+struct alloc_trace_site
+{
+    const char *file; // NULL if the slot is empty.
+    uint32_t line;
+    uint64_t alloc_count;
+    uint64_t realloc_count;
+    uint64_t free_count;
+    uint64_t bytes; // Requested by allocs and reallocs.
+    uint64_t copy_bytes; // Moved by reallocs.
+    uint64_t lifetime_total; // Of freed blocks.
+    uint64_t size_counts[ALLOC_TRACE_BUCKET_COUNT];
+};
+
+enum alloc_trace_kind
+{
+    ALLOC_TRACE_ALLOC,
+    ALLOC_TRACE_REALLOC,
+    ALLOC_TRACE_FREE,
+};
+
+// Traced allocator call.
+struct alloc_trace_event
+{
+    uint64_t seq; // Allocator calls traced before it.
+    uint64_t size;
+    uint64_t old_size; // For reallocs and frees.
+    uint64_t copy_bytes; // For reallocs that moved the block.
+    uint32_t site;
+    enum alloc_trace_kind kind;
+};
+
+struct _alloc_trace
+{
+    // Hash table of sites, keyed by file and line, plus site 0.
+    struct alloc_trace_site sites[ALLOC_TRACE_SITE_CAPACITY];
+    uint32_t site_count;
+
+    // Caller of the outermost traced entry point being evaluated.
+    const char *file;
+    uint32_t line;
+    uint32_t depth;
+
+    uint64_t event_count;
+    struct alloc_trace_event ring[ALLOC_TRACE_RING_SIZE];
+
+    // Sorted by copy_bytes, descending.
+    uint32_t top_count;
+    struct alloc_trace_event top[ALLOC_TRACE_TOP_COUNT];
+};
+
+static struct _alloc_trace _alloc_trace;
+
+// Start evaluating a traced entry point called from file and line. Only the
+// outermost one counts, so helpers that allocate on behalf of a caller
+// don't take the blame.
+static void _alloc_trace_enter(const char *file, uint32_t line)
+{
+    if (_alloc_trace.depth++ == 0)
+    {
+        _alloc_trace.file = file;
+        _alloc_trace.line = line;
+    }
+}
+
+// Finish evaluating a traced entry point. Passes its result through.
+static void *_alloc_trace_leave(void *ptr)
+{
+    if (--_alloc_trace.depth == 0)
+    {
+        _alloc_trace.file = NULL;
+    }
+
+    return ptr;
+}
+
+// Attribute allocations made while evaluating expr, which must yield a
+// pointer, to the line it's on.
+#define ALLOC_TRACE_CALLER(expr) \
+    (_alloc_trace_enter(__FILE__, __LINE__), _alloc_trace_leave(expr))
+
+// Get the site of the current caller, adding it if it's new. 0 if unknown
+// or the table is three quarters full.
+static uint32_t _alloc_trace_site(void)
+{
+    const char *file = _alloc_trace.file;
+    uint32_t line = _alloc_trace.line;
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    // Compare file names, not pointers, which needn't be unique.
+    uint32_t hash = line * UINT32_C(2654435761);
+    for (const char *c = file; *c != 0; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * UINT32_C(16777619);
+    }
+
+    uint32_t slot_count = ALLOC_TRACE_SITE_CAPACITY - 1;
+    for (uint32_t i = hash % slot_count;; i = (i + 1) % slot_count)
+    {
+        struct alloc_trace_site *site = &_alloc_trace.sites[i + 1];
+        if (site->file == NULL)
+        {
+            if (_alloc_trace.site_count >= slot_count / 4 * 3)
+            {
+                return 0;
+            }
+
+            _alloc_trace.site_count++;
+            site->file = file;
+            site->line = line;
+            return i + 1;
+        }
+
+        if (site->line == line &&
+            (site->file == file || strcmp(site->file, file) == 0))
+        {
+            return i + 1;
+        }
+    }
+}
+
+// Record an event in the ring buffer, and the top list if it copied enough.
+static void _alloc_trace_event(
+    enum alloc_trace_kind kind,
+    uint32_t site,
+    uint64_t size,
+    uint64_t old_size,
+    uint64_t copy_bytes)
+{
+    struct alloc_trace_event event;
+    event.seq = _alloc_trace.event_count;
+    event.size = size;
+    event.old_size = old_size;
+    event.copy_bytes = copy_bytes;
+    event.site = site;
+    event.kind = kind;
+    _alloc_trace.ring[_alloc_trace.event_count++ % ALLOC_TRACE_RING_SIZE] =
+        event;
+
+    if (copy_bytes == 0)
+    {
+        return;
+    }
+
+    // Insertion sort into the top list, dropping the least if it's full.
+    uint32_t i = _alloc_trace.top_count;
+    if (i == ALLOC_TRACE_TOP_COUNT)
+    {
+        if (_alloc_trace.top[i - 1].copy_bytes >= copy_bytes)
+        {
+            return;
+        }
+
+        i--;
+    }
+    else
+    {
+        _alloc_trace.top_count++;
+    }
+
+    for (; i > 0 && _alloc_trace.top[i - 1].copy_bytes < copy_bytes; i--)
+    {
+        _alloc_trace.top[i] = _alloc_trace.top[i - 1];
+    }
+
+    _alloc_trace.top[i] = event;
+}
+
+// Count a block of the given size at a site.
+static void _alloc_trace_size(struct alloc_trace_site *site, uint64_t size)
+{
+    uint32_t bucket = 0;
+    for (uint64_t limit = 16;
+        size > limit && bucket < ALLOC_TRACE_BUCKET_COUNT - 1;
+        limit *= 8)
+    {
+        bucket++;
+    }
+
+    site->size_counts[bucket]++;
+    site->bytes += size;
+}
+
+// Trace an alloc, and stamp its header with where and when.
+static void _alloc_trace_alloc(struct _alloc_track_header *header)
+{
+    uint32_t site = _alloc_trace_site();
+    header->site = site;
+    header->birth = _alloc_trace.event_count;
+
+    _alloc_trace.sites[site].alloc_count++;
+    _alloc_trace_size(&_alloc_trace.sites[site], header->size);
+    _alloc_trace_event(ALLOC_TRACE_ALLOC, site, header->size, 0, 0);
+}
+
+// Trace a realloc, attributed to its caller if known, otherwise to where the
+// block was allocated.
+static void _alloc_trace_realloc(
+    struct _alloc_track_header *header,
+    uint64_t old_size,
+    uint64_t copy_bytes)
+{
+    uint32_t site = _alloc_trace_site();
+    if (site == 0)
+    {
+        site = (uint32_t)header->site;
+    }
+
+    _alloc_trace.sites[site].realloc_count++;
+    _alloc_trace.sites[site].copy_bytes += copy_bytes;
+    _alloc_trace_size(&_alloc_trace.sites[site], header->size);
+    _alloc_trace_event(
+        ALLOC_TRACE_REALLOC, site, header->size, old_size, copy_bytes);
+}
+
+// Trace a free, attributed to where the block was allocated.
+static void _alloc_trace_free(struct _alloc_track_header *header)
+{
+    struct alloc_trace_site *site = &_alloc_trace.sites[(size_t)header->site];
+    site->free_count++;
+    site->lifetime_total += _alloc_trace.event_count - header->birth;
+    _alloc_trace_event(
+        ALLOC_TRACE_FREE, (uint32_t)header->site, 0, header->size, 0);
+}
+
+#else
+
+// Attribute allocations made while evaluating expr to the line it's on,
+// when tracing.
+#define ALLOC_TRACE_CALLER(expr) (expr)
+
+#endif
+
+// Tracking alloc. Puts the size and tag in a header in front of the block.
+static void *_alloc_track_alloc(size_t size, enum mem_tag tag, bool zero)
+{
+    struct _alloc_track_header *header;
+    if (size > SIZE_MAX - sizeof(*header))
+    {
+        return NULL;
+    }
+
+    header = zero
+        ? _alloc_vtable->zalloc(sizeof(*header) + size)
+        : _alloc_vtable->alloc(sizeof(*header) + size);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+
+    header->size = size;
+    header->tag = tag;
+    mem_usage[tag].alloc_count++;
+    mem_usage_total.alloc_count++;
+    _mem_count_heap(tag, (int64_t)size);
+#if defined(ALLOC_TRACE)
+    _alloc_trace_alloc(header);
+#endif
+    return header + 1;
+}
+
+// Tracking realloc. The block keeps the tag it was allocated with.
+static void *_alloc_track_realloc(void *ptr, size_t size, enum mem_tag tag)
+{
+    if (ptr == NULL)
+    {
+        return _alloc_track_alloc(size, tag, false);
+    }
+
+    struct _alloc_track_header *header =
+        (struct _alloc_track_header *)ptr - 1;
+    if (size > SIZE_MAX - sizeof(*header))
+    {
+        return NULL;
+    }
+
+    size_t old_size = (size_t)header->size;
+    tag = (enum mem_tag)header->tag;
+    struct _alloc_track_header *new_header =
+        _alloc_vtable->realloc(header, sizeof(*header) + size);
+    if (new_header == NULL)
+    {
+        return NULL;
+    }
+
+    // Count what had to be copied if the block moved.
+    struct mem_usage *usage = &mem_usage[tag];
+    uint64_t copied = 0;
+    if (new_header != header)
+    {
+        copied = old_size < size ? old_size : size;
+        usage->realloc_copy_bytes += copied;
+        mem_usage_total.realloc_copy_bytes += copied;
+    }
+
+    new_header->size = size;
+    usage->realloc_count++;
+    mem_usage_total.realloc_count++;
+    _mem_count_heap(tag, (int64_t)size - (int64_t)old_size);
+#if defined(ALLOC_TRACE)
+    _alloc_trace_realloc(new_header, old_size, copied);
+#endif
+    return new_header + 1;
+}
+
+// Tracking free.
+static void _alloc_track_free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    struct _alloc_track_header *header =
+        (struct _alloc_track_header *)ptr - 1;
+    enum mem_tag tag = (enum mem_tag)header->tag;
+    mem_usage[tag].free_count++;
+    mem_usage_total.free_count++;
+    _mem_count_heap(tag, -(int64_t)header->size);
+#if defined(ALLOC_TRACE)
+    _alloc_trace_free(header);
+#endif
+    _alloc_vtable->free(header);
+}
+
+// Select backend, and whether to track heap usage in mem_usage. Blocks can't
+// move between backends or in or out of tracking, so call this before
+// allocating anything.
+static void alloc_set_backend(enum alloc_backend backend, bool tracking)
+{
+    assert(backend < ALLOC_BACKEND_COUNT);
+
+    _alloc_vtable = &_alloc_vtables[backend];
+#if defined(ALLOC_TRACE)
+    (void)tracking;
+#else
+    _alloc_tracking = tracking;
+#endif
+}
+
+// Free everything the backend can free at once: the arena's memory, or the
+// pool's slabs. Blocks from them are invalid afterwards, even if not freed.
+// If tracking, they stay counted in mem_usage.
+static void alloc_release(void)
+{
+    _alloc_vtable->release();
+}
+
+// Whether a mem_usage has anything to report.
+static bool _mem_report_used(const struct mem_usage *usage)
+{
+    return
+        usage->heap_peak_bytes != 0 ||
+        usage->mapped_peak_bytes != 0 ||
+        usage->array_resize_count != 0;
+}
+
+// Print a mem_usage row of the memory report table.
+static void _mem_report_row(
+    FILE *file,
+    const char *name,
+    const struct mem_usage *usage)
+{
+    fprintf(
+        file,
+        "%-12s %11" PRIu64 " %11" PRIu64 " %11" PRIu64 " %11" PRIu64
+        " %11" PRIu64 " %8" PRIu64 " %11" PRIu64 " %8" PRIu64 "\n",
+        name, usage->heap_peak_bytes, usage->heap_bytes,
+        usage->mapped_peak_bytes, usage->mapped_bytes,
+        usage->realloc_copy_bytes, usage->realloc_count,
+        usage->array_copy_bytes, usage->array_resize_count);
+}
+
+// Print a mem_usage object of the JSON memory report.
+static void _mem_report_json(FILE *file, const struct mem_usage *usage)
+{
+    fprintf(
+        file,
+        "{\"alloc_count\": %" PRIu64 ", "
+        "\"realloc_count\": %" PRIu64 ", "
+        "\"free_count\": %" PRIu64 ", "
+        "\"heap_bytes\": %" PRIu64 ", "
+        "\"heap_peak_bytes\": %" PRIu64 ", "
+        "\"realloc_copy_bytes\": %" PRIu64 ", "
+        "\"mapped_bytes\": %" PRIu64 ", "
+        "\"mapped_peak_bytes\": %" PRIu64 ", "
+        "\"array_resize_count\": %" PRIu64 ", "
+        "\"array_copy_bytes\": %" PRIu64 "}",
+        usage->alloc_count, usage->realloc_count, usage->free_count,
+        usage->heap_bytes, usage->heap_peak_bytes, usage->realloc_copy_bytes,
+        usage->mapped_bytes, usage->mapped_peak_bytes,
+        usage->array_resize_count, usage->array_copy_bytes);
+}
+
+// Print memory usage by mem_tag, as a table or as JSON. Subsystems that never
+// used any memory are left out. Heap columns are 0 unless tracking.
+static void mem_report(FILE *file, bool json)
+{
+    assert(file != NULL);
+
+    if (json)
+    {
+        fprintf(
+            file, "{\n  \"tracking\": %s,\n  \"subsystems\": {\n",
+            _alloc_tracking ? "true" : "false");
+        const char *separator = "";
+        for (int tag = 0; tag < MEM_TAG_COUNT; tag++)
+        {
+            struct mem_usage *usage = &mem_usage[tag];
+            if (_mem_report_used(usage))
+            {
+                fprintf(file, "%s    \"%s\": ", separator, mem_tag_names[tag]);
+                _mem_report_json(file, usage);
+                separator = ",\n";
+            }
+        }
+
+        fprintf(file, "\n  },\n  \"total\": ");
+        _mem_report_json(file, &mem_usage_total);
+        fprintf(file, "\n}\n");
+        return;
+    }
+
+    fprintf(
+        file,
+        "%-12s %11s %11s %11s %11s %11s %8s %11s %8s\n",
+        "bytes", "heap peak", "heap now", "mapped peak", "mapped now",
+        "copied", "reallocs", "arr copied", "resizes");
+    for (int tag = 0; tag < MEM_TAG_COUNT; tag++)
+    {
+        struct mem_usage *usage = &mem_usage[tag];
+        if (_mem_report_used(usage))
+        {
+            _mem_report_row(file, mem_tag_names[tag], usage);
+        }
+    }
+
+    _mem_report_row(file, "total", &mem_usage_total);
+}
+
 // Allocate.
-static void *jocc_alloc(size_t size)
+static void *jocc_alloc(size_t size, enum mem_tag tag)
 {
     assert(size != 0);
+    assert(tag < MEM_TAG_COUNT);
 
-    void *ptr = malloc(size);
+    void *ptr = _alloc_tracking
+        ? _alloc_track_alloc(size, tag, false)
+        : _alloc_vtable->alloc(size);
     if (ptr == NULL)
     {
         out_of_memory();
@@ -21,21 +1175,31 @@ static void *jocc_alloc(size_t size)
 }
 
 // Allocate and zero.
-static void *jocc_zalloc(size_t size)
+static void *jocc_zalloc(size_t size, enum mem_tag tag)
 {
     assert(size != 0);
+    assert(tag < MEM_TAG_COUNT);
+
+    void *ptr = _alloc_tracking
+        ? _alloc_track_alloc(size, tag, true)
+        : _alloc_vtable->zalloc(size);
+    if (ptr == NULL)
+    {
+        out_of_memory();
+    }
 
-    void *ptr = jocc_alloc(size);
-    memset(ptr, 0, size);
     return ptr;
 }
 
-// Re-allocate.
-static void *jocc_realloc(void *ptr, size_t size)
+// Re-allocate. tag is only used if ptr is NULL.
+static void *jocc_realloc(void *ptr, size_t size, enum mem_tag tag)
 {
     assert(size != 0);
+    assert(tag < MEM_TAG_COUNT);
 
-    ptr = realloc(ptr, size);
+    ptr = _alloc_tracking
+        ? _alloc_track_realloc(ptr, size, tag)
+        : _alloc_vtable->realloc(ptr, size);
     if (ptr == NULL)
     {
         out_of_memory();
@@ -45,7 +1209,7 @@ static void *jocc_realloc(void *ptr, size_t size)
 }
 
 // Allocate array.
-static void *alloc_array(size_t len, size_t element_size)
+static void *alloc_array(size_t len, size_t element_size, enum mem_tag tag)
 {
     assert(len != 0);
     assert(element_size != 0);
@@ -55,26 +1219,29 @@ static void *alloc_array(size_t len, size_t element_size)
         out_of_memory();
     }
 
-    return jocc_alloc(len * element_size);
+    return jocc_alloc(len * element_size, tag);
 }
 
 // Allocate array and zero.
-static void *zalloc_array(size_t len, size_t element_size)
+static void *zalloc_array(size_t len, size_t element_size, enum mem_tag tag)
 {
     assert(len != 0);
     assert(element_size != 0);
 
-    void *ptr = calloc(len, element_size);
-    if (ptr == NULL)
+    if (len > SIZE_MAX / element_size)
     {
         out_of_memory();
     }
 
-    return ptr;
+    return jocc_zalloc(len * element_size, tag);
 }
 
-// Re-allocate array.
-static void *realloc_array(void *ptr, size_t len, size_t element_size)
+// Re-allocate array. tag is only used if ptr is NULL.
+static void *realloc_array(
+    void *ptr,
+    size_t len,
+    size_t element_size,
+    enum mem_tag tag)
 {
     assert(len != 0);
     assert(element_size != 0);
@@ -84,26 +1251,180 @@ static void *realloc_array(void *ptr, size_t len, size_t element_size)
         out_of_memory();
     }
 
-    return jocc_realloc(ptr, len * element_size);
+    return jocc_realloc(ptr, len * element_size, tag);
 }
 
 // Free.
 static void jocc_free(void *ptr)
 {
-    free(ptr);
+    if (_alloc_tracking)
+    {
+        _alloc_track_free(ptr);
+    }
+    else
+    {
+        _alloc_vtable->free(ptr);
+    }
 }
 
 // Allocate.
-#define JOCC_ALLOC(T) ((T *)jocc_alloc(sizeof(T)))
+#define JOCC_ALLOC(T, tag) ((T *)jocc_alloc(sizeof(T), tag))
 
 // Allocate and zero.
-#define JOCC_ZALLOC(T) ((T *)jocc_zalloc(sizeof(T)))
+#define JOCC_ZALLOC(T, tag) ((T *)jocc_zalloc(sizeof(T), tag))
 
 // Allocate array.
-#define ALLOC_ARRAY(T, len) ((T *)alloc_array(len, sizeof(T)))
+#define ALLOC_ARRAY(T, len, tag) ((T *)alloc_array(len, sizeof(T), tag))
 
 // Allocate array and zero.
-#define ZALLOC_ARRAY(T, len) ((T *)zalloc_array(len, sizeof(T)))
+#define ZALLOC_ARRAY(T, len, tag) ((T *)zalloc_array(len, sizeof(T), tag))
+
+// Re-allocate array. tag is only used if ptr is NULL.
+#define REALLOC_ARRAY(T, ptr, len, tag) \
+    ((T *)realloc_array(ptr, len, sizeof(T), tag))
+
+#if defined(ALLOC_TRACE)
+
+// Trace where allocations come from. Functions in this file defined
+// before this point call each other untraced, so the outermost caller
+// outside of it is the site.
+#define jocc_alloc(size, tag) ALLOC_TRACE_CALLER(jocc_alloc(size, tag))
+#define jocc_zalloc(size, tag) ALLOC_TRACE_CALLER(jocc_zalloc(size, tag))
+#define jocc_realloc(ptr, size, tag) \
+    ALLOC_TRACE_CALLER(jocc_realloc(ptr, size, tag))
+#define alloc_array(len, element_size, tag) \
+    ALLOC_TRACE_CALLER(alloc_array(len, element_size, tag))
+#define zalloc_array(len, element_size, tag) \
+    ALLOC_TRACE_CALLER(zalloc_array(len, element_size, tag))
+#define realloc_array(ptr, len, element_size, tag) \
+    ALLOC_TRACE_CALLER(realloc_array(ptr, len, element_size, tag))
+
+// Print a site's name: its file's name without directories, and line.
+static void _alloc_trace_print_site(FILE *file, uint32_t site)
+{
+    const char *name = _alloc_trace.sites[site].file;
+    if (name == NULL)
+    {
+        fprintf(file, "%-24s", "(unknown)");
+        return;
+    }
+
+    for (const char *c = name; *c != 0; c++)
+    {
+        if (*c == '/' || *c == '\\')
+        {
+            name = c + 1;
+        }
+    }
+
+    char buf[64];
+    snprintf(
+        buf, sizeof(buf), "%s:%" PRIu32, name, _alloc_trace.sites[site].line);
+    fprintf(file, "%-24s", buf);
+}
+
+// Order site numbers by bytes requested, descending.
+static int _alloc_trace_site_cmp(const void *a, const void *b)
+{
+    uint64_t a_bytes = _alloc_trace.sites[*(const uint32_t *)a].bytes;
+    uint64_t b_bytes = _alloc_trace.sites[*(const uint32_t *)b].bytes;
+    return (a_bytes < b_bytes) - (a_bytes > b_bytes);
+}
+
+// Print the allocation trace: per site totals and size histograms, the
+// re-allocations that copied the most, and the last recent_count events.
+static void alloc_trace_report(FILE *file, uint32_t recent_count)
+{
+    assert(file != NULL);
+
+    static const char *const kind_names[] = {"alloc", "realloc", "free"};
+    static const char *const bucket_names[ALLOC_TRACE_BUCKET_COUNT] = {
+        "<=16", "<=128", "<=1K", "<=8K", "<=64K", "<=512K", "<=4M", ">4M",
+    };
+
+    // Sites, by bytes requested.
+    uint32_t order[ALLOC_TRACE_SITE_CAPACITY];
+    uint32_t order_count = 0;
+    for (uint32_t i = 0; i < ALLOC_TRACE_SITE_CAPACITY; i++)
+    {
+        struct alloc_trace_site *site = &_alloc_trace.sites[i];
+        if (site->alloc_count != 0 || site->realloc_count != 0)
+        {
+            order[order_count++] = i;
+        }
+    }
+
+    qsort(order, order_count, sizeof(*order), _alloc_trace_site_cmp);
+    fprintf(
+        file, "allocation sites:\n%-24s %8s %8s %8s %12s %12s %10s\n",
+        "site", "allocs", "reallocs", "live", "bytes", "copied",
+        "avg life");
+    for (uint32_t i = 0; i < order_count; i++)
+    {
+        struct alloc_trace_site *site = &_alloc_trace.sites[order[i]];
+        _alloc_trace_print_site(file, order[i]);
+        fprintf(
+            file, " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %12" PRIu64
+            " %12" PRIu64 " %10" PRIu64 "\n",
+            site->alloc_count, site->realloc_count,
+            site->alloc_count - site->free_count, site->bytes,
+            site->copy_bytes,
+            site->free_count != 0
+                ? site->lifetime_total / site->free_count
+                : 0);
+
+        // Histogram of sizes allocated or re-allocated to.
+        fprintf(file, "  sizes:");
+        for (uint32_t j = 0; j < ALLOC_TRACE_BUCKET_COUNT; j++)
+        {
+            if (site->size_counts[j] != 0)
+            {
+                fprintf(
+                    file, " %s: %" PRIu64, bucket_names[j],
+                    site->size_counts[j]);
+            }
+        }
+
+        fprintf(file, "\n");
+    }
+
+    // Re-allocations that copied the most.
+    fprintf(file, "top reallocs by bytes copied:\n");
+    for (uint32_t i = 0; i < _alloc_trace.top_count; i++)
+    {
+        struct alloc_trace_event *event = &_alloc_trace.top[i];
+        _alloc_trace_print_site(file, event->site);
+        fprintf(
+            file, " %12" PRIu64 " -> %12" PRIu64 " copied %12" PRIu64
+            " at #%" PRIu64 "\n",
+            event->old_size, event->size, event->copy_bytes, event->seq);
+    }
+
+    // Latest events.
+    uint64_t count = _alloc_trace.event_count;
+    if (recent_count > ALLOC_TRACE_RING_SIZE)
+    {
+        recent_count = ALLOC_TRACE_RING_SIZE;
+    }
+
+    if (recent_count > count)
+    {
+        recent_count = (uint32_t)count;
+    }
+
+    fprintf(
+        file, "last %" PRIu32 " of %" PRIu64 " events:\n", recent_count,
+        count);
+    for (uint64_t i = count - recent_count; i < count; i++)
+    {
+        struct alloc_trace_event *event =
+            &_alloc_trace.ring[i % ALLOC_TRACE_RING_SIZE];
+        _alloc_trace_print_site(file, event->site);
+        fprintf(
+            file, " %-7s %12" PRIu64 " -> %12" PRIu64 " at #%" PRIu64 "\n",
+            kind_names[event->kind], event->old_size, event->size,
+            event->seq);
+    }
+}
 
-// Re-allocate array.
-#define REALLOC_ARRAY(T, ptr, len) ((T *)realloc_array(ptr, len, sizeof(T)))
+#endif
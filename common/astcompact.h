@@ -0,0 +1,147 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "astman.h"
+#include "dynarr.h"
+
+// Abstract syntax tree compaction frame. One for each node being copied.
+struct _astcompact_frame
+{
+    astid_t old_node;
+    astid_t new_node;
+    uint32_t next; // Index of next child to visit.
+};
+
+// Copy node to the end of new_data. Returns its new ID.
+static astid_t _astcompact_copy(
+    struct astman *astman,
+    struct vmem_arr *new_data,
+    uint32_t *new_len,
+    astid_t node)
+{
+    // Include the count entry of wide nodes.
+    uint32_t child_count = astman_get_child_count(astman, node);
+    uint32_t count_size = child_count >= ASTMAN_WIDE_CHILD_COUNT;
+    uint32_t start = node - 1 - count_size;
+    uint32_t size =
+        count_size + 1 + child_count +
+        syncat_extra_count(astman_get_syncat(astman, node));
+
+    // Can't overflow since the new data is a subset of the old.
+    uint32_t new_start = *new_len;
+    *new_len += size;
+    vmem_arr_ensure(new_data, sizeof(uint32_t) * (size_t)*new_len);
+    memcpy(
+        (uint32_t *)new_data->data + new_start,
+        astman->data + start,
+        sizeof(uint32_t) * size);
+
+    return new_start + count_size + 1;
+}
+
+// Compact abstract syntax tree manager down to the subtrees at roots.
+//
+// Live nodes are copied to a new, densely packed array in pre-order, so a
+// traversal reads it front to back, and the old array is released. Nodes
+// shared by several parents, e.g. by hash-consing, stay shared. Node sizes
+// come from syncat_extra_count, so every node must follow it.
+//
+// roots are updated in place, and 0's are left alone. Returns an array
+// mapping every old astid_t to its new one, or 0 if it was dropped, for
+// updating any other references. Free it with jocc_free. Anything else that
+// keeps track of astid's, like an astcons, is invalidated.
+static astid_t *astman_compact(
+    struct astman *astman,
+    astid_t *roots,
+    uint32_t root_count)
+{
+    assert(astman != NULL);
+    assert(roots != NULL || root_count == 0);
+
+    astid_t *remap = ZALLOC_ARRAY(
+        astid_t, (size_t)astman->data_len + 1, MEM_TAG_ASTMAN);
+
+    struct vmem_arr new_data;
+    vmem_arr_init(
+        &new_data, sizeof(uint32_t) * (size_t)UINT32_MAX, MEM_TAG_ASTMAN);
+    uint32_t new_len = 0;
+
+    uint32_t frame_count = 0;
+    uint32_t frame_capacity = 16;
+    struct _astcompact_frame *frames =
+        ALLOC_ARRAY(struct _astcompact_frame, frame_capacity, MEM_TAG_ASTMAN);
+
+    for (uint32_t r = 0; r < root_count; r++)
+    {
+        astid_t root = roots[r];
+        if (root == 0 || remap[root] != 0)
+        {
+            roots[r] = remap[root];
+            continue;
+        }
+
+        remap[root] = _astcompact_copy(astman, &new_data, &new_len, root);
+        roots[r] = remap[root];
+
+        frames[0].old_node = root;
+        frames[0].new_node = remap[root];
+        frames[0].next = 0;
+        frame_count = 1;
+
+        while (frame_count > 0)
+        {
+            struct _astcompact_frame *frame = &frames[frame_count - 1];
+            uint32_t child_count =
+                astman_get_child_count(astman, frame->old_node);
+
+            // Once all children are copied, point the copy at them.
+            if (frame->next == child_count)
+            {
+                uint32_t *new_children =
+                    (uint32_t *)new_data.data + frame->new_node;
+                for (uint32_t i = 0; i < child_count; i++)
+                {
+                    new_children[i] =
+                        remap[astman->data[frame->old_node + i]];
+                }
+
+                frame_count--;
+                continue;
+            }
+
+            // Copy next child unless it's been copied already.
+            astid_t child = astman->data[frame->old_node + frame->next++];
+            if (remap[child] != 0)
+            {
+                continue;
+            }
+
+            remap[child] =
+                _astcompact_copy(astman, &new_data, &new_len, child);
+
+            // Re-allocate if necessary.
+            DYNARR_GROW(
+                struct _astcompact_frame, frames, frame_count, frame_capacity,
+                1, MEM_TAG_ASTMAN);
+
+            frame = &frames[frame_count++];
+            frame->old_node = child;
+            frame->new_node = remap[child];
+            frame->next = 0;
+        }
+    }
+
+    jocc_free(frames);
+
+    // Swap in the new array.
+    astman->compacted_peak_len = astman_get_peak_len(astman);
+    vmem_arr_destroy(&astman->data_vmem);
+    astman->data_vmem = new_data;
+    astman->data = (uint32_t *)new_data.data;
+    astman->data_len = new_len;
+
+    return remap;
+}
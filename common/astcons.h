@@ -0,0 +1,207 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "astman.h"
+#include "hash.h"
+
+// Entry in astcons hash table.
+struct astcons_entry
+{
+    uint32_t hash;
+    uint32_t size; // Entries, including the header and any count entry.
+    astid_t astid; // 0 means empty.
+};
+
+// Abstract syntax tree hash-consing.
+//
+// Merges structurally identical nodes: same header, child ID's, and extra
+// entries. Nodes are interned right after they're made, children first, so
+// identical subtrees end up with identical child ID's and merge all the way
+// up. A node that turns out to be a duplicate is popped off the end of
+// astman, and the existing node's ID is used instead.
+//
+// Merged nodes are shared, so passes that need each node to have a unique
+// identity, e.g. to map nodes to source locations, should disable it.
+struct astcons
+{
+    // Whether astcons_intern merges nodes. Toggle as needed.
+    bool enabled;
+
+    uint32_t count;
+    uint32_t capacity; // Must be a power of two.
+    struct astcons_entry *entries;
+
+    // Statistics.
+    uint64_t intern_count;
+    uint64_t merge_count;
+    uint64_t saved_size; // astman entries.
+};
+
+// Initialize hash-consing, enabled.
+static void astcons_init(struct astcons *astcons)
+{
+    assert(astcons != NULL);
+
+    astcons->enabled = true;
+
+    astcons->count = 0;
+    astcons->capacity = 1024;
+    astcons->entries = ZALLOC_ARRAY(
+        struct astcons_entry, astcons->capacity, MEM_TAG_ASTMAN);
+
+    astcons->intern_count = 0;
+    astcons->merge_count = 0;
+    astcons->saved_size = 0;
+}
+
+// Destroy hash-consing.
+static void astcons_destroy(struct astcons *astcons)
+{
+    assert(astcons != NULL);
+
+    jocc_free(astcons->entries);
+}
+
+// Forget all interned nodes, e.g. after astman_compact moves them.
+// Statistics are kept.
+static void astcons_clear(struct astcons *astcons)
+{
+    assert(astcons != NULL);
+
+    astcons->count = 0;
+    memset(
+        astcons->entries, 0,
+        sizeof(struct astcons_entry) * (size_t)astcons->capacity);
+}
+
+// Get index of the first astman entry of a node: its
+// count entry if it's wide, otherwise its header.
+static uint32_t _astcons_node_start(struct astman *astman, astid_t astid)
+{
+    bool wide =
+        astman->data[astid - 1] >> 16 == ASTMAN_WIDE_CHILD_COUNT;
+    return astid - 1 - wide;
+}
+
+// Insert entry into a hash table known not to contain it.
+static void _astcons_insert(
+    struct astcons_entry *entries,
+    uint32_t capacity,
+    struct astcons_entry entry)
+{
+    uint32_t mask = capacity - 1;
+    for (uint32_t i = entry.hash & mask;; i = (i + 1) & mask)
+    {
+        if (entries[i].astid == 0)
+        {
+            entries[i] = entry;
+            return;
+        }
+    }
+}
+
+// Intern the node last allocated in astman, which has extra_count extra
+// entries. Returns the ID of an identical node if there is one, in which
+// case the new one is freed. Otherwise returns astid.
+static astid_t astcons_intern(
+    struct astcons *astcons,
+    struct astman *astman,
+    astid_t astid,
+    uint32_t extra_count)
+{
+    assert(astcons != NULL);
+    assert(astman != NULL);
+    assert(astid != 0);
+
+    if (!astcons->enabled)
+    {
+        return astid;
+    }
+
+    astcons->intern_count++;
+
+    // Look for an identical node.
+    uint32_t start = _astcons_node_start(astman, astid);
+    uint32_t end = astid + astman_get_child_count(astman, astid) + extra_count;
+    assert(end == astman->data_len);
+
+    uint32_t size = end - start;
+    const uint32_t *node = astman->data + start;
+    uint32_t hash = (uint32_t)jocc_hash(node, sizeof(uint32_t) * size);
+
+    uint32_t mask = astcons->capacity - 1;
+    uint32_t i = hash & mask;
+    for (; astcons->entries[i].astid != 0; i = (i + 1) & mask)
+    {
+        struct astcons_entry *entry = &astcons->entries[i];
+        if (entry->hash == hash &&
+            entry->size == size &&
+            memcmp(
+                astman->data + _astcons_node_start(astman, entry->astid),
+                node, sizeof(uint32_t) * size) == 0)
+        {
+            astman_pop(astman, size);
+            astcons->merge_count++;
+            astcons->saved_size += size;
+            return entry->astid;
+        }
+    }
+
+    // First of its kind.
+    astcons->entries[i].hash = hash;
+    astcons->entries[i].size = size;
+    astcons->entries[i].astid = astid;
+    astcons->count++;
+
+    // Keep the table at most half full.
+    if (astcons->count > astcons->capacity / 2)
+    {
+        uint32_t old_capacity = astcons->capacity;
+        if (old_capacity > UINT32_MAX / 2)
+        {
+            translation_limit_exceeded();
+        }
+
+        struct astcons_entry *old_entries = astcons->entries;
+        astcons->capacity = old_capacity * 2;
+        astcons->entries =
+            ZALLOC_ARRAY(
+                struct astcons_entry, astcons->capacity, MEM_TAG_ASTMAN);
+
+        for (uint32_t j = 0; j < old_capacity; j++)
+        {
+            if (old_entries[j].astid != 0)
+            {
+                _astcons_insert(
+                    astcons->entries, astcons->capacity, old_entries[j]);
+            }
+        }
+
+        jocc_free(old_entries);
+    }
+
+    return astid;
+}
+
+// Print how much memory hash-consing saved, net of its own hash table.
+static void astcons_report(struct astcons *astcons, FILE *file)
+{
+    assert(astcons != NULL);
+    assert(file != NULL);
+
+    uint64_t saved_bytes = sizeof(uint32_t) * astcons->saved_size;
+    uint64_t table_bytes =
+        sizeof(struct astcons_entry) * (uint64_t)astcons->capacity;
+
+    fprintf(
+        file,
+        "ast hash-consing: %" PRIu64 " nodes interned, %" PRIu64 " merged\n"
+        "  astman bytes saved: %" PRIu64 "\n"
+        "  hash table bytes:   %" PRIu64 "\n"
+        "  net bytes saved:    %" PRId64 "\n",
+        astcons->intern_count, astcons->merge_count, saved_bytes,
+        table_bytes, (int64_t)(saved_bytes - table_bytes));
+}
@@ -0,0 +1,315 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "astiter.h"
+#include "tokman.h"
+
+// Token node in the source location index.
+struct astindex_token
+{
+    srcloc_t start;
+    astid_t node;
+};
+
+// Abstract syntax tree index for queries astman can't answer by itself,
+// like finding a node's parent, its siblings, or the innermost node enclosing
+// a source location.
+//
+// Covers the subtree at a root. Each part is built the first time a query
+// needs it, with a single traversal, and rebuilt if any nodes were appended
+// since, so queries cost a lookup or a binary search plus a walk up the tree
+// instead of a scan. Nodes shared by several parents, e.g. by hash-consing,
+// are indexed under the last one traversed.
+struct astindex
+{
+    struct astman *astman;
+    struct tokman *tokman;
+    astid_t root;
+
+    // Parent index, indexed by astid_t. Valid if parents_len == data_len.
+    // child_indexes holds each node's index among its parent's children.
+    uint32_t parents_len;
+    astid_t *parents;
+    uint32_t *child_indexes;
+
+    // Source location index. Valid if srclocs_len == data_len. Token nodes
+    // sorted by starting srcloc, and the ending srcloc of the last token in
+    // each node, indexed by astid_t.
+    uint32_t srclocs_len;
+    uint32_t token_count;
+    struct astindex_token *tokens;
+    srcloc_t *ends;
+};
+
+// Initialize index of the subtree at root. Nothing is built until queried.
+static void astindex_init(
+    struct astindex *index,
+    struct astman *astman,
+    struct tokman *tokman,
+    astid_t root)
+{
+    assert(index != NULL);
+    assert(astman != NULL);
+    assert(tokman != NULL);
+    assert(root != 0);
+
+    index->astman = astman;
+    index->tokman = tokman;
+    index->root = root;
+
+    index->parents_len = UINT32_MAX;
+    index->parents = NULL;
+    index->child_indexes = NULL;
+
+    index->srclocs_len = UINT32_MAX;
+    index->token_count = 0;
+    index->tokens = NULL;
+    index->ends = NULL;
+}
+
+// Destroy index.
+static void astindex_destroy(struct astindex *index)
+{
+    assert(index != NULL);
+
+    jocc_free(index->ends);
+    jocc_free(index->tokens);
+    jocc_free(index->child_indexes);
+    jocc_free(index->parents);
+}
+
+// Force a rebuild on the next query, e.g. after astman_compact. Appending
+// nodes is noticed automatically.
+static void astindex_invalidate(struct astindex *index)
+{
+    assert(index != NULL);
+
+    index->parents_len = UINT32_MAX;
+    index->srclocs_len = UINT32_MAX;
+}
+
+// Build parent index if necessary.
+static void _astindex_build_parents(struct astindex *index)
+{
+    struct astman *astman = index->astman;
+    if (index->parents_len == astman->data_len)
+    {
+        return;
+    }
+
+    size_t len = (size_t)astman->data_len + 1;
+    jocc_free(index->parents);
+    jocc_free(index->child_indexes);
+    index->parents = ZALLOC_ARRAY(astid_t, len, MEM_TAG_ASTMAN);
+    index->child_indexes = ZALLOC_ARRAY(uint32_t, len, MEM_TAG_ASTMAN);
+
+    // Keep track of the nodes being traversed and
+    // how many of their children have been entered.
+    uint32_t node_capacity = 0;
+    uint32_t entered_capacity = 0;
+    astid_t *nodes = NULL;
+    uint32_t *entered = NULL;
+
+    struct astiter iter;
+    astiter_init(&iter, astman, index->root);
+    struct astiter_step step;
+    while (astiter_next(&iter, &step))
+    {
+        if (step.leaving)
+        {
+            continue;
+        }
+
+        // Re-allocate if necessary.
+        DYNARR_GROW(
+            astid_t, nodes, step.depth, node_capacity, 1, MEM_TAG_ASTMAN);
+        DYNARR_RESERVE(
+            uint32_t, entered, step.depth, entered_capacity, node_capacity,
+            MEM_TAG_ASTMAN);
+
+        if (step.depth > 0)
+        {
+            index->parents[step.node] = nodes[step.depth - 1];
+            index->child_indexes[step.node] = entered[step.depth - 1]++;
+        }
+
+        nodes[step.depth] = step.node;
+        entered[step.depth] = 0;
+    }
+
+    astiter_destroy(&iter);
+    jocc_free(entered);
+    jocc_free(nodes);
+
+    index->parents_len = astman->data_len;
+}
+
+// Order index tokens by starting srcloc.
+static int _astindex_token_cmp(const void *a, const void *b)
+{
+    srcloc_t a_start = ((const struct astindex_token *)a)->start;
+    srcloc_t b_start = ((const struct astindex_token *)b)->start;
+    return (a_start > b_start) - (a_start < b_start);
+}
+
+// Build source location index if necessary.
+static void _astindex_build_srclocs(struct astindex *index)
+{
+    struct astman *astman = index->astman;
+    struct tokman *tokman = index->tokman;
+    if (index->srclocs_len == astman->data_len)
+    {
+        return;
+    }
+
+    _astindex_build_parents(index);
+
+    jocc_free(index->tokens);
+    jocc_free(index->ends);
+    index->ends = ZALLOC_ARRAY(
+        srcloc_t, (size_t)astman->data_len + 1, MEM_TAG_ASTMAN);
+
+    // Collect token nodes, and spread their ends up the tree on the way out.
+    uint32_t token_capacity = 0;
+    index->token_count = 0;
+    index->tokens = NULL;
+    bool sorted = true;
+
+    uint32_t node_capacity = 0;
+    astid_t *nodes = NULL;
+
+    struct astiter iter;
+    astiter_init(&iter, astman, index->root);
+    struct astiter_step step;
+    while (astiter_next(&iter, &step))
+    {
+        astid_t node = step.node;
+        if (!step.leaving)
+        {
+            // Re-allocate if necessary.
+            DYNARR_GROW(
+                astid_t, nodes, step.depth, node_capacity, 1, MEM_TAG_ASTMAN);
+
+            nodes[step.depth] = node;
+            continue;
+        }
+
+        enum syncat syncat = astman_get_syncat(astman, node);
+        if (syncat_extra_count(syncat) == 1 &&
+            astman_get_child_count(astman, node) == 0)
+        {
+            // Re-allocate if necessary.
+            DYNARR_GROW(
+                struct astindex_token, index->tokens, index->token_count,
+                token_capacity, 1, MEM_TAG_ASTMAN);
+
+            tokid_t tokid = astman->data[node];
+            struct astindex_token *token =
+                &index->tokens[index->token_count++];
+            token->start = tokman->starts[tokid];
+            token->node = node;
+
+            sorted = sorted &&
+                (index->token_count == 1 || token[-1].start <= token->start);
+            index->ends[node] = tokman_get_end(tokman, tokid);
+        }
+
+        astid_t parent = step.depth > 0 ? nodes[step.depth - 1] : 0;
+        if (parent != 0 && index->ends[parent] < index->ends[node])
+        {
+            index->ends[parent] = index->ends[node];
+        }
+    }
+
+    astiter_destroy(&iter);
+    jocc_free(nodes);
+
+    // Tokens usually come out in source order already.
+    if (!sorted)
+    {
+        qsort(
+            index->tokens, index->token_count, sizeof(*index->tokens),
+            _astindex_token_cmp);
+    }
+
+    index->srclocs_len = astman->data_len;
+}
+
+// Get parent of a node in the indexed subtree. 0 for the root.
+static astid_t astindex_get_parent(struct astindex *index, astid_t node)
+{
+    assert(index != NULL);
+    assert(node != 0);
+
+    _astindex_build_parents(index);
+    assert(node <= index->parents_len);
+
+    return index->parents[node];
+}
+
+// Get sibling offset places after node, e.g. 1 for the next sibling or -1
+// for the previous one. 0 if there isn't one.
+static astid_t astindex_get_sibling(
+    struct astindex *index,
+    astid_t node,
+    int32_t offset)
+{
+    assert(index != NULL);
+    assert(node != 0);
+
+    astid_t parent = astindex_get_parent(index, node);
+    if (parent == 0)
+    {
+        return 0;
+    }
+
+    int64_t i = (int64_t)index->child_indexes[node] + offset;
+    if (i < 0 || i >= astman_get_child_count(index->astman, parent))
+    {
+        return 0;
+    }
+
+    return index->astman->data[parent + (uint32_t)i];
+}
+
+// Find the innermost node in the indexed subtree whose tokens span srcloc.
+// 0 if there isn't one.
+static astid_t astindex_find_srcloc(struct astindex *index, srcloc_t srcloc)
+{
+    assert(index != NULL);
+
+    _astindex_build_srclocs(index);
+
+    // Find the last token starting at or before srcloc.
+    uint32_t lo = 0;
+    uint32_t hi = index->token_count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index->tokens[mid].start <= srcloc)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0)
+    {
+        return 0;
+    }
+
+    // Its innermost ancestor that ends after srcloc spans it.
+    astid_t node = index->tokens[lo - 1].node;
+    while (node != 0 && index->ends[node] <= srcloc)
+    {
+        node = index->parents[node];
+    }
+
+    return node;
+}
@@ -0,0 +1,260 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "astman.h"
+#include "dynarr.h"
+
+// Hint that memory at addr will be read soon.
+#if defined(__GNUC__) || defined(__clang__)
+#define AST_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define AST_PREFETCH(addr) ((void)(addr))
+#endif
+
+// How many children ahead of the current one to prefetch headers for.
+// 0 disables prefetching.
+#ifndef ASTITER_PREFETCH_DISTANCE
+#define ASTITER_PREFETCH_DISTANCE 8
+#endif
+
+// Abstract syntax tree iterator frame. One for each node being traversed.
+struct astiter_frame
+{
+    astid_t node;
+
+    // Range of astman data holding the node's remaining children.
+    uint32_t next;
+    uint32_t end;
+};
+
+// Abstract syntax tree iterator.
+//
+// Yields every node of a subtree twice: once when entering it, before its
+// children (pre-order), and once when leaving it, after them (post-order).
+// Uses an explicit stack instead of recursion, so deep trees can't overflow
+// the call stack, and prefetches the headers of upcoming children while their
+// siblings are visited.
+struct astiter
+{
+    struct astman *astman;
+
+    // Root, until it's been entered.
+    astid_t root;
+
+    // Leaf node just entered, to be left next. Leaves don't get frames.
+    astid_t leaf;
+
+    // Depth of the most recently entered or left node. The root is at 0.
+    uint32_t depth;
+
+    uint32_t frame_count;
+    uint32_t frame_capacity;
+    struct astiter_frame *frames;
+};
+
+// Abstract syntax tree iterator step.
+struct astiter_step
+{
+    astid_t node;
+    uint32_t depth;
+
+    // false when entering the node, true when leaving it.
+    bool leaving;
+};
+
+// Initialize abstract syntax tree iterator to traverse the subtree at root.
+static void astiter_init(
+    struct astiter *iter,
+    struct astman *astman,
+    astid_t root)
+{
+    assert(iter != NULL);
+    assert(astman != NULL);
+    assert(root != 0);
+
+    iter->astman = astman;
+    iter->root = root;
+    iter->leaf = 0;
+    iter->depth = 0;
+
+    iter->frame_count = 0;
+    iter->frame_capacity = 16;
+    iter->frames = ALLOC_ARRAY(
+        struct astiter_frame, iter->frame_capacity, MEM_TAG_ASTMAN);
+}
+
+// Destroy abstract syntax tree iterator.
+static void astiter_destroy(struct astiter *iter)
+{
+    assert(iter != NULL);
+
+    jocc_free(iter->frames);
+}
+
+// Push frame for a node whose children are about to be traversed.
+static void _astiter_push(struct astiter *iter, astid_t node)
+{
+    // Re-allocate if necessary.
+    DYNARR_GROW(
+        struct astiter_frame, iter->frames, iter->frame_count,
+        iter->frame_capacity, 1, MEM_TAG_ASTMAN);
+
+    // Initialize frame.
+    struct astman *astman = iter->astman;
+    struct astiter_frame *frame = &iter->frames[iter->frame_count++];
+    frame->node = node;
+    frame->next = node;
+    frame->end = node + astman_get_child_count(astman, node);
+
+    // Get the first few child headers on their way.
+    uint32_t prefetch_end = frame->next + ASTITER_PREFETCH_DISTANCE;
+    if (prefetch_end > frame->end)
+    {
+        prefetch_end = frame->end;
+    }
+
+    for (uint32_t i = frame->next; i < prefetch_end; i++)
+    {
+        AST_PREFETCH(&astman->data[astman->data[i] - 1]);
+    }
+}
+
+// Advance to the next step. Returns false when the traversal is done.
+static bool astiter_next(struct astiter *iter, struct astiter_step *step)
+{
+    assert(iter != NULL);
+    assert(step != NULL);
+
+    // Enter root first.
+    if (iter->root != 0)
+    {
+        step->node = iter->root;
+        step->depth = 0;
+        step->leaving = false;
+
+        _astiter_push(iter, iter->root);
+        iter->root = 0;
+        return true;
+    }
+
+    // Leave leaf just entered.
+    if (iter->leaf != 0)
+    {
+        step->node = iter->leaf;
+        step->depth = iter->depth--;
+        step->leaving = true;
+
+        iter->leaf = 0;
+        return true;
+    }
+
+    // Done once the root is left.
+    if (iter->frame_count == 0)
+    {
+        return false;
+    }
+
+    struct astman *astman = iter->astman;
+    struct astiter_frame *frame = &iter->frames[iter->frame_count - 1];
+
+    // Leave the node once all its children are done.
+    if (frame->next == frame->end)
+    {
+        iter->frame_count--;
+        step->node = frame->node;
+        step->depth = iter->depth--;
+        step->leaving = true;
+        return true;
+    }
+
+    // Keep the prefetch window ahead of the next child.
+    astid_t child = astman->data[frame->next++];
+#if ASTITER_PREFETCH_DISTANCE > 0
+    uint32_t prefetch = frame->next + ASTITER_PREFETCH_DISTANCE - 1;
+    if (prefetch < frame->end)
+    {
+        AST_PREFETCH(&astman->data[astman->data[prefetch] - 1]);
+    }
+#endif
+
+    // Enter child.
+    step->node = child;
+    step->depth = ++iter->depth;
+    step->leaving = false;
+
+    if (astman_get_child_count(astman, child) == 0)
+    {
+        iter->leaf = child;
+    }
+    else
+    {
+        _astiter_push(iter, child);
+    }
+
+    return true;
+}
+
+// Skip the children of the node just entered. It's left next.
+static void astiter_skip_children(struct astiter *iter)
+{
+    assert(iter != NULL);
+
+    if (iter->leaf != 0)
+    {
+        return;
+    }
+
+    assert(iter->frame_count > 0);
+
+    struct astiter_frame *frame = &iter->frames[iter->frame_count - 1];
+    frame->next = frame->end;
+}
+
+// Abstract syntax tree visitor. Either callback may be NULL.
+struct astvisitor
+{
+    // Called when entering a node, before its children.
+    // Return false to skip its children.
+    bool (*enter)(void *ctx, astid_t node, uint32_t depth);
+
+    // Called when leaving a node, after its children.
+    void (*leave)(void *ctx, astid_t node, uint32_t depth);
+
+    void *ctx;
+};
+
+// Visit every node of the subtree at root.
+static void astman_visit(
+    struct astman *astman,
+    astid_t root,
+    const struct astvisitor *visitor)
+{
+    assert(astman != NULL);
+    assert(visitor != NULL);
+
+    struct astiter iter;
+    astiter_init(&iter, astman, root);
+
+    struct astiter_step step;
+    while (astiter_next(&iter, &step))
+    {
+        if (step.leaving)
+        {
+            if (visitor->leave != NULL)
+            {
+                visitor->leave(visitor->ctx, step.node, step.depth);
+            }
+        }
+        else if (
+            visitor->enter != NULL &&
+            !visitor->enter(visitor->ctx, step.node, step.depth))
+        {
+            astiter_skip_children(&iter);
+        }
+    }
+
+    astiter_destroy(&iter);
+}
@@ -6,11 +6,39 @@
 
 #include "tgroup.h"
 
-// Tracking for an AST ID list being built on the temporary stack.
+// Where an AST ID list's children are going.
+enum astlst_mode
+{
+    ASTLST_HOLD,      // No more than one child, held in the astlst.
+    ASTLST_IN_PLACE,  // Written straight into astman after a reserved header.
+    ASTLST_TMP_STACK, // Pushed on the temporary stack.
+};
+
+// Tracking for an AST ID list being built.
+//
+// Children are written in place, straight into astman after a header reserved
+// for the node, so finishing the list only has to fill in the header. That
+// only works while nothing else is allocated in astman. Once something is,
+// i.e. the list nests with the construction of other nodes, the list falls
+// back to collecting children on the temporary stack and copying them into
+// the node at the end, and the in-place entries so far go to waste. Lists
+// whose children are built between pushes, like a parser's, would waste a
+// little every time, so the first child is held back until the second push
+// shows whether anything was allocated in between.
 struct astlst
 {
-    uint16_t direct_count;
-    uint16_t sublist_count;
+    enum astlst_mode mode;
+    uint32_t child_count;
+
+    // First child and astman data_len at the time, in ASTLST_HOLD mode.
+    astid_t held;
+    uint32_t held_data_len;
+
+    // Index of reserved header, in ASTLST_IN_PLACE mode.
+    uint32_t header;
+
+    // Temporary stack position below the children, in ASTLST_TMP_STACK mode.
+    tmp_stack_mark_t mark;
 };
 
 // Initialize list.
@@ -18,25 +46,48 @@ static void astlst_init(struct astlst *astlst)
 {
     assert(astlst != NULL);
 
-    astlst->direct_count = 0;
-    astlst->sublist_count = 0;
+    astlst->mode = ASTLST_HOLD;
+    astlst->child_count = 0;
+    astlst->held = 0;
+    astlst->held_data_len = 0;
+    astlst->header = 0;
+    astlst->mark = 0;
 }
 
-// Convert all direct ID's to a sublist.
-static void _astlst_direct_to_sublist(
-    struct tgroup *tgroup,
-    uint16_t child_count)
+// Whether anything was allocated in astman since the last in-place child.
+static bool _astlst_interrupted(struct tgroup *tgroup, struct astlst *astlst)
 {
-    struct astman *astman = &tgroup->astman;
+    return
+        tgroup->astman.data_len != astlst->header + 1 + astlst->child_count;
+}
+
+// Switch to collecting children on the temporary stack.
+static void _astlst_fall_back(struct tgroup *tgroup, struct astlst *astlst)
+{
+    if (astlst->mode == ASTLST_TMP_STACK)
+    {
+        return;
+    }
+
     struct tmp_stack *tmp_stack = &tgroup->tmp_stack;
+    astlst->mark = tmp_stack_mark(tmp_stack);
 
-    size_t children_size = sizeof(astid_t) * child_count;
-    void *children = tmp_stack_end(tmp_stack) - children_size;
-    astid_t sublist = astman_alloc_node(astman, SYNCAT_SUBLIST, child_count, 0);
-    memcpy(astman->data + sublist, children, children_size);
-    tmp_stack_pop(tmp_stack, children_size);
+    if (astlst->mode == ASTLST_HOLD)
+    {
+        if (astlst->child_count > 0)
+        {
+            *TMP_STACK_ALLOC(tmp_stack, astid_t, 1) = astlst->held;
+        }
+    }
+    else if (astlst->mode == ASTLST_IN_PLACE)
+    {
+        memcpy(
+            TMP_STACK_ALLOC(tmp_stack, astid_t, astlst->child_count),
+            tgroup->astman.data + astlst->header + 1,
+            sizeof(astid_t) * astlst->child_count);
+    }
 
-    tmp_stack_push(tmp_stack, &sublist, sizeof(sublist));
+    astlst->mode = ASTLST_TMP_STACK;
 }
 
 // Push an ID.
@@ -48,36 +99,118 @@ static void astlst_push(
     assert(tgroup != NULL);
     assert(astlst != NULL);
 
-    // Increment direct ID count.
-    astlst->direct_count++;
-    if (astlst->direct_count == 0)
+    struct astman *astman = &tgroup->astman;
+
+    // Hold first child. On the second, go in place if nothing was
+    // allocated in between.
+    if (astlst->mode == ASTLST_HOLD)
     {
-        // Convert existing direct ID's to a sublist on
-        // uint16_t overflow before pushing the new ID.
-        astlst->direct_count = 1;
-        astlst->sublist_count++;
-        _astlst_direct_to_sublist(tgroup, UINT16_MAX);
+        if (astlst->child_count == 0)
+        {
+            astlst->held = astid;
+            astlst->held_data_len = astman->data_len;
+            astlst->child_count = 1;
+            return;
+        }
+
+        if (astman->data_len != astlst->held_data_len)
+        {
+            _astlst_fall_back(tgroup, astlst);
+        }
+        else
+        {
+            astlst->mode = ASTLST_IN_PLACE;
+            astlst->header = astman_extend(astman, 2);
+            astman->data[astlst->header + 1] = astlst->held;
+        }
     }
+    else if (
+        astlst->mode == ASTLST_IN_PLACE &&
+        _astlst_interrupted(tgroup, astlst))
+    {
+        _astlst_fall_back(tgroup, astlst);
+    }
+
+    if (astlst->child_count == UINT32_MAX)
+    {
+        translation_limit_exceeded();
+    }
+
+    astlst->child_count++;
 
     // Push the new ID.
-    tmp_stack_push(&tgroup->tmp_stack, &astid, sizeof(astid));
+    if (astlst->mode == ASTLST_IN_PLACE)
+    {
+        astman->data[astman_extend(astman, 1)] = astid;
+    }
+    else
+    {
+        *TMP_STACK_ALLOC(&tgroup->tmp_stack, astid_t, 1) = astid;
+    }
 }
 
-// Makes sure the total child count fits in uint16_t. Doesn't bother
-// to leave astlst in a meaningful state; stop using it after this.
-static uint16_t astlst_finalize(struct tgroup *tgroup, struct astlst *astlst)
+// Allocate node with the list's ID's as children and extra_count
+// uninitialized extra entries. Stop using the list after this.
+static astid_t astlst_finish(
+    struct tgroup *tgroup,
+    struct astlst *astlst,
+    enum syncat syncat,
+    uint32_t extra_count)
 {
     assert(tgroup != NULL);
     assert(astlst != NULL);
+    assert(syncat <= 0xFF);
+
+    struct astman *astman = &tgroup->astman;
+    struct tmp_stack *tmp_stack = &tgroup->tmp_stack;
+    uint32_t child_count = astlst->child_count;
 
-    uint32_t total = (uint32_t)astlst->direct_count + astlst->sublist_count;
-    if (total <= UINT16_MAX)
+    // Fill in the reserved header if the list is still intact in place.
+    if (astlst->mode == ASTLST_IN_PLACE &&
+        !_astlst_interrupted(tgroup, astlst))
     {
-        return (uint16_t)total;
+        // Wide nodes need a count entry before the header. Shift the children
+        // up one to make room. Rare enough that the copy doesn't matter.
+        uint32_t header = astlst->header;
+        uint32_t header_child_count = child_count;
+        if (child_count >= ASTMAN_WIDE_CHILD_COUNT)
+        {
+            astman_extend(astman, 1);
+            memmove(
+                astman->data + header + 2,
+                astman->data + header + 1,
+                sizeof(astid_t) * child_count);
+            astman->data[header++] = child_count;
+            header_child_count = ASTMAN_WIDE_CHILD_COUNT;
+        }
+
+        astman->data[header] = syncat | (header_child_count << 16);
+        astman_extend(astman, extra_count);
+        return header + 1;
     }
-    else
+    else if (astlst->mode == ASTLST_HOLD)
     {
-        _astlst_direct_to_sublist(tgroup, astlst->direct_count);
-        return astlst->sublist_count + 1;
+        astid_t astid =
+            astman_alloc_node(astman, syncat, child_count, extra_count);
+        if (child_count > 0)
+        {
+            astman->data[astid] = astlst->held;
+        }
+
+        return astid;
     }
+
+    _astlst_fall_back(tgroup, astlst);
+
+    // Copy children from the temporary stack.
+    size_t children_size = sizeof(astid_t) * child_count;
+    astid_t astid =
+        astman_alloc_node(astman, syncat, child_count, extra_count);
+    memcpy(
+        astman->data + astid,
+        tmp_stack_end(tmp_stack) - children_size,
+        children_size);
+    tmp_stack_rewind(tmp_stack, astlst->mark);
+
+    return astid;
 }
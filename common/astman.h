@@ -4,33 +4,52 @@
 
 #pragma once
 
-#include "alloc.h"
 #include "syncat.h"
+#include "vmem.h"
 
 // Abstract syntax tree manager.
 //
 // The abstract syntax tree is stored as an array of of uint32_t entries. Each
 // node is a contiguous sub-array of these entries. The first entry in each node
-// is its "header" which packs the node's syncat (syntactic category) and
-// child_count. After that are the 32-bit ID's of all its child nodes, followed
-// by optional extra 32-bit entries, the interpretation of which depends on the
-// syncat. For example, token nodes don't have any children, but their "extra"
-// entries include a starting srcloc_t, ending srcloc_t, and a spelling strid_t.
+// is its "header" which packs the node's syncat (syntactic category) in the low
+// 8 bits and child_count in the high 16 bits. Bits 8-15 are reserved. After
+// that are the 32-bit ID's of all its child nodes, followed by optional extra
+// 32-bit entries, the interpretation of which depends on the syncat. For
+// example, token nodes don't have any children, and their only "extra" entry
+// is the tokid_t of the token in tokman, which stores the token itself.
+//
+// "Wide" nodes with ASTMAN_WIDE_CHILD_COUNT or more children have
+// ASTMAN_WIDE_CHILD_COUNT in the header's child_count and a 32-bit count
+// entry right before the header. That way every node's children start right
+// after its header, so child i of any node is data[id + i].
+//
+// The data is reserved up front for the largest possible tree, so it never
+// moves, and pointers into it stay valid as nodes are allocated.
 struct astman
 {
     uint32_t data_len;
-    uint32_t data_capacity;
     uint32_t *data;
+    struct vmem_arr data_vmem;
+
+    // Most entries in use before any compaction. See astman_get_peak_len.
+    uint32_t compacted_peak_len;
 };
 
+// Header child_count of wide nodes, whose actual child count is in the entry
+// before the header.
+#define ASTMAN_WIDE_CHILD_COUNT 0xFFFF
+
 // Initialize abstract syntax tree manager.
 static void astman_init(struct astman *astman)
 {
     assert(astman != NULL);
 
     astman->data_len = 0;
-    astman->data_capacity = 0;
-    astman->data = NULL;
+    vmem_arr_init(
+        &astman->data_vmem, sizeof(uint32_t) * (size_t)UINT32_MAX,
+        MEM_TAG_ASTMAN);
+    astman->data = (uint32_t *)astman->data_vmem.data;
+    astman->compacted_peak_len = 0;
 }
 
 // Destroy abstract syntax tree manager.
@@ -38,51 +57,94 @@ static void astman_destroy(struct astman *astman)
 {
     assert(astman != NULL);
 
-    jocc_free(astman->data);
+    vmem_arr_destroy(&astman->data_vmem);
 }
 
-// Allocate abstract syntax tree node.
-static astid_t astman_alloc_node(
-    struct astman *astman,
-    enum syncat syncat,
-    uint16_t child_count,
-    uint32_t extra_count)
+// Commit memory for len entries up front, e.g. from an estimate of the input
+// size, so growing that far doesn't have to commit any more. Compaction
+// starts over with just what it keeps.
+static void astman_reserve(struct astman *astman, uint32_t len)
+{
+    assert(astman != NULL);
+
+    vmem_arr_ensure(&astman->data_vmem, sizeof(uint32_t) * (size_t)len);
+    astman->data = (uint32_t *)astman->data_vmem.data;
+}
+
+// Get the most entries astman data has held at once, as of the last
+// compaction or now, whichever is more.
+static uint32_t astman_get_peak_len(struct astman *astman)
+{
+    assert(astman != NULL);
+
+    return astman->data_len > astman->compacted_peak_len
+        ? astman->data_len
+        : astman->compacted_peak_len;
+}
+
+// Append count uninitialized entries to astman data. Returns index of first.
+static uint32_t astman_extend(struct astman *astman, uint32_t count)
 {
     assert(astman != NULL);
 
-    // Make sure header + child_count doesn't cause overflow.
+    // Check for overflow.
     uint32_t old_len = astman->data_len;
-    uint32_t tmp_len = old_len + 1 + child_count;
-    if (tmp_len <= old_len)
+    astman->data_len = old_len + count;
+    if (astman->data_len < old_len)
     {
         translation_limit_exceeded();
     }
 
-    // Make sure extra_count doesn't cause overflow.
-    astman->data_len = tmp_len + extra_count;
-    if (astman->data_len < tmp_len)
+    // Commit more memory if necessary.
+    vmem_arr_ensure(
+        &astman->data_vmem, sizeof(uint32_t) * (size_t)astman->data_len);
+    astman->data = (uint32_t *)astman->data_vmem.data;
+
+    return old_len;
+}
+
+// Free the last count entries of astman data, e.g. to drop a node that
+// turned out not to be needed. Pointers into the freed entries must not be
+// used afterwards.
+static void astman_pop(struct astman *astman, uint32_t count)
+{
+    assert(astman != NULL);
+    assert(count <= astman->data_len);
+
+    astman->data_len -= count;
+}
+
+// Allocate abstract syntax tree node.
+static astid_t astman_alloc_node(
+    struct astman *astman,
+    enum syncat syncat,
+    uint32_t child_count,
+    uint32_t extra_count)
+{
+    assert(astman != NULL);
+    assert(syncat <= 0xFF);
+
+    // Make sure count + header + child_count + extra_count
+    // doesn't cause overflow.
+    bool wide = child_count >= ASTMAN_WIDE_CHILD_COUNT;
+    uint64_t size = (uint64_t)wide + 1 + child_count + extra_count;
+    if (size > UINT32_MAX)
     {
         translation_limit_exceeded();
     }
 
-    // Re-allocate if necessary.
-    if (astman->data_capacity < astman->data_len)
+    // Initialize header, and count entry if wide.
+    uint32_t header = astman_extend(astman, (uint32_t)size);
+    if (wide)
     {
-        astman->data_capacity *= 2;
-        if (astman->data_capacity < astman->data_len)
-        {
-            astman->data_capacity = astman->data_len;
-        }
-
-        astman->data = REALLOC_ARRAY(
-            uint32_t, astman->data, astman->data_capacity);
+        astman->data[header++] = child_count;
+        child_count = ASTMAN_WIDE_CHILD_COUNT;
     }
 
-    // Initialize header.
-    astman->data[old_len] = syncat | ((uint32_t)child_count << 16);
+    astman->data[header] = syncat | (child_count << 16);
 
     // Return ID.
-    return old_len + 1;
+    return header + 1;
 }
 
 // Get abstract syntax tree node syntactic category.
@@ -92,15 +154,22 @@ static enum syncat astman_get_syncat(struct astman *astman, astid_t id)
     assert(id > 0);
     assert(id <= astman->data_len);
 
-    return astman->data[id - 1] & 0xFFFF;
+    return astman->data[id - 1] & 0xFF;
 }
 
 // Get abstract syntax tree node child count.
-static uint16_t astman_get_child_count(struct astman *astman, astid_t id)
+static uint32_t astman_get_child_count(struct astman *astman, astid_t id)
 {
     assert(astman != NULL);
     assert(id > 0);
     assert(id <= astman->data_len);
 
-    return astman->data[id - 1] >> 16;
+    uint32_t child_count = astman->data[id - 1] >> 16;
+    if (child_count == ASTMAN_WIDE_CHILD_COUNT)
+    {
+        assert(id > 1);
+        child_count = astman->data[id - 2];
+    }
+
+    return child_count;
 }
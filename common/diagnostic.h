@@ -4,7 +4,7 @@
 
 #pragma once
 
-#include "alloc.h"
+#include "dynarr.h"
 
 // Diagnostic severity.
 enum diag_severity
@@ -17,6 +17,27 @@ enum diag_severity
 enum diag_code
 {
     DIAG_CODE_ILLEGAL_BYTES,
+    DIAG_CODE_MACRO_NAME_EXPECTED,
+    DIAG_CODE_HEADER_NAME_EXPECTED,
+    DIAG_CODE_INCLUDE_NOT_FOUND,
+    DIAG_CODE_INCLUDE_NESTED_TOO_DEEPLY,
+    DIAG_CODE_UNTERMINATED_CONDITIONAL,
+    DIAG_CODE_UNMATCHED_CONDITIONAL_DIRECTIVE,
+    DIAG_CODE_DIRECTIVE_AFTER_ELSE,
+    DIAG_CODE_INVALID_DIRECTIVE,
+    DIAG_CODE_INVALID_MACRO_PARAMS,
+    DIAG_CODE_STRINGIZE_WITHOUT_PARAM,
+    DIAG_CODE_PASTE_AT_EDGE,
+    DIAG_CODE_INVALID_PASTE,
+    DIAG_CODE_UNTERMINATED_MACRO_CALL,
+    DIAG_CODE_MACRO_ARG_COUNT,
+    DIAG_CODE_MACRO_REDEFINED,
+    DIAG_CODE_INVALID_CONDITION,
+    DIAG_CODE_INVALID_INTEGER_CONSTANT,
+    DIAG_CODE_DIVISION_BY_ZERO,
+    DIAG_CODE_INVALID_LINE_DIRECTIVE,
+    DIAG_CODE_ERROR_DIRECTIVE,
+    DIAG_CODE_WARNING_DIRECTIVE,
 };
 
 // Diagnostic (e.g. error or warning).
@@ -54,7 +75,7 @@ static void diag_arr_init(struct diag_arr *arr)
 
     arr->len = 0;
     arr->capacity = 1;
-    arr->data = JOCC_ALLOC(struct diagnostic);
+    arr->data = JOCC_ALLOC(struct diagnostic, MEM_TAG_DIAG_ARR);
 }
 
 // Destroy diagnostic array.
@@ -83,16 +104,9 @@ static void diag_arr_add(
     assert(arr != NULL);
 
     // Re-allocate if necessary.
-    if (arr->capacity == arr->len)
-    {
-        if (arr->capacity > UINT32_MAX / 2)
-        {
-            translation_limit_exceeded();
-        }
-
-        arr->capacity *= 2;
-        arr->data = REALLOC_ARRAY(struct diagnostic, arr->data, arr->capacity);
-    }
+    DYNARR_GROW(
+        struct diagnostic, arr->data, arr->len, arr->capacity, 1,
+        MEM_TAG_DIAG_ARR);
 
     // Locate and initialize new element.
     uint32_t idx = arr->len++;
@@ -112,7 +126,7 @@ static void diag_arr_add(
     else
     {
         size_t line_text_size = strlen(line_text) + 1;
-        diag->line_text = ALLOC_ARRAY(char, line_text_size);
+        diag->line_text = ALLOC_ARRAY(char, line_text_size, MEM_TAG_DIAG_ARR);
         memcpy(diag->line_text, line_text, line_text_size);
     }
 }
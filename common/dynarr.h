@@ -0,0 +1,157 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "alloc.h"
+
+// Dynamic arrays.
+//
+// An owner keeps a typed pointer plus a uint32_t length and capacity, and
+// calls DYNARR_GROW before appending, so element access stays plain array
+// indexing. Growth policy lives here, in one place: capacity is multiplied by
+// the growth factor, a percentage, or raised to what's needed if that's more.
+// Every resize is counted in mem_usage, along with the bytes it moved, so the
+// effect of a different factor shows up in jocc --mem-report.
+
+// Default growth factor, in percent. Override with -DJOCC_ARRAY_GROWTH=...
+// in CMake or jocc --array-growth.
+#ifndef DYNARR_GROWTH_PERCENT
+#define DYNARR_GROWTH_PERCENT 200
+#endif
+
+static uint32_t _dynarr_growth_percent = DYNARR_GROWTH_PERCENT;
+
+// Set growth factor, in percent. Must be over 100.
+static void dynarr_set_growth(uint32_t percent)
+{
+    assert(percent > 100);
+
+    _dynarr_growth_percent = percent;
+}
+
+// Resize array to exactly capacity elements, of which the first len are in
+// use. Returns the possibly moved array.
+static void *_dynarr_resize(
+    void *data,
+    uint32_t len,
+    uint32_t capacity,
+    size_t element_size,
+    enum mem_tag tag)
+{
+    void *new_data = realloc_array(data, capacity, element_size, tag);
+
+    struct mem_usage *usage = &mem_usage[tag];
+    usage->array_resize_count++;
+    mem_usage_total.array_resize_count++;
+    if (data != NULL && new_data != data)
+    {
+        uint64_t copied = (uint64_t)len * element_size;
+        usage->array_copy_bytes += copied;
+        mem_usage_total.array_copy_bytes += copied;
+    }
+
+    return new_data;
+}
+
+// Make sure there's room for extra more elements after the first len,
+// growing capacity by the growth factor if not. data may be NULL if capacity
+// is 0. Returns the possibly moved array.
+static void *dynarr_grow(
+    void *data,
+    uint32_t len,
+    uint32_t *capacity,
+    uint32_t extra,
+    size_t element_size,
+    enum mem_tag tag)
+{
+    assert(capacity != NULL);
+    assert(len <= *capacity);
+
+    if (extra <= *capacity - len)
+    {
+        return data;
+    }
+
+    // Check for overflow.
+    if (extra > UINT32_MAX - len)
+    {
+        translation_limit_exceeded();
+    }
+
+    uint64_t new_capacity =
+        (uint64_t)*capacity * _dynarr_growth_percent / 100;
+    if (new_capacity < (uint64_t)len + extra)
+    {
+        new_capacity = (uint64_t)len + extra;
+    }
+
+    if (new_capacity > UINT32_MAX)
+    {
+        new_capacity = UINT32_MAX;
+    }
+
+    *capacity = (uint32_t)new_capacity;
+    return _dynarr_resize(data, len, *capacity, element_size, tag);
+}
+
+// Make sure capacity is at least new_capacity, growing it to exactly that
+// if not. Returns the possibly moved array.
+static void *dynarr_reserve(
+    void *data,
+    uint32_t len,
+    uint32_t *capacity,
+    uint32_t new_capacity,
+    size_t element_size,
+    enum mem_tag tag)
+{
+    assert(capacity != NULL);
+    assert(len <= *capacity);
+
+    if (new_capacity <= *capacity)
+    {
+        return data;
+    }
+
+    *capacity = new_capacity;
+    return _dynarr_resize(data, len, *capacity, element_size, tag);
+}
+
+// Shrink capacity to len, or 1 if empty, once an array is done growing.
+// Returns the possibly moved array.
+static void *dynarr_shrink(
+    void *data,
+    uint32_t len,
+    uint32_t *capacity,
+    size_t element_size,
+    enum mem_tag tag)
+{
+    assert(data != NULL);
+    assert(capacity != NULL);
+    assert(len <= *capacity);
+
+    uint32_t new_capacity = len > 0 ? len : 1;
+    if (new_capacity == *capacity)
+    {
+        return data;
+    }
+
+    *capacity = new_capacity;
+    return _dynarr_resize(data, len, *capacity, element_size, tag);
+}
+
+// Make sure an array of T has room for extra more elements after len.
+#define DYNARR_GROW(T, data, len, capacity, extra, tag) \
+    ((data) = (T *)ALLOC_TRACE_CALLER(dynarr_grow( \
+        data, len, &(capacity), extra, sizeof(T), tag)))
+
+// Make sure an array of T has capacity for at least new_capacity elements.
+#define DYNARR_RESERVE(T, data, len, capacity, new_capacity, tag) \
+    ((data) = (T *)ALLOC_TRACE_CALLER(dynarr_reserve( \
+        data, len, &(capacity), new_capacity, sizeof(T), tag)))
+
+// Shrink an array of T to fit its len elements.
+#define DYNARR_SHRINK(T, data, len, capacity, tag) \
+    ((data) = (T *)ALLOC_TRACE_CALLER( \
+        dynarr_shrink(data, len, &(capacity), sizeof(T), tag)))
@@ -6,14 +6,358 @@
 
 #include "prelude.h"
 
+// On x86-64 with GCC or Clang, also compile the AVX2 and AVX-512 variants
+// of XXH3's long-input loop so jocc_hash can pick one at runtime instead of
+// being stuck with whatever the compile flags allowed.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define HASH_X86_DISPATCH
+#define XXH_X86DISPATCH
+#define XXH_DISPATCH_AVX2 1
+#define XXH_DISPATCH_AVX512 1
+#define XXH_TARGET_AVX2 __attribute__((__target__("avx2")))
+#define XXH_TARGET_AVX512 __attribute__((__target__("avx512f")))
+#include <immintrin.h>
+#endif
+
 #define XXH_INLINE_ALL
 #include "xxhash.h"
 
 // Hash code.
 typedef XXH64_hash_t hash_t;
 
+// 128-bit hash code. For content fingerprints where collisions must be
+// practically impossible rather than just rare.
+typedef XXH128_hash_t hash128_t;
+
+// XXH3 long-input implementation.
+// Only affects inputs over 240 bytes; shorter ones don't use SIMD.
+enum hash_impl
+{
+    HASH_IMPL_DEFAULT, // Whatever the compile flags allow.
+    HASH_IMPL_AVX2,
+    HASH_IMPL_AVX512,
+    HASH_IMPL_COUNT,
+};
+
+// Human-readable hash_impl names.
+static const char *const hash_impl_names[HASH_IMPL_COUNT] = {
+    "default",
+    "avx2",
+    "avx512",
+};
+
+#ifdef HASH_X86_DISPATCH
+
+// AVX2 XXH3 long-input loop (64-bit).
+XXH_NO_INLINE XXH_TARGET_AVX2 XXH64_hash_t _hash_long64_avx2(
+    const void *XXH_RESTRICT input, size_t len, XXH64_hash_t seed,
+    const xxh_u8 *XXH_RESTRICT secret, size_t secret_len)
+{
+    (void)seed; (void)secret; (void)secret_len;
+    return XXH3_hashLong_64b_internal(
+        input, len, XXH3_kSecret, sizeof(XXH3_kSecret),
+        XXH3_accumulate_512_avx2, XXH3_scrambleAcc_avx2);
+}
+
+// AVX-512 XXH3 long-input loop (64-bit).
+XXH_NO_INLINE XXH_TARGET_AVX512 XXH64_hash_t _hash_long64_avx512(
+    const void *XXH_RESTRICT input, size_t len, XXH64_hash_t seed,
+    const xxh_u8 *XXH_RESTRICT secret, size_t secret_len)
+{
+    (void)seed; (void)secret; (void)secret_len;
+    return XXH3_hashLong_64b_internal(
+        input, len, XXH3_kSecret, sizeof(XXH3_kSecret),
+        XXH3_accumulate_512_avx512, XXH3_scrambleAcc_avx512);
+}
+
+// AVX2 XXH3 long-input loop (128-bit).
+XXH_NO_INLINE XXH_TARGET_AVX2 XXH128_hash_t _hash_long128_avx2(
+    const void *XXH_RESTRICT input, size_t len, XXH64_hash_t seed,
+    const void *XXH_RESTRICT secret, size_t secret_len)
+{
+    (void)seed; (void)secret; (void)secret_len;
+    return XXH3_hashLong_128b_internal(
+        input, len, XXH3_kSecret, sizeof(XXH3_kSecret),
+        XXH3_accumulate_512_avx2, XXH3_scrambleAcc_avx2);
+}
+
+// AVX-512 XXH3 long-input loop (128-bit).
+XXH_NO_INLINE XXH_TARGET_AVX512 XXH128_hash_t _hash_long128_avx512(
+    const void *XXH_RESTRICT input, size_t len, XXH64_hash_t seed,
+    const void *XXH_RESTRICT secret, size_t secret_len)
+{
+    (void)seed; (void)secret; (void)secret_len;
+    return XXH3_hashLong_128b_internal(
+        input, len, XXH3_kSecret, sizeof(XXH3_kSecret),
+        XXH3_accumulate_512_avx512, XXH3_scrambleAcc_avx512);
+}
+
+#endif
+
+// Whether the build and CPU support a hash_impl.
+static bool hash_impl_supported(enum hash_impl impl)
+{
+    assert(impl < HASH_IMPL_COUNT);
+
+    switch (impl)
+    {
+#ifdef HASH_X86_DISPATCH
+    case HASH_IMPL_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+
+    case HASH_IMPL_AVX512:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f");
+#endif
+
+    case HASH_IMPL_DEFAULT:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static XXH64_hash_t _hash_long64_resolve(
+    const void *XXH_RESTRICT, size_t, XXH64_hash_t,
+    const xxh_u8 *XXH_RESTRICT, size_t);
+
+static XXH128_hash_t _hash_long128_resolve(
+    const void *XXH_RESTRICT, size_t, XXH64_hash_t,
+    const void *XXH_RESTRICT, size_t);
+
+// Currently selected long-input loops. Start out pointing
+// at resolvers that pick the best hash_impl on first use.
+static enum hash_impl _hash_impl = HASH_IMPL_DEFAULT;
+static XXH3_hashLong64_f _hash_long64 = _hash_long64_resolve;
+static XXH3_hashLong128_f _hash_long128 = _hash_long128_resolve;
+
+// Select hash_impl. Results don't depend on which one is selected; this is
+// just for benchmarking. Returns false if the build or CPU doesn't support it.
+static bool hash_set_impl(enum hash_impl impl)
+{
+    if (!hash_impl_supported(impl))
+    {
+        return false;
+    }
+
+    _hash_impl = impl;
+    switch (impl)
+    {
+#ifdef HASH_X86_DISPATCH
+    case HASH_IMPL_AVX2:
+        _hash_long64 = _hash_long64_avx2;
+        _hash_long128 = _hash_long128_avx2;
+        break;
+
+    case HASH_IMPL_AVX512:
+        _hash_long64 = _hash_long64_avx512;
+        _hash_long128 = _hash_long128_avx512;
+        break;
+#endif
+
+    default:
+        _hash_long64 = XXH3_hashLong_64b_default;
+        _hash_long128 = XXH3_hashLong_128b_default;
+        break;
+    }
+
+    return true;
+}
+
+// Select the best supported hash_impl. Racing threads
+// all pick the same one, so there's no need to lock.
+static void _hash_select_best(void)
+{
+    if (!hash_set_impl(HASH_IMPL_AVX512) && !hash_set_impl(HASH_IMPL_AVX2))
+    {
+        hash_set_impl(HASH_IMPL_DEFAULT);
+    }
+}
+
+// Get selected hash_impl.
+static enum hash_impl hash_get_impl(void)
+{
+    // Make sure the resolvers have run.
+    if (_hash_long64 == _hash_long64_resolve)
+    {
+        _hash_select_best();
+    }
+
+    return _hash_impl;
+}
+
+// First-use resolver for _hash_long64.
+static XXH64_hash_t _hash_long64_resolve(
+    const void *XXH_RESTRICT input, size_t len, XXH64_hash_t seed,
+    const xxh_u8 *XXH_RESTRICT secret, size_t secret_len)
+{
+    _hash_select_best();
+    return _hash_long64(input, len, seed, secret, secret_len);
+}
+
+// First-use resolver for _hash_long128.
+static XXH128_hash_t _hash_long128_resolve(
+    const void *XXH_RESTRICT input, size_t len, XXH64_hash_t seed,
+    const void *XXH_RESTRICT secret, size_t secret_len)
+{
+    _hash_select_best();
+    return _hash_long128(input, len, seed, secret, secret_len);
+}
+
 // Calculate hash code.
 static hash_t jocc_hash(const void *data, size_t size)
 {
-    return XXH3_64bits(data, size);
+    return XXH3_64bits_internal(
+        data, size, 0, XXH3_kSecret, sizeof(XXH3_kSecret), _hash_long64);
+}
+
+// Calculate 128-bit hash code.
+static hash128_t jocc_hash128(const void *data, size_t size)
+{
+    return XXH3_128bits_internal(
+        data, size, 0, XXH3_kSecret, sizeof(XXH3_kSecret), _hash_long128);
+}
+
+// Incremental hash state, for data that isn't contiguous in memory.
+typedef XXH3_state_t hash_state_t;
+
+// Start incremental hash.
+static void jocc_hash_reset(hash_state_t *state)
+{
+    assert(state != NULL);
+
+    XXH3_64bits_reset(state);
+}
+
+// Add data to incremental hash.
+static void jocc_hash_update(
+    hash_state_t *state,
+    const void *data,
+    size_t size)
+{
+    assert(state != NULL);
+    assert(data != NULL || size == 0);
+
+    XXH3_64bits_update(state, data, size);
+}
+
+// Get incremental hash code. Same as jocc_hash of all the data at once.
+static hash_t jocc_hash_digest(const hash_state_t *state)
+{
+    assert(state != NULL);
+
+    return XXH3_64bits_digest(state);
+}
+
+// Calculate hash code of a key under 16 bytes, like a few packed 32-bit ID's.
+// A single 64x64->128-bit multiply-fold, skipping XXH3's length dispatch and
+// final avalanche. Good enough for hash table indexing, and cheaper than
+// jocc_hash for such keys, but produces different results.
+static hash_t jocc_hash_small(const void *data, size_t size)
+{
+    assert(data != NULL || size == 0);
+    assert(size < 16);
+
+    const unsigned char *bytes = data;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    if (size >= 8)
+    {
+        memcpy(&lo, bytes, 8);
+        memcpy(&hi, bytes + size - 8, 8);
+    }
+    else if (size >= 4)
+    {
+        uint32_t lo32, hi32;
+        memcpy(&lo32, bytes, 4);
+        memcpy(&hi32, bytes + size - 4, 4);
+        lo = lo32;
+        hi = hi32;
+    }
+    else if (size > 0)
+    {
+        lo = bytes[0] | ((uint32_t)bytes[size / 2] << 8) |
+            ((uint32_t)bytes[size - 1] << 16);
+    }
+
+    return XXH3_mul128_fold64(
+        lo ^ XXH_PRIME64_1, hi ^ (XXH_PRIME64_2 + size));
+}
+
+// Longest string str_hash hashes a byte at a time. Longer strings fall back to
+// jocc_hash over the complete string once its length is known.
+#define STR_HASH_ROLLING_MAX 32
+
+// Incremental string hash.
+// Lets producers like the lexer hash short strings as they consume them
+// instead of re-reading them afterwards. Use jocc_str_hash to get the
+// same result for a string that's already complete.
+struct str_hash
+{
+    uint32_t state;
+    uint32_t len;
+};
+
+// Initialize incremental string hash.
+static void str_hash_init(struct str_hash *h)
+{
+    assert(h != NULL);
+
+    h->state = UINT32_C(2166136261); // FNV-1a offset basis.
+    h->len = 0;
+}
+
+// Feed bytes to incremental string hash.
+static void str_hash_bytes(struct str_hash *h, const void *data, size_t size)
+{
+    assert(h != NULL);
+    assert(data != NULL || size == 0);
+
+    // Stop bothering once we know we'll fall back to jocc_hash.
+    const unsigned char *bytes = data;
+    if (h->len + size <= STR_HASH_ROLLING_MAX)
+    {
+        uint32_t state = h->state;
+        for (size_t i = 0; i < size; i++)
+        {
+            state = (state ^ bytes[i]) * UINT32_C(16777619); // FNV-1a prime.
+        }
+        h->state = state;
+    }
+
+    h->len += (uint32_t)size;
+}
+
+// Finish incremental string hash. string must point to all the bytes fed to
+// str_hash_bytes, but it's only read if they didn't fit STR_HASH_ROLLING_MAX.
+static uint32_t str_hash_finish(const struct str_hash *h, const void *string)
+{
+    assert(h != NULL);
+
+    if (h->len > STR_HASH_ROLLING_MAX)
+    {
+        assert(string != NULL);
+        return (uint32_t)jocc_hash(string, h->len);
+    }
+
+    // FNV-1a mixes poorly into the low bits hash tables mask
+    // with, so finish with the MurmurHash3 finalizer.
+    uint32_t x = h->state ^ h->len;
+    x ^= x >> 16;
+    x *= UINT32_C(0x85EBCA6B);
+    x ^= x >> 13;
+    x *= UINT32_C(0xC2B2AE35);
+    x ^= x >> 16;
+    return x;
+}
+
+// Calculate string hash code. Same result as the incremental str_hash.
+static uint32_t jocc_str_hash(const void *string, size_t len)
+{
+    struct str_hash h;
+    str_hash_init(&h);
+    str_hash_bytes(&h, string, len);
+    return str_hash_finish(&h, string);
 }
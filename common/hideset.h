@@ -0,0 +1,409 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "dynarr.h"
+#include "strman.h"
+
+// Hide-set ID. Index into hideset_table sets. 0 is the empty set.
+typedef uint32_t hideset_t;
+
+// Size of the operation cache. Must be a power of two.
+#define HIDESET_MEMO_SIZE 1024
+
+// Hide-set: the names of the macros a token came out of, which must not be
+// expanded again if the token names one of them.
+struct hideset
+{
+    // Sorted members, in hideset_table members.
+    uint32_t first;
+    uint32_t count;
+};
+
+// Hide-set operations that get cached.
+enum hideset_op
+{
+    HIDESET_OP_ADD = 1,
+    HIDESET_OP_UNION,
+    HIDESET_OP_INTERSECT,
+};
+
+// Cached result of a hide-set operation.
+struct hideset_memo
+{
+    uint32_t op;
+    uint32_t a;
+    uint32_t b;
+    hideset_t result;
+};
+
+// Hide-set table.
+//
+// Sets are interned, so each token carries a single 32-bit ID instead of a
+// list of names, equal sets have equal ID's, and the same handful of sets
+// that expanding a macro produces over and over are only stored once.
+// Operations on them go through a small direct-mapped cache, since macro
+// expansion repeats the same few with the same operands.
+struct hideset_table
+{
+    // sets[0] is the empty set.
+    uint32_t set_count;
+    uint32_t set_capacity;
+    struct hideset *sets;
+
+    // Members of every set, back to back.
+    uint32_t member_count;
+    uint32_t member_capacity;
+    strid_t *members;
+
+    // Hash set of the ID's of all nonempty sets, by members.
+    uint32_t slot_capacity; // Must be a power of two.
+    hideset_t *slots;
+
+    struct hideset_memo memo[HIDESET_MEMO_SIZE];
+};
+
+// Initialize hide-set table.
+static void hideset_table_init(struct hideset_table *table)
+{
+    assert(table != NULL);
+
+    table->set_count = 1;
+    table->set_capacity = 1;
+    table->sets = JOCC_ALLOC(struct hideset, MEM_TAG_PREPROCESSOR);
+    table->sets[0].first = 0;
+    table->sets[0].count = 0;
+
+    table->member_count = 0;
+    table->member_capacity = 0;
+    table->members = NULL;
+
+    table->slot_capacity = 16;
+    table->slots = ZALLOC_ARRAY(
+        hideset_t, table->slot_capacity, MEM_TAG_PREPROCESSOR);
+
+    memset(table->memo, 0, sizeof(table->memo));
+}
+
+// Destroy hide-set table.
+static void hideset_table_destroy(struct hideset_table *table)
+{
+    assert(table != NULL);
+
+    jocc_free(table->slots);
+    jocc_free(table->members);
+    jocc_free(table->sets);
+}
+
+// Hash count members.
+static uint32_t _hideset_hash(const strid_t *members, uint32_t count)
+{
+    return (uint32_t)jocc_hash(members, sizeof(strid_t) * count);
+}
+
+// Find the slot for a set with the given members: the one holding its ID,
+// or the empty slot where it would go.
+static hideset_t *_hideset_find(
+    struct hideset_table *table,
+    const strid_t *members,
+    uint32_t count)
+{
+    uint32_t mask = table->slot_capacity - 1;
+    uint32_t hash = _hideset_hash(members, count);
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        hideset_t *slot = &table->slots[i];
+        if (*slot == 0)
+        {
+            return slot;
+        }
+
+        const struct hideset *set = &table->sets[*slot];
+        if (set->count == count &&
+            memcmp(
+                table->members + set->first, members,
+                sizeof(strid_t) * count) == 0)
+        {
+            return slot;
+        }
+    }
+}
+
+// Intern the count members just written past the end of members.
+// They're dropped again if the set already exists.
+static hideset_t _hideset_intern(struct hideset_table *table, uint32_t count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    uint32_t first = table->member_count;
+    hideset_t *slot = _hideset_find(table, table->members + first, count);
+    if (*slot != 0)
+    {
+        return *slot;
+    }
+
+    // Add set.
+    DYNARR_GROW(
+        struct hideset, table->sets, table->set_count, table->set_capacity, 1,
+        MEM_TAG_PREPROCESSOR);
+
+    hideset_t id = table->set_count++;
+    table->sets[id].first = first;
+    table->sets[id].count = count;
+    table->member_count = first + count;
+    *slot = id;
+
+    // Keep the hash set at most half full.
+    if (table->set_count > table->slot_capacity / 2)
+    {
+        if (table->slot_capacity > UINT32_MAX / 2)
+        {
+            translation_limit_exceeded();
+        }
+
+        jocc_free(table->slots);
+        table->slot_capacity *= 2;
+        table->slots = ZALLOC_ARRAY(
+            hideset_t, table->slot_capacity, MEM_TAG_PREPROCESSOR);
+
+        for (hideset_t i = 1; i < table->set_count; i++)
+        {
+            const struct hideset *set = &table->sets[i];
+            *_hideset_find(
+                table, table->members + set->first, set->count) = i;
+        }
+    }
+
+    return id;
+}
+
+// Get cache entry for an operation.
+static struct hideset_memo *_hideset_memo(
+    struct hideset_table *table,
+    enum hideset_op op,
+    uint32_t a,
+    uint32_t b)
+{
+    uint32_t key[3] = {op, a, b};
+    uint32_t hash = (uint32_t)jocc_hash_small(key, sizeof(key));
+    return &table->memo[hash & (HIDESET_MEMO_SIZE - 1)];
+}
+
+// Merge two sets into a new one: their union, or their intersection.
+static hideset_t _hideset_merge(
+    struct hideset_table *table,
+    hideset_t a,
+    hideset_t b,
+    bool intersect)
+{
+    struct hideset set_a = table->sets[a];
+    struct hideset set_b = table->sets[b];
+
+    // Write the result past the end of members for _hideset_intern.
+    DYNARR_GROW(
+        strid_t, table->members, table->member_count, table->member_capacity,
+        set_a.count + set_b.count, MEM_TAG_PREPROCESSOR);
+
+    const strid_t *members_a = table->members + set_a.first;
+    const strid_t *members_b = table->members + set_b.first;
+    strid_t *out = table->members + table->member_count;
+    uint32_t i = 0;
+    uint32_t j = 0;
+    uint32_t count = 0;
+    while (i < set_a.count && j < set_b.count)
+    {
+        if (members_a[i] < members_b[j])
+        {
+            if (!intersect)
+            {
+                out[count++] = members_a[i];
+            }
+
+            i++;
+        }
+        else if (members_b[j] < members_a[i])
+        {
+            if (!intersect)
+            {
+                out[count++] = members_b[j];
+            }
+
+            j++;
+        }
+        else
+        {
+            out[count++] = members_a[i];
+            i++;
+            j++;
+        }
+    }
+
+    if (!intersect)
+    {
+        for (; i < set_a.count; i++)
+        {
+            out[count++] = members_a[i];
+        }
+
+        for (; j < set_b.count; j++)
+        {
+            out[count++] = members_b[j];
+        }
+    }
+
+    return _hideset_intern(table, count);
+}
+
+// Whether a set contains a name.
+static bool hideset_contains(
+    struct hideset_table *table,
+    hideset_t id,
+    strid_t name)
+{
+    assert(table != NULL);
+    assert(id < table->set_count);
+
+    if (id == 0)
+    {
+        return false;
+    }
+
+    // Binary search. Sets are rarely more than a few names.
+    const struct hideset *set = &table->sets[id];
+    const strid_t *members = table->members + set->first;
+    uint32_t low = 0;
+    uint32_t high = set->count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (members[mid] < name)
+        {
+            low = mid + 1;
+        }
+        else if (members[mid] > name)
+        {
+            high = mid;
+        }
+        else
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Get a set plus one name.
+static hideset_t hideset_add(
+    struct hideset_table *table,
+    hideset_t id,
+    strid_t name)
+{
+    assert(table != NULL);
+    assert(id < table->set_count);
+    assert(name != 0);
+
+    struct hideset_memo *memo = _hideset_memo(table, HIDESET_OP_ADD, id, name);
+    if (memo->op == HIDESET_OP_ADD && memo->a == id && memo->b == name)
+    {
+        return memo->result;
+    }
+
+    // Insert name in order, past the end of members for _hideset_intern.
+    uint32_t count = table->sets[id].count;
+    DYNARR_GROW(
+        strid_t, table->members, table->member_count, table->member_capacity,
+        count + 1, MEM_TAG_PREPROCESSOR);
+
+    const strid_t *members = table->members + table->sets[id].first;
+    strid_t *out = table->members + table->member_count;
+    uint32_t i = 0;
+    for (; i < count && members[i] < name; i++)
+    {
+        out[i] = members[i];
+    }
+
+    hideset_t result = id;
+    if (i == count || members[i] != name)
+    {
+        out[i] = name;
+        memcpy(out + i + 1, members + i, sizeof(strid_t) * (count - i));
+        result = _hideset_intern(table, count + 1);
+    }
+
+    memo->op = HIDESET_OP_ADD;
+    memo->a = id;
+    memo->b = name;
+    memo->result = result;
+    return result;
+}
+
+// Get the union of two sets.
+static hideset_t hideset_union(
+    struct hideset_table *table,
+    hideset_t a,
+    hideset_t b)
+{
+    assert(table != NULL);
+    assert(a < table->set_count);
+    assert(b < table->set_count);
+
+    if (a == b || b == 0)
+    {
+        return a;
+    }
+
+    if (a == 0)
+    {
+        return b;
+    }
+
+    struct hideset_memo *memo = _hideset_memo(table, HIDESET_OP_UNION, a, b);
+    if (memo->op != HIDESET_OP_UNION || memo->a != a || memo->b != b)
+    {
+        memo->op = HIDESET_OP_UNION;
+        memo->a = a;
+        memo->b = b;
+        memo->result = _hideset_merge(table, a, b, false);
+    }
+
+    return memo->result;
+}
+
+// Get the intersection of two sets.
+static hideset_t hideset_intersect(
+    struct hideset_table *table,
+    hideset_t a,
+    hideset_t b)
+{
+    assert(table != NULL);
+    assert(a < table->set_count);
+    assert(b < table->set_count);
+
+    if (a == b || b == 0)
+    {
+        return b;
+    }
+
+    if (a == 0)
+    {
+        return 0;
+    }
+
+    struct hideset_memo *memo =
+        _hideset_memo(table, HIDESET_OP_INTERSECT, a, b);
+    if (memo->op != HIDESET_OP_INTERSECT || memo->a != a || memo->b != b)
+    {
+        memo->op = HIDESET_OP_INTERSECT;
+        memo->a = a;
+        memo->b = b;
+        memo->result = _hideset_merge(table, a, b, true);
+    }
+
+    return memo->result;
+}
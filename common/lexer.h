@@ -13,23 +13,22 @@ struct lexeme
     enum syncat syncat;
 
     // Token spelling without line splices.
-    // 0 for non-tokens (EOF, EOL, white-space, etc).
+    // 0 for punctuators and non-tokens (EOF, EOL, white-space, etc).
     strid_t spelling;
 };
 
 // Lexer. One for each file the preprocessor ends up processing.
 //
-// Make sure to call lexer_begin_line before each logical line. The lexer itself
-// calls lexer_begin_line for newlines in block comments and line splices. 
-//
-// Otherwise, call lexer_next to get each lexeme until it returns SYNCAT_EOF.
+// Call lexer_next to get each lexeme until it returns SYNCAT_EOF. Lines are
+// added to srcman separately; see srcman_add_phys_lines.
 struct lexer
 {
     struct tgroup *tgroup;
     const char *pos;
     const char *eof;
-    pres_file_id_t pres_file_id;
-    uint32_t line_num_offset;
+
+    // Hash of the spelling bytes pushed to tmp_stack so far.
+    struct str_hash spelling_hash;
 };
 
 // Initialize lexer.
@@ -37,8 +36,7 @@ static void lexer_init(
     struct lexer *lexer,
     struct tgroup *tgroup,
     const char *file_data,
-    uint32_t file_size,
-    pres_file_id_t pres_file_id)
+    uint32_t file_size)
 {
     assert(lexer != NULL);
     assert(tgroup != NULL);
@@ -48,16 +46,7 @@ static void lexer_init(
     lexer->tgroup = tgroup;
     lexer->pos = file_data;
     lexer->eof = file_data + file_size;
-    lexer->pres_file_id = pres_file_id;
-    lexer->line_num_offset = 0;
-}
-
-// Begin line.
-static void lexer_begin_line(struct lexer *lexer)
-{
-    srcman_add_line(
-        &lexer->tgroup->srcman, lexer->tgroup->srcloc,
-        lexer->pres_file_id, lexer->line_num_offset);
+    str_hash_init(&lexer->spelling_hash);
 }
 
 // Decode UTF-8 with checks for control characters.
@@ -124,9 +113,6 @@ static void _lexer_consume_line_splices(struct lexer *lexer)
         {
             _lexer_consume_byte(lexer);
         }
-
-        lexer->line_num_offset++;
-        lexer_begin_line(lexer);
     }
 }
 
@@ -147,6 +133,7 @@ static char _lexer_consume_peek(struct lexer *lexer)
 static char _lexer_include_byte(struct lexer *lexer)
 {
     tmp_stack_push(&lexer->tgroup->tmp_stack, lexer->pos, 1);
+    str_hash_bytes(&lexer->spelling_hash, lexer->pos, 1);
     return _lexer_consume_byte(lexer);
 }
 
@@ -154,6 +141,7 @@ static char _lexer_include_byte(struct lexer *lexer)
 static void _lexer_include_bytes(struct lexer *lexer, int size)
 {
     tmp_stack_push(&lexer->tgroup->tmp_stack, lexer->pos, (size_t)size);
+    str_hash_bytes(&lexer->spelling_hash, lexer->pos, (size_t)size);
     _lexer_consume_bytes(lexer, size);
 }
 
@@ -163,6 +151,7 @@ static char _lexer_include_peek(struct lexer *lexer)
 {
     char c = _lexer_consume_peek(lexer);
     tmp_stack_push(&lexer->tgroup->tmp_stack, &c, sizeof(c));
+    str_hash_bytes(&lexer->spelling_hash, &c, sizeof(c));
     return c;
 }
 
@@ -324,8 +313,11 @@ static struct lexeme lexer_next(struct lexer *lexer)
 
     // Save initial tmp_stack position. If we're lexing a token, individual
     // characters (excluding line splices) will get pushed to the tmp_stack
-    // so we can generate a spelling strid_t at the end.
-    size_t spelling_start = lexer->tgroup->tmp_stack.size;
+    // so we can generate a spelling strid_t at the end. They're hashed as
+    // they're pushed so strman doesn't have to read them a second time.
+    tmp_stack_mark_t spelling_start =
+        tmp_stack_mark(&lexer->tgroup->tmp_stack);
+    str_hash_init(&lexer->spelling_hash);
 
     // Determine syntactic category and consume characters.
     enum syncat syncat;
@@ -342,22 +334,18 @@ static struct lexeme lexer_next(struct lexer *lexer)
         break;
 
     case '\n':
-        // Consume LF. It's up to the caller to
-        // invoke lexer_begin_line when it's ready.
+        // Consume LF.
         _lexer_consume_byte(lexer);
-        lexer->line_num_offset++;
         syncat = SYNCAT_EOL;
         break;
 
     case '\r':
-        // Consume CR or CRLF. It's up to the caller
-        // to invoke lexer_begin_line when it's ready.
+        // Consume CR or CRLF.
         _lexer_consume_byte(lexer);
         if (*lexer->pos == '\n')
         {
             _lexer_consume_byte(lexer);
         }
-        lexer->line_num_offset++;
         syncat = SYNCAT_EOL;
         break;
 
@@ -552,8 +540,6 @@ static struct lexeme lexer_next(struct lexer *lexer)
                         {
                             _lexer_consume_byte(lexer);
                         }
-                        lexer->line_num_offset++;
-                        lexer_begin_line(lexer);
                         continue;
                     }
 
@@ -783,11 +769,6 @@ static struct lexeme lexer_next(struct lexer *lexer)
             {
                 _lexer_consume_byte(lexer);
             }
-
-            // We're responsible for calling lexer_begin_line on line splices,
-            // unlike logical EOL's where the caller is responsible.
-            lexer->line_num_offset++;
-            lexer_begin_line(lexer);
             syncat = SYNCAT_LINE_SPLICE;
         }
         else
@@ -825,11 +806,21 @@ static struct lexeme lexer_next(struct lexer *lexer)
     }
 
     // Generate spelling strid_t from characters pushed to tmp_stack.
+    // Punctuators don't need one; syncat_punctuator_spelling has it.
     struct tmp_stack *tmp_stack = &lexer->tgroup->tmp_stack;
     char *string = (char *)(tmp_stack->data + spelling_start);
     uint32_t len = (uint32_t)(tmp_stack->size - spelling_start);
-    strid_t spelling = strman_get_id(&lexer->tgroup->strman, string, len);
-    tmp_stack_pop(tmp_stack, len);
+    if (syncat_is_punctuator(syncat))
+    {
+        tmp_stack_rewind(tmp_stack, spelling_start);
+        return (struct lexeme){syncat, 0};
+    }
+
+    assert(len == lexer->spelling_hash.len);
+    uint32_t hash = str_hash_finish(&lexer->spelling_hash, string);
+    strid_t spelling = strman_get_id_hashed(
+        &lexer->tgroup->strman, string, len, hash);
+    tmp_stack_rewind(tmp_stack, spelling_start);
 
     // Done.
     return (struct lexeme){syncat, spelling};
@@ -0,0 +1,442 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "dynarr.h"
+#include "tokman.h"
+
+// Macro ID. Index into macro_table macros. 0 is reserved for null.
+typedef uint32_t macro_id_t;
+
+// How a replacement list token gets substituted.
+enum macro_token_kind
+{
+    MACRO_TOKEN_COPY,      // Copied as-is.
+    MACRO_TOKEN_ARG,       // Parameter. Replaced by the expanded argument.
+    MACRO_TOKEN_RAW_ARG,   // Parameter next to ##. Replaced by the argument.
+    MACRO_TOKEN_STRINGIZE, // # parameter. Replaced by the argument spelled
+                           // as a string literal.
+    MACRO_TOKEN_PASTE,     // ##
+};
+
+// Replacement list token.
+struct macro_token
+{
+    // The token itself. The # for MACRO_TOKEN_STRINGIZE.
+    tokid_t id;
+
+    // Parameter index, if it's a parameter.
+    uint16_t param;
+
+    uint8_t kind; // enum macro_token_kind
+};
+
+// Macro definition.
+struct macro
+{
+    strid_t name;
+
+    // SYNCAT_DEFINE_DIRECTIVE node.
+    astid_t definition;
+
+    bool function_like;
+    bool variadic; // Last parameter is __VA_ARGS__.
+    uint16_t param_count;
+
+    // Parameter names. See macro_table_get_params.
+    uint32_t params_first;
+
+    // Replacement list. See macro_table_get_body.
+    uint32_t body_first;
+    uint32_t body_count;
+};
+
+// Bits of a strid_t that index into a leaf of the macro table.
+#define MACRO_TABLE_LEAF_BITS 8
+#define MACRO_TABLE_LEAF_SIZE (UINT32_C(1) << MACRO_TABLE_LEAF_BITS)
+
+// Macro table.
+//
+// Maps macro names to definitions by strid_t directly, with no hashing or
+// probing: the high bits of a name pick a leaf, the low bits an entry in it.
+// Leaves are only allocated once a name in their range gets defined, since
+// strid_t's are string data offsets and most strings aren't macro names.
+//
+// Definitions are parsed once, when they're made, so expanding a macro never
+// has to look at its #define again. They're never freed before the table is;
+// #undef and redefinition just point the name somewhere else.
+//
+// Optionally layered on top of a read-only base table, e.g. the macros a
+// prelude ended with. Base macros keep their ID's, parameters and replacement
+// lists, and new ones get ID's and indexes past the end of the base's. Leaves
+// are copied from the base the first time a name in their range gets
+// defined or undefined, and looked up in the base until then, so starting
+// from a base doesn't copy anything and a file only pays for what it
+// changes.
+struct macro_table
+{
+    // Macro ID's by name, MACRO_TABLE_LEAF_SIZE names per leaf. NULL for
+    // leaves that were never written to, which are the base's if there is
+    // one. 0 if not defined.
+    uint32_t leaf_count;
+    uint32_t leaf_capacity;
+    macro_id_t **leaves;
+
+    // Definitions made in this table, from ID base_macro_count on.
+    // ID 0 is null, and is macros[0] if there's no base.
+    uint32_t macro_count; // Including the base's.
+    uint32_t macro_capacity;
+    struct macro *macros;
+
+    // Parameter names of definitions made in this table, back to back,
+    // from index base_params_len on.
+    uint32_t params_len; // Including the base's.
+    uint32_t params_capacity;
+    strid_t *params;
+
+    // Replacement lists of definitions made in this table, back to back,
+    // from index base_body_len on.
+    uint32_t body_len; // Including the base's.
+    uint32_t body_capacity;
+    struct macro_token *body;
+
+    // Read-only base layer. Not owned. NULL unless macro_table_set_base is
+    // used.
+    const struct macro_table *base;
+    uint32_t base_macro_count;
+    uint32_t base_params_len;
+    uint32_t base_body_len;
+};
+
+// Initialize macro table.
+static void macro_table_init(struct macro_table *table)
+{
+    assert(table != NULL);
+
+    table->leaf_count = 0;
+    table->leaf_capacity = 0;
+    table->leaves = NULL;
+
+    table->macro_count = 1;
+    table->macro_capacity = 1;
+    table->macros = JOCC_ZALLOC(struct macro, MEM_TAG_MACRO_TABLE);
+
+    table->params_len = 0;
+    table->params_capacity = 0;
+    table->params = NULL;
+
+    table->body_len = 0;
+    table->body_capacity = 0;
+    table->body = NULL;
+
+    table->base = NULL;
+    table->base_macro_count = 0;
+    table->base_params_len = 0;
+    table->base_body_len = 0;
+}
+
+// Destroy macro table.
+// Doesn't touch the base layer; that's up to whoever made it.
+static void macro_table_destroy(struct macro_table *table)
+{
+    assert(table != NULL);
+
+    for (uint32_t i = 0; i < table->leaf_count; i++)
+    {
+        jocc_free(table->leaves[i]);
+    }
+
+    jocc_free(table->leaves);
+    jocc_free(table->macros);
+    jocc_free(table->params);
+    jocc_free(table->body);
+}
+
+// Use a table as the read-only base layer of an empty one, which then has
+// every macro the base has without copying any of them. The base must not
+// change or be destroyed while any table uses it, but any number can use
+// it at once, from any number of threads. It can't have a base itself.
+static void macro_table_set_base(
+    struct macro_table *table,
+    const struct macro_table *base)
+{
+    assert(table != NULL);
+    assert(table->base == NULL);
+    assert(table->leaf_count == 0);
+    assert(table->macro_count == 1);
+    assert(table->params_len == 0);
+    assert(table->body_len == 0);
+    assert(base != NULL);
+    assert(base->base == NULL);
+
+    // The base has the null macro too, so macros starts empty.
+    table->base = base;
+    table->base_macro_count = base->macro_count;
+    table->base_params_len = base->params_len;
+    table->base_body_len = base->body_len;
+    table->macro_count = base->macro_count;
+    table->params_len = base->params_len;
+    table->body_len = base->body_len;
+}
+
+// Get ID of the macro a name is defined as. 0 if not defined.
+static macro_id_t macro_table_get(
+    const struct macro_table *table,
+    strid_t name)
+{
+    assert(table != NULL);
+    assert(name != 0);
+
+    uint32_t leaf = name >> MACRO_TABLE_LEAF_BITS;
+    uint32_t i = name & (MACRO_TABLE_LEAF_SIZE - 1);
+    if (leaf < table->leaf_count && table->leaves[leaf] != NULL)
+    {
+        return table->leaves[leaf][i];
+    }
+
+    const struct macro_table *base = table->base;
+    if (base != NULL && leaf < base->leaf_count && base->leaves[leaf] != NULL)
+    {
+        return base->leaves[leaf][i];
+    }
+
+    return 0;
+}
+
+// Get macro by ID. Valid until the next definition.
+static const struct macro *macro_table_get_macro(
+    const struct macro_table *table,
+    macro_id_t id)
+{
+    assert(table != NULL);
+    assert(id > 0);
+    assert(id < table->macro_count);
+
+    if (id < table->base_macro_count)
+    {
+        return &table->base->macros[id];
+    }
+
+    return &table->macros[id - table->base_macro_count];
+}
+
+// Get a macro's parameter names, macro->param_count of them. Valid until the
+// next definition.
+static const strid_t *macro_table_get_params(
+    const struct macro_table *table,
+    const struct macro *macro)
+{
+    assert(table != NULL);
+    assert(macro != NULL);
+
+    if (macro->param_count == 0)
+    {
+        return NULL;
+    }
+
+    if (macro->params_first < table->base_params_len)
+    {
+        return table->base->params + macro->params_first;
+    }
+
+    return table->params + (macro->params_first - table->base_params_len);
+}
+
+// Get a macro's replacement list, macro->body_count tokens. Valid until the
+// next definition.
+static const struct macro_token *macro_table_get_body(
+    const struct macro_table *table,
+    const struct macro *macro)
+{
+    assert(table != NULL);
+    assert(macro != NULL);
+
+    if (macro->body_count == 0)
+    {
+        return NULL;
+    }
+
+    if (macro->body_first < table->base_body_len)
+    {
+        return table->base->body + macro->body_first;
+    }
+
+    return table->body + (macro->body_first - table->base_body_len);
+}
+
+// Point a name at a macro ID. 0 to undefine.
+static void _macro_table_set(
+    struct macro_table *table,
+    strid_t name,
+    macro_id_t id)
+{
+    // Don't bother adding leaves just to undefine things that aren't
+    // defined.
+    if (id == 0 && macro_table_get(table, name) == 0)
+    {
+        return;
+    }
+
+    uint32_t leaf = name >> MACRO_TABLE_LEAF_BITS;
+    if (leaf >= table->leaf_count)
+    {
+        uint32_t old_count = table->leaf_count;
+        DYNARR_GROW(
+            macro_id_t *, table->leaves, old_count, table->leaf_capacity,
+            leaf + 1 - old_count, MEM_TAG_MACRO_TABLE);
+        for (uint32_t i = old_count; i <= leaf; i++)
+        {
+            table->leaves[i] = NULL;
+        }
+
+        table->leaf_count = leaf + 1;
+    }
+
+    // Copy the base's leaf on first write.
+    if (table->leaves[leaf] == NULL)
+    {
+        const struct macro_table *base = table->base;
+        if (base != NULL &&
+            leaf < base->leaf_count &&
+            base->leaves[leaf] != NULL)
+        {
+            table->leaves[leaf] = ALLOC_ARRAY(
+                macro_id_t, MACRO_TABLE_LEAF_SIZE, MEM_TAG_MACRO_TABLE);
+            memcpy(
+                table->leaves[leaf], base->leaves[leaf],
+                sizeof(macro_id_t) * MACRO_TABLE_LEAF_SIZE);
+        }
+        else
+        {
+            table->leaves[leaf] = ZALLOC_ARRAY(
+                macro_id_t, MACRO_TABLE_LEAF_SIZE, MEM_TAG_MACRO_TABLE);
+        }
+    }
+
+    table->leaves[leaf][name & (MACRO_TABLE_LEAF_SIZE - 1)] = id;
+}
+
+// Define a macro. params are its parameter names, macro->param_count of
+// them, and body is its replacement list, macro->body_count tokens. Both get
+// copied. macro->params_first and macro->body_first are ignored. Returns its
+// ID.
+static macro_id_t macro_table_define(
+    struct macro_table *table,
+    const struct macro *macro,
+    const strid_t *params,
+    const struct macro_token *body)
+{
+    assert(table != NULL);
+    assert(macro != NULL);
+    assert(macro->name != 0);
+    assert(params != NULL || macro->param_count == 0);
+    assert(body != NULL || macro->body_count == 0);
+
+    // ID's and indexes continue on from the base's, so check they don't
+    // overflow as a whole.
+    if (table->macro_count == UINT32_MAX ||
+        macro->param_count > UINT32_MAX - table->params_len ||
+        macro->body_count > UINT32_MAX - table->body_len)
+    {
+        translation_limit_exceeded();
+    }
+
+    // Copy parameter names.
+    uint32_t params_first = table->params_len;
+    uint32_t params_len = params_first - table->base_params_len;
+    DYNARR_GROW(
+        strid_t, table->params, params_len, table->params_capacity,
+        macro->param_count, MEM_TAG_MACRO_TABLE);
+    if (macro->param_count > 0)
+    {
+        memcpy(
+            table->params + params_len, params,
+            sizeof(strid_t) * macro->param_count);
+    }
+
+    table->params_len += macro->param_count;
+
+    // Copy replacement list.
+    uint32_t body_first = table->body_len;
+    uint32_t body_len = body_first - table->base_body_len;
+    DYNARR_GROW(
+        struct macro_token, table->body, body_len, table->body_capacity,
+        macro->body_count, MEM_TAG_MACRO_TABLE);
+    if (macro->body_count > 0)
+    {
+        memcpy(
+            table->body + body_len, body,
+            sizeof(struct macro_token) * macro->body_count);
+    }
+
+    table->body_len += macro->body_count;
+
+    // Add definition.
+    uint32_t macro_len = table->macro_count - table->base_macro_count;
+    DYNARR_GROW(
+        struct macro, table->macros, macro_len, table->macro_capacity, 1,
+        MEM_TAG_MACRO_TABLE);
+
+    macro_id_t id = table->macro_count++;
+    table->macros[macro_len] = *macro;
+    table->macros[macro_len].params_first = params_first;
+    table->macros[macro_len].body_first = body_first;
+
+    _macro_table_set(table, macro->name, id);
+    return id;
+}
+
+// Undefine a macro.
+static void macro_table_undef(struct macro_table *table, strid_t name)
+{
+    assert(table != NULL);
+    assert(name != 0);
+
+    _macro_table_set(table, name, 0);
+}
+
+// Whether a macro is still what its name is defined as, i.e. it hasn't been
+// #undef'd or redefined since.
+static bool macro_table_is_live(const struct macro_table *table, macro_id_t id)
+{
+    return macro_table_get(
+        table, macro_table_get_macro(table, id)->name) == id;
+}
+
+// Define every macro still defined in src in table too, in the order they
+// were defined, replacing any definitions of the same names.
+static void macro_table_define_all(
+    struct macro_table *table,
+    const struct macro_table *src)
+{
+    assert(table != NULL);
+    assert(src != NULL);
+    assert(table != src);
+
+    // At most everything gets copied, so make room for that up front.
+    DYNARR_GROW(
+        strid_t, table->params,
+        table->params_len - table->base_params_len, table->params_capacity,
+        src->params_len, MEM_TAG_MACRO_TABLE);
+    DYNARR_GROW(
+        struct macro_token, table->body,
+        table->body_len - table->base_body_len, table->body_capacity,
+        src->body_len, MEM_TAG_MACRO_TABLE);
+    DYNARR_GROW(
+        struct macro, table->macros,
+        table->macro_count - table->base_macro_count, table->macro_capacity,
+        src->macro_count, MEM_TAG_MACRO_TABLE);
+
+    for (macro_id_t id = 1; id < src->macro_count; id++)
+    {
+        if (macro_table_is_live(src, id))
+        {
+            const struct macro *macro = macro_table_get_macro(src, id);
+            macro_table_define(
+                table, macro, macro_table_get_params(src, macro),
+                macro_table_get_body(src, macro));
+        }
+    }
+}
@@ -0,0 +1,929 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "macro_table.h"
+#include "tokcache.h"
+
+// Prelude snapshot format version. Bump whenever the layout changes or the
+// same prelude could start ending with different macros.
+#define MACROCACHE_VERSION 2
+
+// Prelude snapshot magic number. Also catches files of the wrong byte order.
+#define MACROCACHE_MAGIC UINT32_C(0x4A4F4D43) // "JOMC"
+
+// Size of a dependency that wasn't a readable file.
+#define MACROCACHE_MISSING UINT32_MAX
+
+// Macro flags.
+#define MACROCACHE_FUNCTION_LIKE 0x01
+#define MACROCACHE_VARIADIC 0x02
+
+// Prelude snapshot header. Followed by:
+//
+//   dep_count struct macrocache_dep
+//   macro_count struct macrocache_macro
+//   param_name_count uint32_t parameter names, as string indexes
+//   token_count uint8_t syncats
+//   token_count uint8_t flags
+//   token_count uint8_t kinds, zero-padded to a multiple of 4 bytes
+//   token_count uint32_t params
+//   token_count uint32_t starts, relative to the start of the text
+//   token_count uint32_t lengths
+//   token_count uint32_t spellings, indexes into the string offsets
+//   string_count uint32_t string offsets into the string data
+//   string_data_size bytes of NUL-terminated string data
+//   text_size bytes of text, then a NUL
+//
+// The parameter names are the macros', back to back, and so are the tokens,
+// which are the macros' replacement lists. The text
+// spells them out, one line per nonempty list, for their srclocs to point
+// into. String 0 is the empty string. payload_hash is the jocc_hash of
+// everything after the header, to catch corrupt files.
+struct macrocache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key_low;
+    uint64_t key_high;
+    uint64_t payload_hash;
+    uint32_t dep_count;
+    uint32_t macro_count;
+    uint32_t param_name_count;
+    uint32_t token_count;
+    uint32_t string_count;
+    uint32_t string_data_size;
+    uint32_t text_size;
+    uint32_t reserved;
+};
+
+// Path a prelude looked up for #include, and what it found there.
+struct macrocache_dep
+{
+    uint64_t content_hash_low;
+    uint64_t content_hash_high;
+    uint32_t name; // String index.
+    uint32_t size; // MACROCACHE_MISSING if it wasn't a readable file.
+};
+
+// Macro. Its parameters are the next param_count parameter names, and its
+// replacement list is the next body_count tokens.
+struct macrocache_macro
+{
+    uint32_t name; // String index.
+    uint32_t flags;
+    uint32_t param_count;
+    uint32_t body_count;
+
+    // Presumed file name, as a string index, and line number the
+    // replacement list was on. Both 0 if it's empty.
+    uint32_t file;
+    uint32_t line;
+};
+
+// Prelude snapshot opened for reading. Validated up front,
+// so loading it can't go out of bounds.
+struct macrocache_file
+{
+    struct filemap map;
+    struct macrocache_header header;
+
+    const struct macrocache_dep *deps;
+    const struct macrocache_macro *macros;
+    const uint32_t *param_names;
+    const uint8_t *syncats;
+    const uint8_t *flags;
+    const uint8_t *kinds;
+    const uint32_t *params;
+    const uint32_t *starts;
+    const uint32_t *lengths;
+    const uint32_t *spellings;
+    const uint32_t *string_offsets;
+    const char *string_data;
+    const char *text;
+};
+
+// Prelude snapshots.
+//
+// Every .joc file starts with the macros the .jop prelude files end with,
+// and preludes mostly #include big headers that hardly ever change. A
+// snapshot saves those macros, the strings they use, and what every path
+// the prelude looked up for #include found, so later runs can map it and
+// check those paths instead of preprocessing the prelude again. Snapshots
+// go in the token cache directory, named by a key hashed from the prelude
+// files and include dirs, and get evicted along with token cache files.
+
+// Get the snapshot key for a prelude: the names and contents of its files,
+// in order, and the include dirs, which decide what their #include's find.
+static hash128_t macrocache_key(
+    struct tgroup *tgroup,
+    const phys_file_id_t *phys_file_ids,
+    uint32_t count)
+{
+    assert(tgroup != NULL);
+    assert(phys_file_ids != NULL || count == 0);
+
+    struct tmp_stack *tmp_stack = &tgroup->tmp_stack;
+    tmp_stack_mark_t mark = tmp_stack_mark(tmp_stack);
+
+    uint32_t counts[3] = {
+        MACROCACHE_VERSION, tgroup->include_dir_count, count};
+    tmp_stack_push(tmp_stack, counts, sizeof(counts));
+
+    for (uint32_t i = 0; i < tgroup->include_dir_count; i++)
+    {
+        const char *dir =
+            strman_get_str(&tgroup->strman, tgroup->include_dirs[i]);
+        tmp_stack_push(tmp_stack, dir, strlen(dir) + 1);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct phys_file *file =
+            srcman_get_phys_file(&tgroup->srcman, phys_file_ids[i]);
+        const char *name = strman_get_str(&tgroup->strman, file->name);
+        uint64_t content_hash[2] = {
+            file->content_hash.low64, file->content_hash.high64};
+
+        tmp_stack_push(tmp_stack, name, strlen(name) + 1);
+        tmp_stack_push(tmp_stack, content_hash, sizeof(content_hash));
+    }
+
+    hash128_t key = jocc_hash128(
+        tmp_stack->data + mark, tmp_stack->size - mark);
+
+    tmp_stack_rewind(tmp_stack, mark);
+    return key;
+}
+
+// Order strid_t's.
+static int _macrocache_strid_cmp(const void *a, const void *b)
+{
+    strid_t a_strid = *(const strid_t *)a;
+    strid_t b_strid = *(const strid_t *)b;
+    return (a_strid > b_strid) - (a_strid < b_strid);
+}
+
+// Sort strid_t's and drop repeats. Returns how many are left.
+static uint32_t _macrocache_sort_unique(strid_t *strids, uint32_t count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    qsort(strids, count, sizeof(strid_t), _macrocache_strid_cmp);
+
+    uint32_t unique = 1;
+    for (uint32_t i = 1; i < count; i++)
+    {
+        if (strids[i] != strids[unique - 1])
+        {
+            strids[unique++] = strids[i];
+        }
+    }
+
+    return unique;
+}
+
+// Get index of a strid in sorted strings known to contain it.
+static uint32_t _macrocache_string_index(
+    const strid_t *strings,
+    uint32_t count,
+    strid_t strid)
+{
+    uint32_t low = 0;
+    uint32_t high = count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (strings[mid] < strid)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    assert(low < count && strings[low] == strid);
+    return low;
+}
+
+// Get spelling of a token.
+static const char *_macrocache_spelling(struct tgroup *tgroup, tokid_t id)
+{
+    enum syncat syncat = tgroup->tokman.syncats[id];
+    if (syncat_is_punctuator(syncat))
+    {
+        return syncat_punctuator_spelling(syncat);
+    }
+
+    return strman_get_str(&tgroup->strman, tgroup->tokman.spellings[id]);
+}
+
+// Write snapshot of the macros a prelude ended with, given every path it
+// looked up for #include. Returns false on I/O error.
+static bool macrocache_write(
+    struct tokcache *cache,
+    struct tgroup *tgroup,
+    hash128_t key,
+    struct macro_table *table,
+    const strid_t *lookups,
+    uint32_t lookup_count)
+{
+    assert(cache != NULL);
+    assert(tgroup != NULL);
+    assert(table != NULL);
+    assert(lookups != NULL || lookup_count == 0);
+
+    struct srcman *srcman = &tgroup->srcman;
+    struct strman *strman = &tgroup->strman;
+    struct tokman *tokman = &tgroup->tokman;
+
+    // Count macros that are still defined, their parameters and tokens.
+    uint32_t macro_count = 0;
+    uint32_t param_name_count = 0;
+    uint32_t token_count = 0;
+    for (macro_id_t id = 1; id < table->macro_count; id++)
+    {
+        if (macro_table_is_live(table, id))
+        {
+            const struct macro *macro = macro_table_get_macro(table, id);
+            macro_count++;
+            param_name_count += macro->param_count;
+            token_count += macro->body_count;
+        }
+    }
+
+    // Gather every string used: paths looked up, macro names, parameter
+    // names, presumed file names, and spellings. Sorted, so strid's map to
+    // indexes by binary search. Paths are gathered separately too, to become
+    // dependencies.
+    size_t max_string_count =
+        1 + (size_t)lookup_count + 2 * (size_t)macro_count +
+        param_name_count + token_count;
+    if (max_string_count > UINT32_MAX)
+    {
+        translation_limit_exceeded();
+    }
+
+    strid_t *strings = ALLOC_ARRAY(
+        strid_t, max_string_count, MEM_TAG_TOKCACHE);
+    strid_t *paths = ALLOC_ARRAY(
+        strid_t, (size_t)lookup_count + 1, MEM_TAG_TOKCACHE);
+    struct macrocache_macro *macros = ZALLOC_ARRAY(
+        struct macrocache_macro, (size_t)macro_count + 1, MEM_TAG_TOKCACHE);
+    uint32_t *param_names = ALLOC_ARRAY(
+        uint32_t, (size_t)param_name_count + 1, MEM_TAG_TOKCACHE);
+
+    uint32_t string_count = 0;
+    strings[string_count++] = 0;
+    for (uint32_t i = 0; i < lookup_count; i++)
+    {
+        strings[string_count++] = lookups[i];
+        paths[i] = lookups[i];
+    }
+
+    uint32_t dep_count = _macrocache_sort_unique(paths, lookup_count);
+
+    uint32_t m = 0;
+    uint32_t p = 0;
+    for (macro_id_t id = 1; id < table->macro_count; id++)
+    {
+        if (!macro_table_is_live(table, id))
+        {
+            continue;
+        }
+
+        // Names and files stay strid's until the strings are sorted.
+        const struct macro *macro = macro_table_get_macro(table, id);
+        const strid_t *params = macro_table_get_params(table, macro);
+        const struct macro_token *body = macro_table_get_body(table, macro);
+        struct macrocache_macro *out = &macros[m++];
+        out->name = macro->name;
+        out->flags =
+            (macro->function_like ? MACROCACHE_FUNCTION_LIKE : 0) |
+            (macro->variadic ? MACROCACHE_VARIADIC : 0);
+        out->param_count = macro->param_count;
+        out->body_count = macro->body_count;
+        strings[string_count++] = macro->name;
+
+        for (uint32_t i = 0; i < macro->param_count; i++)
+        {
+            param_names[p++] = params[i];
+            strings[string_count++] = params[i];
+        }
+
+        if (macro->body_count > 0)
+        {
+            srcloc_t line_start;
+            struct srcline *line = srcman_get_line(
+                srcman, tokman->starts[body[0].id],
+                &line_start);
+            struct pres_file *pres_file =
+                srcman_get_pres_file(srcman, line->pres_file_id);
+
+            out->file = pres_file->pres_name;
+            out->line = pres_file->pres_line_num_base + line->line_num_offset;
+            strings[string_count++] = out->file;
+        }
+
+        for (uint32_t i = 0; i < macro->body_count; i++)
+        {
+            strings[string_count++] = tokman->spellings[body[i].id];
+        }
+    }
+
+    string_count = _macrocache_sort_unique(strings, string_count);
+
+    // What each path found.
+    struct macrocache_dep *deps = ALLOC_ARRAY(
+        struct macrocache_dep, (size_t)dep_count + 1, MEM_TAG_TOKCACHE);
+    for (uint32_t i = 0; i < dep_count; i++)
+    {
+        phys_file_id_t id;
+        if (!srcman_find_phys_file(srcman, paths[i], &id))
+        {
+            id = PHYS_FILE_NONE;
+        }
+
+        struct macrocache_dep *dep = &deps[i];
+        dep->content_hash_low = 0;
+        dep->content_hash_high = 0;
+        dep->name = _macrocache_string_index(strings, string_count, paths[i]);
+        dep->size = MACROCACHE_MISSING;
+        if (id != PHYS_FILE_NONE)
+        {
+            struct phys_file *file = srcman_get_phys_file(srcman, id);
+            dep->content_hash_low = file->content_hash.low64;
+            dep->content_hash_high = file->content_hash.high64;
+            dep->size = file->size;
+        }
+    }
+
+    for (uint32_t i = 0; i < macro_count; i++)
+    {
+        macros[i].name =
+            _macrocache_string_index(strings, string_count, macros[i].name);
+        macros[i].file =
+            _macrocache_string_index(strings, string_count, macros[i].file);
+    }
+
+    for (uint32_t i = 0; i < param_name_count; i++)
+    {
+        param_names[i] =
+            _macrocache_string_index(strings, string_count, param_names[i]);
+    }
+
+    // Gather token columns and spell out the text.
+    size_t byte_columns_size = ((size_t)token_count * 3 + 3) & ~(size_t)3;
+    uint8_t *byte_columns = ZALLOC_ARRAY(
+        uint8_t, byte_columns_size + 1, MEM_TAG_TOKCACHE);
+    uint32_t *columns = ALLOC_ARRAY(
+        uint32_t, (size_t)token_count * 4 + 1, MEM_TAG_TOKCACHE);
+
+    uint32_t text_size = 0;
+    uint32_t text_capacity = 0;
+    char *text = NULL;
+
+    uint32_t t = 0;
+    for (macro_id_t id = 1; id < table->macro_count; id++)
+    {
+        const struct macro *macro = macro_table_get_macro(table, id);
+        if (macro->body_count == 0 || !macro_table_is_live(table, id))
+        {
+            continue;
+        }
+
+        const struct macro_token *list = macro_table_get_body(table, macro);
+        for (uint32_t i = 0; i < macro->body_count; i++, t++)
+        {
+            struct macro_token body = list[i];
+            const char *spelling = _macrocache_spelling(tgroup, body.id);
+            size_t len = strlen(spelling);
+            if (len > UINT32_MAX - 2)
+            {
+                translation_limit_exceeded();
+            }
+
+            // Room for this token, a space, and a newline.
+            DYNARR_GROW(
+                char, text, text_size, text_capacity, (uint32_t)len + 2,
+                MEM_TAG_TOKCACHE);
+
+            // Space tokens that had white-space before them.
+            uint8_t flags = tokman->flags[body.id];
+            if (i > 0 && (flags & (TOKEN_LEADING_WS | TOKEN_LINE_START)))
+            {
+                text[text_size++] = ' ';
+            }
+
+            byte_columns[t] = tokman->syncats[body.id];
+            byte_columns[token_count + t] = flags;
+            byte_columns[2 * token_count + t] = body.kind;
+            columns[t] = body.param;
+            columns[token_count + t] = text_size;
+            columns[2 * token_count + t] = (uint32_t)len;
+            columns[3 * token_count + t] = _macrocache_string_index(
+                strings, string_count, tokman->spellings[body.id]);
+
+            memcpy(text + text_size, spelling, len);
+            text_size += (uint32_t)len;
+        }
+
+        text[text_size++] = '\n';
+    }
+
+    // NUL-terminate text.
+    DYNARR_GROW(char, text, text_size, text_capacity, 1, MEM_TAG_TOKCACHE);
+    text[text_size] = 0;
+
+    // Lay out strings.
+    uint32_t *string_offsets = ALLOC_ARRAY(
+        uint32_t, string_count, MEM_TAG_TOKCACHE);
+    uint32_t string_data_size = 0;
+    for (uint32_t i = 0; i < string_count; i++)
+    {
+        string_offsets[i] = string_data_size;
+        size_t size = strlen(strman_get_str(strman, strings[i])) + 1;
+        if (size > UINT32_MAX - string_data_size)
+        {
+            translation_limit_exceeded();
+        }
+
+        string_data_size += (uint32_t)size;
+    }
+
+    // Hash payload.
+    size_t column_count = (size_t)token_count * 4;
+    hash_state_t hash_state;
+    jocc_hash_reset(&hash_state);
+    jocc_hash_update(&hash_state, deps, sizeof(*deps) * dep_count);
+    jocc_hash_update(&hash_state, macros, sizeof(*macros) * macro_count);
+    jocc_hash_update(
+        &hash_state, param_names, sizeof(uint32_t) * param_name_count);
+    jocc_hash_update(&hash_state, byte_columns, byte_columns_size);
+    jocc_hash_update(&hash_state, columns, sizeof(uint32_t) * column_count);
+    jocc_hash_update(
+        &hash_state, string_offsets, sizeof(uint32_t) * string_count);
+
+    for (uint32_t i = 0; i < string_count; i++)
+    {
+        const char *str = strman_get_str(strman, strings[i]);
+        jocc_hash_update(&hash_state, str, strlen(str) + 1);
+    }
+
+    jocc_hash_update(&hash_state, text, (size_t)text_size + 1);
+
+    // Write to a temporary file first, so readers never see a partial file.
+    struct macrocache_header header;
+    header.magic = MACROCACHE_MAGIC;
+    header.version = MACROCACHE_VERSION;
+    header.key_low = key.low64;
+    header.key_high = key.high64;
+    header.payload_hash = jocc_hash_digest(&hash_state);
+    header.dep_count = dep_count;
+    header.macro_count = macro_count;
+    header.param_name_count = param_name_count;
+    header.token_count = token_count;
+    header.string_count = string_count;
+    header.string_data_size = string_data_size;
+    header.text_size = text_size;
+    header.reserved = 0;
+
+    char *path = tokcache_alloc_file_path(cache, key, "");
+    char *tmp_path = tokcache_alloc_file_path(cache, key, ".tmp");
+
+    bool ok = false;
+    FILE *file = fopen(tmp_path, "wb");
+    if (file != NULL)
+    {
+        ok =
+            fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(deps, sizeof(*deps), dep_count, file) == dep_count &&
+            fwrite(macros, sizeof(*macros), macro_count, file) ==
+                macro_count &&
+            fwrite(param_names, sizeof(uint32_t), param_name_count, file) ==
+                param_name_count &&
+            fwrite(byte_columns, 1, byte_columns_size, file) ==
+                byte_columns_size &&
+            fwrite(columns, sizeof(uint32_t), column_count, file) ==
+                column_count &&
+            fwrite(string_offsets, sizeof(uint32_t), string_count, file) ==
+                string_count;
+
+        for (uint32_t i = 0; ok && i < string_count; i++)
+        {
+            const char *str = strman_get_str(strman, strings[i]);
+            size_t size = strlen(str) + 1;
+            ok = fwrite(str, 1, size, file) == size;
+        }
+
+        ok = ok && fwrite(text, 1, (size_t)text_size + 1, file) ==
+            (size_t)text_size + 1;
+
+        ok = fclose(file) == 0 && ok;
+        if (ok)
+        {
+            remove(path);
+            ok = rename(tmp_path, path) == 0;
+        }
+
+        if (!ok)
+        {
+            remove(tmp_path);
+        }
+    }
+
+    if (ok)
+    {
+        cache->write_count++;
+    }
+
+    // Cleanup.
+    jocc_free(tmp_path);
+    jocc_free(path);
+    jocc_free(string_offsets);
+    jocc_free(text);
+    jocc_free(columns);
+    jocc_free(byte_columns);
+    jocc_free(deps);
+    jocc_free(param_names);
+    jocc_free(macros);
+    jocc_free(paths);
+    jocc_free(strings);
+    return ok;
+}
+
+// Whether the mapped file is a valid snapshot for the given key.
+// Sets up file's section pointers if so.
+static bool _macrocache_validate(struct macrocache_file *file, hash128_t key)
+{
+    // Check header.
+    struct macrocache_header header;
+    size_t size = file->map.size;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+
+    memcpy(&header, file->map.data, sizeof(header));
+    if (header.magic != MACROCACHE_MAGIC ||
+        header.version != MACROCACHE_VERSION ||
+        header.key_low != key.low64 ||
+        header.key_high != key.high64 ||
+        header.string_count == 0 ||
+        header.string_data_size == 0 ||
+        header.text_size == UINT32_MAX)
+    {
+        return false;
+    }
+
+    // Check size. Counts are 32-bit, so this can't overflow.
+    uint64_t tokens = header.token_count;
+    uint64_t byte_columns_size = (3 * tokens + 3) & ~(uint64_t)3;
+    uint64_t expected_size =
+        sizeof(header) +
+        sizeof(struct macrocache_dep) * (uint64_t)header.dep_count +
+        sizeof(struct macrocache_macro) * (uint64_t)header.macro_count +
+        sizeof(uint32_t) * (uint64_t)header.param_name_count +
+        byte_columns_size +
+        sizeof(uint32_t) * 4 * tokens +
+        sizeof(uint32_t) * (uint64_t)header.string_count +
+        header.string_data_size +
+        header.text_size + 1;
+
+    const unsigned char *p = (const unsigned char *)file->map.data;
+    if (expected_size != size ||
+        jocc_hash(p + sizeof(header), size - sizeof(header)) !=
+            header.payload_hash)
+    {
+        return false;
+    }
+
+    // Locate sections.
+    p += sizeof(header);
+    file->deps = (const struct macrocache_dep *)p;
+    file->macros = (const struct macrocache_macro *)(
+        file->deps + header.dep_count);
+    file->param_names = (const uint32_t *)(
+        file->macros + header.macro_count);
+    p = (const unsigned char *)(file->param_names + header.param_name_count);
+    file->syncats = p;
+    file->flags = p + tokens;
+    file->kinds = p + 2 * tokens;
+    p += byte_columns_size;
+    file->params = (const uint32_t *)p;
+    file->starts = file->params + tokens;
+    file->lengths = file->starts + tokens;
+    file->spellings = file->lengths + tokens;
+    file->string_offsets = file->spellings + tokens;
+    file->string_data =
+        (const char *)(file->string_offsets + header.string_count);
+    file->text = file->string_data + header.string_data_size;
+
+    // Check dependencies.
+    for (uint32_t i = 0; i < header.dep_count; i++)
+    {
+        uint32_t name = file->deps[i].name;
+        if (name == 0 || name >= header.string_count)
+        {
+            return false;
+        }
+    }
+
+    // Check macros, their parameters and tokens. Each nonempty replacement
+    // list starts a line of the text, so they have to be in order.
+    uint64_t line_start_min = 0;
+    uint32_t n = 0;
+    uint32_t t = 0;
+    for (uint32_t i = 0; i < header.macro_count; i++)
+    {
+        const struct macrocache_macro *macro = &file->macros[i];
+        bool function_like = macro->flags & MACROCACHE_FUNCTION_LIKE;
+        if (macro->name == 0 ||
+            macro->name >= header.string_count ||
+            macro->file >= header.string_count ||
+            macro->flags > (MACROCACHE_FUNCTION_LIKE | MACROCACHE_VARIADIC) ||
+            macro->param_count > UINT16_MAX ||
+            (!function_like && macro->flags != 0) ||
+            (!function_like && macro->param_count != 0) ||
+            ((macro->flags & MACROCACHE_VARIADIC) && macro->param_count == 0) ||
+            macro->param_count > header.param_name_count - n ||
+            macro->body_count > header.token_count - t)
+        {
+            return false;
+        }
+
+        for (uint32_t j = 0; j < macro->param_count; j++, n++)
+        {
+            uint32_t name = file->param_names[n];
+            if (name == 0 || name >= header.string_count)
+            {
+                return false;
+            }
+        }
+
+        uint32_t count = macro->body_count;
+        if (count > 0 &&
+            (file->starts[t] < line_start_min ||
+             file->kinds[t] == MACRO_TOKEN_PASTE ||
+             file->kinds[t + count - 1] == MACRO_TOKEN_PASTE))
+        {
+            return false;
+        }
+
+        for (uint32_t j = 0; j < count; j++, t++)
+        {
+            enum syncat syncat = file->syncats[t];
+            uint8_t kind = file->kinds[t];
+            bool param =
+                kind == MACRO_TOKEN_ARG ||
+                kind == MACRO_TOKEN_RAW_ARG ||
+                kind == MACRO_TOKEN_STRINGIZE;
+
+            if (syncat <= SYNCAT_EOL ||
+                syncat > SYNCAT_ILLEGAL_BYTES ||
+                kind > MACRO_TOKEN_PASTE ||
+                (param && file->params[t] >= macro->param_count) ||
+                (uint64_t)file->starts[t] + file->lengths[t] >
+                    header.text_size ||
+                file->spellings[t] >= header.string_count)
+            {
+                return false;
+            }
+
+            line_start_min = (uint64_t)file->starts[t] + 1;
+        }
+    }
+
+    if (n != header.param_name_count || t != header.token_count)
+    {
+        return false;
+    }
+
+    // Check strings are in order and terminated, as is the text.
+    const uint32_t *offsets = file->string_offsets;
+    if (offsets[0] != 0 ||
+        file->string_data[0] != 0 ||
+        file->string_data[header.string_data_size - 1] != 0 ||
+        file->text[header.text_size] != 0)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 1; i < header.string_count; i++)
+    {
+        if (offsets[i] <= offsets[i - 1] ||
+            offsets[i] >= header.string_data_size ||
+            file->string_data[offsets[i] - 1] != 0)
+        {
+            return false;
+        }
+    }
+
+    file->header = header;
+    return true;
+}
+
+// Whether every path a snapshot's prelude looked up for #include still
+// finds the same content, or still finds nothing. Loads what they find.
+static bool _macrocache_check_deps(
+    struct macrocache_file *file,
+    struct srcman *srcman,
+    const strid_t *strids)
+{
+    for (uint32_t i = 0; i < file->header.dep_count; i++)
+    {
+        const struct macrocache_dep *dep = &file->deps[i];
+        const char *path =
+            file->string_data + file->string_offsets[dep->name];
+        phys_file_id_t id =
+            srcman_load_phys_file(srcman, strids[dep->name], path);
+
+        if (id == PHYS_FILE_NONE)
+        {
+            if (dep->size != MACROCACHE_MISSING)
+            {
+                return false;
+            }
+
+            continue;
+        }
+
+        struct phys_file *phys_file = srcman_get_phys_file(srcman, id);
+        if (dep->size != phys_file->size ||
+            dep->content_hash_low != phys_file->content_hash.low64 ||
+            dep->content_hash_high != phys_file->content_hash.high64)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Load the snapshot for a prelude's key into an empty macro table, if there's
+// a valid one and every path its prelude looked up for #include still finds
+// the same thing. The snapshot's text becomes a phys_file, so file has to
+// stay open until tgroup is destroyed. Returns false if nothing was loaded.
+static bool macrocache_load(
+    struct tokcache *cache,
+    struct tgroup *tgroup,
+    hash128_t key,
+    struct macro_table *table,
+    struct macrocache_file *file)
+{
+    assert(cache != NULL);
+    assert(tgroup != NULL);
+    assert(table != NULL);
+    assert(table->macro_count == 1);
+    assert(file != NULL);
+
+    struct srcman *srcman = &tgroup->srcman;
+    struct tokman *tokman = &tgroup->tokman;
+
+    // Map and validate.
+    char *path = tokcache_alloc_file_path(cache, key, "");
+    bool ok =
+        filemap_open(&file->map, path, true) &&
+        file->map.data != NULL &&
+        (uintptr_t)file->map.data % sizeof(uint64_t) == 0;
+
+    if (ok && !_macrocache_validate(file, key))
+    {
+        filemap_close(&file->map);
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        jocc_free(path);
+        return false;
+    }
+
+    // Intern strings and check dependencies.
+    struct macrocache_header *header = &file->header;
+    const uint32_t *offsets = file->string_offsets;
+    strid_t *strids = ALLOC_ARRAY(
+        strid_t, header->string_count, MEM_TAG_TOKCACHE);
+    strids[0] = 0;
+    for (uint32_t i = 1; i < header->string_count; i++)
+    {
+        uint32_t end = i + 1 < header->string_count
+            ? offsets[i + 1]
+            : header->string_data_size;
+
+        strids[i] = strman_get_id(
+            &tgroup->strman, file->string_data + offsets[i],
+            end - offsets[i] - 1);
+    }
+
+    if (!_macrocache_check_deps(file, srcman, strids))
+    {
+        jocc_free(strids);
+        jocc_free(path);
+        filemap_close(&file->map);
+        return false;
+    }
+
+    tokcache_touch(path);
+    jocc_free(path);
+
+    // Add the text as a file for the tokens' srclocs to point into, with
+    // each line presumed to be where its replacement list came from.
+    srcloc_t start = tgroup->reserved_srcloc_count;
+    tgroup->reserved_srcloc_count += header->text_size + 1;
+    if (tgroup->reserved_srcloc_count <= start)
+    {
+        translation_limit_exceeded();
+    }
+
+    phys_file_id_t phys_file_id = srcman_add_phys_file(
+        srcman, 0, header->text_size, file->text);
+    logi_file_id_t logi_file_id =
+        srcman_add_logi_file(srcman, phys_file_id, 0, start);
+
+    uint32_t t = 0;
+    uint32_t line_num = 1;
+    for (uint32_t i = 0; i < header->macro_count; i++)
+    {
+        const struct macrocache_macro *macro = &file->macros[i];
+        if (macro->body_count > 0)
+        {
+            pres_file_id_t pres_file_id = srcman_add_pres_file(
+                srcman, logi_file_id, line_num++, strids[macro->file],
+                macro->line);
+            srcman_add_line(
+                srcman, start + file->starts[t], pres_file_id, 0);
+        }
+
+        t += macro->body_count;
+    }
+
+    // Add tokens.
+    uint32_t count = header->token_count;
+    tokid_t first = tokman_extend(tokman, count);
+    memcpy(tokman->syncats + first, file->syncats, count);
+    memcpy(tokman->flags + first, file->flags, count);
+    memcpy(tokman->lengths + first, file->lengths, sizeof(uint32_t) * count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        tokman->starts[first + i] = start + file->starts[i];
+        tokman->spellings[first + i] = strids[file->spellings[i]];
+    }
+
+    // Define macros.
+    struct tmp_stack *tmp_stack = &tgroup->tmp_stack;
+    tmp_stack_mark_t mark = tmp_stack_mark(tmp_stack);
+    strid_t *params = TMP_STACK_ALLOC(
+        tmp_stack, strid_t, (size_t)header->param_name_count + 1);
+    struct macro_token *body =
+        TMP_STACK_ALLOC(tmp_stack, struct macro_token, (size_t)count + 1);
+
+    uint32_t n = 0;
+    t = 0;
+    for (uint32_t i = 0; i < header->macro_count; i++)
+    {
+        const struct macrocache_macro *cached = &file->macros[i];
+        struct macro macro;
+        macro.name = strids[cached->name];
+        macro.definition = 0;
+        macro.function_like = cached->flags & MACROCACHE_FUNCTION_LIKE;
+        macro.variadic = cached->flags & MACROCACHE_VARIADIC;
+        macro.param_count = (uint16_t)cached->param_count;
+        macro.params_first = 0;
+        macro.body_first = 0;
+        macro.body_count = cached->body_count;
+
+        for (uint32_t j = 0; j < macro.param_count; j++, n++)
+        {
+            params[j] = strids[file->param_names[n]];
+        }
+
+        for (uint32_t j = 0; j < macro.body_count; j++, t++)
+        {
+            body[j].id = first + t;
+            body[j].param = (uint16_t)file->params[t];
+            body[j].kind = file->kinds[t];
+        }
+
+        macro_table_define(table, &macro, params, body);
+    }
+
+    tmp_stack_rewind(tmp_stack, mark);
+    jocc_free(strids);
+    return true;
+}
+
+// Close snapshot loaded by macrocache_load.
+static void macrocache_close(struct macrocache_file *file)
+{
+    assert(file != NULL);
+
+    filemap_close(&file->map);
+}
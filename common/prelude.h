@@ -4,6 +4,11 @@
 
 #pragma once
 
+// We compile as strict C99, which hides POSIX declarations like mmap.
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <assert.h>
 #include <inttypes.h>
 #include <limits.h>
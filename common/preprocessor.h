@@ -4,98 +4,3352 @@
 
 #pragma once
 
+#include "astcons.h"
 #include "astlst.h"
+#include "hideset.h"
 #include "lexer.h"
+#include "macro_table.h"
+#include "tokcache.h"
 
-// Preprocessor (TODO: work-in-progress).
-static int preprocess(
-    struct tgroup *tgroup,
+// Maximum #include nesting depth.
+#define PP_MAX_INCLUDE_DEPTH 200
+
+// Identifiers with special meaning to the preprocessor.
+enum pp_keyword
+{
+    PP_KEYWORD_DEFINE,
+    PP_KEYWORD_DEFINED,
+    PP_KEYWORD_ELIF,
+    PP_KEYWORD_ELSE,
+    PP_KEYWORD_ENDIF,
+    PP_KEYWORD_ERROR,
+    PP_KEYWORD_IF,
+    PP_KEYWORD_IFDEF,
+    PP_KEYWORD_IFNDEF,
+    PP_KEYWORD_INCLUDE,
+    PP_KEYWORD_LINE,
+    PP_KEYWORD_ONCE,
+    PP_KEYWORD_PRAGMA,
+    PP_KEYWORD_UNDEF,
+    PP_KEYWORD_WARNING,
+    PP_KEYWORD_VA_ARGS,
+    PP_KEYWORD_COUNT,
+};
+
+// Spellings of pp_keyword's.
+static const char *const _pp_keyword_spellings[PP_KEYWORD_COUNT] = {
+    "define",
+    "defined",
+    "elif",
+    "else",
+    "endif",
+    "error",
+    "if",
+    "ifdef",
+    "ifndef",
+    "include",
+    "line",
+    "once",
+    "pragma",
+    "undef",
+    "warning",
+    "__VA_ARGS__",
+};
+
+// Open conditional directive (#if, #ifdef, or #ifndef).
+struct pp_cond
+{
+    // Directive location for diagnostics.
+    srcloc_t start;
+    srcloc_t end;
+
+    // Whether a group has been taken already. Also set if the whole
+    // conditional is in a skipped group, so no group gets taken.
+    bool taken;
+
+    // Whether the current group is being skipped.
+    bool skipping;
+
+    // Whether #else has been seen.
+    bool seen_else;
+};
+
+// Paths #include looked up, in order, repeats and all.
+struct pp_lookups
+{
+    uint32_t count;
+    uint32_t capacity;
+    strid_t *names;
+};
+
+// Preprocessor. One for each top-level source file,
+// shared by everything that file #include's.
+struct preprocessor
+{
+    struct tgroup *tgroup;
+
+    // Whether to make nodes for trivia (white-space, comments, and line
+    // splices). Off by default since the preprocessor only cares about trivia
+    // as TOKEN_LEADING_WS and TOKEN_LINE_START flags on the next
+    // token, and a node for every run of trivia adds up.
+    bool keep_trivia;
+
+    // Cache of lexed tokens to read files from instead of lexing them, and
+    // to write newly lexed files to. Not owned. NULL to always lex. Not used
+    // while keeping trivia, since cache files don't have any.
+    struct tokcache *tokcache;
+
+    // Hash-consing for the nodes the preprocessor makes.
+    // Not owned. NULL to make every node unique.
+    struct astcons *astcons;
+
+    // Where to record the paths #include looks up, e.g. for a prelude
+    // snapshot to check they still find the same files. Not owned. NULL to
+    // not record them.
+    struct pp_lookups *lookups;
+
+    strid_t keywords[PP_KEYWORD_COUNT];
+    struct macro_table macros;
+    struct hideset_table hidesets;
+
+    // Whether a #if or #elif expression is being expanded, so operands of
+    // defined are left alone.
+    bool in_condition;
+
+    // Where to write macro-expanded text lines. Not owned. NULL to just
+    // drop them.
+    FILE *output;
+
+    // Last token written to output. 0 if none yet.
+    tokid_t output_last;
+
+    // Macro expansion stacks. Each only grows at the top and gets popped
+    // back down as nested work finishes, so once they've grown, expanding
+    // doesn't allocate per token or per invocation.
+    //
+    // Tokens to read before the rest of the input, top first. Replacement
+    // lists are pushed here to be rescanned along with what follows them.
+    uint32_t pending_len;
+    uint32_t pending_capacity;
+    struct pp_token *pending;
+
+    // Arguments of the invocations being substituted, and their tokens.
+    uint32_t arg_count;
+    uint32_t arg_capacity;
+    struct pp_arg *args;
+    uint32_t arg_token_count;
+    uint32_t arg_token_capacity;
+    struct pp_token *arg_tokens;
+
+    // Expanded tokens of the current text line, then any argument expansions
+    // and the replacement list being substituted.
+    uint32_t expanded_len;
+    uint32_t expanded_capacity;
+    struct pp_token *expanded;
+
+    // Open conditional directives across all files being processed.
+    uint32_t cond_count;
+    uint32_t cond_capacity;
+    struct pp_cond *conds;
+
+    // Bitset of content_id's whose #pragma once has been processed.
+    uint32_t once_word_count;
+    uint32_t *once_words;
+
+    // Current #include nesting depth.
+    uint32_t include_depth;
+};
+
+// Token being macro-expanded.
+struct pp_token
+{
+    // 0 for a placemarker, which stands in for an empty argument next to ##
+    // until pasting is done.
+    tokid_t id;
+
+    // Names of the macros the token came out of.
+    hideset_t hideset;
+
+    // TOKEN_* flags. They can differ from the token's own once it's been
+    // substituted somewhere else.
+    uint8_t flags;
+};
+
+// How far a macro argument has been expanded.
+enum pp_arg_state
+{
+    PP_ARG_UNEXPANDED,
+    PP_ARG_PLAIN,    // Nothing to expand. The tokens are their own expansion.
+    PP_ARG_EXPANDED, // Expansion is on the expanded stack.
+};
+
+// Argument of a macro invocation being substituted.
+struct pp_arg
+{
+    // Tokens as written, in arg_tokens.
+    uint32_t first;
+    uint32_t count;
+
+    // Expansion, in expanded if state is PP_ARG_EXPANDED. Each argument is
+    // expanded at most once, however many times its parameter is used.
+    enum pp_arg_state state;
+    uint32_t expanded_first;
+    uint32_t expanded_count;
+};
+
+// Where macro expansion reads tokens from: the pending stack down to base,
+// then lexemes [next, end) in tokman, skipping trivia.
+struct pp_reader
+{
+    uint32_t base;
+    tokid_t next;
+    tokid_t end;
+
+    // Whether more lines might follow, so a macro invocation that runs past
+    // end should wait for them instead of being cut short.
+    bool more;
+};
+
+// Result of trying to invoke a macro.
+enum pp_invoke
+{
+    PP_INVOKE_DONE, // Invoked.
+    PP_INVOKE_NONE, // Not invoked. Any arguments are dropped.
+    PP_INVOKE_WAIT, // Ran out of input. Put back on the pending stack.
+};
+
+// Include guard detection state.
+enum pp_guard
+{
+    PP_GUARD_START,  // Nothing but trivia so far.
+    PP_GUARD_OPEN,   // Inside an #ifndef or #if !defined starting the file.
+    PP_GUARD_CLOSED, // Past the matching #endif. Only trivia allowed now.
+    PP_GUARD_NONE,   // Not wrapped in an include guard.
+};
+
+// File being preprocessed.
+struct pp_file
+{
+    phys_file_id_t phys_file_id;
+    const char *data;
+    srcloc_t start;
+
+    // Index of the first conditional opened in this file.
+    uint32_t cond_base;
+
+    // Include guard detection. Lines are checked as they're lexed for the
+    // #ifndef X or #if !defined(X) ... #endif shape with nothing but trivia
+    // outside it.
+    enum pp_guard guard;
+    strid_t guard_name;
+
+    // Presumed file and line numbering. The srclines for the file's physical
+    // lines are all added up front, pointing at the file's own pres_file.
+    // After a #line, the ones from pres_line on belong to a new pres_file
+    // instead, but they're only re-pointed at the next #line or the end of
+    // the file, so each one gets re-pointed at most once.
+    logi_file_id_t logi_file_id;
+    pres_file_id_t pres_file_id;
+    strid_t pres_name;
+    uint32_t pres_line; // Index in srcman lines.
+    uint32_t line_end;  // Index in srcman lines after the file's last.
+
+    // Where lines come from: the token cache if the file is in it,
+    // otherwise the lexer.
+    bool cached;
+    bool eof;
+    struct tokcache_file tokcache_file;
+    struct lexer lexer;
+
+    // Lines lexed so far, to write to the token cache at the end.
+    // Only recorded if the file wasn't in the cache.
+    bool recording;
+    uint32_t recorded_count;
+    uint32_t recorded_capacity;
+    struct tokcache_line *recorded;
+};
+
+// Logical line of lexemes. They're consecutive tokens in tokman.
+// Lines only contain trivia if the preprocessor keeps it.
+struct pp_line
+{
+    tokid_t first;
+    uint32_t count;
+};
+
+// Initialize preprocessor.
+static void preprocessor_init(struct preprocessor *pp, struct tgroup *tgroup)
+{
+    assert(pp != NULL);
+    assert(tgroup != NULL);
+
+    pp->tgroup = tgroup;
+    pp->keep_trivia = false;
+    pp->tokcache = NULL;
+    pp->astcons = NULL;
+    pp->lookups = NULL;
+    for (int i = 0; i < PP_KEYWORD_COUNT; i++)
+    {
+        const char *spelling = _pp_keyword_spellings[i];
+        pp->keywords[i] = strman_get_id(
+            &tgroup->strman, spelling, (uint32_t)strlen(spelling));
+    }
+
+    macro_table_init(&pp->macros);
+    hideset_table_init(&pp->hidesets);
+    pp->in_condition = false;
+    pp->output = NULL;
+    pp->output_last = 0;
+
+    pp->pending_len = 0;
+    pp->pending_capacity = 0;
+    pp->pending = NULL;
+    pp->arg_count = 0;
+    pp->arg_capacity = 0;
+    pp->args = NULL;
+    pp->arg_token_count = 0;
+    pp->arg_token_capacity = 0;
+    pp->arg_tokens = NULL;
+    pp->expanded_len = 0;
+    pp->expanded_capacity = 0;
+    pp->expanded = NULL;
+
+    pp->cond_count = 0;
+    pp->cond_capacity = 1;
+    pp->conds = JOCC_ALLOC(struct pp_cond, MEM_TAG_PREPROCESSOR);
+
+    pp->once_word_count = 1;
+    pp->once_words = JOCC_ZALLOC(uint32_t, MEM_TAG_PREPROCESSOR);
+
+    pp->include_depth = 0;
+}
+
+// Destroy preprocessor.
+static void preprocessor_destroy(struct preprocessor *pp)
+{
+    assert(pp != NULL);
+
+    jocc_free(pp->once_words);
+    jocc_free(pp->conds);
+    jocc_free(pp->expanded);
+    jocc_free(pp->arg_tokens);
+    jocc_free(pp->args);
+    jocc_free(pp->pending);
+    hideset_table_destroy(&pp->hidesets);
+    macro_table_destroy(&pp->macros);
+}
+
+// Get ID of the i'th lexeme in a line.
+static tokid_t _pp_line_get(const struct pp_line *line, uint32_t i)
+{
+    assert(i < line->count);
+
+    return line->first + i;
+}
+
+// Get syntactic category of the i'th lexeme in a line.
+static enum syncat _pp_line_syncat(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i)
+{
+    return pp->tgroup->tokman.syncats[_pp_line_get(line, i)];
+}
+
+// Get spelling of the i'th lexeme in a line.
+// Must not be trivia or a punctuator.
+static strid_t _pp_line_spelling(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i)
+{
+    assert(!syncat_is_trivia(_pp_line_syncat(pp, line, i)));
+    assert(!syncat_is_punctuator(_pp_line_syncat(pp, line, i)));
+
+    return pp->tgroup->tokman.spellings[_pp_line_get(line, i)];
+}
+
+// Get starting source location of the i'th lexeme in a line.
+static srcloc_t _pp_line_start(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i)
+{
+    return pp->tgroup->tokman.starts[_pp_line_get(line, i)];
+}
+
+// Get ending source location of the i'th lexeme in a line.
+static srcloc_t _pp_line_end(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i)
+{
+    return tokman_get_end(&pp->tgroup->tokman, _pp_line_get(line, i));
+}
+
+// Find the first non-trivia lexeme in a line at or after i.
+// Returns line->count if there isn't one.
+static uint32_t _pp_line_skip_trivia(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i)
+{
+    while (i < line->count && syncat_is_trivia(_pp_line_syncat(pp, line, i)))
+    {
+        i++;
+    }
+
+    return i;
+}
+
+// Whether the i'th lexeme in a line is the given keyword.
+static bool _pp_line_is_keyword(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i,
+    enum pp_keyword keyword)
+{
+    return
+        i < line->count &&
+        _pp_line_syncat(pp, line, i) == SYNCAT_IDENT &&
+        _pp_line_spelling(pp, line, i) == pp->keywords[keyword];
+}
+
+// Make a node with token nodes for all of a line's lexemes as children.
+static astid_t _pp_line_to_node(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    enum syncat syncat)
+{
+    struct tgroup *tgroup = pp->tgroup;
+    struct astman *astman = &tgroup->astman;
+    struct astlst astlst;
+    astlst_init(&astlst);
+
+    // Hash-consing may merge token nodes as they're made,
+    // so each one has to be pushed as it comes.
+    struct astcons *astcons = pp->astcons;
+    if (astcons != NULL && astcons->enabled)
+    {
+        for (uint32_t i = 0; i < line->count; i++)
+        {
+            astid_t token = astman_alloc_node(
+                astman, _pp_line_syncat(pp, line, i), 0, 1);
+            astman->data[token] = _pp_line_get(line, i);
+            astlst_push(
+                tgroup, &astlst, astcons_intern(astcons, astman, token, 1));
+        }
+
+        astid_t node = astlst_finish(tgroup, &astlst, syncat, 0);
+        return astcons_intern(astcons, astman, node, 0);
+    }
+
+    // Otherwise make all the token nodes first, so the child list can be
+    // built in place. Each takes a header and a tokid_t.
+    astid_t first_token = astman->data_len + 1;
+    for (uint32_t i = 0; i < line->count; i++)
+    {
+        astid_t token = astman_alloc_node(
+            astman, _pp_line_syncat(pp, line, i), 0, 1);
+        astman->data[token] = _pp_line_get(line, i);
+    }
+
+    for (uint32_t i = 0; i < line->count; i++)
+    {
+        astlst_push(tgroup, &astlst, first_token + 2 * i);
+    }
+
+    return astlst_finish(tgroup, &astlst, syncat, 0);
+}
+
+// Add error diagnostic spanning lexemes first through last of a line.
+static void _pp_line_error(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t first,
+    uint32_t last,
+    enum diag_code code)
+{
+    tgroup_add_diag(
+        pp->tgroup,
+        _pp_line_start(pp, line, first),
+        _pp_line_end(pp, line, last),
+        DIAG_SEVERITY_ERROR,
+        code);
+}
+
+// Whether lines in the current file are being skipped.
+static bool _pp_skipping(struct preprocessor *pp, const struct pp_file *file)
+{
+    return
+        pp->cond_count > file->cond_base &&
+        pp->conds[pp->cond_count - 1].skipping;
+}
+
+// Get macro name operand of a directive. Adds a diagnostic and returns 0 if
+// there isn't one. i is the index of the lexeme after the directive name.
+static strid_t _pp_macro_name(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t directive,
+    uint32_t i)
+{
+    i = _pp_line_skip_trivia(pp, line, i);
+    if (i == line->count || _pp_line_syncat(pp, line, i) != SYNCAT_IDENT)
+    {
+        _pp_line_error(
+            pp, line, directive, i == line->count ? directive : i,
+            DIAG_CODE_MACRO_NAME_EXPECTED);
+        return 0;
+    }
+
+    return _pp_line_spelling(pp, line, i);
+}
+
+static const char *_pp_spelling(struct preprocessor *pp, tokid_t id);
+static void _pp_token_error(
+    struct preprocessor *pp,
+    tokid_t id,
+    enum diag_code code);
+static void _pp_expand(struct preprocessor *pp, struct pp_reader *reader);
+
+// Macro-expand a directive line's lexemes from i on onto the expanded stack.
+// Returns the index of the first expanded token. Any invocation left open by
+// the last text line is below the reader's base, so it's left alone.
+static uint32_t _pp_expand_operands(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i)
+{
+    uint32_t first = pp->expanded_len;
+
+    struct pp_reader reader;
+    reader.base = pp->pending_len;
+    reader.next = line->first + i;
+    reader.end = line->first + line->count;
+    reader.more = false;
+    _pp_expand(pp, &reader);
+
+    return first;
+}
+
+// Value in a #if expression. Every integer type acts like intmax_t or
+// uintmax_t there, so it's just the bits and which of the two.
+struct pp_value
+{
+    uintmax_t bits;
+    bool is_unsigned;
+};
+
+// #if expression being evaluated from the expanded stack.
+struct pp_eval
+{
+    struct preprocessor *pp;
+    const struct pp_line *line;
+    uint32_t directive;
+
+    // Tokens left, as indexes in expanded.
+    uint32_t next;
+    uint32_t end;
+
+    // Whether the subexpression is evaluated, as opposed to e.g. the right
+    // operand of && after a 0. Division by zero is only an error if it is.
+    bool evaluate;
+
+    // Whether a diagnostic has been added. Only the first error is reported.
+    bool failed;
+};
+
+// Get bits of a #if value as intmax_t.
+static intmax_t _pp_value_signed(uintmax_t bits)
+{
+    return bits <= INTMAX_MAX ? (intmax_t)bits : -(intmax_t)~bits - 1;
+}
+
+// Get value of a hexadecimal digit. -1 if c isn't one.
+static int _pp_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+// Parse an integer constant. Returns false if the spelling isn't one, or
+// it's too large for uintmax_t.
+static bool _pp_parse_int(const char *spelling, struct pp_value *value)
+{
+    const char *p = spelling;
+    int base = 10;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    {
+        base = 16;
+        p += 2;
+    }
+    else if (p[0] == '0' && (p[1] == 'b' || p[1] == 'B'))
+    {
+        base = 2;
+        p += 2;
+    }
+    else if (p[0] == '0')
+    {
+        base = 8;
+    }
+
+    // Digits.
+    const char *digits = p;
+    uintmax_t bits = 0;
+    for (;; p++)
+    {
+        int digit = _pp_hex_digit(*p);
+        if (digit < 0 || digit >= base)
+        {
+            break;
+        }
+
+        if (bits > (UINTMAX_MAX - (uintmax_t)digit) / (uintmax_t)base)
+        {
+            return false;
+        }
+
+        bits = bits * (uintmax_t)base + (uintmax_t)digit;
+    }
+
+    if (p == digits)
+    {
+        return false;
+    }
+
+    // Suffix. u, and l or ll, in either order.
+    bool has_u = false;
+    bool has_l = false;
+    while (*p != 0)
+    {
+        if ((*p == 'u' || *p == 'U') && !has_u)
+        {
+            has_u = true;
+            p++;
+        }
+        else if ((*p == 'l' || *p == 'L') && !has_l)
+        {
+            has_l = true;
+            p += p[1] == p[0] ? 2 : 1;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    // Decimal constants too large for intmax_t have no type,
+    // but are commonly taken as unsigned like the others.
+    value->bits = bits;
+    value->is_unsigned = has_u || bits > INTMAX_MAX;
+    return true;
+}
+
+// Parse an escape sequence in a character constant. *p points at the
+// backslash, and is advanced past the sequence. Returns false if it's
+// invalid.
+static bool _pp_parse_escape(const char **p, uint32_t *c)
+{
+    const char *s = *p + 1;
+    int digit;
+    int max_digits;
+    switch (*s)
+    {
+    case '\'':
+    case '"':
+    case '?':
+    case '\\':
+        *c = (unsigned char)*s++;
+        break;
+
+    case 'a':
+        *c = 7;
+        s++;
+        break;
+
+    case 'b':
+        *c = 8;
+        s++;
+        break;
+
+    case 'f':
+        *c = 12;
+        s++;
+        break;
+
+    case 'n':
+        *c = 10;
+        s++;
+        break;
+
+    case 'r':
+        *c = 13;
+        s++;
+        break;
+
+    case 't':
+        *c = 9;
+        s++;
+        break;
+
+    case 'v':
+        *c = 11;
+        s++;
+        break;
+
+    case 'x':
+        // Any number of hex digits.
+        s++;
+        *c = 0;
+        if (_pp_hex_digit(*s) < 0)
+        {
+            return false;
+        }
+
+        while ((digit = _pp_hex_digit(*s)) >= 0)
+        {
+            if (*c >> 28 != 0)
+            {
+                return false;
+            }
+
+            *c = *c << 4 | (uint32_t)digit;
+            s++;
+        }
+        break;
+
+    case 'u':
+    case 'U':
+        // Universal character name.
+        max_digits = *s++ == 'u' ? 4 : 8;
+        *c = 0;
+        for (int i = 0; i < max_digits; i++)
+        {
+            digit = _pp_hex_digit(*s++);
+            if (digit < 0)
+            {
+                return false;
+            }
+
+            *c = *c << 4 | (uint32_t)digit;
+        }
+        break;
+
+    default:
+        // Up to three octal digits.
+        *c = 0;
+        if (*s < '0' || *s > '7')
+        {
+            return false;
+        }
+
+        for (int i = 0; i < 3 && *s >= '0' && *s <= '7'; i++)
+        {
+            *c = *c << 3 | (uint32_t)(*s++ - '0');
+        }
+        break;
+    }
+
+    *p = s;
+    return true;
+}
+
+// Parse a character constant. Returns false if the spelling isn't a valid
+// one.
+static bool _pp_parse_char(const char *spelling, struct pp_value *value)
+{
+    // Prefix. Wide ones hold code points. Plain ones hold bytes, and char
+    // is taken to be signed, as it is on most targets.
+    const char *p = spelling;
+    bool wide = true;
+    value->is_unsigned = true;
+    if (p[0] == 'L')
+    {
+        value->is_unsigned = false;
+        p++;
+    }
+    else if (p[0] == 'u' && p[1] == '8')
+    {
+        wide = false;
+        p += 2;
+    }
+    else if (p[0] == 'u' || p[0] == 'U')
+    {
+        p++;
+    }
+    else
+    {
+        wide = false;
+        value->is_unsigned = false;
+    }
+
+    assert(*p == '\'');
+    p++;
+
+    // Characters. Multi-character constants take the last code point if
+    // wide, otherwise all the bytes, like most compilers do.
+    uintmax_t bits = 0;
+    uint32_t count = 0;
+    while (*p != '\'')
+    {
+        uint32_t c;
+        if (*p == '\\')
+        {
+            if (!_pp_parse_escape(&p, &c))
+            {
+                return false;
+            }
+        }
+        else if (wide)
+        {
+            struct decode_utf8_result result = decode_utf8(p);
+            if (result.code_point < 0)
+            {
+                return false;
+            }
+
+            c = (uint32_t)result.code_point;
+            p += result.size;
+        }
+        else
+        {
+            c = (unsigned char)*p++;
+        }
+
+        bits = wide ? c : bits << 8 | (c & 0xFF);
+        count++;
+    }
+
+    if (count == 0)
+    {
+        return false;
+    }
+
+    if (spelling[0] == '\'' && count == 1 && (bits & 0x80) != 0)
+    {
+        bits |= ~(uintmax_t)0xFF;
+    }
+
+    value->bits = bits;
+    return true;
+}
+
+// Get syntactic category of the next token of a #if expression.
+// SYNCAT_EOL if there isn't one.
+static enum syncat _pp_eval_peek(const struct pp_eval *eval)
+{
+    if (eval->next == eval->end)
+    {
+        return SYNCAT_EOL;
+    }
+
+    struct preprocessor *pp = eval->pp;
+    return pp->tgroup->tokman.syncats[pp->expanded[eval->next].id];
+}
+
+// Add error diagnostic for the token of a #if expression at index i in
+// expanded, or the directive if it's past the end.
+static void _pp_eval_error(
+    struct pp_eval *eval,
+    uint32_t i,
+    enum diag_code code)
+{
+    if (eval->failed)
+    {
+        return;
+    }
+
+    eval->failed = true;
+    if (i < eval->end)
+    {
+        _pp_token_error(eval->pp, eval->pp->expanded[i].id, code);
+    }
+    else
+    {
+        _pp_line_error(
+            eval->pp, eval->line, eval->directive, eval->directive, code);
+    }
+}
+
+static struct pp_value _pp_eval_cond(struct pp_eval *eval);
+
+// Evaluate an identifier in a #if expression. It's either a defined
+// operator, or not a macro and so 0.
+static struct pp_value _pp_eval_ident(struct pp_eval *eval)
+{
+    struct preprocessor *pp = eval->pp;
+    struct tokman *tokman = &pp->tgroup->tokman;
+    struct pp_value value = {0, false};
+
+    tokid_t id = pp->expanded[eval->next++].id;
+    if (tokman->spellings[id] != pp->keywords[PP_KEYWORD_DEFINED])
+    {
+        return value;
+    }
+
+    // defined X or defined ( X )
+    bool paren = _pp_eval_peek(eval) == SYNCAT_LPAREN;
+    if (paren)
+    {
+        eval->next++;
+    }
+
+    if (_pp_eval_peek(eval) != SYNCAT_IDENT)
+    {
+        _pp_eval_error(eval, eval->next, DIAG_CODE_MACRO_NAME_EXPECTED);
+        return value;
+    }
+
+    strid_t name = tokman->spellings[pp->expanded[eval->next++].id];
+    if (paren)
+    {
+        if (_pp_eval_peek(eval) != SYNCAT_RPAREN)
+        {
+            _pp_eval_error(eval, eval->next, DIAG_CODE_INVALID_CONDITION);
+            return value;
+        }
+
+        eval->next++;
+    }
+
+    value.bits = macro_table_get(&pp->macros, name) != 0;
+    return value;
+}
+
+// Evaluate a unary #if expression.
+static struct pp_value _pp_eval_unary(struct pp_eval *eval)
+{
+    struct preprocessor *pp = eval->pp;
+    struct pp_value value = {0, false};
+    enum syncat syncat = _pp_eval_peek(eval);
+    switch (syncat)
+    {
+    case SYNCAT_PLUS:
+    case SYNCAT_MINUS:
+    case SYNCAT_TILDE:
+    case SYNCAT_EXCLAIM:
+        eval->next++;
+        value = _pp_eval_unary(eval);
+        if (syncat == SYNCAT_MINUS)
+        {
+            value.bits = 0 - value.bits;
+        }
+        else if (syncat == SYNCAT_TILDE)
+        {
+            value.bits = ~value.bits;
+        }
+        else if (syncat == SYNCAT_EXCLAIM)
+        {
+            value.bits = value.bits == 0;
+            value.is_unsigned = false;
+        }
+        return value;
+
+    case SYNCAT_LPAREN:
+        eval->next++;
+        value = _pp_eval_cond(eval);
+        if (_pp_eval_peek(eval) != SYNCAT_RPAREN)
+        {
+            _pp_eval_error(eval, eval->next, DIAG_CODE_INVALID_CONDITION);
+            return value;
+        }
+
+        eval->next++;
+        return value;
+
+    case SYNCAT_PP_NUMBER:
+    case SYNCAT_CHAR_CONST:
+    {
+        const char *spelling =
+            _pp_spelling(pp, pp->expanded[eval->next].id);
+        bool valid = syncat == SYNCAT_PP_NUMBER
+            ? _pp_parse_int(spelling, &value)
+            : _pp_parse_char(spelling, &value);
+
+        if (!valid)
+        {
+            _pp_eval_error(
+                eval, eval->next, DIAG_CODE_INVALID_INTEGER_CONSTANT);
+            value.bits = 0;
+            value.is_unsigned = false;
+            return value;
+        }
+
+        eval->next++;
+        return value;
+    }
+
+    case SYNCAT_IDENT:
+        return _pp_eval_ident(eval);
+
+    default:
+        _pp_eval_error(eval, eval->next, DIAG_CODE_INVALID_CONDITION);
+        return value;
+    }
+}
+
+// Get precedence of a binary operator in #if expressions, higher binding
+// tighter. 0 if the syntactic category isn't one.
+static int _pp_binary_precedence(enum syncat syncat)
+{
+    switch (syncat)
+    {
+    case SYNCAT_OR_OR:
+        return 1;
+
+    case SYNCAT_AND_AND:
+        return 2;
+
+    case SYNCAT_VBAR:
+        return 3;
+
+    case SYNCAT_CARET:
+        return 4;
+
+    case SYNCAT_AMPERSAND:
+        return 5;
+
+    case SYNCAT_EQ_EQ:
+    case SYNCAT_NE:
+        return 6;
+
+    case SYNCAT_LT:
+    case SYNCAT_GT:
+    case SYNCAT_LE:
+    case SYNCAT_GE:
+        return 7;
+
+    case SYNCAT_SHL:
+    case SYNCAT_SHR:
+        return 8;
+
+    case SYNCAT_PLUS:
+    case SYNCAT_MINUS:
+        return 9;
+
+    case SYNCAT_ASTERISK:
+    case SYNCAT_SLASH:
+    case SYNCAT_PERCENT:
+        return 10;
+
+    default:
+        return 0;
+    }
+}
+
+// Apply a binary operator to #if values. op is the operator's index in
+// expanded. Signed overflow wraps, and shifting by the width or more, or a
+// negative amount, shifts out every bit.
+static struct pp_value _pp_eval_apply(
+    struct pp_eval *eval,
+    uint32_t op,
+    struct pp_value lhs,
+    struct pp_value rhs)
+{
+    enum syncat syncat =
+        eval->pp->tgroup->tokman.syncats[eval->pp->expanded[op].id];
+    uintmax_t a = lhs.bits;
+    uintmax_t b = rhs.bits;
+
+    // The usual arithmetic conversions. Shifts have the left operand's type,
+    // and comparisons and logical operators give int.
+    struct pp_value result;
+    result.bits = 0;
+    result.is_unsigned = lhs.is_unsigned || rhs.is_unsigned;
+
+    bool overshift = b >= sizeof(uintmax_t) * CHAR_BIT;
+    int order = result.is_unsigned
+        ? (a > b) - (a < b)
+        : (_pp_value_signed(a) > _pp_value_signed(b)) -
+            (_pp_value_signed(a) < _pp_value_signed(b));
+
+    switch (syncat)
+    {
+    case SYNCAT_ASTERISK:
+        result.bits = a * b;
+        break;
+
+    case SYNCAT_SLASH:
+    case SYNCAT_PERCENT:
+        if (b == 0)
+        {
+            if (eval->evaluate)
+            {
+                _pp_eval_error(eval, op, DIAG_CODE_DIVISION_BY_ZERO);
+            }
+        }
+        else if (result.is_unsigned)
+        {
+            result.bits = syncat == SYNCAT_SLASH ? a / b : a % b;
+        }
+        else if (_pp_value_signed(b) == -1)
+        {
+            // Negate without overflowing on INTMAX_MIN / -1.
+            result.bits = syncat == SYNCAT_SLASH ? 0 - a : 0;
+        }
+        else
+        {
+            intmax_t x = _pp_value_signed(a);
+            intmax_t y = _pp_value_signed(b);
+            result.bits = (uintmax_t)(syncat == SYNCAT_SLASH ? x / y : x % y);
+        }
+        break;
+
+    case SYNCAT_PLUS:
+        result.bits = a + b;
+        break;
+
+    case SYNCAT_MINUS:
+        result.bits = a - b;
+        break;
+
+    case SYNCAT_SHL:
+        result.bits = overshift ? 0 : a << b;
+        result.is_unsigned = lhs.is_unsigned;
+        break;
+
+    case SYNCAT_SHR:
+        // Negative values shift in ones, as on most targets.
+        result.is_unsigned = lhs.is_unsigned;
+        if (!lhs.is_unsigned && a > INTMAX_MAX)
+        {
+            result.bits = overshift ? ~(uintmax_t)0 : ~(~a >> b);
+        }
+        else
+        {
+            result.bits = overshift ? 0 : a >> b;
+        }
+        break;
+
+    case SYNCAT_LT:
+        result.bits = order < 0;
+        result.is_unsigned = false;
+        break;
+
+    case SYNCAT_GT:
+        result.bits = order > 0;
+        result.is_unsigned = false;
+        break;
+
+    case SYNCAT_LE:
+        result.bits = order <= 0;
+        result.is_unsigned = false;
+        break;
+
+    case SYNCAT_GE:
+        result.bits = order >= 0;
+        result.is_unsigned = false;
+        break;
+
+    case SYNCAT_EQ_EQ:
+        result.bits = a == b;
+        result.is_unsigned = false;
+        break;
+
+    case SYNCAT_NE:
+        result.bits = a != b;
+        result.is_unsigned = false;
+        break;
+
+    case SYNCAT_AMPERSAND:
+        result.bits = a & b;
+        break;
+
+    case SYNCAT_CARET:
+        result.bits = a ^ b;
+        break;
+
+    case SYNCAT_VBAR:
+        result.bits = a | b;
+        break;
+
+    case SYNCAT_AND_AND:
+        result.bits = a != 0 && b != 0;
+        result.is_unsigned = false;
+        break;
+
+    case SYNCAT_OR_OR:
+        result.bits = a != 0 || b != 0;
+        result.is_unsigned = false;
+        break;
+
+    default:
+        assert(false);
+        break;
+    }
+
+    return result;
+}
+
+// Evaluate a #if expression of binary operators binding at least as
+// tightly as min_precedence. They're all left-associative.
+static struct pp_value _pp_eval_binary(
+    struct pp_eval *eval,
+    int min_precedence)
+{
+    struct pp_value lhs = _pp_eval_unary(eval);
+    for (;;)
+    {
+        enum syncat syncat = _pp_eval_peek(eval);
+        int precedence = _pp_binary_precedence(syncat);
+        if (precedence < min_precedence)
+        {
+            return lhs;
+        }
+
+        uint32_t op = eval->next++;
+
+        // The right operand of && or || isn't evaluated if the left
+        // decides the result.
+        bool evaluate = eval->evaluate;
+        if ((syncat == SYNCAT_AND_AND && lhs.bits == 0) ||
+            (syncat == SYNCAT_OR_OR && lhs.bits != 0))
+        {
+            eval->evaluate = false;
+        }
+
+        struct pp_value rhs = _pp_eval_binary(eval, precedence + 1);
+        eval->evaluate = evaluate;
+        lhs = _pp_eval_apply(eval, op, lhs, rhs);
+    }
+}
+
+// Evaluate a conditional #if expression. Only the chosen operand of ?: is
+// evaluated.
+static struct pp_value _pp_eval_cond(struct pp_eval *eval)
+{
+    struct pp_value cond = _pp_eval_binary(eval, 1);
+    if (_pp_eval_peek(eval) != SYNCAT_QMARK)
+    {
+        return cond;
+    }
+
+    eval->next++;
+    bool evaluate = eval->evaluate;
+    eval->evaluate = evaluate && cond.bits != 0;
+    struct pp_value a = _pp_eval_cond(eval);
+    if (_pp_eval_peek(eval) != SYNCAT_COLON)
+    {
+        _pp_eval_error(eval, eval->next, DIAG_CODE_INVALID_CONDITION);
+        eval->evaluate = evaluate;
+        return a;
+    }
+
+    eval->next++;
+    eval->evaluate = evaluate && cond.bits == 0;
+    struct pp_value b = _pp_eval_cond(eval);
+    eval->evaluate = evaluate;
+
+    struct pp_value result = cond.bits != 0 ? a : b;
+    result.is_unsigned = a.is_unsigned || b.is_unsigned;
+    return result;
+}
+
+// Whether a token is the given keyword.
+static bool _pp_is_keyword(
+    struct preprocessor *pp,
+    tokid_t id,
+    enum pp_keyword keyword)
+{
+    struct tokman *tokman = &pp->tgroup->tokman;
+    return
+        tokman->syncats[id] == SYNCAT_IDENT &&
+        tokman->spellings[id] == pp->keywords[keyword];
+}
+
+// Evaluate the expression of a #if or #elif line. Adds a diagnostic and
+// returns false if it's invalid.
+static bool _pp_eval_if(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t directive)
+{
+    pp->in_condition = true;
+    uint32_t first = _pp_expand_operands(pp, line, directive + 1);
+    pp->in_condition = false;
+
+    // Evaluate. It has to use up every token.
+    struct pp_eval eval;
+    eval.pp = pp;
+    eval.line = line;
+    eval.directive = directive;
+    eval.next = first;
+    eval.end = pp->expanded_len;
+    eval.evaluate = true;
+    eval.failed = false;
+
+    struct pp_value value = _pp_eval_cond(&eval);
+    if (eval.next < eval.end)
+    {
+        _pp_eval_error(&eval, eval.next, DIAG_CODE_INVALID_CONDITION);
+    }
+
+    pp->expanded_len = first;
+    return !eval.failed && value.bits != 0;
+}
+
+// Get the macro name X if the rest of a #if line is exactly !defined X or
+// !defined(X), the other include guard shape. 0 otherwise.
+static strid_t _pp_if_guard_name(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t directive)
+{
+    uint32_t i = _pp_line_skip_trivia(pp, line, directive + 1);
+    if (i == line->count || _pp_line_syncat(pp, line, i) != SYNCAT_EXCLAIM)
+    {
+        return 0;
+    }
+
+    i = _pp_line_skip_trivia(pp, line, i + 1);
+    if (!_pp_line_is_keyword(pp, line, i, PP_KEYWORD_DEFINED))
+    {
+        return 0;
+    }
+
+    i = _pp_line_skip_trivia(pp, line, i + 1);
+    bool paren =
+        i < line->count && _pp_line_syncat(pp, line, i) == SYNCAT_LPAREN;
+    if (paren)
+    {
+        i = _pp_line_skip_trivia(pp, line, i + 1);
+    }
+
+    if (i == line->count || _pp_line_syncat(pp, line, i) != SYNCAT_IDENT)
+    {
+        return 0;
+    }
+
+    strid_t name = _pp_line_spelling(pp, line, i);
+    i = _pp_line_skip_trivia(pp, line, i + 1);
+    if (paren)
+    {
+        if (i == line->count ||
+            _pp_line_syncat(pp, line, i) != SYNCAT_RPAREN)
+        {
+            return 0;
+        }
+
+        i = _pp_line_skip_trivia(pp, line, i + 1);
+    }
+
+    return i == line->count ? name : 0;
+}
+
+// Handle #if, #ifdef, or #ifndef.
+static void _pp_if(
+    struct preprocessor *pp,
+    struct pp_file *file,
+    const struct pp_line *line,
+    uint32_t hash,
+    uint32_t directive,
+    enum pp_keyword keyword)
+{
+    // Conditionals in skipped groups only matter for nesting.
+    bool skipping = _pp_skipping(pp, file);
+    bool value = false;
+    strid_t name = 0;
+    if (!skipping)
+    {
+        if (keyword == PP_KEYWORD_IF)
+        {
+            value = _pp_eval_if(pp, line, directive);
+            if (file->guard == PP_GUARD_START)
+            {
+                name = _pp_if_guard_name(pp, line, directive);
+            }
+        }
+        else
+        {
+            name = _pp_macro_name(pp, line, directive, directive + 1);
+            if (name != 0)
+            {
+                bool defined = macro_table_get(&pp->macros, name) != 0;
+                value = (keyword == PP_KEYWORD_IFDEF) == defined;
+            }
+        }
+    }
+
+    // Re-allocate if necessary.
+    DYNARR_GROW(
+        struct pp_cond, pp->conds, pp->cond_count, pp->cond_capacity, 1,
+        MEM_TAG_PREPROCESSOR);
+
+    // Push conditional.
+    struct pp_cond *cond = &pp->conds[pp->cond_count++];
+    cond->start = _pp_line_start(pp, line, hash);
+    cond->end = _pp_line_end(pp, line, directive);
+    cond->taken = skipping || value;
+    cond->skipping = skipping || !value;
+    cond->seen_else = false;
+
+    // An #ifndef or #if !defined at the very start of a file
+    // might be an include guard.
+    if (file->guard == PP_GUARD_START &&
+        keyword != PP_KEYWORD_IFDEF && name != 0)
+    {
+        file->guard = PP_GUARD_OPEN;
+        file->guard_name = name;
+    }
+    else if (file->guard != PP_GUARD_OPEN)
+    {
+        file->guard = PP_GUARD_NONE;
+    }
+}
+
+// Handle #elif, #else, or #endif.
+static void _pp_else_or_endif(
+    struct preprocessor *pp,
+    struct pp_file *file,
+    const struct pp_line *line,
+    uint32_t hash,
+    uint32_t directive,
+    enum pp_keyword keyword)
+{
+    if (pp->cond_count == file->cond_base)
+    {
+        _pp_line_error(
+            pp, line, hash, directive,
+            DIAG_CODE_UNMATCHED_CONDITIONAL_DIRECTIVE);
+        return;
+    }
+
+    // Any other group at the include guard's level means it's not one.
+    bool guard_level = pp->cond_count == file->cond_base + 1;
+    if (guard_level && file->guard == PP_GUARD_OPEN)
+    {
+        file->guard =
+            keyword == PP_KEYWORD_ENDIF ? PP_GUARD_CLOSED : PP_GUARD_NONE;
+    }
+
+    if (keyword == PP_KEYWORD_ENDIF)
+    {
+        pp->cond_count--;
+        return;
+    }
+
+    struct pp_cond *cond = &pp->conds[pp->cond_count - 1];
+    if (cond->seen_else)
+    {
+        _pp_line_error(
+            pp, line, hash, directive, DIAG_CODE_DIRECTIVE_AFTER_ELSE);
+    }
+
+    if (cond->taken)
+    {
+        cond->skipping = true;
+    }
+    else if (keyword == PP_KEYWORD_ELSE)
+    {
+        cond->taken = true;
+        cond->skipping = false;
+    }
+    else
+    {
+        cond->taken = _pp_eval_if(pp, line, directive);
+        cond->skipping = !cond->taken;
+    }
+
+    if (keyword == PP_KEYWORD_ELSE)
+    {
+        cond->seen_else = true;
+    }
+}
+
+// Whether a character separates path components.
+static bool _pp_is_path_separator(char c)
+{
+    return c == '/' || c == '\\';
+}
+
+// Try to find or load an #include'd file in a directory.
+// Returns PHYS_FILE_NONE if it doesn't exist there.
+static phys_file_id_t _pp_try_include(
+    struct preprocessor *pp,
+    const char *dir,
+    size_t dir_len,
+    const char *name,
+    size_t name_len)
+{
+    struct tgroup *tgroup = pp->tgroup;
+
+    // Build path.
+    bool separate = dir_len > 0 && !_pp_is_path_separator(dir[dir_len - 1]);
+    size_t path_len = dir_len + separate + name_len;
+    if (path_len > UINT32_MAX)
+    {
+        translation_limit_exceeded();
+    }
+
+    char *path = ALLOC_ARRAY(char, path_len + 1, MEM_TAG_PREPROCESSOR);
+    memcpy(path, dir, dir_len);
+    if (separate)
+    {
+        path[dir_len] = '/';
+    }
+
+    memcpy(path + dir_len + separate, name, name_len);
+    path[path_len] = 0;
+
+    // Record lookup.
+    strid_t path_id =
+        strman_get_id(&tgroup->strman, path, (uint32_t)path_len);
+    struct pp_lookups *lookups = pp->lookups;
+    if (lookups != NULL)
+    {
+        DYNARR_GROW(
+            strid_t, lookups->names, lookups->count, lookups->capacity, 1,
+            MEM_TAG_PREPROCESSOR);
+        lookups->names[lookups->count++] = path_id;
+    }
+
+    // Find or load.
+    phys_file_id_t id =
+        srcman_load_phys_file(&tgroup->srcman, path_id, path);
+
+    jocc_free(path);
+    return id;
+}
+
+static int _pp_file(
+    struct preprocessor *pp,
     phys_file_id_t phys_file_id,
-    astid_t included_at)
+    astid_t included_at);
+
+// Macro-expand an #include operand from lexeme i on, and get the header
+// name it forms, copied with room for a NUL. Returns NULL if it doesn't form
+// one.
+static char *_pp_expanded_header_name(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i,
+    bool *angled,
+    size_t *name_len)
+{
+    struct tgroup *tgroup = pp->tgroup;
+    struct tokman *tokman = &tgroup->tokman;
+    uint32_t first = _pp_expand_operands(pp, line, i);
+    uint32_t count = pp->expanded_len - first;
+    const struct pp_token *tokens = pp->expanded + first;
+
+    char *name = NULL;
+    if (count == 1 && tokman->syncats[tokens[0].id] == SYNCAT_STRING_LIT)
+    {
+        // "h-char-sequence"
+        const char *spelling = _pp_spelling(pp, tokens[0].id);
+        if (spelling[0] == '"')
+        {
+            *name_len = strlen(spelling) - 2;
+            name = ALLOC_ARRAY(char, *name_len + 1, MEM_TAG_PREPROCESSOR);
+            memcpy(name, spelling + 1, *name_len);
+        }
+    }
+    else if (
+        count >= 2 &&
+        tokman->syncats[tokens[0].id] == SYNCAT_LT &&
+        tokman->syncats[tokens[count - 1].id] == SYNCAT_GT)
+    {
+        // <h-char-sequence>
+        // Spell out the tokens between, with a space wherever there was
+        // white-space.
+        struct tmp_stack *tmp_stack = &tgroup->tmp_stack;
+        tmp_stack_mark_t mark = tmp_stack_mark(tmp_stack);
+        for (uint32_t j = 1; j < count - 1; j++)
+        {
+            if (j > 1 &&
+                (tokens[j].flags & (TOKEN_LEADING_WS | TOKEN_LINE_START)))
+            {
+                tmp_stack_push(tmp_stack, " ", 1);
+            }
+
+            const char *spelling = _pp_spelling(pp, tokens[j].id);
+            tmp_stack_push(tmp_stack, spelling, strlen(spelling));
+        }
+
+        *angled = true;
+        *name_len = tmp_stack->size - mark;
+        name = ALLOC_ARRAY(char, *name_len + 1, MEM_TAG_PREPROCESSOR);
+        memcpy(name, tmp_stack->data + mark, *name_len);
+        tmp_stack_rewind(tmp_stack, mark);
+    }
+
+    pp->expanded_len = first;
+    return name;
+}
+
+// Handle #include.
+static int _pp_include(
+    struct preprocessor *pp,
+    struct pp_file *file,
+    const struct pp_line *line,
+    uint32_t directive)
+{
+    struct tgroup *tgroup = pp->tgroup;
+
+    // Find header name. It's part of a longer string either way, so copy
+    // it to get it NUL-terminated.
+    uint32_t first = _pp_line_skip_trivia(pp, line, directive + 1);
+    uint32_t last = first;
+    bool angled = false;
+    char *name = NULL;
+    size_t name_len = 0;
+    if (first < line->count &&
+        _pp_line_syncat(pp, line, first) == SYNCAT_STRING_LIT)
+    {
+        // "h-char-sequence"
+        const char *spelling = strman_get_str(
+            &tgroup->strman, _pp_line_spelling(pp, line, first));
+
+        if (spelling[0] == '"')
+        {
+            name_len = strlen(spelling) - 2;
+            name = ALLOC_ARRAY(char, name_len + 1, MEM_TAG_PREPROCESSOR);
+            memcpy(name, spelling + 1, name_len);
+        }
+    }
+    else if (
+        first < line->count &&
+        _pp_line_syncat(pp, line, first) == SYNCAT_LT)
+    {
+        // <q-char-sequence>
+        // Lexed as separate tokens, so take the source text between < and >.
+        uint32_t gt = tokman_find_syncat(
+            &tgroup->tokman, _pp_line_get(line, first) + 1,
+            line->first + line->count, SYNCAT_GT) - line->first;
+
+        if (gt < line->count)
+        {
+            srcloc_t start = _pp_line_end(pp, line, first);
+            srcloc_t end = _pp_line_start(pp, line, gt);
+
+            last = gt;
+            angled = true;
+            name_len = end - start;
+            name = ALLOC_ARRAY(char, name_len + 1, MEM_TAG_PREPROCESSOR);
+            memcpy(name, file->data + (start - file->start), name_len);
+        }
+    }
+    else if (first < line->count)
+    {
+        // Anything else is macro-expanded, and has to form one of those.
+        last = line->count - 1;
+        name = _pp_expanded_header_name(
+            pp, line, first, &angled, &name_len);
+    }
+
+    if (name == NULL || name_len == 0)
+    {
+        uint32_t end = first < line->count ? first : directive;
+        _pp_line_error(
+            pp, line, directive, end, DIAG_CODE_HEADER_NAME_EXPECTED);
+        jocc_free(name);
+        return 1;
+    }
+
+    name[name_len] = 0;
+
+    // Make a node for the directive so the #include'd logi_file can
+    // refer to it.
+    astid_t included_at =
+        _pp_line_to_node(pp, line, SYNCAT_INCLUDE_DIRECTIVE);
+
+    // Search for the file. Absolute paths are used as-is. "Quoted" names are
+    // looked for relative to the including file first. Then include dirs.
+    struct srcman *srcman = &tgroup->srcman;
+    phys_file_id_t id = PHYS_FILE_NONE;
+    bool absolute =
+        _pp_is_path_separator(name[0]) ||
+        (name_len >= 2 && name[1] == ':');
+
+    if (absolute)
+    {
+        id = _pp_try_include(pp, "", 0, name, name_len);
+    }
+    else if (!angled)
+    {
+        struct phys_file *includer =
+            srcman_get_phys_file(srcman, file->phys_file_id);
+        const char *dir = strman_get_str(&tgroup->strman, includer->name);
+
+        size_t dir_len = strlen(dir);
+        while (dir_len > 0 && !_pp_is_path_separator(dir[dir_len - 1]))
+        {
+            dir_len--;
+        }
+
+        id = _pp_try_include(pp, dir, dir_len, name, name_len);
+    }
+
+    for (uint32_t i = 0;
+        !absolute && id == PHYS_FILE_NONE && i < tgroup->include_dir_count;
+        i++)
+    {
+        const char *dir =
+            strman_get_str(&tgroup->strman, tgroup->include_dirs[i]);
+        id = _pp_try_include(pp, dir, strlen(dir), name, name_len);
+    }
+
+    jocc_free(name);
+
+    if (id == PHYS_FILE_NONE)
+    {
+        _pp_line_error(pp, line, first, last, DIAG_CODE_INCLUDE_NOT_FOUND);
+        return 1;
+    }
+
+    // Multiple-include optimization. Skip files we know would contribute
+    // nothing without even lexing them. Properties of the content are
+    // tracked on the first phys_file with that content.
+    phys_file_id_t content_id = srcman_get_phys_file(srcman, id)->content_id;
+    struct phys_file *content = srcman_get_phys_file(srcman, content_id);
+    if (content->pragma_once &&
+        content_id / 32 < pp->once_word_count &&
+        (pp->once_words[content_id / 32] >> (content_id % 32)) & 1)
+    {
+        return 0;
+    }
+
+    if (content->skip_ifdef != 0 &&
+        macro_table_get(&pp->macros, content->skip_ifdef) != 0)
+    {
+        return 0;
+    }
+
+    // Preprocess #include'd file, then pick up where we left off.
+    if (pp->include_depth == PP_MAX_INCLUDE_DEPTH)
+    {
+        _pp_line_error(
+            pp, line, first, last, DIAG_CODE_INCLUDE_NESTED_TOO_DEEPLY);
+        return 1;
+    }
+
+    srcloc_t resume_srcloc = tgroup->srcloc;
+    pp->include_depth++;
+    int ret = _pp_file(pp, id, included_at);
+    pp->include_depth--;
+    tgroup->srcloc = resume_srcloc;
+
+    return ret;
+}
+
+// Handle #pragma.
+static void _pp_pragma(
+    struct preprocessor *pp,
+    struct pp_file *file,
+    const struct pp_line *line,
+    uint32_t directive)
+{
+    uint32_t i = _pp_line_skip_trivia(pp, line, directive + 1);
+    if (!_pp_line_is_keyword(pp, line, i, PP_KEYWORD_ONCE))
+    {
+        return; // Ignore unknown pragmas.
+    }
+
+    // Remember #pragma once for the content, and that
+    // this preprocessor has processed it.
+    struct srcman *srcman = &pp->tgroup->srcman;
+    phys_file_id_t content_id =
+        srcman_get_phys_file(srcman, file->phys_file_id)->content_id;
+    srcman_get_phys_file(srcman, content_id)->pragma_once = true;
+
+    uint32_t word = content_id / 32;
+    if (word >= pp->once_word_count)
+    {
+        // Every word is in use, so the count doubles as the capacity.
+        uint32_t old_count = pp->once_word_count;
+        DYNARR_RESERVE(
+            uint32_t, pp->once_words, old_count, pp->once_word_count, word + 1,
+            MEM_TAG_PREPROCESSOR);
+        memset(
+            pp->once_words + old_count, 0,
+            sizeof(uint32_t) * (pp->once_word_count - old_count));
+    }
+
+    pp->once_words[word] |= UINT32_C(1) << (content_id % 32);
+}
+
+// Point a file's srclines from pres_line up to end at its current
+// pres_file. Until a #line, they already are.
+static void _pp_set_pres_lines(
+    struct srcman *srcman,
+    const struct pp_file *file,
+    uint32_t end)
+{
+    struct srcline *lines = srcman->lines;
+    if (file->pres_line == end ||
+        lines[file->pres_line].pres_file_id == file->pres_file_id)
+    {
+        return;
+    }
+
+    for (uint32_t i = file->pres_line; i < end; i++)
+    {
+        lines[i].pres_file_id = file->pres_file_id;
+        lines[i].line_num_offset = i - file->pres_line;
+    }
+}
+
+// Handle #line.
+static void _pp_line_directive(
+    struct preprocessor *pp,
+    struct pp_file *file,
+    const struct pp_line *line,
+    uint32_t directive)
+{
+    struct tgroup *tgroup = pp->tgroup;
+    struct tokman *tokman = &tgroup->tokman;
+
+    // Operands are macro-expanded, and then have to be a digit-sequence
+    // from 1 to 2147483647 and optionally a "s-char-sequence".
+    uint32_t first = _pp_expand_operands(pp, line, directive + 1);
+    uint32_t count = pp->expanded_len - first;
+    const struct pp_token *tokens = pp->expanded + first;
+
+    bool valid =
+        (count == 1 || count == 2) &&
+        tokman->syncats[tokens[0].id] == SYNCAT_PP_NUMBER;
+
+    uint32_t number = 0;
+    for (const char *p = valid ? _pp_spelling(pp, tokens[0].id) : "";
+        valid && *p != 0;
+        p++)
+    {
+        uint32_t digit = (uint32_t)(*p - '0');
+        valid = *p >= '0' && *p <= '9' && number <= (INT32_MAX - digit) / 10;
+        number = number * 10 + digit;
+    }
+
+    strid_t name = file->pres_name;
+    if (valid && count == 2)
+    {
+        const char *spelling = _pp_spelling(pp, tokens[1].id);
+        valid =
+            tokman->syncats[tokens[1].id] == SYNCAT_STRING_LIT &&
+            spelling[0] == '"';
+
+        if (valid)
+        {
+            name = strman_get_id(
+                &tgroup->strman, spelling + 1, (uint32_t)strlen(spelling) - 2);
+        }
+    }
+
+    pp->expanded_len = first;
+    if (!valid || number == 0)
+    {
+        _pp_line_error(
+            pp, line, directive, line->count - 1,
+            DIAG_CODE_INVALID_LINE_DIRECTIVE);
+        return;
+    }
+
+    // Lines after the directive's last get a new pres_file.
+    struct srcman *srcman = &tgroup->srcman;
+    srcloc_t line_start;
+    uint32_t next_line = (uint32_t)(srcman_get_line(
+        srcman, _pp_line_start(pp, line, line->count - 1), &line_start) -
+        srcman->lines) + 1;
+
+    _pp_set_pres_lines(srcman, file, next_line);
+
+    uint32_t phys_line_num =
+        srcman_get_pres_file(srcman, file->pres_file_id)->phys_line_num_base +
+        (next_line - file->pres_line);
+
+    file->pres_file_id = srcman_add_pres_file(
+        srcman, file->logi_file_id, phys_line_num, name, number);
+    file->pres_name = name;
+    file->pres_line = next_line;
+}
+
+// Parse a function-like macro's parameters into params. i is the index of
+// the lexeme after the (. Returns the index of the lexeme after the ), or 0
+// after adding a diagnostic if the parameter list is invalid.
+static uint32_t _pp_define_params(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i,
+    struct macro *macro,
+    strid_t *params)
+{
+    strid_t va_args = pp->keywords[PP_KEYWORD_VA_ARGS];
+    for (;;)
+    {
+        i = _pp_line_skip_trivia(pp, line, i);
+        if (i == line->count)
+        {
+            break;
+        }
+
+        enum syncat syncat = _pp_line_syncat(pp, line, i);
+        if (syncat == SYNCAT_RPAREN && macro->param_count == 0)
+        {
+            return i + 1;
+        }
+
+        // Identifier, or ... for the rest of the arguments.
+        strid_t param = va_args;
+        if (syncat == SYNCAT_ELLIPSIS)
+        {
+            macro->variadic = true;
+        }
+        else if (syncat == SYNCAT_IDENT)
+        {
+            param = _pp_line_spelling(pp, line, i);
+            bool valid = param != va_args;
+            for (uint32_t j = 0; valid && j < macro->param_count; j++)
+            {
+                valid = params[j] != param;
+            }
+
+            if (!valid)
+            {
+                break;
+            }
+        }
+        else
+        {
+            break;
+        }
+
+        if (macro->param_count == UINT16_MAX)
+        {
+            translation_limit_exceeded();
+        }
+
+        params[macro->param_count++] = param;
+
+        // Then ) or, unless it was ..., a comma.
+        i = _pp_line_skip_trivia(pp, line, i + 1);
+        if (i < line->count && _pp_line_syncat(pp, line, i) == SYNCAT_RPAREN)
+        {
+            return i + 1;
+        }
+
+        if (macro->variadic ||
+            i == line->count ||
+            _pp_line_syncat(pp, line, i) != SYNCAT_COMMA)
+        {
+            break;
+        }
+
+        i++;
+    }
+
+    uint32_t last = i < line->count ? i : line->count - 1;
+    _pp_line_error(pp, line, last, last, DIAG_CODE_INVALID_MACRO_PARAMS);
+    return 0;
+}
+
+// Parse a macro's replacement list, from lexeme i to the end of the line,
+// into body. Returns false after adding a diagnostic if it's invalid.
+static bool _pp_define_body(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t i,
+    struct macro *macro,
+    const strid_t *params,
+    struct macro_token *body)
+{
+    uint32_t count = 0;
+    for (i = _pp_line_skip_trivia(pp, line, i);
+        i < line->count;
+        i = _pp_line_skip_trivia(pp, line, i + 1))
+    {
+        struct macro_token *token = &body[count++];
+        token->id = _pp_line_get(line, i);
+        token->param = 0;
+        token->kind = MACRO_TOKEN_COPY;
+
+        enum syncat syncat = _pp_line_syncat(pp, line, i);
+        if (syncat == SYNCAT_HASH_HASH)
+        {
+            token->kind = MACRO_TOKEN_PASTE;
+            continue;
+        }
+
+        if (!macro->function_like)
+        {
+            continue;
+        }
+
+        // Find parameter, or the one # applies to.
+        uint32_t at = i;
+        if (syncat == SYNCAT_HASH)
+        {
+            at = _pp_line_skip_trivia(pp, line, i + 1);
+        }
+
+        uint32_t param = macro->param_count;
+        if (at < line->count && _pp_line_syncat(pp, line, at) == SYNCAT_IDENT)
+        {
+            strid_t spelling = _pp_line_spelling(pp, line, at);
+            for (param = 0;
+                param < macro->param_count && params[param] != spelling;
+                param++)
+            {
+            }
+        }
+
+        if (syncat == SYNCAT_HASH)
+        {
+            if (param == macro->param_count)
+            {
+                _pp_line_error(
+                    pp, line, i, at < line->count ? at : i,
+                    DIAG_CODE_STRINGIZE_WITHOUT_PARAM);
+                return false;
+            }
+
+            token->kind = MACRO_TOKEN_STRINGIZE;
+            token->param = (uint16_t)param;
+            i = at;
+        }
+        else if (param < macro->param_count)
+        {
+            token->kind = MACRO_TOKEN_ARG;
+            token->param = (uint16_t)param;
+        }
+    }
+
+    // ## needs something on both sides.
+    if (count > 0 &&
+        (body[0].kind == MACRO_TOKEN_PASTE ||
+         body[count - 1].kind == MACRO_TOKEN_PASTE))
+    {
+        tokid_t id =
+            body[0].kind == MACRO_TOKEN_PASTE ? body[0].id : body[count - 1].id;
+        _pp_line_error(
+            pp, line, id - line->first, id - line->first,
+            DIAG_CODE_PASTE_AT_EDGE);
+        return false;
+    }
+
+    // Parameters next to ## get pasted as written instead of expanded.
+    for (uint32_t j = 0; j < count; j++)
+    {
+        if (body[j].kind == MACRO_TOKEN_ARG &&
+            ((j > 0 && body[j - 1].kind == MACRO_TOKEN_PASTE) ||
+             (j + 1 < count && body[j + 1].kind == MACRO_TOKEN_PASTE)))
+        {
+            body[j].kind = MACRO_TOKEN_RAW_ARG;
+        }
+    }
+
+    macro->body_count = count;
+    return true;
+}
+
+// Whether a macro is defined the same as the given definition: the same
+// kind, the same parameters, and the same replacement list, spelled the same
+// with white-space between the same tokens.
+static bool _pp_same_definition(
+    struct preprocessor *pp,
+    macro_id_t id,
+    const struct macro *macro,
+    const strid_t *params,
+    const struct macro_token *body)
+{
+    const struct macro_table *table = &pp->macros;
+    const struct macro *old = macro_table_get_macro(table, id);
+    if (old->function_like != macro->function_like ||
+        old->variadic != macro->variadic ||
+        old->param_count != macro->param_count ||
+        old->body_count != macro->body_count)
+    {
+        return false;
+    }
+
+    const strid_t *old_params = macro_table_get_params(table, old);
+    for (uint32_t i = 0; i < macro->param_count; i++)
+    {
+        if (old_params[i] != params[i])
+        {
+            return false;
+        }
+    }
+
+    const struct tokman *tokman = &pp->tgroup->tokman;
+    const struct macro_token *old_body = macro_table_get_body(table, old);
+    for (uint32_t i = 0; i < macro->body_count; i++)
+    {
+        tokid_t a = old_body[i].id;
+        tokid_t b = body[i].id;
+        uint8_t ws = TOKEN_LEADING_WS | TOKEN_LINE_START;
+        if (old_body[i].kind != body[i].kind ||
+            old_body[i].param != body[i].param ||
+            tokman->syncats[a] != tokman->syncats[b] ||
+            tokman->spellings[a] != tokman->spellings[b] ||
+            (i > 0 && !(tokman->flags[a] & ws) != !(tokman->flags[b] & ws)))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Handle #define.
+static void _pp_define(
+    struct preprocessor *pp,
+    const struct pp_line *line,
+    uint32_t directive)
+{
+    uint32_t i = _pp_line_skip_trivia(pp, line, directive + 1);
+    struct macro macro;
+    macro.name = _pp_macro_name(pp, line, directive, i);
+    if (macro.name == 0)
+    {
+        return;
+    }
+
+    macro.definition = 0;
+    macro.function_like = false;
+    macro.variadic = false;
+    macro.param_count = 0;
+    macro.params_first = 0;
+    macro.body_first = 0;
+    macro.body_count = 0;
+
+    // Parameters and replacement list go on the temporary stack until
+    // they're known to be valid. Neither is longer than the line.
+    struct tmp_stack *tmp_stack = &pp->tgroup->tmp_stack;
+    tmp_stack_mark_t mark = tmp_stack_mark(tmp_stack);
+    strid_t *params = TMP_STACK_ALLOC(tmp_stack, strid_t, line->count);
+    struct macro_token *body =
+        TMP_STACK_ALLOC(tmp_stack, struct macro_token, line->count);
+
+    // A ( right after the name, with no white-space between, starts a
+    // parameter list.
+    i++;
+    if (i < line->count &&
+        _pp_line_syncat(pp, line, i) == SYNCAT_LPAREN &&
+        !(pp->tgroup->tokman.flags[_pp_line_get(line, i)] & TOKEN_LEADING_WS))
+    {
+        macro.function_like = true;
+        i = _pp_define_params(pp, line, i + 1, &macro, params);
+    }
+
+    if (i == 0 || !_pp_define_body(pp, line, i, &macro, params, body))
+    {
+        tmp_stack_rewind(tmp_stack, mark);
+        return;
+    }
+
+    // A macro can only be redefined the same way. Doing that is common,
+    // e.g. by headers without include guards, and changes nothing, so it
+    // keeps the definition it already has.
+    macro_id_t old = macro_table_get(&pp->macros, macro.name);
+    if (old != 0)
+    {
+        if (_pp_same_definition(pp, old, &macro, params, body))
+        {
+            tmp_stack_rewind(tmp_stack, mark);
+            return;
+        }
+
+        uint32_t name = _pp_line_skip_trivia(pp, line, directive + 1);
+        _pp_line_error(pp, line, name, name, DIAG_CODE_MACRO_REDEFINED);
+    }
+
+    macro.definition = _pp_line_to_node(pp, line, SYNCAT_DEFINE_DIRECTIVE);
+    macro_table_define(&pp->macros, &macro, params, body);
+    tmp_stack_rewind(tmp_stack, mark);
+}
+
+// Handle a directive line. hash is the index of the leading #.
+static int _pp_directive(
+    struct preprocessor *pp,
+    struct pp_file *file,
+    const struct pp_line *line,
+    uint32_t hash)
+{
+    uint32_t directive = _pp_line_skip_trivia(pp, line, hash + 1);
+    if (directive == line->count)
+    {
+        return 0; // Null directive.
+    }
+
+    // Find directive keyword.
+    enum pp_keyword keyword = PP_KEYWORD_COUNT;
+    if (_pp_line_syncat(pp, line, directive) == SYNCAT_IDENT)
+    {
+        strid_t spelling = _pp_line_spelling(pp, line, directive);
+        for (int i = 0; i < PP_KEYWORD_COUNT; i++)
+        {
+            if (pp->keywords[i] == spelling)
+            {
+                keyword = (enum pp_keyword)i;
+                break;
+            }
+        }
+    }
+
+    // Conditional directives are handled even in skipped groups.
+    switch (keyword)
+    {
+    case PP_KEYWORD_IF:
+    case PP_KEYWORD_IFDEF:
+    case PP_KEYWORD_IFNDEF:
+        _pp_if(pp, file, line, hash, directive, keyword);
+        return 0;
+
+    case PP_KEYWORD_ELIF:
+    case PP_KEYWORD_ELSE:
+    case PP_KEYWORD_ENDIF:
+        _pp_else_or_endif(pp, file, line, hash, directive, keyword);
+        return 0;
+
+    default:
+        break;
+    }
+
+    if (_pp_skipping(pp, file))
+    {
+        return 0;
+    }
+
+    // Anything else outside an include guard means it's not one.
+    if (file->guard != PP_GUARD_OPEN)
+    {
+        file->guard = PP_GUARD_NONE;
+    }
+
+    strid_t name;
+    switch (keyword)
+    {
+    case PP_KEYWORD_DEFINE:
+        _pp_define(pp, line, directive);
+        return 0;
+
+    case PP_KEYWORD_UNDEF:
+        name = _pp_macro_name(pp, line, directive, directive + 1);
+        if (name != 0)
+        {
+            macro_table_undef(&pp->macros, name);
+        }
+        return 0;
+
+    case PP_KEYWORD_INCLUDE:
+        return _pp_include(pp, file, line, directive);
+
+    case PP_KEYWORD_PRAGMA:
+        _pp_pragma(pp, file, line, directive);
+        return 0;
+
+    case PP_KEYWORD_LINE:
+        _pp_line_directive(pp, file, line, directive);
+        return 0;
+
+    case PP_KEYWORD_ERROR:
+        _pp_line_error(
+            pp, line, hash, line->count - 1, DIAG_CODE_ERROR_DIRECTIVE);
+        return 1;
+
+    case PP_KEYWORD_WARNING:
+        tgroup_add_diag(
+            pp->tgroup, _pp_line_start(pp, line, hash),
+            _pp_line_end(pp, line, line->count - 1),
+            DIAG_SEVERITY_WARNING, DIAG_CODE_WARNING_DIRECTIVE);
+        return 0;
+
+    default:
+        _pp_line_error(
+            pp, line, hash, directive, DIAG_CODE_INVALID_DIRECTIVE);
+        return 0;
+    }
+}
+
+// Get spelling of a token.
+static const char *_pp_spelling(struct preprocessor *pp, tokid_t id)
+{
+    struct tokman *tokman = &pp->tgroup->tokman;
+    enum syncat syncat = tokman->syncats[id];
+    if (syncat_is_punctuator(syncat))
+    {
+        return syncat_punctuator_spelling(syncat);
+    }
+
+    return strman_get_str(&pp->tgroup->strman, tokman->spellings[id]);
+}
+
+// Add error diagnostic spanning a token.
+static void _pp_token_error(
+    struct preprocessor *pp,
+    tokid_t id,
+    enum diag_code code)
+{
+    struct tokman *tokman = &pp->tgroup->tokman;
+    tgroup_add_diag(
+        pp->tgroup, tokman->starts[id], tokman_get_end(tokman, id),
+        DIAG_SEVERITY_ERROR, code);
+}
+
+// Flags for a token substituted somewhere else. It's not at the start of a
+// line anymore, but still needs separating from whatever's before it.
+static uint8_t _pp_moved_flags(uint8_t flags)
+{
+    return flags & TOKEN_LINE_START
+        ? (flags & ~TOKEN_LINE_START) | TOKEN_LEADING_WS
+        : flags;
+}
+
+// Push tokens onto the pending stack, so they're read back in order.
+static void _pp_push_pending(
+    struct preprocessor *pp,
+    const struct pp_token *tokens,
+    uint32_t count)
+{
+    DYNARR_GROW(
+        struct pp_token, pp->pending, pp->pending_len, pp->pending_capacity,
+        count, MEM_TAG_PREPROCESSOR);
+
+    struct pp_token *top = pp->pending + pp->pending_len + count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        *--top = tokens[i];
+    }
+
+    pp->pending_len += count;
+}
+
+// Append count uninitialized tokens to the expanded stack.
+// Returns pointer to the first.
+static struct pp_token *_pp_extend_expanded(
+    struct preprocessor *pp,
+    uint32_t count)
+{
+    DYNARR_GROW(
+        struct pp_token, pp->expanded, pp->expanded_len,
+        pp->expanded_capacity, count, MEM_TAG_PREPROCESSOR);
+
+    struct pp_token *tokens = pp->expanded + pp->expanded_len;
+    pp->expanded_len += count;
+    return tokens;
+}
+
+// Read the next token for macro expansion.
+// Returns false if the reader has run out.
+static bool _pp_read(
+    struct preprocessor *pp,
+    struct pp_reader *reader,
+    struct pp_token *token)
+{
+    if (pp->pending_len > reader->base)
+    {
+        *token = pp->pending[--pp->pending_len];
+        return true;
+    }
+
+    struct tokman *tokman = &pp->tgroup->tokman;
+    while (reader->next < reader->end)
+    {
+        tokid_t id = reader->next++;
+        if (!syncat_is_trivia(tokman->syncats[id]))
+        {
+            token->id = id;
+            token->hideset = 0;
+            token->flags = tokman->flags[id];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Get ID of the macro a token would invoke: the one it names, unless the
+// token came out of that macro. 0 if none.
+static macro_id_t _pp_token_macro(
+    struct preprocessor *pp,
+    const struct pp_token *token)
+{
+    struct tokman *tokman = &pp->tgroup->tokman;
+    if (tokman->syncats[token->id] != SYNCAT_IDENT)
+    {
+        return 0;
+    }
+
+    strid_t name = tokman->spellings[token->id];
+    macro_id_t id = macro_table_get(&pp->macros, name);
+    if (id == 0 || hideset_contains(&pp->hidesets, token->hideset, name))
+    {
+        return 0;
+    }
+
+    return id;
+}
+
+// Start a new, empty argument of the macro invocation being collected.
+static void _pp_start_arg(struct preprocessor *pp)
+{
+    DYNARR_GROW(
+        struct pp_arg, pp->args, pp->arg_count, pp->arg_capacity, 1,
+        MEM_TAG_PREPROCESSOR);
+
+    struct pp_arg *arg = &pp->args[pp->arg_count++];
+    arg->first = pp->arg_token_count;
+    arg->count = 0;
+    arg->state = PP_ARG_UNEXPANDED;
+    arg->expanded_first = 0;
+    arg->expanded_count = 0;
+}
+
+// Add a token to arg_tokens.
+static void _pp_push_arg_token(
+    struct preprocessor *pp,
+    const struct pp_token *token)
+{
+    DYNARR_GROW(
+        struct pp_token, pp->arg_tokens, pp->arg_token_count,
+        pp->arg_token_capacity, 1, MEM_TAG_PREPROCESSOR);
+
+    pp->arg_tokens[pp->arg_token_count++] = *token;
+}
+
+// Collect the arguments of a function-like macro invocation, after the (,
+// onto args and arg_tokens, up to the ), which is returned in rparen.
+// Returns false if the reader ran out first. Commas between arguments are
+// kept in arg_tokens too, so the invocation can be put back as it was.
+static bool _pp_collect_args(
+    struct preprocessor *pp,
+    struct pp_reader *reader,
+    const struct macro *macro,
+    struct pp_token *rparen)
+{
+    struct tokman *tokman = &pp->tgroup->tokman;
+    uint32_t first_arg = pp->arg_count;
+    uint32_t depth = 0;
+    _pp_start_arg(pp);
+    for (;;)
+    {
+        struct pp_token token;
+        if (!_pp_read(pp, reader, &token))
+        {
+            return false;
+        }
+
+        enum syncat syncat = tokman->syncats[token.id];
+        if (depth == 0 && syncat == SYNCAT_RPAREN)
+        {
+            *rparen = token;
+            return true;
+        }
+
+        // Commas don't separate the arguments that __VA_ARGS__ stands for.
+        uint32_t arg = pp->arg_count - first_arg;
+        if (depth == 0 &&
+            syncat == SYNCAT_COMMA &&
+            !(macro->variadic && arg >= macro->param_count))
+        {
+            _pp_push_arg_token(pp, &token);
+            _pp_start_arg(pp);
+            continue;
+        }
+
+        if (syncat == SYNCAT_LPAREN)
+        {
+            depth++;
+        }
+        else if (syncat == SYNCAT_RPAREN)
+        {
+            depth--;
+        }
+
+        _pp_push_arg_token(pp, &token);
+        pp->args[pp->arg_count - 1].count++;
+    }
+}
+
+// Macro-expand an argument onto the expanded stack, unless it has been
+// already or there's nothing to expand.
+static void _pp_expand_arg(struct preprocessor *pp, uint32_t index)
+{
+    struct pp_arg *arg = &pp->args[index];
+    if (arg->state != PP_ARG_UNEXPANDED)
+    {
+        return;
+    }
+
+    // Most arguments don't invoke anything, and are their own expansion.
+    arg->state = PP_ARG_PLAIN;
+    for (uint32_t i = 0; i < arg->count; i++)
+    {
+        if (_pp_token_macro(pp, &pp->arg_tokens[arg->first + i]) != 0)
+        {
+            arg->state = PP_ARG_EXPANDED;
+            break;
+        }
+    }
+
+    if (arg->state == PP_ARG_PLAIN)
+    {
+        return;
+    }
+
+    // Expand it on its own, as if it were all the input there is.
+    struct pp_reader reader;
+    reader.base = pp->pending_len;
+    reader.next = 0;
+    reader.end = 0;
+    reader.more = false;
+    _pp_push_pending(pp, pp->arg_tokens + arg->first, arg->count);
+
+    uint32_t expanded_first = pp->expanded_len;
+    _pp_expand(pp, &reader);
+
+    // Nested invocations may have moved args.
+    arg = &pp->args[index];
+    arg->expanded_first = expanded_first;
+    arg->expanded_count = pp->expanded_len - expanded_first;
+}
+
+// Spell the tokens of an argument as a string literal, for # parameter.
+// hash is the #. Returns ID of the new token.
+static tokid_t _pp_stringize(
+    struct preprocessor *pp,
+    tokid_t hash,
+    const struct pp_arg *arg)
+{
+    struct tgroup *tgroup = pp->tgroup;
+    struct tokman *tokman = &tgroup->tokman;
+    struct tmp_stack *tmp_stack = &tgroup->tmp_stack;
+    tmp_stack_mark_t mark = tmp_stack_mark(tmp_stack);
+
+    tmp_stack_push(tmp_stack, "\"", 1);
+    for (uint32_t i = 0; i < arg->count; i++)
+    {
+        // Any white-space between tokens becomes one space.
+        const struct pp_token *token = &pp->arg_tokens[arg->first + i];
+        if (i > 0 && (token->flags & (TOKEN_LEADING_WS | TOKEN_LINE_START)))
+        {
+            tmp_stack_push(tmp_stack, " ", 1);
+        }
+
+        // Quotes and backslashes in literals get escaped.
+        enum syncat syncat = tokman->syncats[token->id];
+        bool literal =
+            syncat == SYNCAT_STRING_LIT ||
+            syncat == SYNCAT_CHAR_CONST ||
+            syncat == SYNCAT_INCOMPLETE_STRING_LIT ||
+            syncat == SYNCAT_INCOMPLETE_CHAR_CONST;
+
+        for (const char *c = _pp_spelling(pp, token->id); *c != 0; c++)
+        {
+            if (literal && (*c == '"' || *c == '\\'))
+            {
+                tmp_stack_push(tmp_stack, "\\", 1);
+            }
+
+            tmp_stack_push(tmp_stack, c, 1);
+        }
+    }
+
+    tmp_stack_push(tmp_stack, "\"", 1);
+
+    size_t len = tmp_stack->size - mark;
+    if (len > UINT32_MAX)
+    {
+        translation_limit_exceeded();
+    }
+
+    strid_t spelling = strman_get_id(
+        &tgroup->strman, (const char *)(tmp_stack->data + mark),
+        (uint32_t)len);
+    tmp_stack_rewind(tmp_stack, mark);
+
+    return tokman_add(
+        tokman, SYNCAT_STRING_LIT, 0, tokman->starts[hash],
+        tokman_get_end(tokman, hash), spelling);
+}
+
+// Paste two tokens together, for ##. Returns ID of the new token,
+// or 0 if the result isn't a single token.
+static tokid_t _pp_paste_tokens(
+    struct preprocessor *pp,
+    tokid_t lhs,
+    tokid_t rhs)
 {
-    int ret = 0;
+    struct tgroup *tgroup = pp->tgroup;
+    struct tmp_stack *tmp_stack = &tgroup->tmp_stack;
+    tmp_stack_mark_t mark = tmp_stack_mark(tmp_stack);
 
-    // Reserve source locations.
-    struct phys_file *phys_file =
-        srcman_get_phys_file(&tgroup->srcman, phys_file_id);
+    const char *left = _pp_spelling(pp, lhs);
+    const char *right = _pp_spelling(pp, rhs);
+    tmp_stack_push(tmp_stack, left, strlen(left));
+    tmp_stack_push(tmp_stack, right, strlen(right) + 1);
 
-    uint32_t old_reserved_srcloc_count = tgroup->reserved_srcloc_count;
-    tgroup->reserved_srcloc_count += phys_file->size + 1;
-    if (tgroup->reserved_srcloc_count <= old_reserved_srcloc_count)
+    size_t len = tmp_stack->size - mark - 1;
+    if (len > UINT32_MAX)
     {
         translation_limit_exceeded();
     }
 
-    // Add logical and presumed file.
-    logi_file_id_t logi_file_id = srcman_add_logi_file(
-        &tgroup->srcman, phys_file_id, included_at, tgroup->srcloc);
+    // Lex the result. The lexer moves the current source location along,
+    // which has to be put back since the text isn't in any file.
+    srcloc_t srcloc = tgroup->srcloc;
+    struct lexer lexer;
+    lexer_init(
+        &lexer, tgroup, (const char *)(tmp_stack->data + mark), (uint32_t)len);
+    struct lexeme lexeme = lexer_next(&lexer);
+    bool valid =
+        lexer.pos == lexer.eof &&
+        lexeme.syncat != SYNCAT_EOF &&
+        !syncat_is_trivia(lexeme.syncat);
 
-    pres_file_id_t pres_file_id = srcman_add_pres_file(
-        &tgroup->srcman, logi_file_id, 1, phys_file->name, 1);
+    tgroup->srcloc = srcloc;
+    tmp_stack_rewind(tmp_stack, mark);
 
-    // Initialize lexer.
-    struct lexer lexer;
-    lexer_init(&lexer, tgroup, phys_file->data, phys_file->size, pres_file_id);
+    if (!valid)
+    {
+        return 0;
+    }
 
-    // For each line.
-    for (;;)
+    struct tokman *tokman = &tgroup->tokman;
+    return tokman_add(
+        tokman, lexeme.syncat, 0, tokman->starts[lhs],
+        tokman_get_end(tokman, lhs), lexeme.spelling);
+}
+
+// Paste the token at index i of the expanded stack onto the one before it.
+static void _pp_paste(struct preprocessor *pp, uint32_t i)
+{
+    assert(i > 0);
+    assert(i < pp->expanded_len);
+
+    // Placemarkers paste to whatever they're pasted with.
+    struct pp_token *lhs = &pp->expanded[i - 1];
+    struct pp_token *rhs = &pp->expanded[i];
+    if (lhs->id == 0)
+    {
+        lhs->id = rhs->id;
+        lhs->hideset = rhs->hideset;
+    }
+    else if (rhs->id != 0)
+    {
+        tokid_t id = _pp_paste_tokens(pp, lhs->id, rhs->id);
+        if (id == 0)
+        {
+            // Leave them as they are.
+            _pp_token_error(pp, rhs->id, DIAG_CODE_INVALID_PASTE);
+            return;
+        }
+
+        lhs->id = id;
+        lhs->hideset =
+            hideset_intersect(&pp->hidesets, lhs->hideset, rhs->hideset);
+    }
+
+    memmove(
+        rhs, rhs + 1, sizeof(struct pp_token) * (pp->expanded_len - i - 1));
+    pp->expanded_len--;
+}
+
+// Substitute an argument for a parameter, onto the expanded stack. raw if
+// it's next to ##, which takes the argument as written. flags are the
+// parameter's.
+static void _pp_substitute_arg(
+    struct preprocessor *pp,
+    uint32_t index,
+    bool raw,
+    uint8_t flags)
+{
+    struct pp_arg arg = pp->args[index];
+    bool expanded = !raw && arg.state == PP_ARG_EXPANDED;
+    uint32_t count = expanded ? arg.expanded_count : arg.count;
+    if (count == 0)
+    {
+        if (raw)
+        {
+            struct pp_token *placemarker = _pp_extend_expanded(pp, 1);
+            placemarker->id = 0;
+            placemarker->hideset = 0;
+            placemarker->flags = flags;
+        }
+
+        return;
+    }
+
+    // Expansions are on the same stack, so copy after growing it.
+    struct pp_token *out = _pp_extend_expanded(pp, count);
+    const struct pp_token *in = expanded
+        ? pp->expanded + arg.expanded_first
+        : pp->arg_tokens + arg.first;
+
+    memcpy(out, in, sizeof(struct pp_token) * count);
+    out[0].flags = flags;
+    for (uint32_t i = 1; i < count; i++)
+    {
+        out[i].flags = _pp_moved_flags(out[i].flags);
+    }
+}
+
+// Substitute the arguments into a macro's replacement list, then push it
+// onto the pending stack to be rescanned with the rest of the input.
+// name is the token that invoked it. hideset goes on every token.
+static void _pp_substitute(
+    struct preprocessor *pp,
+    const struct macro *macro,
+    uint32_t first_arg,
+    const struct pp_token *name,
+    hideset_t hideset)
+{
+    struct tokman *tokman = &pp->tgroup->tokman;
+    uint32_t first = pp->expanded_len;
+    bool paste = false;
+    const struct macro_token *list = macro_table_get_body(&pp->macros, macro);
+    for (uint32_t i = 0; i < macro->body_count; i++)
     {
-        lexer_begin_line(&lexer);
+        struct macro_token body = list[i];
+        uint8_t flags = _pp_moved_flags(tokman->flags[body.id]);
+        uint32_t start = pp->expanded_len;
+        struct pp_token *out;
+        switch (body.kind)
+        {
+        case MACRO_TOKEN_PASTE:
+            paste = true;
+            continue;
+
+        case MACRO_TOKEN_ARG:
+        case MACRO_TOKEN_RAW_ARG:
+            _pp_substitute_arg(
+                pp, first_arg + body.param, body.kind == MACRO_TOKEN_RAW_ARG,
+                flags);
+            break;
 
-        // Convert lexemes to AST nodes.
-        struct astlst lexemes;
-        astlst_init(&lexemes);
-        bool eof = false;
-        for (;;)
+        case MACRO_TOKEN_STRINGIZE:
+            out = _pp_extend_expanded(pp, 1);
+            out->id = _pp_stringize(
+                pp, body.id, &pp->args[first_arg + body.param]);
+            out->hideset = 0;
+            out->flags = flags;
+            break;
+
+        default:
+            out = _pp_extend_expanded(pp, 1);
+            out->id = body.id;
+            out->hideset = 0;
+            out->flags = flags;
+            break;
+        }
+
+        // ## is never first or last, and what's on either side of it
+        // always substitutes at least a placemarker.
+        if (paste)
         {
-            srcloc_t start_srcloc = tgroup->srcloc;
-            struct lexeme lexeme = lexer_next(&lexer);
-            srcloc_t end_srcloc = tgroup->srcloc;
+            _pp_paste(pp, start);
+            paste = false;
+        }
+    }
 
-            if (lexeme.syncat == SYNCAT_EOF)
+    // Drop placemarkers and hide the macro's name from the result. Runs of
+    // tokens tend to share hide-sets, so the last union is reused.
+    uint32_t count = 0;
+    hideset_t last = 0;
+    hideset_t last_union = hideset;
+    for (uint32_t i = first; i < pp->expanded_len; i++)
+    {
+        struct pp_token token = pp->expanded[i];
+        if (token.id != 0)
+        {
+            if (token.hideset != last)
             {
-                eof = true;
-                break;
+                last = token.hideset;
+                last_union = hideset_union(&pp->hidesets, last, hideset);
+            }
+
+            token.hideset = last_union;
+            pp->expanded[first + count++] = token;
+        }
+    }
+
+    // The result takes the name's place, spacing included.
+    if (count > 0)
+    {
+        pp->expanded[first].flags = name->flags;
+    }
+
+    _pp_push_pending(pp, pp->expanded + first, count);
+    pp->expanded_len = first;
+}
+
+// Invoke the macro a token names, if it's object-like or followed by (.
+static enum pp_invoke _pp_invoke(
+    struct preprocessor *pp,
+    struct pp_reader *reader,
+    const struct pp_token *name,
+    macro_id_t id)
+{
+    struct tokman *tokman = &pp->tgroup->tokman;
+    const struct macro *macro = macro_table_get_macro(&pp->macros, id);
+    if (!macro->function_like)
+    {
+        hideset_t hideset =
+            hideset_add(&pp->hidesets, name->hideset, macro->name);
+        _pp_substitute(pp, macro, pp->arg_count, name, hideset);
+        return PP_INVOKE_DONE;
+    }
+
+    // Look for (. If the reader runs out first, it might be on the next line.
+    struct pp_token lparen;
+    if (!_pp_read(pp, reader, &lparen))
+    {
+        if (reader->more)
+        {
+            _pp_push_pending(pp, name, 1);
+            return PP_INVOKE_WAIT;
+        }
+
+        return PP_INVOKE_NONE;
+    }
+
+    if (tokman->syncats[lparen.id] != SYNCAT_LPAREN)
+    {
+        _pp_push_pending(pp, &lparen, 1);
+        return PP_INVOKE_NONE;
+    }
+
+    uint32_t first_arg = pp->arg_count;
+    uint32_t first_arg_token = pp->arg_token_count;
+    uint32_t expanded_base = pp->expanded_len;
+    struct pp_token rparen;
+    if (!_pp_collect_args(pp, reader, macro, &rparen))
+    {
+        // Put it all back to try again with more input.
+        if (reader->more)
+        {
+            _pp_push_pending(
+                pp, pp->arg_tokens + first_arg_token,
+                pp->arg_token_count - first_arg_token);
+            _pp_push_pending(pp, &lparen, 1);
+            _pp_push_pending(pp, name, 1);
+            pp->arg_token_count = first_arg_token;
+            pp->arg_count = first_arg;
+            return PP_INVOKE_WAIT;
+        }
+
+        _pp_token_error(pp, name->id, DIAG_CODE_UNTERMINATED_MACRO_CALL);
+        pp->arg_token_count = first_arg_token;
+        pp->arg_count = first_arg;
+        return PP_INVOKE_NONE;
+    }
+
+    // f() is one empty argument, which is right if f takes one, and fine if
+    // it takes none. __VA_ARGS__ can be left out entirely.
+    uint32_t arg_count = pp->arg_count - first_arg;
+    if (macro->param_count == 0 &&
+        arg_count == 1 &&
+        pp->args[first_arg].count == 0)
+    {
+        pp->arg_count = first_arg;
+        arg_count = 0;
+    }
+    else if (macro->variadic && arg_count + 1 == macro->param_count)
+    {
+        _pp_start_arg(pp);
+        arg_count++;
+    }
+
+    if (arg_count != macro->param_count)
+    {
+        _pp_token_error(pp, name->id, DIAG_CODE_MACRO_ARG_COUNT);
+        pp->arg_token_count = first_arg_token;
+        pp->arg_count = first_arg;
+        return PP_INVOKE_NONE;
+    }
+
+    // Expand arguments up front, since substitution builds the result on
+    // the same stack.
+    const struct macro_token *list = macro_table_get_body(&pp->macros, macro);
+    for (uint32_t i = 0; i < macro->body_count; i++)
+    {
+        struct macro_token body = list[i];
+        if (body.kind == MACRO_TOKEN_ARG)
+        {
+            _pp_expand_arg(pp, first_arg + body.param);
+        }
+    }
+
+    // Only names hidden from both the name and the ) stay hidden, so a
+    // macro invoked partly from outside its own expansion can recur.
+    hideset_t hideset = hideset_add(
+        &pp->hidesets,
+        hideset_intersect(&pp->hidesets, name->hideset, rparen.hideset),
+        macro->name);
+    _pp_substitute(pp, macro, first_arg, name, hideset);
+
+    pp->expanded_len = expanded_base;
+    pp->arg_token_count = first_arg_token;
+    pp->arg_count = first_arg;
+    return PP_INVOKE_DONE;
+}
+
+// Macro-expand tokens from a reader onto the expanded stack until it runs
+// out. Invocations the reader runs out in the middle of are put back on the
+// pending stack if more input might come.
+static void _pp_expand(struct preprocessor *pp, struct pp_reader *reader)
+{
+    // In #if expressions, operands of defined get hide-sets with their own
+    // names, like tokens that came out of the macros they name, so they
+    // aren't expanded. Most compilers allow a defined that came out of a
+    // macro, so those count too. 1 after defined, 2 after defined (.
+    int defined_state = 0;
+
+    struct tokman *tokman = &pp->tgroup->tokman;
+    struct pp_token token;
+    while (_pp_read(pp, reader, &token))
+    {
+        if (pp->in_condition)
+        {
+            enum syncat syncat = tokman->syncats[token.id];
+            if (defined_state != 0 && syncat == SYNCAT_IDENT)
+            {
+                token.hideset = hideset_add(
+                    &pp->hidesets, token.hideset, tokman->spellings[token.id]);
             }
-            else if (lexeme.syncat == SYNCAT_EOL)
+
+            defined_state =
+                _pp_is_keyword(pp, token.id, PP_KEYWORD_DEFINED) ? 1
+                : defined_state == 1 && syncat == SYNCAT_LPAREN ? 2
+                : 0;
+        }
+
+        macro_id_t id = _pp_token_macro(pp, &token);
+        if (id != 0)
+        {
+            enum pp_invoke invoke = _pp_invoke(pp, reader, &token, id);
+            if (invoke == PP_INVOKE_WAIT)
             {
-                break;
+                return;
             }
-            else if (lexeme.syncat == SYNCAT_ILLEGAL_BYTES)
+
+            if (invoke == PP_INVOKE_DONE)
             {
-                eof = true;
-                ret = 1;
-                break;
+                continue;
+            }
+        }
+
+        *_pp_extend_expanded(pp, 1) = token;
+    }
+}
+
+// Whether two tokens written with nothing between them might lex
+// differently. Tokens that are next to each other in the source never do,
+// but macro expansion can put any two tokens together.
+static bool _pp_would_paste(
+    struct preprocessor *pp,
+    tokid_t prev,
+    tokid_t next)
+{
+    struct tokman *tokman = &pp->tgroup->tokman;
+    enum syncat prev_syncat = tokman->syncats[prev];
+    enum syncat next_syncat = tokman->syncats[next];
+    switch (prev_syncat)
+    {
+    case SYNCAT_IDENT:
+    case SYNCAT_PP_NUMBER:
+        return
+            next_syncat == SYNCAT_IDENT ||
+            next_syncat == SYNCAT_PP_NUMBER ||
+            next_syncat == SYNCAT_CHAR_CONST ||
+            next_syncat == SYNCAT_STRING_LIT ||
+            (prev_syncat == SYNCAT_PP_NUMBER &&
+             (next_syncat == SYNCAT_DOT ||
+              next_syncat == SYNCAT_PLUS ||
+              next_syncat == SYNCAT_MINUS));
+
+    case SYNCAT_DOT:
+        if (next_syncat == SYNCAT_PP_NUMBER)
+        {
+            return true;
+        }
+
+        break;
+
+    default:
+        break;
+    }
+
+    if (!syncat_is_punctuator(prev_syncat) ||
+        !syncat_is_punctuator(next_syncat))
+    {
+        return false;
+    }
+
+    // Punctuators paste if the first and the start of the second begin a
+    // longer one, or a comment. Most characters never continue anything.
+    char c = syncat_punctuator_spelling(next_syncat)[0];
+    if (strchr("#&*+-./:<=>|", c) == NULL)
+    {
+        return false;
+    }
+
+    const char *spelling = syncat_punctuator_spelling(prev_syncat);
+    size_t len = strlen(spelling);
+    if (spelling[len - 1] == '/' && (c == '/' || c == '*'))
+    {
+        return true;
+    }
+
+    for (int i = SYNCAT_EXCLAIM; i <= SYNCAT_TILDE; i++)
+    {
+        const char *longer = syncat_punctuator_spelling((enum syncat)i);
+        if (strncmp(longer, spelling, len) == 0 && longer[len] == c)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Write out the expanded stack, if there's somewhere to write it,
+// then clear it. The text is put together on the temporary stack first
+// and written all at once.
+static void _pp_write_expanded(struct preprocessor *pp)
+{
+    FILE *file = pp->output;
+    if (file == NULL || pp->expanded_len == 0)
+    {
+        pp->expanded_len = 0;
+        return;
+    }
+
+    struct tmp_stack *tmp_stack = &pp->tgroup->tmp_stack;
+    tmp_stack_mark_t mark = tmp_stack_mark(tmp_stack);
+    for (uint32_t i = 0; i < pp->expanded_len; i++)
+    {
+        const struct pp_token *token = &pp->expanded[i];
+        if (pp->output_last != 0)
+        {
+            if (token->flags & TOKEN_LINE_START)
+            {
+                tmp_stack_push(tmp_stack, "\n", 1);
             }
-            else
+            else if (
+                (token->flags & TOKEN_LEADING_WS) ||
+                _pp_would_paste(pp, pp->output_last, token->id))
             {
-                astid_t astid = astman_alloc_node(
-                    &tgroup->astman, lexeme.syncat, 0,
-                    lexeme.spelling == 0 ? 2 : 3);
+                tmp_stack_push(tmp_stack, " ", 1);
+            }
+        }
+
+        const char *spelling = _pp_spelling(pp, token->id);
+        tmp_stack_push(tmp_stack, spelling, strlen(spelling));
+        pp->output_last = token->id;
+    }
+
+    fwrite(tmp_stack->data + mark, 1, tmp_stack->size - mark, file);
+    tmp_stack_rewind(tmp_stack, mark);
+    pp->expanded_len = 0;
+}
+
+// Macro-expand a text line and write it out. An invocation that's still
+// open at the end waits for the next line.
+static void _pp_text_line(struct preprocessor *pp, const struct pp_line *line)
+{
+    struct pp_reader reader;
+    reader.base = 0;
+    reader.next = line->first;
+    reader.end = line->first + line->count;
+    reader.more = true;
+    _pp_expand(pp, &reader);
+    _pp_write_expanded(pp);
+}
+
+// Whether the last text line ended in the middle of a macro invocation's
+// arguments. One that ended with a function-like macro's name only leaves
+// the name pending.
+static bool _pp_args_open(struct preprocessor *pp)
+{
+    return pp->pending_len > 1;
+}
+
+// Finish any invocation left open by the last text line. Done at the end of
+// files, which invocations can't span, and before directives.
+static void _pp_text_end(struct preprocessor *pp)
+{
+    if (pp->pending_len == 0)
+    {
+        return;
+    }
+
+    struct pp_reader reader;
+    reader.base = 0;
+    reader.next = 0;
+    reader.end = 0;
+    reader.more = false;
+    _pp_expand(pp, &reader);
+    _pp_write_expanded(pp);
+}
+
+// Record a lexed line for the token cache.
+static void _pp_record_line(struct pp_file *file, const struct pp_line *line)
+{
+    // Re-allocate if necessary.
+    DYNARR_GROW(
+        struct tokcache_line, file->recorded, file->recorded_count,
+        file->recorded_capacity, 1, MEM_TAG_TOKCACHE);
+
+    struct tokcache_line *recorded = &file->recorded[file->recorded_count++];
+    recorded->first = line->first;
+    recorded->count = line->count;
+}
+
+// Get the next line of a file, from the token cache or the lexer.
+// Returns false if there are no more lines.
+static bool _pp_next_line(
+    struct preprocessor *pp,
+    struct pp_file *file,
+    struct pp_line *line,
+    int *ret)
+{
+    struct tgroup *tgroup = pp->tgroup;
+
+    if (file->cached)
+    {
+        struct tokcache_line cached;
+        if (!tokcache_read_line(
+            &file->tokcache_file, &tgroup->tokman, file->start, &cached))
+        {
+            return false;
+        }
+
+        line->first = cached.first;
+        line->count = cached.count;
+        return true;
+    }
+
+    if (file->eof)
+    {
+        return false;
+    }
 
-                tgroup->astman.data[astid + 0] = start_srcloc;
-                tgroup->astman.data[astid + 1] = end_srcloc;
+    // Add lexemes to token manager.
+    line->first = tgroup->tokman.count;
+    line->count = 0;
 
-                if (lexeme.spelling != 0)
-                {
-                    tgroup->astman.data[astid + 2] = lexeme.spelling;
-                }
+    uint8_t flags = TOKEN_LINE_START;
+    for (;;)
+    {
+        srcloc_t start_srcloc = tgroup->srcloc;
+        struct lexeme lexeme = lexer_next(&file->lexer);
+        srcloc_t end_srcloc = tgroup->srcloc;
+
+        if (lexeme.syncat == SYNCAT_EOF)
+        {
+            file->eof = true;
+            break;
+        }
+        else if (lexeme.syncat == SYNCAT_EOL)
+        {
+            break;
+        }
+        else if (lexeme.syncat == SYNCAT_ILLEGAL_BYTES)
+        {
+            // Don't cache files with errors.
+            file->eof = true;
+            file->recording = false;
+            *ret = 1;
+            break;
+        }
+        else if (syncat_is_trivia(lexeme.syncat) && !pp->keep_trivia)
+        {
+            flags |= TOKEN_LEADING_WS;
+        }
+        else
+        {
+            // Flags describe what precedes a token.
+            // Kept trivia doesn't get any.
+            bool trivia = syncat_is_trivia(lexeme.syncat);
+            tokman_add(
+                &tgroup->tokman, lexeme.syncat, trivia ? 0 : flags,
+                start_srcloc, end_srcloc, lexeme.spelling);
 
-                astlst_push(tgroup, &lexemes, astid);
+            flags = trivia ? flags | TOKEN_LEADING_WS : 0;
+            if (++line->count == 0)
+            {
+                translation_limit_exceeded();
             }
         }
+    }
+
+    if (file->recording && line->count > 0)
+    {
+        _pp_record_line(file, line);
+    }
+
+    return true;
+}
+
+// Preprocess a file.
+static int _pp_file(
+    struct preprocessor *pp,
+    phys_file_id_t phys_file_id,
+    astid_t included_at)
+{
+    int ret = 0;
+    struct tgroup *tgroup = pp->tgroup;
+    struct srcman *srcman = &tgroup->srcman;
+
+    // Copy what we need from the phys_file since
+    // nested #include's can move the phys_files array.
+    struct phys_file *phys_file = srcman_get_phys_file(srcman, phys_file_id);
+    strid_t name = phys_file->name;
+    uint32_t size = phys_file->size;
+    hash128_t content_hash = phys_file->content_hash;
+
+    struct pp_file file;
+    file.phys_file_id = phys_file_id;
+    file.data = phys_file->data;
+    file.start = tgroup->reserved_srcloc_count;
+    file.cond_base = pp->cond_count;
+    file.guard = PP_GUARD_START;
+    file.guard_name = 0;
+
+    // Reserve source locations.
+    tgroup->reserved_srcloc_count += size + 1;
+    if (tgroup->reserved_srcloc_count <= file.start)
+    {
+        translation_limit_exceeded();
+    }
+
+    tgroup->srcloc = file.start;
+
+    // Add logical and presumed file and their lines.
+    logi_file_id_t logi_file_id = srcman_add_logi_file(
+        srcman, phys_file_id, included_at, file.start);
+
+    pres_file_id_t pres_file_id = srcman_add_pres_file(
+        srcman, logi_file_id, 1, name, 1);
 
-        // Finalize lexemes.
-        uint16_t child_count = astlst_finalize(tgroup, &lexemes);
-        size_t children_size = sizeof(astid_t) * child_count;
+    file.logi_file_id = logi_file_id;
+    file.pres_file_id = pres_file_id;
+    file.pres_name = name;
+    file.pres_line = srcman->line_count;
+    srcman_add_phys_lines(srcman, file.start, file.data, size, pres_file_id);
+    file.line_end = srcman->line_count;
 
-        // TODO.
-        tmp_stack_pop(&tgroup->tmp_stack, children_size);
+    // Read tokens from the cache if possible. Otherwise lex,
+    // and record the lines for the cache if there is one.
+    struct tokcache *tokcache = pp->keep_trivia ? NULL : pp->tokcache;
+    file.cached =
+        tokcache != NULL &&
+        tokcache_open(
+            tokcache, &tgroup->strman, content_hash, size,
+            &file.tokcache_file);
+
+    file.eof = false;
+    file.recording = tokcache != NULL && !file.cached;
+    file.recorded_count = 0;
+    file.recorded_capacity = 1;
+    file.recorded = JOCC_ALLOC(struct tokcache_line, MEM_TAG_TOKCACHE);
+    lexer_init(&file.lexer, tgroup, file.data, size);
+
+    // For each line.
+    struct pp_line line;
+    while (_pp_next_line(pp, &file, &line, &ret))
+    {
+        // Handle directives. Anything else significant
+        // outside an include guard means it's not one.
+        uint32_t first = _pp_line_skip_trivia(pp, &line, 0);
+        if (first == line.count)
+        {
+            // Blank line.
+        }
+        else if (_pp_line_syncat(pp, &line, first) == SYNCAT_HASH)
+        {
+            // Directives can be in the middle of macro arguments, as most
+            // compilers allow, but not between a macro's name and its (.
+            if (!_pp_args_open(pp))
+            {
+                _pp_text_end(pp);
+            }
 
-        // Stop after EOF.
-        if (eof)
+            ret |= _pp_directive(pp, &file, &line, first);
+        }
+        else
         {
-            return ret;
+            if (file.guard != PP_GUARD_OPEN)
+            {
+                file.guard = PP_GUARD_NONE;
+            }
+
+            if (!_pp_skipping(pp, &file))
+            {
+                _pp_text_line(pp, &line);
+            }
         }
     }
+
+    _pp_text_end(pp);
+    _pp_set_pres_lines(srcman, &file, file.line_end);
+
+    // Save tokens for next time.
+    if (file.cached)
+    {
+        tokcache_close(&file.tokcache_file);
+    }
+    else if (file.recording)
+    {
+        tokcache_write(
+            tokcache, tgroup, content_hash, size, file.start,
+            file.recorded, file.recorded_count);
+    }
+
+    jocc_free(file.recorded);
+
+    // Close conditionals left open.
+    while (pp->cond_count > file.cond_base)
+    {
+        struct pp_cond *cond = &pp->conds[--pp->cond_count];
+        tgroup_add_diag(
+            tgroup, cond->start, cond->end,
+            DIAG_SEVERITY_ERROR, DIAG_CODE_UNTERMINATED_CONDITIONAL);
+
+        file.guard = PP_GUARD_NONE;
+        ret = 1;
+    }
+
+    // Remember include guard for the content.
+    if (file.guard == PP_GUARD_CLOSED)
+    {
+        phys_file_id_t content_id =
+            srcman_get_phys_file(srcman, phys_file_id)->content_id;
+        srcman_get_phys_file(srcman, content_id)->skip_ifdef =
+            file.guard_name;
+    }
+
+    tgroup->srcloc = file.start + size + 1;
+    return ret;
+}
+
+// Preprocess a top-level file.
+static int preprocess(
+    struct preprocessor *pp,
+    phys_file_id_t phys_file_id,
+    astid_t included_at)
+{
+    assert(pp != NULL);
+    assert(pp->include_depth == 0);
+
+    int ret = _pp_file(pp, phys_file_id, included_at);
+    if (pp->output != NULL && pp->output_last != 0)
+    {
+        fputc('\n', pp->output);
+    }
+
+    return ret;
 }
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include "dynarr.h"
 #include "strman.h"
 
 // Physical file ID.
@@ -18,6 +19,9 @@ typedef uint32_t logi_file_id_t;
 // Index into srcman pres_files.
 typedef uint32_t pres_file_id_t;
 
+// Sentinel phys_file_id_t for a name that doesn't refer to a readable file.
+#define PHYS_FILE_NONE UINT32_MAX
+
 // Physical file.
 // One for each actual file we care about.
 struct phys_file
@@ -25,10 +29,31 @@ struct phys_file
     strid_t name;
     uint32_t size; // Excluding NUL-terminator.
     const char *data; // NUL-terminated.
+    hash128_t content_hash;
+
+    // First phys_file with byte-identical content. This one's ID if there
+    // wasn't one. Its data is shared, and so can anything else derived
+    // purely from the content.
+    phys_file_id_t content_id;
+
+    // Whether srcman frees data on destruction.
+    bool owns_data;
+
+    // Multiple-include optimization. Only meaningful on content_id's.
+    // pragma_once is set if the file contains an active #pragma once.
+    // skip_ifdef is the guard macro if the whole file is wrapped in
+    // #ifndef X ... #endif, meaning it can be skipped while X is defined.
     bool pragma_once;
     strid_t skip_ifdef;
 };
 
+// Entry in srcman name index.
+struct srcman_name_entry
+{
+    strid_t name;
+    phys_file_id_t phys_file_id; // PHYS_FILE_NONE if not readable.
+};
+
 // Logical file.
 // One for each file instance whether or not it was #include'd and where.
 struct logi_file
@@ -64,6 +89,18 @@ struct srcman
     uint32_t phys_file_capacity;
     struct phys_file *phys_files;
 
+    // Hash set of content_id's keyed by content_hash.
+    // Slots hold phys_file_id_t plus 1; 0 means empty.
+    uint32_t content_index_count;
+    uint32_t content_index_capacity; // Must be a power of two.
+    phys_file_id_t *content_index;
+
+    // Hash map of phys_file name to ID, including names known not to be
+    // readable, so repeated lookups don't touch the file system.
+    uint32_t name_index_count;
+    uint32_t name_index_capacity; // Must be a power of two.
+    struct srcman_name_entry *name_index;
+
     uint32_t logi_file_count;
     uint32_t logi_file_capacity;
     struct logi_file *logi_files;
@@ -72,10 +109,13 @@ struct srcman
     uint32_t pres_file_capacity;
     struct pres_file *pres_files;
 
+    // Line arrays are reserved up front for the most lines possible,
+    // so adding lines never copies them.
     uint32_t line_count;
-    uint32_t line_capacity;
     srcloc_t *line_starts;
     struct srcline *lines;
+    struct vmem_arr line_starts_vmem;
+    struct vmem_arr lines_vmem;
 };
 
 // Initialize source manager.
@@ -85,20 +125,34 @@ static void srcman_init(struct srcman *srcman)
 
     srcman->phys_file_count = 0;
     srcman->phys_file_capacity = 1;
-    srcman->phys_files = JOCC_ALLOC(struct phys_file);
+    srcman->phys_files = JOCC_ALLOC(struct phys_file, MEM_TAG_SRCMAN);
+
+    srcman->content_index_count = 0;
+    srcman->content_index_capacity = 1;
+    srcman->content_index = JOCC_ZALLOC(phys_file_id_t, MEM_TAG_SRCMAN);
+
+    srcman->name_index_count = 0;
+    srcman->name_index_capacity = 1;
+    srcman->name_index = JOCC_ZALLOC(struct srcman_name_entry, MEM_TAG_SRCMAN);
 
     srcman->logi_file_count = 0;
     srcman->logi_file_capacity = 1;
-    srcman->logi_files = JOCC_ALLOC(struct logi_file);
+    srcman->logi_files = JOCC_ALLOC(struct logi_file, MEM_TAG_SRCMAN);
 
     srcman->pres_file_count = 0;
     srcman->pres_file_capacity = 1;
-    srcman->pres_files = JOCC_ALLOC(struct pres_file);
+    srcman->pres_files = JOCC_ALLOC(struct pres_file, MEM_TAG_SRCMAN);
 
+    // There's at most one line per srcloc.
     srcman->line_count = 0;
-    srcman->line_capacity = 1;
-    srcman->line_starts = JOCC_ALLOC(srcloc_t);
-    srcman->lines = JOCC_ALLOC(struct srcline);
+    vmem_arr_init(
+        &srcman->line_starts_vmem, sizeof(srcloc_t) * (size_t)UINT32_MAX,
+        MEM_TAG_SRCMAN);
+    vmem_arr_init(
+        &srcman->lines_vmem, sizeof(struct srcline) * (size_t)UINT32_MAX,
+        MEM_TAG_SRCMAN);
+    srcman->line_starts = (srcloc_t *)srcman->line_starts_vmem.data;
+    srcman->lines = (struct srcline *)srcman->lines_vmem.data;
 }
 
 // Destroy source manager.
@@ -106,35 +160,212 @@ static void srcman_destroy(struct srcman *srcman)
 {
     assert(srcman != NULL);
 
-    jocc_free(srcman->lines);
-    jocc_free(srcman->line_starts);
+    vmem_arr_destroy(&srcman->lines_vmem);
+    vmem_arr_destroy(&srcman->line_starts_vmem);
     jocc_free(srcman->pres_files);
     jocc_free(srcman->logi_files);
+    jocc_free(srcman->name_index);
+    jocc_free(srcman->content_index);
+
+    for (uint32_t i = 0; i < srcman->phys_file_count; i++)
+    {
+        struct phys_file *file = &srcman->phys_files[i];
+        if (file->owns_data)
+        {
+            jocc_free((char *)file->data);
+        }
+    }
+
     jocc_free(srcman->phys_files);
 }
 
-// Add physical file.
-static phys_file_id_t srcman_add_phys_file(
+// Find name index slot for name.
+static struct srcman_name_entry *_srcman_find_name_slot(
+    struct srcman_name_entry *index,
+    uint32_t capacity,
+    strid_t name)
+{
+    uint32_t mask = capacity - 1;
+    uint32_t hash = (uint32_t)jocc_hash_small(&name, sizeof(name));
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        struct srcman_name_entry *entry = &index[i];
+        if (entry->name == name || entry->name == 0)
+        {
+            return entry;
+        }
+    }
+}
+
+// Map name to phys_file ID (or PHYS_FILE_NONE) in the name index.
+static void _srcman_set_name(
     struct srcman *srcman,
     strid_t name,
-    uint32_t size,
-    const char *data)
+    phys_file_id_t phys_file_id)
+{
+    assert(name != 0);
+
+    struct srcman_name_entry *entry = _srcman_find_name_slot(
+        srcman->name_index, srcman->name_index_capacity, name);
+
+    if (entry->name == 0)
+    {
+        srcman->name_index_count++;
+        entry->name = name;
+    }
+
+    entry->phys_file_id = phys_file_id;
+
+    // Keep the index at most half full.
+    if (srcman->name_index_count > srcman->name_index_capacity / 2)
+    {
+        uint32_t old_capacity = srcman->name_index_capacity;
+        if (old_capacity > UINT32_MAX / 2)
+        {
+            translation_limit_exceeded();
+        }
+
+        struct srcman_name_entry *old_index = srcman->name_index;
+        srcman->name_index_capacity = old_capacity * 2;
+        srcman->name_index = ZALLOC_ARRAY(
+            struct srcman_name_entry, srcman->name_index_capacity,
+            MEM_TAG_SRCMAN);
+
+        for (uint32_t i = 0; i < old_capacity; i++)
+        {
+            if (old_index[i].name != 0)
+            {
+                *_srcman_find_name_slot(
+                    srcman->name_index, srcman->name_index_capacity,
+                    old_index[i].name) = old_index[i];
+            }
+        }
+
+        jocc_free(old_index);
+    }
+}
+
+// Look up phys_file by name. Returns false if the name hasn't been seen.
+// Otherwise, sets *phys_file_id_out, possibly to PHYS_FILE_NONE.
+static bool srcman_find_phys_file(
+    struct srcman *srcman,
+    strid_t name,
+    phys_file_id_t *phys_file_id_out)
 {
     assert(srcman != NULL);
+    assert(phys_file_id_out != NULL);
 
-    // Re-allocate if necessary.
-    if (srcman->phys_file_capacity == srcman->phys_file_count)
+    struct srcman_name_entry *entry = _srcman_find_name_slot(
+        srcman->name_index, srcman->name_index_capacity, name);
+
+    if (entry->name == 0)
+    {
+        return false;
+    }
+
+    *phys_file_id_out = entry->phys_file_id;
+    return true;
+}
+
+// Insert content_id into content index known not to contain its content.
+static void _srcman_content_index_insert(
+    phys_file_id_t *index,
+    uint32_t capacity,
+    hash128_t content_hash,
+    phys_file_id_t content_id)
+{
+    uint32_t mask = capacity - 1;
+    for (uint32_t i = (uint32_t)content_hash.low64 & mask;; i = (i + 1) & mask)
+    {
+        if (index[i] == 0)
+        {
+            index[i] = content_id + 1;
+            return;
+        }
+    }
+}
+
+// Find phys_file with identical content, or add id to the content index
+// if there isn't one. Returns the resulting content_id.
+static phys_file_id_t _srcman_dedup_content(
+    struct srcman *srcman,
+    phys_file_id_t id)
+{
+    struct phys_file *file = &srcman->phys_files[id];
+
+    // Look for an existing phys_file with the same content. Compare the
+    // bytes as well so a hash collision can't alias two different files.
+    uint32_t mask = srcman->content_index_capacity - 1;
+    uint32_t i = (uint32_t)file->content_hash.low64 & mask;
+    for (;; i = (i + 1) & mask)
+    {
+        phys_file_id_t slot = srcman->content_index[i];
+        if (slot == 0)
+        {
+            break;
+        }
+
+        struct phys_file *other = &srcman->phys_files[slot - 1];
+        if (XXH128_isEqual(other->content_hash, file->content_hash) &&
+            other->size == file->size &&
+            memcmp(other->data, file->data, file->size) == 0)
+        {
+            return slot - 1;
+        }
+    }
+
+    // First time we've seen this content.
+    srcman->content_index[i] = id + 1;
+    srcman->content_index_count++;
+
+    // Keep the index at most half full.
+    if (srcman->content_index_count > srcman->content_index_capacity / 2)
     {
-        if (srcman->phys_file_capacity > UINT32_MAX / 2)
+        uint32_t old_capacity = srcman->content_index_capacity;
+        if (old_capacity > UINT32_MAX / 2)
         {
             translation_limit_exceeded();
         }
 
-        srcman->phys_file_capacity *= 2;
-        srcman->phys_files = REALLOC_ARRAY(
-            struct phys_file, srcman->phys_files, srcman->phys_file_capacity);
+        phys_file_id_t *old_index = srcman->content_index;
+        srcman->content_index_capacity = old_capacity * 2;
+        srcman->content_index = ZALLOC_ARRAY(
+            phys_file_id_t, srcman->content_index_capacity, MEM_TAG_SRCMAN);
+
+        for (uint32_t j = 0; j < old_capacity; j++)
+        {
+            if (old_index[j] != 0)
+            {
+                phys_file_id_t content_id = old_index[j] - 1;
+                _srcman_content_index_insert(
+                    srcman->content_index, srcman->content_index_capacity,
+                    srcman->phys_files[content_id].content_hash, content_id);
+            }
+        }
+
+        jocc_free(old_index);
     }
 
+    return id;
+}
+
+// Add physical file.
+// If a phys_file with byte-identical content was already added, the new one
+// shares its data instead, so the caller can free data right away if
+// srcman_get_phys_file(srcman, id)->data != data.
+static phys_file_id_t srcman_add_phys_file(
+    struct srcman *srcman,
+    strid_t name,
+    uint32_t size,
+    const char *data)
+{
+    assert(srcman != NULL);
+
+    // Re-allocate if necessary.
+    DYNARR_GROW(
+        struct phys_file, srcman->phys_files, srcman->phys_file_count,
+        srcman->phys_file_capacity, 1, MEM_TAG_SRCMAN);
+
     // Locate and initialize new element.
     phys_file_id_t id = srcman->phys_file_count++;
     struct phys_file *file = &srcman->phys_files[id];
@@ -142,13 +373,108 @@ static phys_file_id_t srcman_add_phys_file(
     file->name = name;
     file->size = size;
     file->data = data;
+    file->content_hash = jocc_hash128(data, size);
+    file->owns_data = false;
     file->pragma_once = false;
     file->skip_ifdef = 0;
 
+    // Share data with any identical phys_file.
+    file->content_id = _srcman_dedup_content(srcman, id);
+    file->data = srcman->phys_files[file->content_id].data;
+
+    // Remember name unless it's already taken.
+    phys_file_id_t existing;
+    if (name != 0 &&
+        (!srcman_find_phys_file(srcman, name, &existing) ||
+         existing == PHYS_FILE_NONE))
+    {
+        _srcman_set_name(srcman, name, id);
+    }
+
     // Return ID.
     return id;
 }
 
+// Read whole file into a NUL-terminated buffer. Returns NULL on failure.
+static char *_srcman_read_file(const char *path, uint32_t *size_out)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    // Read as much as fits each time, growing geometrically, so the
+    // buffer is copied O(size) bytes in total, not O(size^2).
+    uint32_t size = 0;
+    uint32_t capacity = 0;
+    char *data = NULL;
+    for (;;)
+    {
+        DYNARR_GROW(char, data, size, capacity, 4096, MEM_TAG_FILE_DATA);
+        size_t ret = fread(data + size, 1, capacity - size, file);
+        if (ret > 0)
+        {
+            size += (uint32_t)ret;
+        }
+        else if (ferror(file))
+        {
+            jocc_free(data);
+            fclose(file);
+            return NULL;
+        }
+        else
+        {
+            *size_out = size;
+            data[size] = 0;
+            fclose(file);
+            return DYNARR_SHRINK(
+                char, data, size + 1, capacity, MEM_TAG_FILE_DATA);
+        }
+    }
+}
+
+// Find or load physical file. name must be the strid of path. Returns
+// PHYS_FILE_NONE if the file can't be read. Either way, the result is
+// remembered, so the file system is only consulted once per name.
+static phys_file_id_t srcman_load_phys_file(
+    struct srcman *srcman,
+    strid_t name,
+    const char *path)
+{
+    assert(srcman != NULL);
+    assert(name != 0);
+    assert(path != NULL);
+
+    phys_file_id_t id;
+    if (srcman_find_phys_file(srcman, name, &id))
+    {
+        return id;
+    }
+
+    uint32_t size;
+    char *data = _srcman_read_file(path, &size);
+    if (data == NULL)
+    {
+        _srcman_set_name(srcman, name, PHYS_FILE_NONE);
+        return PHYS_FILE_NONE;
+    }
+
+    // Take ownership unless the content turned out to be a duplicate.
+    id = srcman_add_phys_file(srcman, name, size, data);
+    struct phys_file *file = &srcman->phys_files[id];
+    if (file->data == data)
+    {
+        file->owns_data = true;
+    }
+    else
+    {
+        jocc_free(data);
+    }
+
+    return id;
+}
+
 // Add logical file.
 static logi_file_id_t srcman_add_logi_file(
     struct srcman *srcman,
@@ -159,17 +485,9 @@ static logi_file_id_t srcman_add_logi_file(
     assert(srcman != NULL);
 
     // Re-allocate if necessary.
-    if (srcman->logi_file_capacity == srcman->logi_file_count)
-    {
-        if (srcman->logi_file_capacity > UINT32_MAX / 2)
-        {
-            translation_limit_exceeded();
-        }
-
-        srcman->logi_file_capacity *= 2;
-        srcman->logi_files = REALLOC_ARRAY(
-            struct logi_file, srcman->logi_files, srcman->logi_file_capacity);
-    }
+    DYNARR_GROW(
+        struct logi_file, srcman->logi_files, srcman->logi_file_count,
+        srcman->logi_file_capacity, 1, MEM_TAG_SRCMAN);
 
     // Locate and initialize new element.
     logi_file_id_t id = srcman->logi_file_count++;
@@ -194,17 +512,9 @@ static pres_file_id_t srcman_add_pres_file(
     assert(srcman != NULL);
 
     // Re-allocate if necessary.
-    if (srcman->pres_file_capacity == srcman->pres_file_count)
-    {
-        if (srcman->pres_file_capacity > UINT32_MAX / 2)
-        {
-            translation_limit_exceeded();
-        }
-
-        srcman->pres_file_capacity *= 2;
-        srcman->pres_files = REALLOC_ARRAY(
-            struct pres_file, srcman->pres_files, srcman->pres_file_capacity);
-    }
+    DYNARR_GROW(
+        struct pres_file, srcman->pres_files, srcman->pres_file_count,
+        srcman->pres_file_capacity, 1, MEM_TAG_SRCMAN);
 
     // Locate and initialize new element.
     pres_file_id_t id = srcman->pres_file_count++;
@@ -219,6 +529,31 @@ static pres_file_id_t srcman_add_pres_file(
     return id;
 }
 
+// Make room for file_count physical and logical files and line_count lines
+// up front, e.g. from an estimate of the input size, so adding that many
+// doesn't have to re-allocate or commit any more.
+static void srcman_reserve(
+    struct srcman *srcman,
+    uint32_t file_count,
+    uint32_t line_count)
+{
+    assert(srcman != NULL);
+
+    DYNARR_RESERVE(
+        struct phys_file, srcman->phys_files, srcman->phys_file_count,
+        srcman->phys_file_capacity, file_count, MEM_TAG_SRCMAN);
+    DYNARR_RESERVE(
+        struct logi_file, srcman->logi_files, srcman->logi_file_count,
+        srcman->logi_file_capacity, file_count, MEM_TAG_SRCMAN);
+
+    vmem_arr_ensure(
+        &srcman->line_starts_vmem, sizeof(srcloc_t) * (size_t)line_count);
+    vmem_arr_ensure(
+        &srcman->lines_vmem, sizeof(struct srcline) * (size_t)line_count);
+    srcman->line_starts = (srcloc_t *)srcman->line_starts_vmem.data;
+    srcman->lines = (struct srcline *)srcman->lines_vmem.data;
+}
+
 // Add line.
 static void srcman_add_line(
     struct srcman *srcman,
@@ -230,23 +565,18 @@ static void srcman_add_line(
     uint32_t old_count = srcman->line_count;
     assert(old_count == 0 || start > srcman->line_starts[old_count - 1]);
 
-    // Re-allocate if necessary.
-    if (srcman->line_capacity == old_count)
+    // Commit more memory if necessary.
+    if (old_count == UINT32_MAX)
     {
-        if (srcman->line_capacity > UINT32_MAX / 2)
-        {
-            translation_limit_exceeded();
-        }
-
-        srcman->line_capacity *= 2;
-
-        srcman->line_starts = REALLOC_ARRAY(
-            srcloc_t, srcman->line_starts, srcman->line_capacity);
-
-        srcman->lines = REALLOC_ARRAY(
-            struct srcline, srcman->lines, srcman->line_capacity);
+        translation_limit_exceeded();
     }
 
+    size_t new_count = (size_t)old_count + 1;
+    vmem_arr_ensure(&srcman->line_starts_vmem, sizeof(srcloc_t) * new_count);
+    vmem_arr_ensure(&srcman->lines_vmem, sizeof(struct srcline) * new_count);
+    srcman->line_starts = (srcloc_t *)srcman->line_starts_vmem.data;
+    srcman->lines = (struct srcline *)srcman->lines_vmem.data;
+
     // Locate and initialize new elements.
     uint32_t idx = srcman->line_count++;
     srcman->line_starts[idx] = start;
@@ -256,6 +586,39 @@ static void srcman_add_line(
     line->line_num_offset = line_num_offset;
 }
 
+// Add a line for each physical line of a logical file, all at once so lines
+// from files it #include's, which get later srclocs, don't interleave.
+static void srcman_add_phys_lines(
+    struct srcman *srcman,
+    srcloc_t start,
+    const char *data,
+    uint32_t size,
+    pres_file_id_t pres_file_id)
+{
+    assert(srcman != NULL);
+    assert(data != NULL);
+
+    // A new line starts at the beginning of the file
+    // and after every LF, CR, or CRLF, even at EOF.
+    uint32_t line_num_offset = 0;
+    srcman_add_line(srcman, start, pres_file_id, line_num_offset);
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+        char c = data[i];
+        if (c == '\r' || c == '\n')
+        {
+            if (c == '\r' && data[i + 1] == '\n')
+            {
+                i++;
+            }
+
+            srcman_add_line(
+                srcman, start + i + 1, pres_file_id, ++line_num_offset);
+        }
+    }
+}
+
 // Get physical file.
 static struct phys_file *srcman_get_phys_file(
     struct srcman *srcman,
@@ -4,8 +4,8 @@
 
 #pragma once
 
-#include "alloc.h"
 #include "hash.h"
+#include "vmem.h"
 
 // String ID.
 // Index into strman data.
@@ -23,15 +23,47 @@ struct strman_entry
 // Effectively a hash set of strings.
 // Stores a single copy of each unique string and generates a small ID that
 // can be used to efficiently store references and compare for equality.
+//
+// Optionally layered on top of a read-only base, e.g. a memory-mapped snapshot
+// written by strman_write_snapshot. Base strings keep the ID's they had when
+// the snapshot was written. New strings go into the overlay entries and data
+// and get ID's past the end of the base data.
 struct strman
 {
     uint32_t entry_count;
     uint32_t entry_capacity; // Must be a power of two.
     struct strman_entry *entries;
 
+    // Reserved up front for the most data strid's can address,
+    // so pointers returned by strman_get_str stay valid.
     uint32_t data_size;
-    uint32_t data_capacity;
     char *data;
+    struct vmem_arr data_vmem;
+
+    // Read-only base layer. Not owned. Empty unless strman_load_base is used.
+    uint32_t base_entry_count;
+    uint32_t base_entry_capacity; // Power of two unless empty.
+    const struct strman_entry *base_entries;
+    uint32_t base_data_size;
+    const char *base_data;
+};
+
+// Snapshot format version.
+// Bump whenever the snapshot layout or jocc_str_hash changes.
+#define STRMAN_SNAPSHOT_VERSION 1
+
+// Snapshot magic number. Also catches snapshots of the wrong byte order.
+#define STRMAN_SNAPSHOT_MAGIC UINT32_C(0x4A4F5354) // "JOST"
+
+// Snapshot header. Followed by entry_capacity entries,
+// then data_size bytes of NUL-terminated string data.
+struct strman_snapshot_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+    uint32_t data_size;
 };
 
 // Initialize string manager.
@@ -41,106 +73,281 @@ static void strman_init(struct strman *strman)
 
     strman->entry_count = 0;
     strman->entry_capacity = 1;
-    strman->entries = JOCC_ZALLOC(struct strman_entry);
+    strman->entries = JOCC_ZALLOC(struct strman_entry, MEM_TAG_STRMAN);
 
     strman->data_size = 1;
-    strman->data_capacity = 1;
-    strman->data = JOCC_ZALLOC(char);
+    vmem_arr_init(&strman->data_vmem, (size_t)UINT32_MAX, MEM_TAG_STRMAN);
+    vmem_arr_ensure(&strman->data_vmem, 1);
+    strman->data = (char *)strman->data_vmem.data;
+    strman->data[0] = 0;
+
+    strman->base_entry_count = 0;
+    strman->base_entry_capacity = 0;
+    strman->base_entries = NULL;
+    strman->base_data_size = 0;
+    strman->base_data = NULL;
 }
 
 // Destroy string manager.
+// Doesn't touch the base layer; that's up to whoever loaded it.
 static void strman_destroy(struct strman *strman)
 {
     assert(strman != NULL);
 
-    jocc_free(strman->data);
     jocc_free(strman->entries);
+    vmem_arr_destroy(&strman->data_vmem);
 }
 
-// Get ID for string.
-static strid_t strman_get_id(
+// Use a snapshot as the read-only base layer of an empty string manager.
+// The snapshot is used in place without copying or rehashing, so it must
+// outlive the string manager and be at least 4-byte aligned. Returns false
+// and leaves the string manager untouched if the snapshot isn't valid.
+static bool strman_load_base(
     struct strman *strman,
-    const char *string,
-    uint32_t len)
+    const void *snapshot,
+    size_t size)
 {
     assert(strman != NULL);
-    assert(string != NULL || len == 0);
+    assert(strman->entry_count == 0);
+    assert(strman->base_entries == NULL);
+    assert(snapshot != NULL || size == 0);
+    assert((uintptr_t)snapshot % sizeof(uint32_t) == 0);
+
+    // Validate header.
+    struct strman_snapshot_header header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
 
-    if (len == 0)
+    memcpy(&header, snapshot, sizeof(header));
+    if (header.magic != STRMAN_SNAPSHOT_MAGIC ||
+        header.version != STRMAN_SNAPSHOT_VERSION ||
+        header.entry_capacity == 0 ||
+        (header.entry_capacity & (header.entry_capacity - 1)) != 0 ||
+        header.entry_count > header.entry_capacity / 2 ||
+        header.data_size == 0)
     {
-        return 0; // The empty string.
+        return false;
     }
 
-    // Try to find an existing entry.
-    uint32_t hash = (uint32_t)jocc_hash(string, len);
-    uint32_t mask = strman->entry_capacity - 1;
+    // Validate size.
+    size_t entries_size =
+        sizeof(struct strman_entry) * (size_t)header.entry_capacity;
+    if (entries_size / sizeof(struct strman_entry) != header.entry_capacity ||
+        size - sizeof(header) < entries_size ||
+        size - sizeof(header) - entries_size != header.data_size)
+    {
+        return false;
+    }
+
+    // Make sure the data starts with the empty
+    // string and the last string is terminated.
+    const char *entries = (const char *)snapshot + sizeof(header);
+    const char *data = entries + entries_size;
+    if (data[0] != 0 || data[header.data_size - 1] != 0)
+    {
+        return false;
+    }
+
+    // Make sure every entry points at the start of a string, and that there
+    // are as many as the header says, which leaves probing an empty entry
+    // to stop at.
+    const struct strman_entry *base_entries =
+        (const struct strman_entry *)entries;
+    uint32_t entry_count = 0;
+    for (uint32_t i = 0; i < header.entry_capacity; i++)
+    {
+        strid_t strid = base_entries[i].strid;
+        if (strid == 0)
+        {
+            continue;
+        }
+
+        if (strid >= header.data_size || data[strid - 1] != 0)
+        {
+            return false;
+        }
+
+        entry_count++;
+    }
+
+    if (entry_count != header.entry_count)
+    {
+        return false;
+    }
+
+    // Overlay strings go after the base data.
+    // They don't need their own empty string.
+    strman->base_entry_count = header.entry_count;
+    strman->base_entry_capacity = header.entry_capacity;
+    strman->base_entries = base_entries;
+    strman->base_data_size = header.data_size;
+    strman->base_data = data;
+    strman->data_size = 0;
+
+    return true;
+}
 
-    struct strman_entry *entry;
+// Probe hash table for string. Returns the index of the matching
+// entry or of the empty entry where it would be inserted.
+static uint32_t _strman_probe(
+    const struct strman_entry *entries,
+    uint32_t capacity,
+    const char *data,
+    strid_t first_strid,
+    const char *string,
+    uint32_t len,
+    uint32_t hash)
+{
+    uint32_t mask = capacity - 1;
     for (uint32_t i = hash & mask;; i = (i + 1) & mask)
     {
-        entry = &strman->entries[i];
+        const struct strman_entry *entry = &entries[i];
+
+        // Empty entry. This must be the first
+        // time we've encountered this string.
+        if (entry->strid == 0)
+        {
+            return i;
+        }
+
         if (entry->hash == hash)
         {
             // The hash of this entry matches.
             // Make extra sure the string actually matches too.
-            const char *data = strman->data + entry->strid;
-            if (strncmp(data, string, len) == 0 && data[len] == 0)
+            const char *str = data + (entry->strid - first_strid);
+            if (strncmp(str, string, len) == 0 && str[len] == 0)
             {
-                return entry->strid;
+                return i;
             }
         }
+    }
+}
 
-        // Empty entry. This must be the first
-        // time we've encountered this string.
-        if (entry->strid == 0)
+// Insert entry into a hash table known not to contain it.
+static void _strman_insert(
+    struct strman_entry *entries,
+    uint32_t capacity,
+    struct strman_entry entry)
+{
+    uint32_t mask = capacity - 1;
+    for (uint32_t i = entry.hash & mask;; i = (i + 1) & mask)
+    {
+        if (entries[i].strid == 0)
         {
-            break;
+            entries[i] = entry;
+            return;
         }
     }
+}
 
-    // No existing entry. Create a new one.
-    strman->entry_count++;
-
-    // Make sure entry_capacity is at least double entry_count.
-    if (strman->entry_count > strman->entry_capacity / 2)
+// Move entries to a new hash table with the given capacity, a power of two.
+static void _strman_rehash(struct strman *strman, uint32_t capacity)
+{
+    uint32_t old_capacity = strman->entry_capacity;
+    struct strman_entry *old_entries = strman->entries;
+    strman->entry_capacity = capacity;
+    strman->entries = ZALLOC_ARRAY(
+        struct strman_entry, strman->entry_capacity, MEM_TAG_STRMAN);
+
+    // Migrate from old_entries.
+    for (uint32_t i = 0; i < old_capacity; i++)
     {
-        uint32_t old_capacity = strman->entry_capacity;
-        if (old_capacity > UINT32_MAX / 2)
+        struct strman_entry *old_entry = &old_entries[i];
+
+        // Copy non-empty old_entries into empty slots in the new array.
+        if (old_entry->strid != 0)
         {
-            translation_limit_exceeded();
+            _strman_insert(
+                strman->entries, strman->entry_capacity, *old_entry);
         }
+    }
 
-        strman->entry_capacity = old_capacity * 2;
-        mask = strman->entry_capacity - 1;
+    jocc_free(old_entries);
+}
 
-        struct strman_entry *old_entries = strman->entries;
-        strman->entries = ZALLOC_ARRAY(
-            struct strman_entry, strman->entry_capacity);
+// Make room for count strings totalling data_size bytes, including their
+// NUL terminators, up front, e.g. from an estimate of the input size, so
+// interning that many doesn't have to rehash or commit any more.
+static void strman_reserve(
+    struct strman *strman,
+    uint32_t count,
+    uint32_t data_size)
+{
+    assert(strman != NULL);
+
+    // Keep the table at most half full, as strman_get_id_hashed does.
+    uint32_t capacity = strman->entry_capacity;
+    while (count > capacity / 2 && capacity <= UINT32_MAX / 2)
+    {
+        capacity *= 2;
+    }
 
-        // Migrate from old_entries.
-        for (uint32_t i = 0; i < old_capacity; i++)
+    if (capacity > strman->entry_capacity)
+    {
+        _strman_rehash(strman, capacity);
+    }
+
+    vmem_arr_ensure(&strman->data_vmem, data_size);
+    strman->data = (char *)strman->data_vmem.data;
+}
+
+// Get ID for string with a precomputed hash.
+// hash must be jocc_str_hash(string, len). Lets callers that already hashed
+// the string while producing it (e.g. the lexer) skip re-reading it.
+static strid_t strman_get_id_hashed(
+    struct strman *strman,
+    const char *string,
+    uint32_t len,
+    uint32_t hash)
+{
+    assert(strman != NULL);
+    assert(string != NULL || len == 0);
+    assert(hash == jocc_str_hash(string, len));
+
+    if (len == 0)
+    {
+        return 0; // The empty string.
+    }
+
+    // Check the base layer first.
+    if (strman->base_entries != NULL)
+    {
+        uint32_t i = _strman_probe(
+            strman->base_entries, strman->base_entry_capacity,
+            strman->base_data, 0, string, len, hash);
+
+        if (strman->base_entries[i].strid != 0)
         {
-            struct strman_entry *old_entry = &old_entries[i];
+            return strman->base_entries[i].strid;
+        }
+    }
 
-            // Skip empty old_entries.
-            if (old_entry->strid == 0)
-            {
-                continue;
-            }
+    // Try to find an existing entry.
+    uint32_t mask = strman->entry_capacity - 1;
+    struct strman_entry *entry = &strman->entries[_strman_probe(
+        strman->entries, strman->entry_capacity,
+        strman->data, strman->base_data_size, string, len, hash)];
 
-            // Copy non-empty old_entries into empty slots in the new array.
-            for (uint32_t j = old_entry->hash & mask;; j = (j + 1) & mask)
-            {
-                struct strman_entry *new_entry = &strman->entries[j];
-                if (new_entry->strid == 0)
-                {
-                    *new_entry = *old_entry;
-                    break;
-                }
-            }
+    if (entry->strid != 0)
+    {
+        return entry->strid;
+    }
+
+    // No existing entry. Create a new one.
+    strman->entry_count++;
+
+    // Make sure entry_capacity is at least double entry_count.
+    if (strman->entry_count > strman->entry_capacity / 2)
+    {
+        if (strman->entry_capacity > UINT32_MAX / 2)
+        {
+            translation_limit_exceeded();
         }
 
-        jocc_free(old_entries);
+        _strman_rehash(strman, strman->entry_capacity * 2);
+        mask = strman->entry_capacity - 1;
 
         // Find an empty slot for the new entry.
         for (uint32_t i = hash & mask;; i = (i + 1) & mask)
@@ -154,41 +361,112 @@ static strid_t strman_get_id(
     }
 
     // Initialize new entry.
-    strid_t strid = strman->data_size;
+    uint32_t offset = strman->data_size;
+    strid_t strid = strman->base_data_size + offset;
     entry->strid = strid;
     entry->hash = hash;
 
     // Append new data.
-    strman->data_size = strid + len + 1;
-    if (strman->data_size <= strid)
+    if (strid + len + 1 <= strid)
     {
         translation_limit_exceeded();
     }
 
-    if (strman->data_capacity < strman->data_size)
-    {
-        strman->data_capacity *= 2;
-        if (strman->data_capacity < strman->data_size)
-        {
-            strman->data_capacity = strman->data_size;
-        }
+    strman->data_size = offset + len + 1;
 
-        strman->data = REALLOC_ARRAY(
-            char, strman->data, strman->data_capacity);
-    }
+    vmem_arr_ensure(&strman->data_vmem, strman->data_size);
+    strman->data = (char *)strman->data_vmem.data;
 
-    memcpy(strman->data + strid, string, len);
-    strman->data[strid + len] = 0;
+    memcpy(strman->data + offset, string, len);
+    strman->data[offset + len] = 0;
 
     // Done.
     return strid;
 }
 
+// Get ID for string.
+static strid_t strman_get_id(
+    struct strman *strman,
+    const char *string,
+    uint32_t len)
+{
+    assert(strman != NULL);
+    assert(string != NULL || len == 0);
+
+    return strman_get_id_hashed(
+        strman, string, len, jocc_str_hash(string, len));
+}
+
 // Get string by ID.
 static const char *strman_get_str(struct strman *strman, strid_t strid)
 {
     assert(strman != NULL);
-    assert(strid < strman->data_size);
 
-    return strman->data + strid;
+    if (strid < strman->base_data_size)
+    {
+        return strman->base_data + strid;
+    }
+
+    assert(strid - strman->base_data_size < strman->data_size);
+    return strman->data + (strid - strman->base_data_size);
+}
+
+// Write snapshot of all strings, base layer included, for strman_load_base.
+// String ID's are preserved. Returns false on I/O error.
+static bool strman_write_snapshot(struct strman *strman, FILE *file)
+{
+    assert(strman != NULL);
+    assert(file != NULL);
+
+    // Merge base and overlay entries into a single table. Base and
+    // overlay data are written back-to-back, so strid's don't change.
+    uint32_t count = strman->base_entry_count + strman->entry_count;
+    uint32_t capacity = 1;
+    while (count > capacity / 2)
+    {
+        if (capacity > UINT32_MAX / 2)
+        {
+            translation_limit_exceeded();
+        }
+
+        capacity *= 2;
+    }
+
+    struct strman_entry *entries =
+        ZALLOC_ARRAY(struct strman_entry, capacity, MEM_TAG_STRMAN);
+
+    for (uint32_t i = 0; i < strman->base_entry_capacity; i++)
+    {
+        if (strman->base_entries[i].strid != 0)
+        {
+            _strman_insert(entries, capacity, strman->base_entries[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < strman->entry_capacity; i++)
+    {
+        if (strman->entries[i].strid != 0)
+        {
+            _strman_insert(entries, capacity, strman->entries[i]);
+        }
+    }
+
+    // Write header, entries, and data.
+    struct strman_snapshot_header header;
+    header.magic = STRMAN_SNAPSHOT_MAGIC;
+    header.version = STRMAN_SNAPSHOT_VERSION;
+    header.entry_count = count;
+    header.entry_capacity = capacity;
+    header.data_size = strman->base_data_size + strman->data_size;
+
+    bool ok =
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(entries, sizeof(*entries), capacity, file) == capacity &&
+        (strman->base_data_size == 0 ||
+         fwrite(strman->base_data, 1, strman->base_data_size, file) ==
+             strman->base_data_size) &&
+        fwrite(strman->data, 1, strman->data_size, file) == strman->data_size;
+
+    jocc_free(entries);
+    return ok;
 }
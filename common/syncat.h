@@ -81,5 +81,56 @@ enum syncat
     SYNCAT_OTHER_CHAR,
     SYNCAT_ILLEGAL_BYTES,
 
-    SYNCAT_SUBLIST, // Sub-list of a node with over UINT16_MAX children.
+    SYNCAT_DEFINE_DIRECTIVE,  // # define ... (children are the line's lexemes)
+    SYNCAT_INCLUDE_DIRECTIVE, // # include ... (children are the line's lexemes)
 };
+
+// Whether lexemes of a syntactic category are
+// insignificant to the preprocessor beyond separating tokens.
+static bool syncat_is_trivia(enum syncat syncat)
+{
+    switch (syncat)
+    {
+    case SYNCAT_WS:
+    case SYNCAT_BLOCK_COMMENT:
+    case SYNCAT_LINE_COMMENT:
+    case SYNCAT_INCOMPLETE_BLOCK_COMMENT:
+    case SYNCAT_LINE_SPLICE:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Whether a syntactic category is a punctuator. Punctuators are spelled the
+// same every time, so their nodes don't store a spelling.
+static bool syncat_is_punctuator(enum syncat syncat)
+{
+    return syncat >= SYNCAT_EXCLAIM && syncat <= SYNCAT_TILDE;
+}
+
+// Get spelling of a punctuator.
+static const char *syncat_punctuator_spelling(enum syncat syncat)
+{
+    static const char *const spellings[] = {
+        "!", "!=", "#", "##", "%", "%=", "&", "&&", "&=", "(", ")", "*", "*=",
+        "+", "++", "+=", ",", "-", "--", "-=", "->", ".", "...", "/", "/=",
+        ":", "::", ";", "<", "<=", "<<", "<<=", "=", "==", ">", ">=", ">>",
+        ">>=", "?", "[", "]", "^", "^=", "{", "|", "||", "|=", "}", "~",
+    };
+
+    assert(syncat_is_punctuator(syncat));
+    assert(
+        sizeof(spellings) / sizeof(spellings[0]) ==
+        SYNCAT_TILDE - SYNCAT_EXCLAIM + 1);
+
+    return spellings[syncat - SYNCAT_EXCLAIM];
+}
+
+// Get number of extra entries in abstract syntax tree nodes of a syntactic
+// category. Token nodes have the tokid_t of their token. Others have none.
+static uint32_t syncat_extra_count(enum syncat syncat)
+{
+    return syncat > SYNCAT_NONE && syncat <= SYNCAT_ILLEGAL_BYTES ? 1 : 0;
+}
@@ -9,6 +9,29 @@
 #include "diagnostic.h"
 #include "srcman.h"
 #include "tmp_stack.h"
+#include "tokman.h"
+
+// Structure sizes per MiB of input, for tgroup_reserve. Measured with
+// jocc --reserve-report on the 40 .c files of zstd 1.5.7's lib, 2.2 MiB of
+// ordinary C. AST entries are per MiB of one file, since the tree is
+// compacted after each; the rest are per MiB of all the input.
+#define TGROUP_LINES_PER_MIB 26000
+#define TGROUP_TOKENS_PER_MIB 144000
+#define TGROUP_STRINGS_PER_MIB 3200
+#define TGROUP_STRING_BYTES_PER_MIB 58000
+#define TGROUP_AST_ENTRIES_PER_MIB 14000
+
+// Capacities reserved by tgroup_reserve, to compare with what was used.
+struct tgroup_estimate
+{
+    uint64_t input_size;
+    uint32_t file_count;
+    uint32_t line_count;
+    uint32_t token_count;
+    uint32_t string_count;
+    uint32_t string_bytes;
+    uint32_t ast_entries;
+};
 
 // Translation group.
 // Contains all the data structures needed to store the
@@ -35,6 +58,17 @@ struct tgroup
 
     // Temporary stack.
     struct tmp_stack tmp_stack;
+
+    // Token manager.
+    struct tokman tokman;
+
+    // Directories to search for #include'd files, in order.
+    uint32_t include_dir_count;
+    uint32_t include_dir_capacity;
+    strid_t *include_dirs;
+
+    // What tgroup_reserve planned for. All 0 if it wasn't called.
+    struct tgroup_estimate estimate;
 };
 
 // Initialize translation group.
@@ -49,6 +83,13 @@ static void tgroup_init(struct tgroup *tgroup)
     srcman_init(&tgroup->srcman);
     strman_init(&tgroup->strman);
     tmp_stack_init(&tgroup->tmp_stack);
+    tokman_init(&tgroup->tokman);
+
+    tgroup->include_dir_count = 0;
+    tgroup->include_dir_capacity = 1;
+    tgroup->include_dirs = JOCC_ALLOC(strid_t, MEM_TAG_SRCMAN);
+
+    memset(&tgroup->estimate, 0, sizeof(tgroup->estimate));
 }
 
 // Destroy translation group.
@@ -56,6 +97,8 @@ static void tgroup_destroy(struct tgroup *tgroup)
 {
     assert(tgroup != NULL);
 
+    jocc_free(tgroup->include_dirs);
+    tokman_destroy(&tgroup->tokman);
     tmp_stack_destroy(&tgroup->tmp_stack);
     strman_destroy(&tgroup->strman);
     srcman_destroy(&tgroup->srcman);
@@ -63,6 +106,21 @@ static void tgroup_destroy(struct tgroup *tgroup)
     astman_destroy(&tgroup->astman);
 }
 
+// Add directory to search for #include'd files.
+static void tgroup_add_include_dir(struct tgroup *tgroup, const char *dir)
+{
+    assert(tgroup != NULL);
+    assert(dir != NULL);
+
+    // Re-allocate if necessary.
+    DYNARR_GROW(
+        strid_t, tgroup->include_dirs, tgroup->include_dir_count,
+        tgroup->include_dir_capacity, 1, MEM_TAG_SRCMAN);
+
+    tgroup->include_dirs[tgroup->include_dir_count++] =
+        strman_get_id(&tgroup->strman, dir, (uint32_t)strlen(dir));
+}
+
 // Determine size of a decode_utf8_result after escaping.
 static size_t _escaped_size(struct decode_utf8_result u)
 {
@@ -251,3 +309,97 @@ static void tgroup_add_diag(
         &tgroup->diag_arr, start, end, severity, code,
         line_text_offset, line_text);
 }
+
+// Scale input_size by a per-MiB ratio, up to UINT32_MAX.
+static uint32_t _tgroup_scale(uint64_t input_size, uint64_t per_mib)
+{
+    if (input_size > UINT64_MAX / per_mib)
+    {
+        return UINT32_MAX;
+    }
+
+    uint64_t scaled = (input_size * per_mib) >> 20;
+    return scaled > UINT32_MAX ? UINT32_MAX : (uint32_t)scaled;
+}
+
+// Reserve capacity up front for translating file_count files totalling
+// input_size bytes, so the biggest structures don't have to grow step by
+// step. Sizes are estimated from ratios measured on a corpus, and how well
+// they fit a different mix of code shows in tgroup_reserve_report.
+// #include'd files aren't counted, so inputs that pull in a lot of headers
+// get less than they need, which just means some growing after all.
+static void tgroup_reserve(
+    struct tgroup *tgroup,
+    uint64_t input_size,
+    uint32_t file_count)
+{
+    assert(tgroup != NULL);
+
+    struct tgroup_estimate *estimate = &tgroup->estimate;
+    estimate->input_size = input_size;
+    estimate->file_count = file_count;
+    estimate->line_count = _tgroup_scale(input_size, TGROUP_LINES_PER_MIB);
+    estimate->token_count = _tgroup_scale(input_size, TGROUP_TOKENS_PER_MIB);
+    estimate->string_count =
+        _tgroup_scale(input_size, TGROUP_STRINGS_PER_MIB);
+    estimate->string_bytes =
+        _tgroup_scale(input_size, TGROUP_STRING_BYTES_PER_MIB);
+    estimate->ast_entries = _tgroup_scale(
+        input_size / (file_count > 0 ? file_count : 1),
+        TGROUP_AST_ENTRIES_PER_MIB);
+
+    srcman_reserve(&tgroup->srcman, file_count, estimate->line_count);
+    tokman_reserve(&tgroup->tokman, estimate->token_count);
+    strman_reserve(
+        &tgroup->strman, estimate->string_count, estimate->string_bytes);
+    astman_reserve(&tgroup->astman, estimate->ast_entries);
+}
+
+// Print a row of the tgroup_reserve report.
+static void _tgroup_report_row(
+    FILE *file,
+    const char *name,
+    uint32_t estimated,
+    uint32_t actual)
+{
+    fprintf(file, "  %-13s %11" PRIu32 " %11" PRIu32, name, estimated, actual);
+    if (actual != 0)
+    {
+        fprintf(file, " %9.1f%%\n", 100.0 * estimated / actual);
+    }
+    else
+    {
+        fprintf(file, " %10s\n", "n/a");
+    }
+}
+
+// Print how tgroup_reserve's estimates compare with what was actually used.
+// Over 100% means memory was committed that wasn't needed; under means the
+// structure had to grow past its reservation.
+static void tgroup_reserve_report(struct tgroup *tgroup, FILE *file)
+{
+    assert(tgroup != NULL);
+    assert(file != NULL);
+
+    struct tgroup_estimate *estimate = &tgroup->estimate;
+    fprintf(
+        file,
+        "capacity estimate for %" PRIu64 " bytes in %" PRIu32 " files:\n"
+        "  %-13s %11s %11s %10s\n",
+        estimate->input_size, estimate->file_count,
+        "", "estimated", "actual", "estimate");
+    _tgroup_report_row(
+        file, "files", estimate->file_count, tgroup->srcman.phys_file_count);
+    _tgroup_report_row(
+        file, "lines", estimate->line_count, tgroup->srcman.line_count);
+    _tgroup_report_row(
+        file, "tokens", estimate->token_count, tgroup->tokman.count);
+    _tgroup_report_row(
+        file, "strings", estimate->string_count, tgroup->strman.entry_count);
+    _tgroup_report_row(
+        file, "string bytes", estimate->string_bytes,
+        tgroup->strman.data_size);
+    _tgroup_report_row(
+        file, "ast entries", estimate->ast_entries,
+        astman_get_peak_len(&tgroup->astman));
+}
@@ -4,24 +4,42 @@
 
 #pragma once
 
-#include "alloc.h"
+#include "vmem.h"
 
 // Stack for runtime-sized temporaries.
+//
+// Backed by a vmem_arr, so growing never moves what's on it: pointers into
+// the stack stay valid until the stack is rewound past them. Each frame of
+// temporaries stays contiguous, too, so a frame can be handed off as one
+// buffer, e.g. a token's spelling to strman.
 struct tmp_stack
 {
     size_t size;
-    size_t capacity;
     unsigned char *data;
+    struct vmem_arr vmem;
 };
 
+// Position on the temporary stack to rewind to.
+typedef size_t tmp_stack_mark_t;
+
+// Alignment for a type of the given size: the largest power of two that
+// divides it, since that's a multiple of the type's alignment, up to
+// ALLOC_ALIGNMENT.
+#define _TMP_STACK_ALIGN(size) \
+    ((size) & (0 - (size)) & (2 * ALLOC_ALIGNMENT - 1) \
+        ? (size) & (0 - (size)) & (2 * ALLOC_ALIGNMENT - 1) \
+        : ALLOC_ALIGNMENT)
+
 // Initialize temporary stack.
 static void tmp_stack_init(struct tmp_stack *stack)
 {
     assert(stack != NULL);
 
     stack->size = 0;
-    stack->capacity = 0;
-    stack->data = NULL;
+    vmem_arr_init(
+        &stack->vmem, sizeof(uint32_t) * (size_t)UINT32_MAX,
+        MEM_TAG_TMP_STACK);
+    stack->data = stack->vmem.data;
 }
 
 // Destroy temporary stack.
@@ -29,7 +47,7 @@ static void tmp_stack_destroy(struct tmp_stack *stack)
 {
     assert(stack != NULL);
 
-    jocc_free(stack->data);
+    vmem_arr_destroy(&stack->vmem);
 }
 
 // Get pointer to end of temporary stack.
@@ -40,6 +58,27 @@ static unsigned char *tmp_stack_end(struct tmp_stack *stack)
     return stack->data + stack->size;
 }
 
+// Grow temporary stack by size bytes. Returns pointer to the first.
+static void *_tmp_stack_grow(struct tmp_stack *stack, size_t size)
+{
+    // Check for overflow.
+    size_t old_size = stack->size;
+    if (size > SIZE_MAX - old_size)
+    {
+        translation_limit_exceeded();
+    }
+
+    // Commit more memory if necessary.
+    stack->size = old_size + size;
+    if (stack->size > stack->vmem.committed)
+    {
+        vmem_arr_ensure(&stack->vmem, stack->size);
+        stack->data = stack->vmem.data;
+    }
+
+    return stack->data + old_size;
+}
+
 // Push bytes to temporary stack.
 static void tmp_stack_push(
     struct tmp_stack *stack,
@@ -49,35 +88,53 @@ static void tmp_stack_push(
     assert(stack != NULL);
     assert(data != NULL);
 
-    // Check for overflow.
-    size_t old_size = stack->size;
-    stack->size = old_size + size;
-    if (stack->size < old_size)
+    memcpy(_tmp_stack_grow(stack, size), data, size);
+}
+
+// Allocate uninitialized space for len elements of element_size bytes on
+// top of the temporary stack, aligned to align, which must be a power of two
+// no greater than ALLOC_ALIGNMENT. Padding is added below if necessary.
+static void *tmp_stack_alloc(
+    struct tmp_stack *stack,
+    size_t len,
+    size_t element_size,
+    size_t align)
+{
+    assert(stack != NULL);
+    assert(align != 0 && (align & (align - 1)) == 0);
+    assert(align <= ALLOC_ALIGNMENT);
+
+    if (element_size != 0 && len > SIZE_MAX / element_size)
     {
         translation_limit_exceeded();
     }
 
-    // Re-allocate if necessary.
-    if (stack->capacity < stack->size)
-    {
-        stack->capacity *= 2;
-        if (stack->capacity < stack->size)
-        {
-            stack->capacity = stack->size;
-        }
+    // The base is page-aligned, so aligning the size aligns the pointer.
+    size_t padding = (0 - stack->size) & (align - 1);
+    unsigned char *ptr = _tmp_stack_grow(stack, padding + len * element_size);
+    return ptr + padding;
+}
 
-        stack->data = jocc_realloc(stack->data, stack->capacity);
-    }
+// Allocate uninitialized array of len elements of type T on top of the
+// temporary stack. Release it with tmp_stack_rewind.
+#define TMP_STACK_ALLOC(stack, T, len) \
+    ((T *)tmp_stack_alloc( \
+        stack, len, sizeof(T), _TMP_STACK_ALIGN(sizeof(T))))
+
+// Mark the current top of the temporary stack, to rewind to later.
+static tmp_stack_mark_t tmp_stack_mark(struct tmp_stack *stack)
+{
+    assert(stack != NULL);
 
-    // Copy the new data to the top of the stack.
-    memcpy(stack->data + old_size, data, size);
+    return stack->size;
 }
 
-// Pop bytes off temporary stack.
-static void tmp_stack_pop(struct tmp_stack *stack, size_t size)
+// Pop everything pushed or allocated since mark. Marks taken in between
+// are invalid afterwards.
+static void tmp_stack_rewind(struct tmp_stack *stack, tmp_stack_mark_t mark)
 {
     assert(stack != NULL);
-    assert(stack->size >= size);
+    assert(mark <= stack->size);
 
-    stack->size -= size;
+    stack->size = mark;
 }
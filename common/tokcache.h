@@ -0,0 +1,810 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "tgroup.h"
+
+#if defined(VMEM_POSIX)
+#include <dirent.h>
+#include <time.h>
+#include <utime.h>
+#endif
+
+// Cache file format version. jocc doesn't have a version number of its own,
+// so bump this whenever the layout changes or the lexer starts producing
+// different tokens for the same bytes.
+#define TOKCACHE_VERSION 1
+
+// Cache file magic number. Also catches files of the wrong byte order.
+#define TOKCACHE_MAGIC UINT32_C(0x4A4F5443) // "JOTC"
+
+// Cache file name extension. Only files with it are ever evicted.
+#define TOKCACHE_EXT ".jtc"
+
+// Default limit on the total size of a cache directory. A big translation
+// group can take a few hundred MiB of cache files, so this leaves room for a
+// few of them. Files used by the current run are never evicted, so a run
+// that needs more than the limit goes over it rather than losing its own.
+#define TOKCACHE_DEFAULT_MAX_SIZE ((uint64_t)1024 * 1024 * 1024)
+
+// Cache file header. Followed by:
+//
+//   token_count uint8_t syncats
+//   token_count uint8_t flags, zero-padded to a multiple of 4 bytes
+//   token_count uint32_t starts, relative to the start of the file
+//   token_count uint32_t lengths
+//   token_count uint32_t spellings, indexes into the string offsets
+//   line_count uint32_t line token counts
+//   string_count uint32_t string offsets into the string data
+//   string_data_size bytes of NUL-terminated string data
+//
+// String 0 is the empty string, standing in for spelling 0. payload_hash is
+// the jocc_hash of everything after the header, to catch corrupt files.
+struct tokcache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t content_hash_low;
+    uint64_t content_hash_high;
+    uint64_t payload_hash;
+    uint32_t content_size;
+    uint32_t token_count;
+    uint32_t line_count;
+    uint32_t string_count;
+    uint32_t string_data_size;
+    uint32_t reserved;
+};
+
+// Token cache.
+//
+// A directory of files holding the tokens lexed from a phys_file's content,
+// one file per content_hash, so files that haven't changed since a previous
+// run don't need to be lexed again. Only lines with tokens are stored; blank
+// lines don't matter to the preprocessor. The directory is kept under a size
+// limit by evicting the least recently used files, going by modification
+// time, which is bumped whenever a file is used.
+struct tokcache
+{
+    char *dir;
+    uint64_t max_size;
+
+    // When the cache was initialized, in the units of modification times.
+    // Files modified since then were written or used by this run.
+    int64_t start_time;
+
+    // Statistics.
+    uint32_t hit_count;
+    uint32_t miss_count;
+    uint32_t write_count;
+    uint32_t evict_count;
+};
+
+// Line of consecutive tokens in tokman.
+struct tokcache_line
+{
+    tokid_t first;
+    uint32_t count;
+};
+
+// Cache file opened for reading. Validated up front,
+// so reading lines from it can't go out of bounds.
+struct tokcache_file
+{
+    struct filemap map;
+
+    uint32_t token_count;
+    uint32_t line_count;
+    const uint8_t *syncats;
+    const uint8_t *flags;
+    const uint32_t *starts;
+    const uint32_t *lengths;
+    const uint32_t *spellings;
+    const uint32_t *line_counts;
+
+    uint32_t string_count;
+    uint32_t string_data_size;
+    const uint32_t *string_offsets;
+    const char *string_data;
+
+    // strid of each string in the file. Owned.
+    strid_t *strids;
+
+    // Next line to read and its first token.
+    uint32_t next_line;
+    uint32_t next_token;
+};
+
+// Get current time in the units of cache file modification times.
+static int64_t _tokcache_now(void)
+{
+#if defined(_WIN32)
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return (int64_t)(
+        ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime);
+#elif defined(VMEM_POSIX)
+    return (int64_t)time(NULL);
+#else
+    return 0;
+#endif
+}
+
+// Initialize token cache using directory dir, which is created if necessary.
+static void tokcache_init(
+    struct tokcache *cache,
+    const char *dir,
+    uint64_t max_size)
+{
+    assert(cache != NULL);
+    assert(dir != NULL);
+
+    size_t dir_size = strlen(dir) + 1;
+    cache->dir = ALLOC_ARRAY(char, dir_size, MEM_TAG_TOKCACHE);
+    memcpy(cache->dir, dir, dir_size);
+    cache->max_size = max_size;
+    cache->start_time = _tokcache_now();
+
+    cache->hit_count = 0;
+    cache->miss_count = 0;
+    cache->write_count = 0;
+    cache->evict_count = 0;
+
+    // Failure shows up later as files that can't be written.
+#if defined(_WIN32)
+    CreateDirectoryA(dir, NULL);
+#elif defined(VMEM_POSIX)
+    mkdir(dir, 0777);
+#endif
+}
+
+// Destroy token cache.
+static void tokcache_destroy(struct tokcache *cache)
+{
+    assert(cache != NULL);
+
+    jocc_free(cache->dir);
+}
+
+// Allocate path of cache directory entry name.
+static char *_tokcache_alloc_path(struct tokcache *cache, const char *name)
+{
+    size_t dir_len = strlen(cache->dir);
+    size_t name_size = strlen(name) + 1;
+    char *path = ALLOC_ARRAY(char, dir_len + 1 + name_size, MEM_TAG_TOKCACHE);
+    memcpy(path, cache->dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_size);
+    return path;
+}
+
+// Allocate path of the cache file for content_hash, plus suffix.
+static char *tokcache_alloc_file_path(
+    struct tokcache *cache,
+    hash128_t content_hash,
+    const char *suffix)
+{
+    char name[64];
+    snprintf(
+        name, sizeof(name), "%016" PRIx64 "%016" PRIx64 TOKCACHE_EXT "%s",
+        (uint64_t)content_hash.high64, (uint64_t)content_hash.low64, suffix);
+
+    return _tokcache_alloc_path(cache, name);
+}
+
+// Bump file modification time to now, marking it recently used.
+static void tokcache_touch(const char *path)
+{
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(
+        path, FILE_WRITE_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        SetFileTime(file, NULL, NULL, &now);
+        CloseHandle(file);
+    }
+#elif defined(VMEM_POSIX)
+    utime(path, NULL);
+#else
+    (void)path;
+#endif
+}
+
+// Whether the mapped file is a valid cache file for the given content.
+// Sets up file's column pointers if so.
+static bool _tokcache_validate(
+    struct tokcache_file *file,
+    hash128_t content_hash,
+    uint32_t content_size)
+{
+    // Check header.
+    struct tokcache_header header;
+    size_t size = file->map.size;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+
+    memcpy(&header, file->map.data, sizeof(header));
+    if (header.magic != TOKCACHE_MAGIC ||
+        header.version != TOKCACHE_VERSION ||
+        header.content_hash_low != content_hash.low64 ||
+        header.content_hash_high != content_hash.high64 ||
+        header.content_size != content_size ||
+        header.string_count == 0 ||
+        header.string_data_size == 0)
+    {
+        return false;
+    }
+
+    // Check size. Counts are 32-bit, so this can't overflow.
+    uint64_t tokens = header.token_count;
+    uint64_t byte_columns_size = (2 * tokens + 3) & ~(uint64_t)3;
+    uint64_t expected_size =
+        sizeof(header) +
+        byte_columns_size +
+        sizeof(uint32_t) * (3 * tokens + header.line_count) +
+        sizeof(uint32_t) * (uint64_t)header.string_count +
+        header.string_data_size;
+
+    const unsigned char *p = (const unsigned char *)file->map.data;
+    if (expected_size != size ||
+        jocc_hash(p + sizeof(header), size - sizeof(header)) !=
+            header.payload_hash)
+    {
+        return false;
+    }
+
+    // Locate sections.
+    p += sizeof(header);
+    file->syncats = p;
+    file->flags = p + tokens;
+    p += byte_columns_size;
+    file->starts = (const uint32_t *)p;
+    file->lengths = file->starts + tokens;
+    file->spellings = file->lengths + tokens;
+    file->line_counts = file->spellings + tokens;
+    file->string_offsets = file->line_counts + header.line_count;
+    file->string_data =
+        (const char *)(file->string_offsets + header.string_count);
+
+    // Check tokens.
+    for (uint32_t i = 0; i < header.token_count; i++)
+    {
+        enum syncat syncat = file->syncats[i];
+        if (syncat <= SYNCAT_EOL ||
+            syncat > SYNCAT_ILLEGAL_BYTES ||
+            (uint64_t)file->starts[i] + file->lengths[i] > content_size ||
+            file->spellings[i] >= header.string_count)
+        {
+            return false;
+        }
+    }
+
+    // Check lines.
+    uint64_t line_tokens = 0;
+    for (uint32_t i = 0; i < header.line_count; i++)
+    {
+        if (file->line_counts[i] == 0)
+        {
+            return false;
+        }
+
+        line_tokens += file->line_counts[i];
+    }
+
+    if (line_tokens != tokens)
+    {
+        return false;
+    }
+
+    // Check strings are in order and terminated.
+    const uint32_t *offsets = file->string_offsets;
+    if (offsets[0] != 0 ||
+        file->string_data[0] != 0 ||
+        file->string_data[header.string_data_size - 1] != 0)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 1; i < header.string_count; i++)
+    {
+        if (offsets[i] <= offsets[i - 1] ||
+            offsets[i] >= header.string_data_size ||
+            file->string_data[offsets[i] - 1] != 0)
+        {
+            return false;
+        }
+    }
+
+    file->token_count = header.token_count;
+    file->line_count = header.line_count;
+    file->string_count = header.string_count;
+    file->string_data_size = header.string_data_size;
+    return true;
+}
+
+// Open the cache file for a phys_file's content and intern its strings.
+// Returns false if there isn't a valid one.
+static bool tokcache_open(
+    struct tokcache *cache,
+    struct strman *strman,
+    hash128_t content_hash,
+    uint32_t content_size,
+    struct tokcache_file *file)
+{
+    assert(cache != NULL);
+    assert(strman != NULL);
+    assert(file != NULL);
+
+    // Map and validate.
+    char *path = tokcache_alloc_file_path(cache, content_hash, "");
+    bool ok =
+        filemap_open(&file->map, path, true) &&
+        file->map.data != NULL &&
+        (uintptr_t)file->map.data % sizeof(uint32_t) == 0;
+
+    if (ok && !_tokcache_validate(file, content_hash, content_size))
+    {
+        filemap_close(&file->map);
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        jocc_free(path);
+        cache->miss_count++;
+        return false;
+    }
+
+    tokcache_touch(path);
+    jocc_free(path);
+    cache->hit_count++;
+
+    // Intern strings.
+    const uint32_t *offsets = file->string_offsets;
+    file->strids = ALLOC_ARRAY(strid_t, file->string_count, MEM_TAG_TOKCACHE);
+    file->strids[0] = 0;
+    for (uint32_t i = 1; i < file->string_count; i++)
+    {
+        uint32_t end = i + 1 < file->string_count
+            ? offsets[i + 1]
+            : file->string_data_size;
+
+        file->strids[i] = strman_get_id(
+            strman, file->string_data + offsets[i], end - offsets[i] - 1);
+    }
+
+    file->next_line = 0;
+    file->next_token = 0;
+    return true;
+}
+
+// Close cache file.
+static void tokcache_close(struct tokcache_file *file)
+{
+    assert(file != NULL);
+
+    jocc_free(file->strids);
+    filemap_close(&file->map);
+}
+
+// Add the next line of tokens in the cache file to tokman, with srclocs
+// relative to file_start. Returns false if there are no more lines.
+static bool tokcache_read_line(
+    struct tokcache_file *file,
+    struct tokman *tokman,
+    srcloc_t file_start,
+    struct tokcache_line *line)
+{
+    assert(file != NULL);
+    assert(tokman != NULL);
+    assert(line != NULL);
+
+    if (file->next_line == file->line_count)
+    {
+        return false;
+    }
+
+    uint32_t src = file->next_token;
+    uint32_t count = file->line_counts[file->next_line++];
+    file->next_token += count;
+
+    tokid_t dst = tokman_extend(tokman, count);
+    memcpy(tokman->syncats + dst, file->syncats + src, count);
+    memcpy(tokman->flags + dst, file->flags + src, count);
+    memcpy(
+        tokman->lengths + dst, file->lengths + src,
+        sizeof(uint32_t) * count);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        tokman->starts[dst + i] = file_start + file->starts[src + i];
+        tokman->spellings[dst + i] = file->strids[file->spellings[src + i]];
+    }
+
+    line->first = dst;
+    line->count = count;
+    return true;
+}
+
+// Hash map of strid to cache file string index, for writing.
+struct _tokcache_strmap
+{
+    uint32_t count;
+    uint32_t capacity; // Must be a power of two.
+    strid_t *strids; // 0 means empty.
+    uint32_t *indexes;
+};
+
+// Get cache file string index of strid, adding it if necessary.
+static uint32_t _tokcache_strmap_get(
+    struct _tokcache_strmap *map,
+    strid_t strid)
+{
+    if (strid == 0)
+    {
+        return 0;
+    }
+
+    uint32_t mask = map->capacity - 1;
+    uint32_t i = (uint32_t)jocc_hash_small(&strid, sizeof(strid)) & mask;
+    for (; map->strids[i] != 0; i = (i + 1) & mask)
+    {
+        if (map->strids[i] == strid)
+        {
+            return map->indexes[i];
+        }
+    }
+
+    // String 0 is the empty string, so new ones start at 1.
+    map->strids[i] = strid;
+    map->indexes[i] = ++map->count;
+
+    // Keep the map at most half full.
+    if (map->count > map->capacity / 2)
+    {
+        uint32_t old_capacity = map->capacity;
+        strid_t *old_strids = map->strids;
+        uint32_t *old_indexes = map->indexes;
+
+        map->capacity = old_capacity * 2;
+        map->strids = ZALLOC_ARRAY(strid_t, map->capacity, MEM_TAG_TOKCACHE);
+        map->indexes = ALLOC_ARRAY(uint32_t, map->capacity, MEM_TAG_TOKCACHE);
+
+        mask = map->capacity - 1;
+        for (uint32_t j = 0; j < old_capacity; j++)
+        {
+            if (old_strids[j] != 0)
+            {
+                uint32_t k = (uint32_t)jocc_hash_small(
+                    &old_strids[j], sizeof(strid_t)) & mask;
+                while (map->strids[k] != 0)
+                {
+                    k = (k + 1) & mask;
+                }
+
+                map->strids[k] = old_strids[j];
+                map->indexes[k] = old_indexes[j];
+            }
+        }
+
+        jocc_free(old_indexes);
+        jocc_free(old_strids);
+    }
+
+    return map->count;
+}
+
+// Write cache file for a phys_file's content from the lines of tokens lexed
+// from it, with srclocs relative to file_start. Returns false on I/O error.
+static bool tokcache_write(
+    struct tokcache *cache,
+    struct tgroup *tgroup,
+    hash128_t content_hash,
+    uint32_t content_size,
+    srcloc_t file_start,
+    const struct tokcache_line *lines,
+    uint32_t line_count)
+{
+    assert(cache != NULL);
+    assert(tgroup != NULL);
+    assert(lines != NULL || line_count == 0);
+
+    struct tokman *tokman = &tgroup->tokman;
+    struct strman *strman = &tgroup->strman;
+
+    // Gather columns, rebasing srclocs and mapping strids to string indexes.
+    uint32_t token_count = 0;
+    for (uint32_t i = 0; i < line_count; i++)
+    {
+        token_count += lines[i].count;
+    }
+
+    size_t byte_columns_size = ((size_t)token_count * 2 + 3) & ~(size_t)3;
+    uint8_t *byte_columns = ZALLOC_ARRAY(
+        uint8_t, byte_columns_size + 1, MEM_TAG_TOKCACHE);
+    uint32_t *columns = ALLOC_ARRAY(
+        uint32_t, (size_t)token_count * 3 + 1, MEM_TAG_TOKCACHE);
+    uint32_t *line_counts = ALLOC_ARRAY(
+        uint32_t, (size_t)line_count + 1, MEM_TAG_TOKCACHE);
+
+    struct _tokcache_strmap strmap;
+    strmap.count = 0;
+    strmap.capacity = 64;
+    strmap.strids = ZALLOC_ARRAY(strid_t, strmap.capacity, MEM_TAG_TOKCACHE);
+    strmap.indexes = ALLOC_ARRAY(uint32_t, strmap.capacity, MEM_TAG_TOKCACHE);
+
+    uint32_t t = 0;
+    for (uint32_t i = 0; i < line_count; i++)
+    {
+        tokid_t first = lines[i].first;
+        uint32_t count = lines[i].count;
+        line_counts[i] = count;
+
+        memcpy(byte_columns + t, tokman->syncats + first, count);
+        memcpy(byte_columns + token_count + t, tokman->flags + first, count);
+        for (uint32_t j = 0; j < count; j++, t++)
+        {
+            columns[t] = tokman->starts[first + j] - file_start;
+            columns[token_count + t] = tokman->lengths[first + j];
+            columns[2 * token_count + t] = _tokcache_strmap_get(
+                &strmap, tokman->spellings[first + j]);
+        }
+    }
+
+    // Lay out strings in index order.
+    uint32_t string_count = strmap.count + 1;
+    strid_t *strings = ALLOC_ARRAY(strid_t, string_count, MEM_TAG_TOKCACHE);
+    strings[0] = 0;
+    for (uint32_t i = 0; i < strmap.capacity; i++)
+    {
+        if (strmap.strids[i] != 0)
+        {
+            strings[strmap.indexes[i]] = strmap.strids[i];
+        }
+    }
+
+    uint32_t *string_offsets = ALLOC_ARRAY(
+        uint32_t, string_count, MEM_TAG_TOKCACHE);
+    uint32_t string_data_size = 0;
+    for (uint32_t i = 0; i < string_count; i++)
+    {
+        string_offsets[i] = string_data_size;
+        size_t size = strlen(strman_get_str(strman, strings[i])) + 1;
+        if (size > UINT32_MAX - string_data_size)
+        {
+            translation_limit_exceeded();
+        }
+
+        string_data_size += (uint32_t)size;
+    }
+
+    // Hash payload.
+    size_t column_count = (size_t)token_count * 3;
+    hash_state_t hash_state;
+    jocc_hash_reset(&hash_state);
+    jocc_hash_update(&hash_state, byte_columns, byte_columns_size);
+    jocc_hash_update(&hash_state, columns, sizeof(uint32_t) * column_count);
+    jocc_hash_update(&hash_state, line_counts, sizeof(uint32_t) * line_count);
+    jocc_hash_update(
+        &hash_state, string_offsets, sizeof(uint32_t) * string_count);
+
+    for (uint32_t i = 0; i < string_count; i++)
+    {
+        const char *str = strman_get_str(strman, strings[i]);
+        jocc_hash_update(&hash_state, str, strlen(str) + 1);
+    }
+
+    // Write to a temporary file first, so readers never see a partial file.
+    struct tokcache_header header;
+    header.magic = TOKCACHE_MAGIC;
+    header.version = TOKCACHE_VERSION;
+    header.content_hash_low = content_hash.low64;
+    header.content_hash_high = content_hash.high64;
+    header.payload_hash = jocc_hash_digest(&hash_state);
+    header.content_size = content_size;
+    header.token_count = token_count;
+    header.line_count = line_count;
+    header.string_count = string_count;
+    header.string_data_size = string_data_size;
+    header.reserved = 0;
+
+    char *path = tokcache_alloc_file_path(cache, content_hash, "");
+    char *tmp_path = tokcache_alloc_file_path(cache, content_hash, ".tmp");
+
+    bool ok = false;
+    FILE *file = fopen(tmp_path, "wb");
+    if (file != NULL)
+    {
+        ok =
+            fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(byte_columns, 1, byte_columns_size, file) ==
+                byte_columns_size &&
+            fwrite(columns, sizeof(uint32_t), column_count, file) ==
+                column_count &&
+            fwrite(line_counts, sizeof(uint32_t), line_count, file) ==
+                line_count &&
+            fwrite(string_offsets, sizeof(uint32_t), string_count, file) ==
+                string_count;
+
+        for (uint32_t i = 0; ok && i < string_count; i++)
+        {
+            const char *str = strman_get_str(strman, strings[i]);
+            size_t size = strlen(str) + 1;
+            ok = fwrite(str, 1, size, file) == size;
+        }
+
+        ok = fclose(file) == 0 && ok;
+        if (ok)
+        {
+            remove(path);
+            ok = rename(tmp_path, path) == 0;
+        }
+
+        if (!ok)
+        {
+            remove(tmp_path);
+        }
+    }
+
+    if (ok)
+    {
+        cache->write_count++;
+    }
+
+    // Cleanup.
+    jocc_free(tmp_path);
+    jocc_free(path);
+    jocc_free(string_offsets);
+    jocc_free(strings);
+    jocc_free(strmap.indexes);
+    jocc_free(strmap.strids);
+    jocc_free(line_counts);
+    jocc_free(columns);
+    jocc_free(byte_columns);
+    return ok;
+}
+
+// Cache directory entry, for eviction.
+struct _tokcache_entry
+{
+    char *name;
+    uint64_t size;
+    int64_t mtime;
+};
+
+// Order cache directory entries from least to most recently used.
+static int _tokcache_entry_cmp(const void *a, const void *b)
+{
+    int64_t a_mtime = ((const struct _tokcache_entry *)a)->mtime;
+    int64_t b_mtime = ((const struct _tokcache_entry *)b)->mtime;
+    return (a_mtime > b_mtime) - (a_mtime < b_mtime);
+}
+
+// Add cache directory entry if name has the cache file extension.
+static void _tokcache_add_entry(
+    struct _tokcache_entry **entries,
+    uint32_t *count,
+    uint32_t *capacity,
+    const char *name,
+    uint64_t size,
+    int64_t mtime)
+{
+    size_t name_len = strlen(name);
+    size_t ext_len = strlen(TOKCACHE_EXT);
+    if (name_len <= ext_len ||
+        strcmp(name + name_len - ext_len, TOKCACHE_EXT) != 0)
+    {
+        return;
+    }
+
+    // Re-allocate if necessary.
+    DYNARR_GROW(
+        struct _tokcache_entry, *entries, *count, *capacity, 1,
+        MEM_TAG_TOKCACHE);
+
+    struct _tokcache_entry *entry = &(*entries)[(*count)++];
+    entry->name = ALLOC_ARRAY(char, name_len + 1, MEM_TAG_TOKCACHE);
+    memcpy(entry->name, name, name_len + 1);
+    entry->size = size;
+    entry->mtime = mtime;
+}
+
+// Delete least recently used cache files until the directory fits in the
+// size limit, except for any this run wrote or used. Call after writing.
+static void tokcache_evict(struct tokcache *cache)
+{
+    assert(cache != NULL);
+
+    // List cache files.
+    uint32_t count = 0;
+    uint32_t capacity = 16;
+    struct _tokcache_entry *entries =
+        ALLOC_ARRAY(struct _tokcache_entry, capacity, MEM_TAG_TOKCACHE);
+
+#if defined(_WIN32)
+    char *pattern = _tokcache_alloc_path(cache, "*" TOKCACHE_EXT);
+    WIN32_FIND_DATAA find_data;
+    HANDLE find = FindFirstFileA(pattern, &find_data);
+    jocc_free(pattern);
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            uint64_t size =
+                ((uint64_t)find_data.nFileSizeHigh << 32) |
+                find_data.nFileSizeLow;
+            int64_t mtime = (int64_t)(
+                ((uint64_t)find_data.ftLastWriteTime.dwHighDateTime << 32) |
+                find_data.ftLastWriteTime.dwLowDateTime);
+
+            _tokcache_add_entry(
+                &entries, &count, &capacity,
+                find_data.cFileName, size, mtime);
+        }
+        while (FindNextFileA(find, &find_data));
+
+        FindClose(find);
+    }
+#elif defined(VMEM_POSIX)
+    DIR *dir = opendir(cache->dir);
+    if (dir != NULL)
+    {
+        struct dirent *dirent;
+        while ((dirent = readdir(dir)) != NULL)
+        {
+            char *path = _tokcache_alloc_path(cache, dirent->d_name);
+            struct stat st;
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            {
+                _tokcache_add_entry(
+                    &entries, &count, &capacity, dirent->d_name,
+                    (uint64_t)st.st_size, (int64_t)st.st_mtime);
+            }
+
+            jocc_free(path);
+        }
+
+        closedir(dir);
+    }
+#endif
+
+    // Delete oldest first until the rest fit. Files this run has used are
+    // newer than any it hasn't, so stop at the first of them.
+    uint64_t total_size = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        total_size += entries[i].size;
+    }
+
+    qsort(entries, count, sizeof(*entries), _tokcache_entry_cmp);
+    for (uint32_t i = 0;
+        i < count &&
+        total_size > cache->max_size &&
+        entries[i].mtime < cache->start_time;
+        i++)
+    {
+        char *path = _tokcache_alloc_path(cache, entries[i].name);
+        if (remove(path) == 0)
+        {
+            total_size -= entries[i].size;
+            cache->evict_count++;
+        }
+
+        jocc_free(path);
+    }
+
+    // Cleanup.
+    for (uint32_t i = 0; i < count; i++)
+    {
+        jocc_free(entries[i].name);
+    }
+
+    jocc_free(entries);
+}
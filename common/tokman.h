@@ -0,0 +1,218 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "strman.h"
+#include "syncat.h"
+
+// Token ID.
+// Index into tokman columns.
+// 0 is reserved for null.
+typedef uint32_t tokid_t;
+
+// Token flags.
+#define TOKEN_LEADING_WS 0x01 // Preceded by trivia on the same line.
+#define TOKEN_LINE_START 0x02 // First token on its line.
+
+// Token manager.
+//
+// Stores tokens as a struct of arrays: one column each for syncat, flags,
+// starting srcloc, length, and spelling, all indexed by tokid_t. Loops that
+// only care about some token properties, e.g. scanning for a syncat, only
+// touch those columns. Like astman data, the columns are reserved up front
+// for the most tokens possible, so they never move.
+struct tokman
+{
+    uint32_t count;
+    size_t capacity; // Tokens every column has committed memory for.
+    uint8_t *syncats;
+    uint8_t *flags;
+    srcloc_t *starts;
+    uint32_t *lengths;
+    strid_t *spellings; // 0 for punctuators and trivia.
+
+    struct vmem_arr syncats_vmem;
+    struct vmem_arr flags_vmem;
+    struct vmem_arr starts_vmem;
+    struct vmem_arr lengths_vmem;
+    struct vmem_arr spellings_vmem;
+};
+
+// Commit column memory for count tokens and refresh column pointers.
+static void _tokman_ensure(struct tokman *tokman, size_t count)
+{
+    vmem_arr_ensure(&tokman->syncats_vmem, sizeof(uint8_t) * count);
+    vmem_arr_ensure(&tokman->flags_vmem, sizeof(uint8_t) * count);
+    vmem_arr_ensure(&tokman->starts_vmem, sizeof(srcloc_t) * count);
+    vmem_arr_ensure(&tokman->lengths_vmem, sizeof(uint32_t) * count);
+    vmem_arr_ensure(&tokman->spellings_vmem, sizeof(strid_t) * count);
+
+    tokman->syncats = tokman->syncats_vmem.data;
+    tokman->flags = tokman->flags_vmem.data;
+    tokman->starts = (srcloc_t *)tokman->starts_vmem.data;
+    tokman->lengths = (uint32_t *)tokman->lengths_vmem.data;
+    tokman->spellings = (strid_t *)tokman->spellings_vmem.data;
+
+    // Columns commit at their own pace, so the widest one limits capacity.
+    size_t capacity = tokman->syncats_vmem.committed / sizeof(uint8_t);
+    size_t widest = tokman->starts_vmem.committed / sizeof(srcloc_t);
+    if (widest < capacity)
+    {
+        capacity = widest;
+    }
+
+    widest = tokman->lengths_vmem.committed / sizeof(uint32_t);
+    if (widest < capacity)
+    {
+        capacity = widest;
+    }
+
+    widest = tokman->spellings_vmem.committed / sizeof(strid_t);
+    if (widest < capacity)
+    {
+        capacity = widest;
+    }
+
+    tokman->capacity = capacity;
+}
+
+// Initialize token manager.
+static void tokman_init(struct tokman *tokman)
+{
+    assert(tokman != NULL);
+
+    size_t max_count = UINT32_MAX;
+    vmem_arr_init(
+        &tokman->syncats_vmem, sizeof(uint8_t) * max_count, MEM_TAG_TOKMAN);
+    vmem_arr_init(
+        &tokman->flags_vmem, sizeof(uint8_t) * max_count, MEM_TAG_TOKMAN);
+    vmem_arr_init(
+        &tokman->starts_vmem, sizeof(srcloc_t) * max_count, MEM_TAG_TOKMAN);
+    vmem_arr_init(
+        &tokman->lengths_vmem, sizeof(uint32_t) * max_count, MEM_TAG_TOKMAN);
+    vmem_arr_init(
+        &tokman->spellings_vmem, sizeof(strid_t) * max_count, MEM_TAG_TOKMAN);
+
+    // Reserve the null token.
+    tokman->count = 1;
+    _tokman_ensure(tokman, 1);
+    tokman->syncats[0] = SYNCAT_NONE;
+    tokman->flags[0] = 0;
+    tokman->starts[0] = 0;
+    tokman->lengths[0] = 0;
+    tokman->spellings[0] = 0;
+}
+
+// Destroy token manager.
+static void tokman_destroy(struct tokman *tokman)
+{
+    assert(tokman != NULL);
+
+    vmem_arr_destroy(&tokman->spellings_vmem);
+    vmem_arr_destroy(&tokman->lengths_vmem);
+    vmem_arr_destroy(&tokman->starts_vmem);
+    vmem_arr_destroy(&tokman->flags_vmem);
+    vmem_arr_destroy(&tokman->syncats_vmem);
+}
+
+// Commit column memory for count tokens up front, e.g. from an estimate of
+// the input size, so adding that many doesn't have to commit any more.
+static void tokman_reserve(struct tokman *tokman, uint32_t count)
+{
+    assert(tokman != NULL);
+
+    if (count > tokman->capacity)
+    {
+        _tokman_ensure(tokman, count);
+    }
+}
+
+// Add token spanning [start, end).
+static tokid_t tokman_add(
+    struct tokman *tokman,
+    enum syncat syncat,
+    uint8_t flags,
+    srcloc_t start,
+    srcloc_t end,
+    strid_t spelling)
+{
+    assert(tokman != NULL);
+    assert(syncat <= 0xFF);
+    assert(start <= end);
+
+    // Commit more memory if necessary.
+    tokid_t id = tokman->count;
+    if (id == UINT32_MAX)
+    {
+        translation_limit_exceeded();
+    }
+
+    tokman->count = id + 1;
+    if (tokman->count > tokman->capacity)
+    {
+        _tokman_ensure(tokman, tokman->count);
+    }
+
+    // Initialize columns.
+    tokman->syncats[id] = (uint8_t)syncat;
+    tokman->flags[id] = flags;
+    tokman->starts[id] = start;
+    tokman->lengths[id] = end - start;
+    tokman->spellings[id] = spelling;
+
+    // Return ID.
+    return id;
+}
+
+// Append count uninitialized tokens. Returns ID of first.
+static tokid_t tokman_extend(struct tokman *tokman, uint32_t count)
+{
+    assert(tokman != NULL);
+
+    // Check for overflow.
+    tokid_t first = tokman->count;
+    if (count > UINT32_MAX - first)
+    {
+        translation_limit_exceeded();
+    }
+
+    // Commit more memory if necessary.
+    tokman->count = first + count;
+    if (tokman->count > tokman->capacity)
+    {
+        _tokman_ensure(tokman, tokman->count);
+    }
+
+    return first;
+}
+
+// Get token ending srcloc (exclusive).
+static srcloc_t tokman_get_end(struct tokman *tokman, tokid_t id)
+{
+    assert(tokman != NULL);
+    assert(id > 0);
+    assert(id < tokman->count);
+
+    return tokman->starts[id] + tokman->lengths[id];
+}
+
+// Find the first token in [first, end) with the given syncat. Returns end if
+// there isn't one. Only reads the syncat column, with memchr, which libc's
+// typically vectorize.
+static tokid_t tokman_find_syncat(
+    struct tokman *tokman,
+    tokid_t first,
+    tokid_t end,
+    enum syncat syncat)
+{
+    assert(tokman != NULL);
+    assert(first <= end);
+    assert(end <= tokman->count);
+
+    const uint8_t *found =
+        memchr(tokman->syncats + first, (int)syncat, end - first);
+
+    return found == NULL ? end : (tokid_t)(found - tokman->syncats);
+}
@@ -0,0 +1,417 @@
+// Copyright (c) Jo Bates 2021.
+// Distributed under the MIT License.
+// See accompanying file LICENSE.txt
+
+#pragma once
+
+#include "alloc.h"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#define VMEM_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Transparent huge pages, where madvise can ask for them.
+#if defined(VMEM_POSIX) && defined(MADV_HUGEPAGE)
+#define VMEM_HUGE_PAGES
+#endif
+
+// Read-only view of a whole file.
+// Memory-mapped where the platform supports it. Otherwise, read into a buffer.
+struct filemap
+{
+    const void *data;
+    size_t size;
+
+    // Platform-specific bookkeeping.
+    void *_base;
+    void *_handle;
+};
+
+// Map file into memory. Returns false if the file can't be opened or mapped.
+// Empty files map successfully with data set to NULL. Pages are read ahead
+// on the assumption the whole file is about to be used, and more aggressively
+// if it's going to be read front to back.
+static bool filemap_open(struct filemap *map, const char *path, bool sequential)
+{
+    assert(map != NULL);
+    assert(path != NULL);
+
+    map->data = NULL;
+    map->size = 0;
+    map->_base = NULL;
+    map->_handle = NULL;
+    (void)sequential; // Not every platform takes hints.
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(
+        path, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || (uint64_t)size.QuadPart > SIZE_MAX)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    if (size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return true;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+    {
+        return false;
+    }
+
+    void *base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (base == NULL)
+    {
+        CloseHandle(mapping);
+        return false;
+    }
+
+    map->data = base;
+    map->size = (size_t)size.QuadPart;
+    map->_base = base;
+    map->_handle = mapping;
+    mem_count_mapped(MEM_TAG_FILE_DATA, (int64_t)map->size);
+    return true;
+#elif defined(VMEM_POSIX)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uintmax_t)st.st_size > SIZE_MAX)
+    {
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return false;
+    }
+
+    // Just hints, so failure doesn't matter.
+#if defined(MADV_SEQUENTIAL) && defined(MADV_WILLNEED)
+    if (sequential)
+    {
+        madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+    }
+
+    madvise(base, (size_t)st.st_size, MADV_WILLNEED);
+#endif
+
+    map->data = base;
+    map->size = (size_t)st.st_size;
+    map->_base = base;
+    mem_count_mapped(MEM_TAG_FILE_DATA, (int64_t)map->size);
+    return true;
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    size_t size = 0;
+    size_t capacity = 0;
+    unsigned char *data = NULL;
+    for (;;)
+    {
+        if (size == capacity)
+        {
+            if (capacity > SIZE_MAX / 2 - 4096)
+            {
+                out_of_memory();
+            }
+
+            capacity = capacity * 2 + 4096;
+            data = jocc_realloc(data, capacity, MEM_TAG_FILE_DATA);
+        }
+
+        size_t ret = fread(data + size, 1, capacity - size, file);
+        size += ret;
+        if (ret == 0)
+        {
+            break;
+        }
+    }
+
+    bool ok = !ferror(file);
+    fclose(file);
+    if (!ok || size == 0)
+    {
+        jocc_free(data);
+        return ok;
+    }
+
+    map->data = data;
+    map->size = size;
+    map->_base = data;
+    return true;
+#endif
+}
+
+// Unmap file.
+static void filemap_close(struct filemap *map)
+{
+    assert(map != NULL);
+
+    if (map->_base == NULL)
+    {
+        return;
+    }
+
+#if defined(_WIN32)
+    UnmapViewOfFile(map->_base);
+    CloseHandle(map->_handle);
+    mem_count_mapped(MEM_TAG_FILE_DATA, -(int64_t)map->size);
+#elif defined(VMEM_POSIX)
+    munmap(map->_base, map->size);
+    mem_count_mapped(MEM_TAG_FILE_DATA, -(int64_t)map->size);
+#else
+    jocc_free(map->_base);
+#endif
+
+    map->data = NULL;
+    map->size = 0;
+    map->_base = NULL;
+    map->_handle = NULL;
+}
+
+// Growable array backed by a virtual memory reservation.
+//
+// Address space for the largest size the array may ever need is reserved up
+// front, and pages are committed as it grows, so growing never copies or
+// moves the data. Pointers into it stay valid until it's destroyed. Where the
+// platform has no virtual memory API, falls back to re-allocating.
+//
+// Big arrays get walked all over, and with 4 KiB pages that means a TLB miss
+// on nearly every access. So where transparent huge pages are available, the
+// reservation is aligned to VMEM_HUGE_PAGE_SIZE, and once an array grows to a
+// huge page, it asks for them and commits whole ones from then on.
+struct vmem_arr
+{
+    unsigned char *data;
+    size_t committed;
+    size_t reserved;
+    enum mem_tag tag;
+    bool huge; // Whether the reservation is aligned for huge pages.
+};
+
+// Granularity of committing pages. Must be a power of two and a multiple of
+// the page size on every platform we care about.
+#define VMEM_COMMIT_GRANULE ((size_t)64 * 1024)
+
+// Huge page size and alignment. 2 MiB on x86-64 and most AArch64 kernels.
+#define VMEM_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+// Whether new arrays may use huge pages. On by default.
+static bool _vmem_huge_pages = true;
+
+// Set whether arrays initialized from now on may use huge pages,
+// e.g. to compare with and without them.
+static void vmem_set_huge_pages(bool enabled)
+{
+    _vmem_huge_pages = enabled;
+}
+
+// Initialize array able to grow to max_size bytes, with committed memory
+// counted under tag. Address space is tight on 32-bit platforms, so if
+// max_size can't be reserved, successively halve it.
+static void vmem_arr_init(
+    struct vmem_arr *arr,
+    size_t max_size,
+    enum mem_tag tag)
+{
+    assert(arr != NULL);
+    assert(max_size != 0);
+
+    arr->data = NULL;
+    arr->committed = 0;
+    arr->tag = tag;
+    arr->huge = false;
+
+    size_t granule_mask = VMEM_COMMIT_GRANULE - 1;
+    size_t reserved = max_size > SIZE_MAX - granule_mask
+        ? SIZE_MAX & ~granule_mask
+        : (max_size + granule_mask) & ~granule_mask;
+
+#if defined(_WIN32) || defined(VMEM_POSIX)
+    for (; reserved >= VMEM_COMMIT_GRANULE; reserved /= 2)
+    {
+#if defined(_WIN32)
+        void *base = VirtualAlloc(NULL, reserved, MEM_RESERVE, PAGE_NOACCESS);
+        if (base != NULL)
+#else
+        // Over-reserve by a huge page to be able to align, then trim. Not
+        // worth it unless the array could span a few huge pages.
+        bool huge = false;
+#if defined(VMEM_HUGE_PAGES)
+        huge =
+            _vmem_huge_pages &&
+            reserved >= 4 * VMEM_HUGE_PAGE_SIZE &&
+            reserved <= SIZE_MAX - 2 * VMEM_HUGE_PAGE_SIZE;
+        if (huge)
+        {
+            reserved = (reserved + VMEM_HUGE_PAGE_SIZE - 1) &
+                ~(VMEM_HUGE_PAGE_SIZE - 1);
+        }
+#endif
+
+        size_t slack = huge ? VMEM_HUGE_PAGE_SIZE : 0;
+        unsigned char *base = mmap(
+            NULL, reserved + slack, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED && huge)
+        {
+            uintptr_t mask = VMEM_HUGE_PAGE_SIZE - 1;
+            size_t head = (size_t)
+                ((((uintptr_t)base + mask) & ~mask) - (uintptr_t)base);
+            if (head > 0)
+            {
+                munmap(base, head);
+            }
+
+            if (slack > head)
+            {
+                munmap(base + head + reserved, slack - head);
+            }
+
+            base += head;
+        }
+
+        if (base != MAP_FAILED)
+#endif
+        {
+            arr->data = base;
+            arr->reserved = reserved;
+#if defined(VMEM_POSIX)
+            arr->huge = huge;
+#endif
+            return;
+        }
+    }
+
+    out_of_memory();
+#else
+    arr->reserved = reserved;
+#endif
+}
+
+// Destroy array.
+static void vmem_arr_destroy(struct vmem_arr *arr)
+{
+    assert(arr != NULL);
+
+#if defined(_WIN32)
+    VirtualFree(arr->data, 0, MEM_RELEASE);
+    mem_count_mapped(arr->tag, -(int64_t)arr->committed);
+#elif defined(VMEM_POSIX)
+    munmap(arr->data, arr->reserved);
+    mem_count_mapped(arr->tag, -(int64_t)arr->committed);
+#else
+    jocc_free(arr->data);
+#endif
+}
+
+// Commit more of the array so that at least size bytes are usable.
+static void _vmem_arr_commit(struct vmem_arr *arr, size_t size)
+{
+    if (size > arr->reserved)
+    {
+        out_of_memory();
+    }
+
+    // Commit geometrically, like re-allocating arrays grow,
+    // so growing one element at a time stays cheap.
+    size_t granule_mask = VMEM_COMMIT_GRANULE - 1;
+    size_t committed = arr->committed;
+    size_t new_committed = (size + granule_mask) & ~granule_mask;
+    if (new_committed < committed * 2)
+    {
+        new_committed = committed * 2;
+    }
+
+    // Commit whole huge pages once the array reaches one. The first time,
+    // ask for them; mprotect keeps the advice for the pages it commits.
+#if defined(VMEM_HUGE_PAGES)
+    if (arr->huge && new_committed >= VMEM_HUGE_PAGE_SIZE)
+    {
+        size_t huge_mask = VMEM_HUGE_PAGE_SIZE - 1;
+        new_committed = (new_committed + huge_mask) & ~huge_mask;
+        if (committed < VMEM_HUGE_PAGE_SIZE)
+        {
+            madvise(arr->data, arr->reserved, MADV_HUGEPAGE);
+        }
+    }
+#endif
+
+    if (new_committed > arr->reserved)
+    {
+        new_committed = arr->reserved;
+    }
+
+#if defined(_WIN32)
+    if (VirtualAlloc(
+        arr->data + committed, new_committed - committed,
+        MEM_COMMIT, PAGE_READWRITE) == NULL)
+    {
+        out_of_memory();
+    }
+
+    mem_count_mapped(arr->tag, (int64_t)(new_committed - committed));
+#elif defined(VMEM_POSIX)
+    if (mprotect(
+        arr->data + committed, new_committed - committed,
+        PROT_READ | PROT_WRITE) != 0)
+    {
+        out_of_memory();
+    }
+
+    mem_count_mapped(arr->tag, (int64_t)(new_committed - committed));
+#else
+    arr->data = jocc_realloc(arr->data, new_committed, arr->tag);
+#endif
+
+    arr->committed = new_committed;
+}
+
+// Make sure at least size bytes of the array are usable.
+static void vmem_arr_ensure(struct vmem_arr *arr, size_t size)
+{
+    assert(arr != NULL);
+
+    if (size > arr->committed)
+    {
+        _vmem_arr_commit(arr, size);
+    }
+}
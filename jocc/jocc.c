@@ -2,73 +2,446 @@
 // Distributed under the MIT License.
 // See accompanying file LICENSE.txt
 
+#include "../common/astcompact.h"
+#include "../common/macrocache.h"
 #include "../common/preprocessor.h"
+#include "../common/vmem.h"
 
-// Read file.
-static char *read_file(const char *path, uint32_t *size_out)
+// Allocate path of temporary file to write before replacing path.
+static char *alloc_tmp_path(const char *path)
 {
-    FILE *file = fopen(path, "rb");
-    if (file == NULL)
+    size_t path_len = strlen(path);
+    char *tmp_path = ALLOC_ARRAY(char, path_len + 5, MEM_TAG_OTHER);
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+    return tmp_path;
+}
+
+// Write string manager snapshot. Written to a temporary file first since the
+// old snapshot may still be mapped as the string manager's base layer.
+static bool write_string_cache(struct strman *strman, const char *path)
+{
+    char *tmp_path = alloc_tmp_path(path);
+
+    bool ok = false;
+    FILE *file = fopen(tmp_path, "wb");
+    if (file != NULL)
+    {
+        ok = strman_write_snapshot(strman, file);
+        ok = fclose(file) == 0 && ok;
+        if (!ok)
+        {
+            remove(tmp_path);
+        }
+    }
+
+    jocc_free(tmp_path);
+    return ok;
+}
+
+// Replace string cache with the temporary file from write_string_cache.
+// Done after the old snapshot is unmapped for platforms that care.
+static void commit_string_cache(const char *path)
+{
+    char *tmp_path = alloc_tmp_path(path);
+
+    remove(path);
+    rename(tmp_path, path);
+
+    jocc_free(tmp_path);
+}
+
+// Whether a path names a prelude file.
+static bool is_prelude_path(const char *path)
+{
+    size_t len = strlen(path);
+    return len >= 4 && strcmp(path + len - 4, ".jop") == 0;
+}
+
+// Drop abstract syntax tree nodes nothing refers to anymore. For now, that's
+// all but the #include directives that logi_files point at and the #define
+// directives of the prelude's macros.
+static void compact_ast(struct tgroup *tgroup, struct macro_table *prelude)
+{
+    struct srcman *srcman = &tgroup->srcman;
+    uint32_t file_count = srcman->logi_file_count;
+    uint32_t count = file_count + prelude->macro_count;
+    astid_t *roots = ALLOC_ARRAY(astid_t, count, MEM_TAG_OTHER);
+    for (uint32_t i = 0; i < file_count; i++)
+    {
+        roots[i] = srcman->logi_files[i].included_at;
+    }
+
+    for (uint32_t i = 0; i < prelude->macro_count; i++)
+    {
+        roots[file_count + i] = prelude->macros[i].definition;
+    }
+
+    jocc_free(astman_compact(&tgroup->astman, roots, count));
+
+    for (uint32_t i = 0; i < file_count; i++)
+    {
+        srcman->logi_files[i].included_at = roots[i];
+    }
+
+    for (uint32_t i = 0; i < prelude->macro_count; i++)
+    {
+        prelude->macros[i].definition = roots[file_count + i];
+    }
+
+    jocc_free(roots);
+}
+
+// Entry point.
+int main(int argc, char **argv)
+{
+    // Select allocator before anything is allocated,
+    // since blocks can't move between backends.
+    enum alloc_backend alloc_backend = ALLOC_DEFAULT_BACKEND;
+    bool mem_report_wanted = false;
+    bool mem_report_json = false;
+    for (int i = 1; i < argc; i++)
     {
-        abort();
+        if (strcmp(argv[i], "--alloc") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            for (alloc_backend = 0;
+                alloc_backend < ALLOC_BACKEND_COUNT &&
+                strcmp(name, alloc_backend_names[alloc_backend]) != 0;
+                alloc_backend++)
+            {
+            }
+
+            if (alloc_backend == ALLOC_BACKEND_COUNT)
+            {
+                fprintf(stderr, "jocc: unknown allocator: %s\n", name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--mem-report") == 0)
+        {
+            mem_report_wanted = true;
+        }
+        else if (strcmp(argv[i], "--mem-report=json") == 0)
+        {
+            mem_report_wanted = true;
+            mem_report_json = true;
+        }
     }
 
-    uint32_t size = 0;
-    char *data = NULL;
-    for (;;)
+    // Heap usage can only be broken down with tracking.
+    alloc_set_backend(alloc_backend, mem_report_wanted);
+
+    // Parse command line.
+    const char **paths = ALLOC_ARRAY(const char *, (size_t)argc, MEM_TAG_OTHER);
+    uint32_t path_count = 0;
+    const char **include_dirs = ALLOC_ARRAY(
+        const char *, (size_t)argc, MEM_TAG_OTHER);
+    uint32_t include_dir_count = 0;
+    const char *string_cache_path = NULL;
+    const char *tokcache_dir = NULL;
+    uint64_t tokcache_max_size = TOKCACHE_DEFAULT_MAX_SIZE;
+    bool keep_trivia = false;
+    bool write_expanded = false;
+    bool huge_pages = true;
+    bool reserve = true;
+    bool reserve_report = false;
+    uint32_t array_growth = DYNARR_GROWTH_PERCENT;
+    bool ast_cons = false;
+    for (int i = 1; i < argc; i++)
     {
-        if (size > UINT32_MAX - 4096)
+        if (strcmp(argv[i], "--string-cache") == 0 && i + 1 < argc)
+        {
+            string_cache_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc)
+        {
+            tokcache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc)
+        {
+            // In MiB.
+            tokcache_max_size = strtoull(argv[++i], NULL, 10) << 20;
+        }
+        else if (strcmp(argv[i], "--alloc") == 0 && i + 1 < argc)
+        {
+            i++; // Handled above.
+        }
+        else if (
+            strcmp(argv[i], "--mem-report") == 0 ||
+            strcmp(argv[i], "--mem-report=json") == 0)
         {
-            abort();
+            // Handled above.
         }
+        else if (strcmp(argv[i], "-E") == 0)
+        {
+            write_expanded = true;
+        }
+        else if (strcmp(argv[i], "--keep-trivia") == 0)
+        {
+            keep_trivia = true;
+        }
+        else if (strcmp(argv[i], "--no-huge-pages") == 0)
+        {
+            huge_pages = false;
+        }
+        else if (strcmp(argv[i], "--no-reserve") == 0)
+        {
+            reserve = false;
+        }
+        else if (strcmp(argv[i], "--reserve-report") == 0)
+        {
+            reserve_report = true;
+        }
+        else if (strcmp(argv[i], "--array-growth") == 0 && i + 1 < argc)
+        {
+            // In percent.
+            unsigned long percent = strtoul(argv[++i], NULL, 10);
+            if (percent <= 100 || percent > 1000)
+            {
+                fprintf(
+                    stderr, "jocc: array growth must be 101 to 1000%%\n");
+                exit(EXIT_FAILURE);
+            }
 
-        data = jocc_realloc(data, size + 4096);
-        size_t ret = fread(data + size, 1, 4096, file);
-        if (ret > 0)
+            array_growth = (uint32_t)percent;
+        }
+        else if (strcmp(argv[i], "--ast-cons") == 0)
+        {
+            ast_cons = true;
+        }
+        else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc)
         {
-            size += (uint32_t)ret;
+            include_dirs[include_dir_count++] = argv[++i];
         }
-        else if (ferror(file))
+        else if (strncmp(argv[i], "-I", 2) == 0 && argv[i][2] != 0)
         {
-            abort();
+            include_dirs[include_dir_count++] = argv[i] + 2;
         }
         else
         {
-            *size_out = size;
-            data[size] = 0;
-            fclose(file);
-            return data;
+            paths[path_count++] = argv[i];
         }
     }
-}
 
-// Entry point.
-int main(void)
-{
+    if (path_count == 0)
+    {
+        paths[path_count++] = "example.joc";
+    }
+
     // Initialize translation group.
+    vmem_set_huge_pages(huge_pages);
+    dynarr_set_growth(array_growth);
     struct tgroup tgroup;
     tgroup_init(&tgroup);
 
-    // Read file and generate corresponding phys_file.
-    const char *path = "example.joc";
-    strid_t name = strman_get_id(&tgroup.strman, path, (uint32_t)strlen(path));
+    for (uint32_t i = 0; i < include_dir_count; i++)
+    {
+        tgroup_add_include_dir(&tgroup, include_dirs[i]);
+    }
+
+    // Start from the strings interned by previous runs, if any.
+    struct filemap string_cache = {0};
+    bool string_cache_mapped =
+        string_cache_path != NULL &&
+        filemap_open(&string_cache, string_cache_path, false);
+    bool string_cache_loaded =
+        string_cache_mapped &&
+        strman_load_base(&tgroup.strman, string_cache.data, string_cache.size);
+
+    // Load files and generate corresponding phys_files.
+    phys_file_id_t *phys_file_ids = ALLOC_ARRAY(
+        phys_file_id_t, path_count, MEM_TAG_OTHER);
+    for (uint32_t i = 0; i < path_count; i++)
+    {
+        const char *path = paths[i];
+        strid_t name =
+            strman_get_id(&tgroup.strman, path, (uint32_t)strlen(path));
+
+        phys_file_ids[i] = srcman_load_phys_file(&tgroup.srcman, name, path);
+        if (phys_file_ids[i] == PHYS_FILE_NONE)
+        {
+            fprintf(stderr, "jocc: cannot read file: %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Size the big structures for the input up front.
+    if (reserve)
+    {
+        uint64_t input_size = 0;
+        for (uint32_t i = 0; i < path_count; i++)
+        {
+            input_size +=
+                srcman_get_phys_file(&tgroup.srcman, phys_file_ids[i])->size;
+        }
+
+        tgroup_reserve(&tgroup, input_size, path_count);
+    }
+
+    // Skip lexing files whose tokens were cached by previous runs.
+    struct tokcache tokcache;
+    if (tokcache_dir != NULL)
+    {
+        tokcache_init(&tokcache, tokcache_dir, tokcache_max_size);
+    }
+
+    // Merge identical AST nodes if asked to.
+    struct astcons astcons;
+    astcons_init(&astcons);
+    astcons.enabled = ast_cons;
+
+    // Preprocess prelude files first. The rest start with the macros they
+    // end with, which come from a snapshot instead if a previous run saved
+    // one for the same prelude and nothing it #include'd has changed.
+    phys_file_id_t *prelude_ids = ALLOC_ARRAY(
+        phys_file_id_t, path_count, MEM_TAG_OTHER);
+    uint32_t prelude_count = 0;
+    for (uint32_t i = 0; i < path_count; i++)
+    {
+        if (is_prelude_path(paths[i]))
+        {
+            prelude_ids[prelude_count++] = phys_file_ids[i];
+        }
+    }
+
+    struct macro_table prelude;
+    macro_table_init(&prelude);
+    bool use_snapshot = prelude_count > 0 && tokcache_dir != NULL;
+    hash128_t snapshot_key = {0};
+    struct macrocache_file snapshot;
+    bool snapshot_loaded = false;
+    if (use_snapshot)
+    {
+        snapshot_key = macrocache_key(&tgroup, prelude_ids, prelude_count);
+        snapshot_loaded = macrocache_load(
+            &tokcache, &tgroup, snapshot_key, &prelude, &snapshot);
+    }
+
+    if (!snapshot_loaded)
+    {
+        struct pp_lookups lookups = {0};
+        int ret = 0;
+        for (uint32_t i = 0; i < prelude_count; i++)
+        {
+            struct preprocessor pp;
+            preprocessor_init(&pp, &tgroup);
+            pp.keep_trivia = keep_trivia;
+            pp.tokcache = tokcache_dir != NULL ? &tokcache : NULL;
+            pp.astcons = &astcons;
+            pp.lookups = &lookups;
+            ret |= preprocess(&pp, prelude_ids[i], 0);
+            macro_table_define_all(&prelude, &pp.macros);
+            preprocessor_destroy(&pp);
+
+            compact_ast(&tgroup, &prelude);
+            astcons_clear(&astcons);
+        }
+
+        // Don't save a prelude with errors, so they show up every time.
+        if (use_snapshot && ret == 0)
+        {
+            macrocache_write(
+                &tokcache, &tgroup, snapshot_key, &prelude,
+                lookups.names, lookups.count);
+        }
+
+        jocc_free(lookups.names);
+    }
+
+    // Preprocess. Each top-level file gets a fresh preprocessor, but they
+    // share phys_files, so headers are only read once, and the prelude's
+    // macros, which are only copied as files change them.
+    for (uint32_t i = 0; i < path_count; i++)
+    {
+        if (is_prelude_path(paths[i]))
+        {
+            continue;
+        }
+
+        struct preprocessor pp;
+        preprocessor_init(&pp, &tgroup);
+        pp.keep_trivia = keep_trivia;
+        pp.tokcache = tokcache_dir != NULL ? &tokcache : NULL;
+        pp.astcons = &astcons;
+        pp.output = write_expanded ? stdout : NULL;
+        macro_table_set_base(&pp.macros, &prelude);
+        preprocess(&pp, phys_file_ids[i], 0);
+        preprocessor_destroy(&pp);
+
+        // Macro definitions are dead now. Compacting moves
+        // nodes, so anything interned has to be forgotten.
+        compact_ast(&tgroup, &prelude);
+        astcons_clear(&astcons);
+    }
 
-    uint32_t size;
-    char *data = read_file(path, &size);
+    macro_table_destroy(&prelude);
 
-    phys_file_id_t phys_file_id =
-        srcman_add_phys_file(&tgroup.srcman, name, size, data);
+    if (ast_cons)
+    {
+        astcons_report(&astcons, stderr);
+    }
 
-    // Preprocess.
-    preprocess(&tgroup, phys_file_id, 0);
+    astcons_destroy(&astcons);
+
+    if (tokcache_dir != NULL)
+    {
+        tokcache_evict(&tokcache);
+        tokcache_destroy(&tokcache);
+    }
 
     // Put some unused functions through their
-    // paces to elide -Wunused-function for now.
-    astman_get_syncat(&tgroup.astman, 1);
-    astman_get_child_count(&tgroup.astman, 1);
-    strman_get_str(&tgroup.strman, name);
+    // paces to elide -Wunused-function for now. Compacting can leave
+    // astman empty, so its getters are only referenced.
+    (void)astman_get_syncat;
+    (void)astman_get_child_count;
+    strman_get_str(&tgroup.strman, 0);
+    jocc_hash128(NULL, 0);
+    hash_get_impl();
+
+    // Save any new strings for next time.
+    bool string_cache_written =
+        string_cache_path != NULL &&
+        (!string_cache_loaded || tgroup.strman.entry_count > 0) &&
+        write_string_cache(&tgroup.strman, string_cache_path);
+
+    if (reserve_report)
+    {
+        tgroup_reserve_report(&tgroup, stderr);
+    }
 
     // Cleanup.
-    jocc_free(data);
+    jocc_free(prelude_ids);
+    jocc_free(phys_file_ids);
+    jocc_free(include_dirs);
+    jocc_free(paths);
     tgroup_destroy(&tgroup);
+
+    if (snapshot_loaded)
+    {
+        macrocache_close(&snapshot);
+    }
+
+    if (string_cache_mapped)
+    {
+        filemap_close(&string_cache);
+    }
+
+    if (string_cache_written)
+    {
+        commit_string_cache(string_cache_path);
+    }
+
+    if (mem_report_wanted)
+    {
+        mem_report(stderr, mem_report_json);
+    }
+
+#if defined(ALLOC_TRACE)
+    alloc_trace_report(stderr, 16);
+#endif
+
+    // Give back everything the allocator backend was holding on to, e.g. the
+    // arena's memory. Nothing may be freed after this.
+    alloc_release();
 }